@@ -58,4 +58,12 @@ bool check_device_type_match(
     return true;
 }
 
+bool check_device_type_match(
+    const DeviceSnapshot &snapshot,
+    const FirmwareArchive &firmware,
+    std::function<void (const QString &)> logger)
+{
+    return check_device_type_match(snapshot.otp.get_device(), firmware, logger);
+}
+
 }
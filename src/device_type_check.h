@@ -4,6 +4,7 @@
 #include <QMap>
 #include <QString>
 #include "firmware.h"
+#include "flash.h"
 
 namespace mesytec::mvp
 {
@@ -23,6 +24,12 @@ bool check_device_type_match(
     const FirmwareArchive &firmware,
     std::function<void (const QString &)> logger = {});
 
+// Uses the OTP device type contained in the snapshot.
+bool check_device_type_match(
+    const DeviceSnapshot &snapshot,
+    const FirmwareArchive &firmware,
+    std::function<void (const QString &)> logger = {});
+
 }
 
 #endif /* ADA780E0_E8D0_41FE_9471_40EE0EA4706F */
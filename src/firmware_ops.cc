@@ -21,7 +21,9 @@ void FirmwareWriter::write()
   auto area_specific_parts = m_firmware.get_area_specific_parts();
   const auto selected_area = m_flash->read_area_index();
 
-  m_flash->set_verbose(false);
+  m_verify_reports.clear();
+
+  m_flash->maybe_set_verbose(false);
 
   emit status_message("Writing non area-specific parts...");
 
@@ -38,7 +40,7 @@ void FirmwareWriter::write()
 
   emit status_message(QString("Restoring area index to %1")
       .arg(selected_area));
-  m_flash->set_area_index(selected_area);
+  m_flash->maybe_set_area_index(selected_area);
 }
 
 void FirmwareWriter::write_part(const FirmwarePartPtr &pp,
@@ -53,7 +55,7 @@ void FirmwareWriter::write_part(const FirmwarePartPtr &pp,
 
   if (bool(area)) {
     emit status_message(QString("Selecting area %1").arg(*area));
-    m_flash->set_area_index(*area);
+    m_flash->maybe_set_area_index(*area);
   }
 
   if (section != constants::otp_section) {
@@ -85,7 +87,7 @@ void FirmwareWriter::write_part(const FirmwarePartPtr &pp,
           .arg(pp->get_filename()));
 
 
-      auto res = m_flash->verify_memory({0, 0, 0}, section, gsl::span(contents));
+      auto res = verify_part(pp, section, gsl::span(contents));
       if (!res) throw FlashVerificationError(res);
     }
   } else if (is_instruction_part(pp) && !is_key_part(pp)) {
@@ -112,7 +114,7 @@ void FirmwareWriter::write_part(const FirmwarePartPtr &pp,
         emit status_message(QString("File %1: verifying memory")
             .arg(pp->get_filename()));
 
-        auto res = m_flash->verify_memory({0, 0, 0}, section, gsl::span(mem));
+        auto res = verify_part(pp, section, gsl::span(mem));
 
         qDebug() << res.to_string();
 
@@ -134,7 +136,7 @@ void FirmwareWriter::write_part(const FirmwarePartPtr &pp,
 
         auto mem = generate_memory(instructions);
 
-        auto res = m_flash->verify_memory({0, 0, 0}, section, gsl::span(mem));
+        auto res = verify_part(pp, section, gsl::span(mem));
         qDebug() << res.to_string();
         if (!res) throw FlashVerificationError(res);
       }
@@ -142,6 +144,24 @@ void FirmwareWriter::write_part(const FirmwarePartPtr &pp,
   }
 }
 
+VerifyResult FirmwareWriter::verify_part(const FirmwarePartPtr &pp, uchar section,
+    const gsl::span<uchar> mem)
+{
+  if (!m_quick_verify)
+    return m_flash->verify_memory({0, 0, 0}, section, mem, m_verify_mode);
+
+  auto report = m_flash->sample_verify_memory({0, 0, 0}, section, mem,
+      m_sample_verify_options, m_verify_mode);
+
+  emit status_message(QString("File %1: %2")
+      .arg(pp->get_filename())
+      .arg(report.to_string()));
+
+  m_verify_reports.push_back({ pp->get_filename(), section, report });
+
+  return report.result;
+}
+
 KeysInfo::KeysInfo(
     const OTP &otp,
     const KeyMap &device_keys,
@@ -189,6 +209,7 @@ KeysHandler::KeysHandler(
     QObject *parent)
   : m_firmware(firmware)
   , m_flash(flash)
+  , m_page_cache_scope(flash)
 {
 }
 
@@ -205,10 +226,9 @@ KeysInfo KeysHandler::get_keys_info()
     fw_keys.push_back(key_from_firmware_part(*key_part));
   }
 
-  const auto otp      = m_flash->read_otp();
-  const auto dev_keys = m_flash->read_keys();
+  const auto snapshot = m_flash->read_device_snapshot();
 
-  m_keys_info = KeysInfo(otp, dev_keys, fw_keys);
+  m_keys_info = KeysInfo(snapshot.otp, snapshot.keys, fw_keys);
   m_keys_info_read = true;
 
   return m_keys_info;
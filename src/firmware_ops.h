@@ -10,6 +10,14 @@ namespace mvp
 
 class FlashInterface;
 
+/** Quick verify result of a single firmware part. */
+struct PartVerifyReport
+{
+  QString filename;
+  uchar section = 0;
+  SampleVerifyReport report;
+};
+
 class FirmwareWriter: public QObject
 {
   Q_OBJECT
@@ -26,22 +34,50 @@ class FirmwareWriter: public QObject
     bool do_erase() const   { return m_do_erase; }
     bool do_program() const { return m_do_program; }
     bool do_verify() const  { return m_do_verify; }
+    VerifyMode get_verify_mode() const { return m_verify_mode; }
 
     void set_do_erase(bool b)   { m_do_erase = b; }
     void set_do_program(bool b) { m_do_program = b; }
     void set_do_verify(bool b)  { m_do_verify = b; }
 
+    /** With VerifyMode::CollectAll each part is read completely and the
+     * FlashVerificationError lists all differing ranges of the part. */
+    void set_verify_mode(VerifyMode mode) { m_verify_mode = mode; }
+
+    /** Quick verify: only a sample of the pages of each part is compared
+     * (see FlashInterface::sample_verify_memory()). Parts with a differing
+     * sampled page are fully verified. */
+    void set_quick_verify(bool b) { m_quick_verify = b; }
+    bool is_quick_verify() const { return m_quick_verify; }
+
+    void set_sample_verify_options(const SampleVerifyOptions &opts)
+    { m_sample_verify_options = opts; }
+
+    const SampleVerifyOptions &get_sample_verify_options() const
+    { return m_sample_verify_options; }
+
+    /** Quick verify results of the parts processed by the last write(). */
+    const QVector<PartVerifyReport> &get_verify_reports() const
+    { return m_verify_reports; }
+
   private:
     void write_part(const FirmwarePartPtr &pp,
         uchar section,
         const boost::optional<uchar> &area = boost::none);
 
+    VerifyResult verify_part(const FirmwarePartPtr &pp, uchar section,
+        const gsl::span<uchar> mem);
+
     FirmwareArchive m_firmware;
     FlashInterface *m_flash = nullptr;
 
     bool m_do_erase = true;
     bool m_do_program = true;
     bool m_do_verify = false;
+    VerifyMode m_verify_mode = VerifyMode::StopAtFirst;
+    bool m_quick_verify = false;
+    SampleVerifyOptions m_sample_verify_options;
+    QVector<PartVerifyReport> m_verify_reports;
 };
 
 typedef QList<Key> KeyList;
@@ -107,6 +143,8 @@ class KeysHandler: public QObject
   private:
     FirmwareArchive m_firmware;
     FlashInterface *m_flash = nullptr;
+    // OTP and key pages are read repeatedly during a keys session.
+    PageCacheScope m_page_cache_scope;
     bool m_keys_info_read = false;
     KeysInfo m_keys_info;
 };
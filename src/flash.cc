@@ -1,6 +1,10 @@
 #include "flash.h"
 #include <boost/endian/conversion.hpp>
 #include <boost/format.hpp>
+#include <array>
+#include <cmath>
+#include <random>
+#include <QStringList>
 #include <mesytec-mvlc/scanbus_support.h>
 
 namespace mesytec
@@ -60,11 +64,11 @@ void FlashInterface::ensure_response_ok(
   try {
     const gsl::span<uchar> response_code{std::begin(response) + (response.size() - 2),
           std::end(response)};
-    m_last_status = *(response_code.begin()+1);
-    emit statusbyte_received(m_last_status);
+    m_state.last_status = *(response_code.begin()+1);
+    emit statusbyte_received(m_state.last_status);
     ensure_response_code_ok(response_code);
   } catch (const std::runtime_error &e) {
-    m_write_enabled = false; // write enable is unset on error
+    m_state.write_enabled = false; // write enable is unset on error
     throw FlashInstructionError(instruction, response, e.what());
   }
 }
@@ -123,54 +127,328 @@ QVector<uchar> FlashInterface::read_memory(const Address &start, uchar section,
 
   QVector<uchar> ret(len);
 
+  // Misses are counted by the read_page() calls done by stream_memory().
+  if (cache_read_memory(start, section, len, chunk_size, early_return_fun, ret, false))
+    return ret;
+
+  return collect_memory(start, section, len, chunk_size, early_return_fun);
+}
+
+void FlashInterface::stream_memory(const Address &start, uchar section,
+  size_t len, size_t chunk_size, EarlyReturnFun f)
+{
+  if (chunk_size == 0 || chunk_size > constants::page_size)
+    throw std::invalid_argument("stream_memory: invalid chunk size");
+
+  QVector<uchar> buf(chunk_size);
   Address addr(start);
   size_t remaining = len;
-  size_t offset    = 0;
-
 
   emit progress_range_changed(0, std::max(static_cast<int>(remaining / chunk_size), 1));
   int progress = 0;
 
-  set_verbose(false);
+  maybe_set_verbose(false);
 
   while (remaining) {
     emit progress_changed(progress++);
 
     auto rl = std::min(chunk_size, remaining);
-    auto page_span = gsl::span(ret.data() + offset, rl);
-    read_page(addr, section, page_span);
+    auto chunk = gsl::span(buf.data(), rl);
+    read_page(addr, section, chunk);
 
-    offset    += rl;
-
-    if (early_return_fun && early_return_fun(addr, section, page_span)) {
-      ret.resize(offset);
-      return ret;
-    }
+    if (f && f(addr, section, chunk))
+      return;
 
     remaining -= rl;
     addr      += rl;
   }
+}
+
+QVector<uchar> FlashInterface::collect_memory(const Address &start, uchar section,
+  size_t len, size_t chunk_size, EarlyReturnFun early_return_fun)
+{
+  QVector<uchar> ret;
+  ret.reserve(len);
+
+  stream_memory(start, section, len, chunk_size,
+    [&](const Address &addr, uchar s, const gsl::span<uchar> chunk) {
+      auto offset = ret.size();
+      std::copy(chunk.begin(), chunk.end(), std::back_inserter(ret));
+      return early_return_fun
+        && early_return_fun(addr, s, gsl::span(ret.data() + offset, chunk.size()));
+    });
 
   return ret;
 }
 
 VerifyResult FlashInterface::verify_memory(const Address &start, uchar section,
-  const gsl::span<uchar> data)
+  const gsl::span<uchar> data, VerifyMode mode)
 {
-  set_verbose(false);
+  MemoryVerifier verifier(start, data, mode);
 
-  auto fun = [&](const Address &addr, uchar, const gsl::span<uchar> page) {
-    auto res = std::mismatch(page.begin(), page.end(), data.begin() + addr.to_int());
-    return res.first != page.end();
+  stream_memory(start, section, data.size(), get_default_mem_read_chunk_size(),
+    [&verifier](const Address &addr, uchar, const gsl::span<uchar> chunk) {
+      return verifier.compare(addr, chunk);
+    });
+
+  if (verifier.get_bytes_compared() < static_cast<size_t>(data.size()) && verifier.get_result())
+    throw std::runtime_error("verify_memory: short read");
+
+  return verifier.get_result();
+}
+
+namespace
+{
+  // Shannon entropy of the byte values in bits per byte.
+  double byte_entropy(const gsl::span<uchar> data)
+  {
+    std::array<size_t, 256> counts = {};
+
+    for (auto c: data)
+      ++counts[c];
+
+    double ret = 0.0;
+
+    for (auto count: counts) {
+      if (count) {
+        double p = static_cast<double>(count) / data.size();
+        ret -= p * std::log2(p);
+      }
+    }
+
+    return ret;
+  }
+}
+
+SampleVerifyReport FlashInterface::sample_verify_memory(const Address &start, uchar section,
+  const gsl::span<uchar> data, const SampleVerifyOptions &opts, VerifyMode full_mode)
+{
+  const size_t len = data.size();
+  const size_t page_size = constants::page_size;
+
+  SampleVerifyReport ret;
+  ret.options     = opts;
+  ret.total_pages = (len + page_size - 1) / page_size;
+
+  if (!ret.total_pages)
+    return ret;
+
+  auto page_span = [&](size_t page) {
+    const size_t offset = page * page_size;
+    return gsl::span<uchar>(data.data() + offset, std::min(page_size, len - offset));
+  };
+
+  std::vector<bool> selected(ret.total_pages, false);
+  size_t selected_count = 0;
+
+  auto select_page = [&](size_t page) {
+    if (!selected[page]) {
+      selected[page] = true;
+      ++selected_count;
+    }
   };
 
-  auto mem = read_memory(start, section, data.size(), get_default_mem_read_chunk_size(), fun);
-  auto res = std::mismatch(mem.begin(), mem.end(), data.begin());
+  select_page(0);
+  select_page(ret.total_pages - 1);
+
+  // High entropy pages, ties resolved by page index.
+  {
+    std::vector<std::pair<double, size_t>> entropies;
+
+    for (size_t page=0; page<ret.total_pages; ++page)
+      if (!selected[page])
+        entropies.emplace_back(-byte_entropy(page_span(page)), page);
+
+    const size_t n = std::min(opts.entropy_pages, entropies.size());
+    std::partial_sort(entropies.begin(), entropies.begin() + n, entropies.end());
+
+    for (size_t i=0; i<n; ++i)
+      select_page(entropies[i].second);
+  }
+
+  // Pseudo random pages. std::mt19937 output is specified by the standard,
+  // so the selection only depends on the seed.
+  {
+    std::mt19937 rng(opts.seed);
+    const size_t target = std::min(selected_count + opts.random_pages, ret.total_pages);
+
+    while (selected_count < target)
+      select_page(rng() % ret.total_pages);
+  }
 
-  if (res.first == mem.end())
-    return VerifyResult();
+  for (size_t page=0; page<ret.total_pages; ++page)
+    if (selected[page])
+      ret.pages.push_back(page);
 
-  return VerifyResult(res.second - data.begin(), *res.second, *res.first);
+  emit progress_text_changed(QString("Verifying %1 of %2 pages of section %3")
+      .arg(ret.pages.size())
+      .arg(ret.total_pages)
+      .arg(static_cast<int>(section)));
+
+  // Read runs of consecutive sampled pages with one stream_memory() call.
+  MemoryVerifier verifier(start, data);
+
+  auto compare = [&verifier](const Address &addr, uchar, const gsl::span<uchar> chunk) {
+    return verifier.compare(addr, chunk);
+  };
+
+  for (int i=0; i<ret.pages.size() && verifier.get_result();) {
+    int j = i + 1;
+
+    while (j < ret.pages.size() && ret.pages[j] == ret.pages[j - 1] + 1)
+      ++j;
+
+    const size_t offset = ret.pages[i] * page_size;
+    const size_t run_len = std::min((ret.pages[j - 1] + 1) * page_size, len) - offset;
+
+    stream_memory(start + Address(offset), section, run_len,
+      get_default_mem_read_chunk_size(), compare);
+
+    i = j;
+  }
+
+  if (!verifier.get_result()) {
+    emit progress_text_changed(QString("Sampled page differs (%1), verifying all of section %2")
+        .arg(verifier.get_result().to_string())
+        .arg(static_cast<int>(section)));
+
+    ret.escalated = true;
+    ret.result    = verify_memory(start, section, data, full_mode);
+  }
+
+  return ret;
+}
+
+double SampleVerifyReport::detection_probability(size_t bad_pages) const
+{
+  const size_t sampled = pages.size();
+
+  if (!bad_pages || !total_pages)
+    return 0.0;
+
+  if (sampled + bad_pages > total_pages)
+    return 1.0;
+
+  // Hypergeometric: probability that none of the sampled pages is bad.
+  double miss = 1.0;
+
+  for (size_t i=0; i<sampled; ++i)
+    miss *= static_cast<double>(total_pages - bad_pages - i) / (total_pages - i);
+
+  return 1.0 - miss;
+}
+
+QString SampleVerifyReport::to_string() const
+{
+  auto ret = QString("sampled %1 of %2 pages (seed=%3)")
+    .arg(pages.size())
+    .arg(total_pages)
+    .arg(options.seed);
+
+  if (escalated)
+    return ret + QString(", sample mismatch, full verify %1").arg(result.to_string());
+
+  if (static_cast<size_t>(pages.size()) == total_pages)
+    return ret + ", success, all pages verified";
+
+  const size_t one_percent = std::max(total_pages / 100, size_t(1));
+
+  return ret + QString(", success, detection probability: single bad page %1%, %2 bad pages (1%) %3%")
+    .arg(detection_probability(1) * 100.0, 0, 'f', 1)
+    .arg(one_percent)
+    .arg(detection_probability(one_percent) * 100.0, 0, 'f', 1);
+}
+
+//
+// MemoryVerifier
+//
+
+MemoryVerifier::MemoryVerifier(const Address &start, const gsl::span<uchar> expected,
+  VerifyMode mode)
+  : m_start(start)
+  , m_expected(expected)
+  , m_mode(mode)
+{
+}
+
+bool MemoryVerifier::compare(const Address &addr, const gsl::span<uchar> chunk)
+{
+  const size_t offset = addr.to_int() - m_start.to_int();
+
+  if (addr.to_int() < m_start.to_int()
+      || offset + chunk.size() > static_cast<size_t>(m_expected.size()))
+    throw std::out_of_range("MemoryVerifier: chunk outside of the expected data");
+
+  auto expected = m_expected.begin() + offset;
+  auto pos = chunk.begin();
+
+  while (true) {
+    auto res = std::mismatch(pos, chunk.end(), expected + (pos - chunk.begin()));
+
+    if (res.first == chunk.end())
+      break;
+
+    add_mismatch(offset + (res.first - chunk.begin()), *res.second, *res.first);
+
+    if (m_mode == VerifyMode::StopAtFirst) {
+      m_bytes_compared += (res.first - chunk.begin()) + 1;
+      return true;
+    }
+
+    pos = res.first + 1;
+  }
+
+  m_bytes_compared += chunk.size();
+  return false;
+}
+
+void MemoryVerifier::add_mismatch(size_t offset, uchar expected, uchar actual)
+{
+  if (m_result.mismatch_count++ == 0) {
+    m_result.offset   = offset;
+    m_result.expected = expected;
+    m_result.actual   = actual;
+  }
+
+  auto &ranges = m_result.mismatches;
+
+  if (!ranges.isEmpty()) {
+    auto &last = ranges.last();
+
+    if (offset - (last.offset + last.length) < merge_distance) {
+      last.length = offset - last.offset + 1;
+      ++last.count;
+      return;
+    }
+  }
+
+  if (ranges.size() < max_ranges)
+    ranges.push_back({ offset, 1, 1 });
+  else
+    m_result.ranges_truncated = true;
+}
+
+QString VerifyResult::ranges_to_string(int max_lines) const
+{
+  QStringList lines;
+
+  for (const auto &m: mismatches) {
+    if (lines.size() >= max_lines) {
+      lines.push_back(QString("... %1 more ranges").arg(mismatches.size() - max_lines));
+      break;
+    }
+
+    lines.push_back(QString("0x%1-0x%2: %3 of %4 bytes differ")
+        .arg(m.offset, 6, 16, QLatin1Char('0'))
+        .arg(m.offset + m.length - 1, 6, 16, QLatin1Char('0'))
+        .arg(m.count)
+        .arg(m.length));
+  }
+
+  if (ranges_truncated)
+    lines.push_back(QString("range list truncated after %1 ranges").arg(mismatches.size()));
+
+  return lines.join("\n");
 }
 
 void FlashInterface::nop()
@@ -188,6 +466,7 @@ void FlashInterface::set_area_index(uchar area_index)
   write_instruction(m_wbuf);
   read_response(m_rbuf, m_wbuf.size() + size_t(2));
   ensure_response_ok(m_wbuf, m_rbuf);
+  m_state.area = area_index;
 }
 
 uchar FlashInterface::read_area_index()
@@ -197,6 +476,7 @@ uchar FlashInterface::read_area_index()
   write_instruction(m_wbuf);
   read_response(m_rbuf, size_t(4));
   ensure_response_ok(m_wbuf, m_rbuf);
+  m_state.area = m_rbuf[1];
   return m_rbuf[1];
 }
 
@@ -208,7 +488,7 @@ void FlashInterface::set_verbose(bool verbose)
   write_instruction(m_wbuf);
   read_response(m_rbuf, size_t(6));
   ensure_response_ok(m_wbuf, m_rbuf);
-  m_verbose = verbose;
+  m_state.verbose = verbose;
 }
 
 void FlashInterface::boot(uchar area_index)
@@ -227,7 +507,7 @@ void FlashInterface::enable_write()
   write_instruction(m_wbuf);
   read_response(m_rbuf, size_t(5));
   ensure_response_ok(m_wbuf, m_rbuf);
-  m_write_enabled = true;
+  m_state.write_enabled = true;
 
   qDebug() << "end enable_write: set write_enable flag";
 }
@@ -242,6 +522,43 @@ void FlashInterface::erase_section(uchar index)
   ensure_response_ok(m_wbuf, m_rbuf);
 }
 
+void FlashInterface::maybe_set_verbose(bool verbose)
+{
+  if (m_state.verbose == verbose) {
+    ++m_suppressed.veb;
+    return;
+  }
+
+  set_verbose(verbose);
+}
+
+void FlashInterface::maybe_enable_write()
+{
+  if (m_state.write_enabled) {
+    ++m_suppressed.efw;
+    return;
+  }
+
+  enable_write();
+}
+
+void FlashInterface::maybe_set_area_index(uchar area_index)
+{
+  if (m_state.area == area_index) {
+    ++m_suppressed.sai;
+    return;
+  }
+
+  set_area_index(area_index);
+}
+
+void FlashInterface::reset_state()
+{
+  m_state.verbose = boost::none;
+  m_state.area = boost::none;
+  m_state.write_enabled = false;
+}
+
 uchar FlashInterface::read_hardware_id()
 {
   m_wbuf = { opcodes::RDI };
@@ -338,16 +655,19 @@ VerifyResult FlashInterface::blankcheck_section(uchar section, size_t size)
       .arg(static_cast<int>(section))
       .arg(size));
 
-  set_verbose(false);
+  VerifyResult ret;
 
-  auto fun = [&](const Address &, uchar, const gsl::span<uchar> page) {
+  auto fun = [&](const Address &addr, uchar, const gsl::span<uchar> page) {
     auto it = std::find_if(page.begin(), page.end(), [](uchar c) { return c != 0xff; });
-    return it != page.end();
+
+    if (it == page.end())
+      return false;
+
+    ret = VerifyResult(addr.to_int() + (it - page.begin()), 0xff, *it);
+    return true;
   };
 
-  auto mem = read_memory({0, 0, 0}, section, size, get_default_mem_read_chunk_size(), fun);
-  auto it  = std::find_if(mem.begin(), mem.end(), [](uchar c) { return c != 0xff; });
-  auto ret = (it == mem.end() ? VerifyResult() : VerifyResult(it - mem.begin(), 0xff, *it));
+  stream_memory({0, 0, 0}, section, size, get_default_mem_read_chunk_size(), fun);
 
   emit progress_text_changed(QString("Blankcheck result for section %1: %2")
       .arg(static_cast<int>(section))
@@ -364,19 +684,23 @@ KeyMap FlashInterface::read_keys()
 
     auto addr = Address(i * constants::keys_offset);
     auto mem  = read_memory(addr, constants::keys_section, keys::total_bytes, get_default_mem_read_chunk_size());
-    auto it   = std::find_if(mem.begin(), mem.end(), [](uchar c) { return c != 0xff; });
-
-    if (it == mem.end())
-      continue;
 
-    auto key = Key::from_flash_memory(mem);
-
-    ret[i] = key;
+    add_key_from_slot(ret, i, mem);
   }
 
   return ret;
 }
 
+void FlashInterface::add_key_from_slot(KeyMap &keys, size_t slot, const gsl::span<uchar> mem)
+{
+  auto it = std::find_if(mem.begin(), mem.end(), [](uchar c) { return c != 0xff; });
+
+  if (it == mem.end())
+    return;
+
+  keys[slot] = Key::from_flash_memory(mem);
+}
+
 QSet<size_t> FlashInterface::get_used_key_slots()
 {
   auto keymap = read_keys();
@@ -415,6 +739,262 @@ OTP FlashInterface::read_otp()
   return OTP::from_flash_memory(mem);
 }
 
+DeviceSnapshot FlashInterface::read_device_snapshot()
+{
+  DeviceSnapshot ret;
+
+  ret.hardware_id = read_hardware_id();
+  ret.area        = read_area_index();
+  ret.dipswitch   = get_dipswitch(get_last_status());
+  ret.otp         = read_otp();
+  ret.keys        = read_keys();
+
+  return ret;
+}
+
+//
+// PageCache
+//
+
+namespace
+{
+  // Calls f(page, page_offset, data_offset, len) for each page touched by
+  // the given address range.
+  template<typename F>
+  void for_each_page(const Address &addr, size_t len, F f)
+  {
+    uint32_t cur = addr.to_int();
+    size_t offset = 0;
+
+    while (offset < len) {
+      const uint32_t page = cur / constants::page_size;
+      const size_t page_offset = cur % constants::page_size;
+      const size_t n = std::min(constants::page_size - page_offset, len - offset);
+
+      if (!f(page, page_offset, offset, n))
+        return;
+
+      cur    += n;
+      offset += n;
+    }
+  }
+}
+
+bool PageCache::lookup(uchar area, uchar section, const Address &addr, gsl::span<uchar> dest) const
+{
+  bool ret = true;
+
+  for_each_page(addr, dest.size(), [&] (uint32_t page, size_t page_offset, size_t offset, size_t n) {
+    auto it = m_pages.find(make_key(area, section, page));
+
+    if (it == m_pages.end()) {
+      ret = false;
+      return false;
+    }
+
+    for (size_t i=page_offset; i<page_offset+n; ++i) {
+      if (!it->valid.test(i)) {
+        ret = false;
+        return false;
+      }
+    }
+
+    std::copy(it->data.begin() + page_offset, it->data.begin() + page_offset + n,
+      std::begin(dest) + offset);
+    return true;
+  });
+
+  return ret;
+}
+
+void PageCache::store(uchar area, uchar section, const Address &addr, const gsl::span<uchar> data)
+{
+  for_each_page(addr, data.size(), [&] (uint32_t page, size_t page_offset, size_t offset, size_t n) {
+    auto &entry = m_pages[make_key(area, section, page)];
+
+    std::copy(std::begin(data) + offset, std::begin(data) + offset + n,
+      entry.data.begin() + page_offset);
+
+    for (size_t i=page_offset; i<page_offset+n; ++i)
+      entry.valid.set(i);
+
+    return true;
+  });
+}
+
+void PageCache::invalidate(uchar area, uchar section, const Address &addr, size_t len)
+{
+  for_each_page(addr, len, [&] (uint32_t page, size_t, size_t, size_t) {
+    m_pages.remove(make_key(area, section, page));
+    return true;
+  });
+}
+
+void PageCache::invalidate_section(int area, uchar section)
+{
+  for (auto it = m_pages.begin(); it != m_pages.end(); ) {
+    const auto key = it.key();
+    const bool match = ((key >> 24) & 0xff) == section
+      && (area < 0 || (key >> 32) == static_cast<quint64>(area));
+
+    if (match)
+      it = m_pages.erase(it);
+    else
+      ++it;
+  }
+}
+
+//
+// FlashInterface page cache hooks
+//
+
+void FlashInterface::set_page_cache_enabled(bool enabled)
+{
+  m_page_cache_enabled = enabled;
+
+  if (!enabled)
+    m_page_cache.clear();
+}
+
+bool FlashInterface::get_cache_area(uchar section, uchar &area) const
+{
+  if (!is_valid_section(section))
+    return false;
+
+  if (is_non_area_specific_section(section)) {
+    area = 0;
+    return true;
+  }
+
+  if (!m_state.area)
+    return false;
+
+  area = *m_state.area;
+  return true;
+}
+
+bool FlashInterface::cache_lookup(const Address &addr, uchar section, gsl::span<uchar> dest)
+{
+  if (!m_page_cache_enabled)
+    return false;
+
+  uchar area = 0;
+
+  if (get_cache_area(section, area) && m_page_cache.lookup(area, section, addr, dest)) {
+    ++m_page_cache_hits;
+    return true;
+  }
+
+  ++m_page_cache_misses;
+  return false;
+}
+
+void FlashInterface::cache_store(const Address &addr, uchar section, const gsl::span<uchar> data)
+{
+  uchar area = 0;
+
+  if (m_page_cache_enabled && get_cache_area(section, area))
+    m_page_cache.store(area, section, addr, data);
+}
+
+void FlashInterface::cache_invalidate(const Address &addr, uchar section, size_t len)
+{
+  if (!is_valid_section(section))
+    return;
+
+  uchar area = 0;
+
+  if (get_cache_area(section, area))
+    m_page_cache.invalidate(area, section, addr, len);
+  else
+    m_page_cache.invalidate_section(-1, section); // unknown area
+}
+
+void FlashInterface::cache_invalidate_section(uchar section)
+{
+  if (!is_valid_section(section))
+    return;
+
+  uchar area = 0;
+
+  if (get_cache_area(section, area))
+    m_page_cache.invalidate_section(area, section);
+  else
+    m_page_cache.invalidate_section(-1, section);
+}
+
+bool FlashInterface::cache_read_memory(const Address &start, uchar section, size_t len,
+  size_t chunk_size, EarlyReturnFun early_return_fun, QVector<uchar> &dest, bool count_miss)
+{
+  if (!m_page_cache_enabled || len == 0 || chunk_size == 0)
+    return false;
+
+  QVector<uchar> buf(len);
+  uchar area = 0;
+
+  if (!get_cache_area(section, area) || !m_page_cache.lookup(area, section, start, gsl::span(buf))) {
+    if (count_miss)
+      ++m_page_cache_misses;
+    return false;
+  }
+
+  ++m_page_cache_hits;
+
+  if (early_return_fun) {
+    for (size_t offset=0; offset<len; offset+=chunk_size) {
+      auto rl = std::min(chunk_size, len - offset);
+
+      if (early_return_fun(start + static_cast<int>(offset), section, gsl::span(buf.data() + offset, rl))) {
+        buf.resize(offset + rl);
+        break;
+      }
+    }
+  }
+
+  dest = buf;
+  return true;
+}
+
+void FlashInterface::track_instruction(const gsl::span<uchar> instruction)
+{
+  if (instruction.empty())
+    return;
+
+  const uchar opcode = instruction[0];
+
+  if (opcode != opcodes::WRF && opcode != opcodes::EFW)
+    m_state.write_enabled = false;
+
+  switch (opcode) {
+    case opcodes::WRF:
+      if (instruction.size() >= 6) {
+        Address addr(instruction[1], instruction[2], instruction[3]);
+        size_t len = instruction[5] ? instruction[5] : constants::page_size;
+        cache_invalidate(addr, instruction[4], len);
+      }
+      break;
+
+    case opcodes::ERF:
+      if (instruction.size() >= 5)
+        cache_invalidate_section(instruction[4]);
+      break;
+
+    case opcodes::VEB:
+      m_state.verbose = boost::none;
+      break;
+
+    case opcodes::SAI:
+      m_state.area = boost::none;
+      break;
+
+    case opcodes::BFP:
+      // The device reboots.
+      m_page_cache.clear();
+      reset_state();
+      break;
+  }
+}
+
 size_t pad_to_page_size(QVector<uchar> &data)
 {
   auto rest = data.size() % constants::page_size;
@@ -1,9 +1,12 @@
 #ifndef UUID_1b258d8d_e521_438d_b374_64a974cf2e1e
 #define UUID_1b258d8d_e521_438d_b374_64a974cf2e1e
 
+#include <bitset>
+#include <boost/optional.hpp>
 #include <gsl/gsl-lite.hpp>
 #include <QDebug>
 #include <gsl/gsl-lite.hpp>
+#include <QHash>
 #include <QMap>
 #include <QObject>
 #include <QString>
@@ -42,6 +45,23 @@ namespace mvp
       QVector<uchar> m_response;
   };
 
+  enum class VerifyMode
+  {
+    StopAtFirst,  // stop reading at the first differing byte
+    CollectAll,   // read everything and record all differing ranges
+  };
+
+  /** Range of differing bytes. offset is relative to the start of the
+   * verified data. Differences less than MemoryVerifier::merge_distance
+   * bytes apart are merged into one range, count is the number of
+   * differing bytes within the range. */
+  struct VerifyMismatch
+  {
+    size_t offset = 0;
+    size_t length = 0;
+    size_t count  = 0;
+  };
+
   struct VerifyResult
   {
     VerifyResult() = default;
@@ -59,15 +79,89 @@ namespace mvp
       if (*this)
         return "success";
 
-      return QString("failed: offset=%1, expected=0x%2, actual=0x%3")
+      auto ret = QString("failed: offset=%1, expected=0x%2, actual=0x%3")
         .arg(offset)
         .arg(expected, 0, 16)
         .arg(actual, 0, 16);
+
+      if (mismatch_count > 1) {
+        ret += QString(", %1 differing bytes in %2%3 ranges")
+          .arg(mismatch_count)
+          .arg(ranges_truncated ? "more than " : "")
+          .arg(mismatches.size());
+      }
+
+      return ret;
     }
 
+    /** One line per mismatching range, at most max_lines lines. */
+    QString ranges_to_string(int max_lines = 32) const;
+
+    // offset, expected and actual describe the first differing byte.
     size_t offset  = 0;
     uchar expected = 0;
     uchar actual   = 0;
+
+    // Differing ranges and the total number of differing bytes. With
+    // VerifyMode::StopAtFirst this is the first byte only.
+    QVector<VerifyMismatch> mismatches;
+    size_t mismatch_count = 0;
+    bool ranges_truncated = false; // more than MemoryVerifier::max_ranges ranges
+  };
+
+  /** Compares memory chunks against the expected data as they are read,
+   * e.g. from an early return function passed to
+   * FlashInterface::stream_memory(). Chunks may arrive from any address
+   * within [start, start + expected.size()). Only the result is kept, so the
+   * memory used does not depend on the size of the verified region. */
+  class MemoryVerifier
+  {
+    public:
+      MemoryVerifier(const Address &start, const gsl::span<uchar> expected,
+        VerifyMode mode = VerifyMode::StopAtFirst);
+
+      /** Returns true if the verification is done, i.e. in StopAtFirst mode
+       * once a difference has been found. */
+      bool compare(const Address &addr, const gsl::span<uchar> chunk);
+
+      const VerifyResult &get_result() const { return m_result; }
+      size_t get_bytes_compared() const { return m_bytes_compared; }
+
+      static const size_t merge_distance = 16;
+      static const int max_ranges = 1024;
+
+    private:
+      void add_mismatch(size_t offset, uchar expected, uchar actual);
+
+      Address m_start;
+      gsl::span<uchar> m_expected;
+      VerifyMode m_mode;
+      VerifyResult m_result;
+      size_t m_bytes_compared = 0;
+  };
+
+  /** Page selection for FlashInterface::sample_verify_memory(). The first
+   * and the last page are always part of the sample. */
+  struct SampleVerifyOptions
+  {
+    size_t entropy_pages  = 8;  // pages with the highest byte entropy
+    size_t random_pages   = 16; // pseudo random pages drawn using seed
+    uint32_t seed         = 0;
+  };
+
+  struct SampleVerifyReport
+  {
+    SampleVerifyOptions options;
+    size_t total_pages = 0;
+    QVector<size_t> pages;    // sampled page indexes, sorted
+    bool escalated = false;   // a sampled page differed, a full verify was done
+    VerifyResult result;      // result of the full verify if escalated
+
+    /** Probability of the sample containing at least one of bad_pages
+     * uniformly distributed differing pages. */
+    double detection_probability(size_t bad_pages) const;
+
+    QString to_string() const;
   };
 
   class FlashVerificationError: public std::runtime_error
@@ -162,6 +256,75 @@ namespace mvp
 
   typedef QMap<size_t, Key> KeyMap;
 
+  /** Device identification data as returned by
+   * FlashInterface::read_device_snapshot(). */
+  struct DeviceSnapshot
+  {
+    uchar hardware_id = 0;  // RDI
+    uchar area        = 0;  // currently selected area (RAI)
+    int dipswitch     = 0;  // from the status byte of the RAI response
+    OTP otp;
+    KeyMap keys;
+
+    // VME hardware id and firmware revision registers. Only filled in by
+    // backends accessing the module through VME, 0 otherwise.
+    uint32_t vme_hardware_id = 0;
+    uint32_t vme_firmware_id = 0;
+  };
+
+  /** Byte granular cache of flash memory contents keyed by (area, section,
+   * page). Partial pages can be stored; a lookup only succeeds if all of the
+   * requested bytes are known. */
+  class PageCache
+  {
+    public:
+      bool lookup(uchar area, uchar section, const Address &addr, gsl::span<uchar> dest) const;
+      void store(uchar area, uchar section, const Address &addr, const gsl::span<uchar> data);
+      void invalidate(uchar area, uchar section, const Address &addr, size_t len);
+
+      /** Drops all pages of the section. A negative area drops the pages of
+       * the section in all areas. */
+      void invalidate_section(int area, uchar section);
+
+      void clear() { m_pages.clear(); }
+      size_t size() const { return m_pages.size(); }
+
+    private:
+      struct Page
+      {
+        QVector<uchar> data = QVector<uchar>(constants::page_size, 0xff);
+        std::bitset<constants::page_size> valid;
+      };
+
+      static quint64 make_key(uchar area, uchar section, uint32_t page)
+      { return (quint64(area) << 32) | (quint64(section) << 24) | page; }
+
+      QHash<quint64, Page> m_pages;
+  };
+
+  /** Flash interface state as known to the host side. Unknown values are
+   * boost::none, e.g. the verbose mode and the selected area before the
+   * first VEB/SAI/RAI instruction. */
+  struct FlashState
+  {
+    boost::optional<bool> verbose;
+    boost::optional<uchar> area;
+    bool write_enabled      = false;
+    bool interface_enabled  = false; // VME flash interface enable bit (MvlcMvpFlash)
+    uchar last_status       = 0;
+  };
+
+  /** Number of instructions dropped by the maybe_* methods because they
+   * would not have changed the device state. Each saves one round trip. */
+  struct SuppressedInstructions
+  {
+    size_t veb = 0;
+    size_t sai = 0;
+    size_t efw = 0;
+
+    size_t total() const { return veb + sai + efw; }
+  };
+
   class FlashInterface: public QObject
   {
     Q_OBJECT
@@ -228,36 +391,63 @@ namespace mvp
 
       void ensure_clean_state();
 
-      QVector<uchar> read_memory(const Address &start, uchar section,
+      /** Reads len bytes of memory in chunks of chunk_size bytes. If the
+       * early return function returns true for a chunk the data read so far
+       * is returned. Backends may override this to read multiple chunks per
+       * device transaction. */
+      virtual QVector<uchar> read_memory(const Address &start, uchar section,
         size_t len, size_t chunk_size, EarlyReturnFun f = nullptr);
 
+      /** Like read_memory() but the data is not collected: each chunk is
+       * passed to f as soon as it has been read and is only valid during
+       * the call. Reading stops if f returns true. Backends override this
+       * with their multi-page read paths. Unlike read_memory() the
+       * pipelined implementations do not serve data from the page cache. */
+      virtual void stream_memory(const Address &start, uchar section,
+        size_t len, size_t chunk_size, EarlyReturnFun f);
+
+      /** Compares the memory starting at start against data using
+       * stream_memory() and a MemoryVerifier. */
       VerifyResult verify_memory(const Address &start, uchar section,
-        const gsl::span<uchar> data);
+        const gsl::span<uchar> data, VerifyMode mode = VerifyMode::StopAtFirst);
+
+      /** Quick verification: only the pages selected according to opts are
+       * compared against data. Pages are counted from start. If any sampled
+       * page differs a full verify_memory() using full_mode is done. */
+      SampleVerifyReport sample_verify_memory(const Address &start, uchar section,
+        const gsl::span<uchar> data, const SampleVerifyOptions &opts = {},
+        VerifyMode full_mode = VerifyMode::StopAtFirst);
 
       VerifyResult blankcheck_section(uchar section, size_t size);
 
       uchar get_last_status() const
-      { return m_last_status; }
+      { return m_state.last_status; }
 
       // state carrying
       /** Sets verbose mode to the given value. Only writes to the port if
-       * verbose mode is changed. */
-      void maybe_set_verbose(bool verbose)
-      {
-        if (m_verbose != verbose)
-          set_verbose(verbose);
-      }
+       * verbose mode is not known to be set already. */
+      void maybe_set_verbose(bool verbose);
 
-      bool get_verbose_mode() const { return m_verbose; }
+      bool get_verbose_mode() const { return m_state.verbose.value_or(true); }
 
       /** Enables write mode if it is not already enabled. */
-      void maybe_enable_write()
-      {
-        if (!m_write_enabled)
-          enable_write();
-      }
+      void maybe_enable_write();
+
+      bool is_write_enabled() const { return m_state.write_enabled; }
+
+      /** Selects the given area unless it is known to be selected already. */
+      void maybe_set_area_index(uchar area_index);
 
-      bool is_write_enabled() const { return m_write_enabled; }
+      const FlashState &get_state() const { return m_state; }
+
+      /** Forgets the tracked verbose mode, area and write enable state, e.g.
+       * after the device has been power cycled. */
+      void reset_state();
+
+      const SuppressedInstructions &get_suppressed_instructions() const
+      { return m_suppressed; }
+
+      void reset_suppressed_instructions() { m_suppressed = {}; }
 
       KeyMap read_keys();
       QSet<size_t> get_used_key_slots();
@@ -265,15 +455,100 @@ namespace mvp
 
       OTP read_otp();
 
+      /** Reads the hardware id, the selected area, the dipswitch setting,
+       * the OTP and the keys. The default implementation issues one
+       * instruction or memory read after the other. Backends override this
+       * to read everything in a single batched operation. */
+      virtual DeviceSnapshot read_device_snapshot();
+
+      // page cache
+      /** Opt-in read cache. When enabled read_page() and read_memory() serve
+       * previously read ranges from memory. Page writes, erases, area changes
+       * and boot invalidate the affected pages. Area-specific sections are
+       * only cached while the selected area is known (see get_state()).
+       * Disabling the cache clears
+       * it. */
+      void set_page_cache_enabled(bool enabled);
+      bool is_page_cache_enabled() const { return m_page_cache_enabled; }
+      void clear_page_cache() { m_page_cache.clear(); }
+
+      /** Number of reads served from the cache and number of reads which
+       * had to go to the device while the cache was enabled. */
+      size_t get_page_cache_hits() const { return m_page_cache_hits; }
+      size_t get_page_cache_misses() const { return m_page_cache_misses; }
+      void reset_page_cache_stats() { m_page_cache_hits = m_page_cache_misses = 0; }
+
     protected:
-      bool m_verbose        = true;
-      bool m_write_enabled  = false;
-      uchar m_last_status   = 0;
+      // Page cache hooks used by the implementations of the pure virtual
+      // methods and the read/write overrides.
+      bool cache_lookup(const Address &addr, uchar section, gsl::span<uchar> dest);
+      void cache_store(const Address &addr, uchar section, const gsl::span<uchar> data);
+      void cache_invalidate(const Address &addr, uchar section, size_t len);
+      void cache_invalidate_section(uchar section);
+
+      /** Serves a full read_memory() request from the cache, invoking the
+       * early return function for each chunk. Returns false if any of the
+       * requested bytes is not cached. */
+      bool cache_read_memory(const Address &start, uchar section, size_t len,
+        size_t chunk_size, EarlyReturnFun f, QVector<uchar> &dest, bool count_miss = true);
+
+      /** Updates the tracked state and the page cache for an instruction
+       * about to be sent. Must be called by the write_instruction()
+       * implementations. Follows the device rules: any instruction except
+       * WRF (and EFW itself) clears write enable; VEB, SAI and BFP make the
+       * respective state unknown until their response has been checked. */
+      void track_instruction(const gsl::span<uchar> instruction);
+
+      /** Adds the key stored in the given key slot memory to the map. Empty
+       * (erased) slots are skipped. */
+      static void add_key_from_slot(KeyMap &keys, size_t slot, const gsl::span<uchar> mem);
+
+      /** read_memory() implementation on top of stream_memory(). */
+      QVector<uchar> collect_memory(const Address &start, uchar section,
+        size_t len, size_t chunk_size, EarlyReturnFun f);
+
+      FlashState m_state;
+      SuppressedInstructions m_suppressed;
       QVector<uchar> m_wbuf;
       QVector<uchar> m_rbuf;
+
+    private:
+      bool get_cache_area(uchar section, uchar &area) const;
+
+      PageCache m_page_cache;
+      bool m_page_cache_enabled   = false;
+      size_t m_page_cache_hits    = 0;
+      size_t m_page_cache_misses  = 0;
   };
 
 
+  /** Enables the page cache of a FlashInterface for the lifetime of the
+   * object. If the cache was disabled before it is disabled (and thus
+   * cleared) again on destruction. */
+  class PageCacheScope
+  {
+    public:
+      explicit PageCacheScope(gsl::not_null<FlashInterface *> flash)
+        : m_flash(flash)
+        , m_was_enabled(flash->is_page_cache_enabled())
+      {
+        m_flash->set_page_cache_enabled(true);
+      }
+
+      ~PageCacheScope()
+      {
+        if (!m_was_enabled)
+          m_flash->set_page_cache_enabled(false);
+      }
+
+      PageCacheScope(const PageCacheScope &) = delete;
+      PageCacheScope &operator=(const PageCacheScope &) = delete;
+
+    private:
+      FlashInterface *m_flash;
+      bool m_was_enabled;
+  };
+
   class Canceled: public std::runtime_error
   {
     public:
@@ -32,6 +32,7 @@
 
 #include "mdpp16.h"
 #include "device_type_check.h"
+#include "serial_port_multi_flash.h"
 
 #include <mvlc_connect_widget.h>
 #include <serial_port_connect_widget.h>
@@ -132,12 +133,16 @@ MVPLabGui::MVPLabGui(QWidget *parent)
   gb_boot_layout->addWidget(combo_bootArea);
   gb_boot_layout->addWidget(pb_boot);
 
+  // Writes the firmware to all USB-serial devices in parallel.
+  auto pb_programAllPorts = new QPushButton("Program All Serial Ports");
+
   gb_actions_ = new QGroupBox("Actions");
   auto actions_layout = new QHBoxLayout(gb_actions_);
   actions_layout->setContentsMargins(0, 0, 0, 0);
   actions_layout->addStretch(1);
   actions_layout->addWidget(pb_deviceInfo);
   actions_layout->addWidget(gb_boot);
+  actions_layout->addWidget(pb_programAllPorts);
   actions_layout->addStretch(1);
 
   auto top_layout = new QGridLayout;
@@ -148,6 +153,9 @@ MVPLabGui::MVPLabGui(QWidget *parent)
   connect(pb_deviceInfo, &QPushButton::clicked,
     this, &MVPLabGui::show_device_info);
 
+  connect(pb_programAllPorts, &QPushButton::clicked,
+    this, &MVPLabGui::write_firmware_all_serial_ports);
+
   connect(pb_boot, &QPushButton::clicked,
     this, [=] {
       auto area = combo_bootArea->currentData().toUInt();
@@ -452,14 +460,9 @@ void MVPLabGui::write_firmware()
   const bool do_verify      = steps & FirmwareSteps::Step_Verify;
 
   try {
-    auto otp = run_in_thread_wait_in_loop<OTP>([&] {
-      auto connector = getActiveConnector();
-      connector->open();
-      auto flash = connector->getFlash();
-      return flash->read_otp();
-    }, m_object_holder, m_fw);
+    auto snapshot = read_device_snapshot();
 
-    if (!check_device_type_match(otp.get_device(), m_firmware,
+    if (!check_device_type_match(snapshot, m_firmware,
         [this](const QString &msg) { append_to_log(msg); }))
     {
       return;
@@ -518,6 +521,88 @@ void MVPLabGui::write_firmware()
   }
 }
 
+void MVPLabGui::write_firmware_all_serial_ports()
+{
+  if (m_fw.isRunning()) {
+    append_to_log("Error: operation in progress");
+    return;
+  }
+
+  if (m_firmware.is_empty()) {
+    append_to_log("Error: no or empty firmware loaded");
+    return;
+  }
+
+  auto steps = firmwareSelectWidget_->get_firmware_steps();
+
+  if (steps == 0)
+  {
+    append_to_log("Nothing to do, no steps have been enabled.");
+    return;
+  }
+
+  auto ports = find_ports();
+
+  if (ports.isEmpty()) {
+    append_to_log("Error: no USB serial ports found");
+    return;
+  }
+
+  QStringList portNames;
+
+  for (const auto &port: ports)
+    portNames.push_back(QString("%1 (%2)").arg(port.portName()).arg(port.serialNumber()));
+
+  auto answer = QMessageBox::question(this, "Program All Serial Ports",
+    QString("Write firmware %1 to the devices connected to the following ports?\n\n%2")
+      .arg(firmwareSelectWidget_->get_firmware_file())
+      .arg(portNames.join("\n")));
+
+  if (answer != QMessageBox::Yes)
+    return;
+
+  // The serial connector must not keep one of the ports open.
+  serialPortConnector_->close();
+
+  MultiPortFlasher flasher(m_firmware);
+  flasher.set_ports(ports);
+  flasher.set_area_index(firmwareSelectWidget_->get_area_index());
+  flasher.set_do_erase(steps & FirmwareSteps::Step_Erase);
+  flasher.set_do_program(steps & FirmwareSteps::Step_Program);
+  flasher.set_do_verify(steps & FirmwareSteps::Step_Verify);
+
+  connect(&flasher, &MultiPortFlasher::port_status_message,
+    this, [this](const QString &port, const QString &msg) {
+      append_to_log(QString("%1: %2").arg(port).arg(msg));
+    }, Qt::QueuedConnection);
+
+  connect(&flasher, &MultiPortFlasher::progress_changed,
+    this, [this](int value, int max) {
+      m_progressbar->setRange(0, max);
+      m_progressbar->setValue(value);
+    }, Qt::QueuedConnection);
+
+  append_to_log(QString("Programming %1 serial ports").arg(ports.size()));
+
+  try {
+    run_in_thread_wait_in_loop([&] {
+      flasher.run();
+    }, m_object_holder, m_fw);
+  } catch (const std::exception &e) {
+    append_to_log(QString(e.what()));
+    return;
+  }
+
+  for (const auto &result: flasher.get_results()) {
+    if (result.success)
+      append_to_log(QString("%1 (%2): done in %3 s")
+        .arg(result.port_name).arg(result.device).arg(result.elapsed_ms / 1000.0));
+    else
+      append_to_log(QString("%1 (%2): failed: %3")
+        .arg(result.port_name).arg(result.device).arg(result.error));
+  }
+}
+
 void MVPLabGui::handle_keys()
 {
   if (m_fw.isRunning()) {
@@ -815,12 +900,12 @@ void MVPLabGui::_show_logview_context_menu(const QPoint &pos)
 }
 
 // Similar to adv_keys_info() but does not display the actual key. Also shows
-// the selected boot area (dip switches).
+// the hardware id, the selected area and the boot area (dip switches).
 void MVPLabGui::show_device_info()
 {
   try {
-    auto keys_info = read_device_keys();
-    auto otp = keys_info.get_otp();
+    auto snapshot = read_device_snapshot();
+    auto otp = snapshot.otp;
     auto devName = otp.get_device().trimmed();
 
     append_to_log(QString("Device Info: type='<b>%1</b>', serial=<b>%2</b>")
@@ -828,7 +913,19 @@ void MVPLabGui::show_device_info()
                   .arg(otp.get_sn(), 8, 16, QLatin1Char('0'))
                  );
 
-    const auto device_keys = keys_info.get_device_keys();
+    append_to_log(QString("  hardware id=0x%1, selected area=%2, boot area on power cycle=%3 (dipswitches)")
+                  .arg(snapshot.hardware_id, 2, 16, QLatin1Char('0'))
+                  .arg(snapshot.area)
+                  .arg(snapshot.dipswitch));
+
+    if (snapshot.vme_hardware_id)
+    {
+      append_to_log(QString("  VME hardware id=0x%1, firmware revision=0x%2")
+                    .arg(snapshot.vme_hardware_id, 4, 16, QLatin1Char('0'))
+                    .arg(snapshot.vme_firmware_id, 4, 16, QLatin1Char('0')));
+    }
+
+    const auto device_keys = snapshot.keys;
 
     append_to_log(QString("  %1/%2 keys on device%3")
     .arg(device_keys.size())
@@ -1099,6 +1196,17 @@ void MVPLabGui::adv_read_dip_switches()
   }
 }
 
+DeviceSnapshot MVPLabGui::read_device_snapshot()
+{
+    return run_in_thread_wait_in_loop<DeviceSnapshot>([&] {
+        auto connector = getActiveConnector();
+        connector->open();
+        auto flash = connector->getFlash();
+        flash->ensure_clean_state();
+        return flash->read_device_snapshot();
+      }, m_object_holder, m_fw);
+}
+
 KeysInfo MVPLabGui::read_device_keys()
 {
     auto flash = getActiveConnector()->getFlash();
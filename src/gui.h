@@ -63,6 +63,7 @@ class MVPLabGui: public QMainWindow
     void _on_firmware_file_changed(const QString &);
 
     void write_firmware();
+    void write_firmware_all_serial_ports();
     void handle_keys();
     void mvlc_connect();
     void mvlc_scanbus();
@@ -81,6 +82,7 @@ class MVPLabGui: public QMainWindow
     void adv_read_hardware_id();
     void adv_read_dip_switches();
     KeysInfo read_device_keys();
+    DeviceSnapshot read_device_snapshot();
     void adv_keys_info();
     void adv_manage_keys();
     void adv_mdpp16_cal_dump_to_console();
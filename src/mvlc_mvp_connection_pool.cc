@@ -0,0 +1,177 @@
+#include "mvlc_mvp_connection_pool.h"
+
+namespace mesytec::mvp
+{
+
+using namespace mesytec::mvlc;
+
+MvlcConnectionPool::MvlcConnectionPool(std::chrono::milliseconds keepaliveInterval)
+    : keepaliveInterval_(keepaliveInterval)
+{
+    if (keepaliveInterval_.count() > 0)
+        keepaliveThread_ = std::thread(&MvlcConnectionPool::keepaliveLoop, this);
+}
+
+MvlcConnectionPool::~MvlcConnectionPool()
+{
+    {
+        std::unique_lock<std::mutex> guard(mutex_);
+        quit_ = true;
+    }
+
+    quitCondition_.notify_all();
+
+    if (keepaliveThread_.joinable())
+        keepaliveThread_.join();
+
+    clear();
+}
+
+std::error_code MvlcConnectionPool::acquire(
+    const std::string &key, const Factory &factory, MVLC &dest, bool &reused)
+{
+    auto logger = mvlc::get_logger("mvlc_mvp_lib");
+    std::unique_lock<std::mutex> guard(mutex_);
+    reused = false;
+
+    if (auto it = connections_.find(key); it != connections_.end())
+    {
+        if (it->second.mvlc.isConnected())
+        {
+            it->second.lastUse = Clock::now();
+            it->second.checkedOut = true;
+            dest = it->second.mvlc;
+            reused = true;
+            logger->debug("MvlcConnectionPool: reusing connection {}", key);
+            return {};
+        }
+
+        connections_.erase(it);
+    }
+
+    auto mvlc = factory();
+
+    if (!mvlc)
+        return make_error_code(MVLCErrorCode::IsDisconnected);
+
+    logger->debug("MvlcConnectionPool: connecting to {}", key);
+
+    if (auto ec = mvlc.connect())
+        return ec;
+
+    connections_[key] = { mvlc, Clock::now(), true };
+    dest = mvlc;
+
+    return {};
+}
+
+void MvlcConnectionPool::release(const std::string &key)
+{
+    std::unique_lock<std::mutex> guard(mutex_);
+
+    if (auto it = connections_.find(key); it != connections_.end())
+    {
+        it->second.lastUse = Clock::now();
+        it->second.checkedOut = false;
+    }
+}
+
+void MvlcConnectionPool::remove(const std::string &key)
+{
+    MVLC mvlc;
+
+    {
+        std::unique_lock<std::mutex> guard(mutex_);
+
+        if (auto it = connections_.find(key); it != connections_.end())
+        {
+            mvlc = it->second.mvlc;
+            connections_.erase(it);
+        }
+    }
+
+    if (mvlc)
+        mvlc.disconnect();
+}
+
+void MvlcConnectionPool::clear()
+{
+    std::map<std::string, Entry> connections;
+
+    {
+        std::unique_lock<std::mutex> guard(mutex_);
+        std::swap(connections, connections_);
+    }
+
+    for (auto &kv: connections)
+        kv.second.mvlc.disconnect();
+}
+
+bool MvlcConnectionPool::contains(const std::string &key) const
+{
+    std::unique_lock<std::mutex> guard(mutex_);
+    return connections_.count(key) > 0;
+}
+
+size_t MvlcConnectionPool::size() const
+{
+    std::unique_lock<std::mutex> guard(mutex_);
+    return connections_.size();
+}
+
+std::vector<std::string> MvlcConnectionPool::keepalive()
+{
+    auto logger = mvlc::get_logger("mvlc_mvp_lib");
+    std::vector<std::pair<std::string, MVLC>> idle;
+
+    {
+        std::unique_lock<std::mutex> guard(mutex_);
+        auto now = Clock::now();
+
+        for (const auto &kv: connections_)
+        {
+            if (!kv.second.checkedOut && now - kv.second.lastUse >= keepaliveInterval_)
+                idle.emplace_back(kv.first, kv.second.mvlc);
+        }
+    }
+
+    // The register reads are done without holding the pool lock. MVLC
+    // serializes them with any ongoing flash transactions.
+    std::vector<std::string> dead;
+
+    for (auto &entry: idle)
+    {
+        u32 value = 0;
+
+        if (auto ec = entry.second.readRegister(registers::hardware_id, value))
+        {
+            logger->warn("MvlcConnectionPool: keepalive failed for {}: {}, dropping connection",
+                         entry.first, ec.message());
+            dead.push_back(entry.first);
+        }
+    }
+
+    for (const auto &key: dead)
+        remove(key);
+
+    return dead;
+}
+
+void MvlcConnectionPool::keepaliveLoop()
+{
+    std::unique_lock<std::mutex> guard(mutex_);
+
+    while (!quit_)
+    {
+        quitCondition_.wait_for(guard, keepaliveInterval_, [this] { return quit_; });
+
+        if (quit_)
+            break;
+
+        guard.unlock();
+        keepalive();
+        guard.lock();
+    }
+}
+
+}
@@ -0,0 +1,79 @@
+#ifndef __MESYTEC_MVLC_MVP_CONNECTION_POOL_H__
+#define __MESYTEC_MVLC_MVP_CONNECTION_POOL_H__
+
+#include <condition_variable>
+#include <thread>
+#include "mvlc_mvp_lib.h"
+
+namespace mesytec::mvp
+{
+
+// Keeps MVLC connections open across multiple actions. Connections are keyed
+// by a string identifying the MVLC, e.g. "eth://mvlc-0056" or
+// "usb://<serial>".
+//
+// A background thread periodically reads a register from each connection
+// which is not checked out and has not been used within the keepalive
+// interval. acquire() checks a connection out, release() returns it to the
+// pool. Connections failing the read are disconnected and removed from the
+// pool so that the next acquire() reconnects.
+class MvlcConnectionPool
+{
+    public:
+        using Factory = std::function<MVLC ()>;
+        using Clock = std::chrono::steady_clock;
+
+        static constexpr std::chrono::milliseconds DefaultKeepaliveInterval{5000};
+
+        explicit MvlcConnectionPool(
+            std::chrono::milliseconds keepaliveInterval = DefaultKeepaliveInterval);
+        ~MvlcConnectionPool();
+
+        MvlcConnectionPool(const MvlcConnectionPool &) = delete;
+        MvlcConnectionPool &operator=(const MvlcConnectionPool &) = delete;
+
+        // Returns a connected MVLC for the given key. A live pooled connection
+        // is reused, otherwise a new MVLC is created using the factory and
+        // connected. reused is set to true if an existing connection was
+        // returned.
+        std::error_code acquire(const std::string &key, const Factory &factory,
+                                MVLC &dest, bool &reused);
+
+        // Returns a connection checked out by acquire() to the pool. The
+        // keepalive interval starts again from the time of the release.
+        void release(const std::string &key);
+
+        // Disconnects the connection and removes it from the pool.
+        void remove(const std::string &key);
+
+        // Disconnects all connections.
+        void clear();
+
+        bool contains(const std::string &key) const;
+        size_t size() const;
+
+        // Pings idle connections. Called by the keepalive thread, public for
+        // testing. Returns the keys of the removed connections.
+        std::vector<std::string> keepalive();
+
+    private:
+        struct Entry
+        {
+            MVLC mvlc;
+            Clock::time_point lastUse;
+            bool checkedOut = false;
+        };
+
+        void keepaliveLoop();
+
+        mutable std::mutex mutex_;
+        std::map<std::string, Entry> connections_;
+        std::chrono::milliseconds keepaliveInterval_;
+        std::condition_variable quitCondition_;
+        bool quit_ = false;
+        std::thread keepaliveThread_;
+};
+
+}
+
+#endif /* __MESYTEC_MVLC_MVP_CONNECTION_POOL_H__ */
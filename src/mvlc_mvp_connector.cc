@@ -4,17 +4,43 @@
 #include <mesytec-mvlc/mvlc_impl_usb.h>
 #include <mesytec-mvlc/scanbus_support.h>
 
+#include "mvlc_mvp_connection_pool.h"
 #include "mvlc_mvp_flash.h"
+#include "mvlc_mvp_identify.h"
 
 namespace mesytec::mvp
 {
 
+namespace
+{
+
+// Key identifying the MVLC in the connection pool. Empty if the connect info
+// is not valid.
+std::string make_pool_key(const QVariantMap &m)
+{
+    if (m["method"] == "eth")
+        return "eth://" + m["address"].toString().toStdString();
+    else if (m["method"] == "usb")
+        return "usb://" + m["serial"].toString().toStdString();
+    return {};
+}
+
+}
+
 struct MvlcMvpConnector::Private
 {
     mvlc::MVLC mvlc_;
     MvlcMvpFlash *flash_;
     QVariantMap connectInfo_;
     QVariantMap activeConnectInfo_;
+    // Connections are kept open between open() calls. The flash session
+    // state (flash interface enabled, verbose mode, selected area) is kept as
+    // long as the same connection and target module are used.
+    MvlcConnectionPool pool_;
+    std::string activeKey_;
+    // Results of the last scanbus, keyed by vme address. Passed on to the
+    // flash object so that it does not have to re-read the module ids.
+    std::map<mvlc::u32, ModuleIdentity> identities_;
 };
 
 MvlcMvpConnector::MvlcMvpConnector(QObject *parent)
@@ -31,41 +57,63 @@ MvlcMvpConnector::MvlcMvpConnector(QObject *parent)
 
 MvlcMvpConnector::~MvlcMvpConnector()
 {
+    close();
 }
 
 void MvlcMvpConnector::open()
 {
-    close();
-
     const auto &m = d->connectInfo_;
+    const auto key = make_pool_key(m);
 
-    if (m["method"] == "eth")
-        d->mvlc_ = mvlc::make_mvlc_eth(m["address"].toString().toStdString());
-    else if (m["method"] == "usb")
-        d->mvlc_ = mvlc::make_mvlc_usb(m["serial"].toString().toStdString());
-    else
+    if (key.empty())
         throw std::runtime_error("MvlcMvpConnector error: could not parse connectionInfo map");
 
-    if (auto ec = d->mvlc_.connect())
-        throw std::system_error(ec);
-
-    emit connectedToMVLC(m);
-
     bool addrOk = false;
     auto vmeAddress = m["vme_address"].toString().toUInt(&addrOk, 0);
 
     if (!addrOk)
         throw std::runtime_error("MvlcMvpConnector error: could not parse target VME address");
 
-    d->flash_->setMvlc(d->mvlc_);
+    auto factory = [&m]
+    {
+        if (m["method"] == "eth")
+            return mvlc::make_mvlc_eth(m["address"].toString().toStdString());
+        return mvlc::make_mvlc_usb(m["serial"].toString().toStdString());
+    };
+
+    mvlc::MVLC mvlc;
+    bool reused = false;
+
+    if (auto ec = d->pool_.acquire(key, factory, mvlc, reused))
+        throw std::system_error(ec);
+
+    if (!reused || key != d->activeKey_)
+    {
+        // Different or new connection: setMvlc() ends the flash session on
+        // the previous connection and starts over. The previous connection
+        // stays in the pool.
+        d->flash_->setMvlc(mvlc);
+
+        if (!d->activeKey_.empty() && d->activeKey_ != key)
+            d->pool_.release(d->activeKey_);
+    }
+
+    d->mvlc_ = mvlc;
+    d->activeKey_ = key;
+
+    emit connectedToMVLC(m);
+
     d->flash_->setVmeAddress(vmeAddress);
+
+    if (auto it = d->identities_.find(vmeAddress); it != d->identities_.end())
+        d->flash_->setModuleIdentity(it->second.hwId, it->second.fwId);
 }
 
 void MvlcMvpConnector::close()
 {
     d->flash_->maybe_disable_flash_interface();
-    if (d->mvlc_)
-        d->mvlc_.disconnect();
+    d->pool_.clear();
+    d->activeKey_.clear();
     d->mvlc_ = mvlc::MVLC();
 }
 
@@ -76,6 +124,16 @@ FlashInterface *MvlcMvpConnector::getFlash()
 
 void MvlcMvpConnector::setConnectInfo(const QVariantMap &info)
 {
+    // Cached module ids are only valid for the MVLC they were read from.
+    for (const auto &key: { "method", "address", "serial" })
+    {
+        if (info.value(key) != d->connectInfo_.value(key))
+        {
+            d->identities_.clear();
+            break;
+        }
+    }
+
     d->connectInfo_ = info;
 }
 
@@ -103,20 +161,31 @@ QVariantList MvlcMvpConnector::scanbus()
     auto candidates = mvlc::scanbus::scan_vme_bus_for_candidates(d->mvlc_);
     QVariantList result;
 
-    for (auto &addr: candidates)
+    std::vector<ModuleIdentity> identities;
+
+    if (auto ec = identify_modules(d->mvlc_, candidates, identities))
+        throw std::system_error(ec);
+
+    d->identities_.clear();
+
+    for (const auto &ident: identities)
     {
-        mvlc::scanbus::VMEModuleInfo moduleInfo{};
+        if (ident.ec)
+            throw std::system_error(ident.ec);
 
-        if (auto ec = mvlc::scanbus::read_module_info(d->mvlc_, addr, moduleInfo))
-            throw std::system_error(ec);
+        mvlc::scanbus::VMEModuleInfo moduleInfo{};
+        moduleInfo.hwId = ident.hwId;
+        moduleInfo.fwId = ident.fwId;
 
         QVariantMap m;
-        m["address"] = addr;
+        m["address"] = ident.address;
         m["hwId"] = moduleInfo.hwId;
         m["fwId"] = moduleInfo.fwId;
         m["module_type"] = QString::fromStdString(moduleInfo.moduleTypeName());
         m["firmware_type"] = QString::fromStdString(moduleInfo.mdppFirmwareTypeName());
         result.push_back(m);
+
+        d->identities_[ident.address] = ident;
     }
 
     emit scanbusResultReady(result);
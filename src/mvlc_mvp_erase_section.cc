@@ -32,10 +32,7 @@ int main(int argc, char *argv[])
         if (auto ec = clear_output_fifo(mvlc, moduleBase))
             throw ec;
 
-        if (auto ec = set_verbose_mode(mvlc, moduleBase, false))
-            throw ec;
-
-        if (auto ec = set_area_index(mvlc, moduleBase, area))
+        if (auto ec = setup_flash_session(mvlc, moduleBase, area))
             throw ec;
 
         spdlog::info("Erasing section {}", section);
@@ -0,0 +1,677 @@
+#include "mvlc_mvp_eth_emulator.h"
+
+#include <algorithm>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <cerrno>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace mesytec::mvp
+{
+
+using namespace mesytec::mvlc;
+
+namespace
+{
+    // One stack wait cycle is 12.5 ns.
+    const std::chrono::nanoseconds WaitCycleTime(12);
+    const std::chrono::nanoseconds WaitCycleTimeFraction(500); // per 1000 cycles
+    // Duration of a single VME cycle on the emulated bus.
+    const std::chrono::nanoseconds VMECycleTime(500);
+
+    // Content words per frame. Each frame is sent in its own packet which
+    // stays below the jumbo frame size.
+    const size_t MaxFrameWords = 2000;
+    const int PollTimeout_ms = 50;
+
+    // Module address decoding uses the upper 16 bits of the VME address.
+    const u32 ModuleBaseMask = 0xffff0000u;
+
+    bool is_block_amod(u8 amod)
+    {
+        switch (amod)
+        {
+            case 0x08: case 0x09: case 0x0b: case 0x0c: case 0x0f: // A32 MBLT/BLT
+            case 0x20: case 0x21:                                 // 2eSST
+            case 0x38: case 0x3b: case 0x3c: case 0x3f:           // A24 MBLT/BLT
+                return true;
+        }
+        return false;
+    }
+
+    u32 get_data_width_mask(VMEDataWidth dw)
+    {
+        return dw == VMEDataWidth::D16 ? 0xffffu : 0xffffffffu;
+    }
+
+    u8 get_stack_word_type(u32 word)
+    {
+        return (word >> 24) & 0xffu;
+    }
+
+    u32 make_frame_header(u8 type, u8 flags, u8 stackNum, size_t len)
+    {
+        return (static_cast<u32>(type) << frame_headers::TypeShift)
+            | ((flags & frame_headers::FrameFlagsMask) << frame_headers::FrameFlagsShift)
+            | ((stackNum & frame_headers::StackNumMask) << frame_headers::StackNumShift)
+            | (static_cast<u32>(len) & frame_headers::LengthMask);
+    }
+
+    bool compare_accu(AccuComparator comp, u32 accu, u32 value)
+    {
+        switch (comp)
+        {
+            case AccuComparator::EQ: return accu == value;
+            case AccuComparator::LT: return accu < value;
+            case AccuComparator::GT: return accu > value;
+        }
+        return true;
+    }
+}
+
+//
+// MvpVmeModule
+//
+
+MvpVmeModule::MvpVmeModule()
+{
+}
+
+MvpVmeModule::MvpVmeModule(const Options &opts)
+    : opts_(opts)
+    , device_(opts.device)
+{
+}
+
+bool MvpVmeModule::isOutputAvailable(Clock::time_point now) const
+{
+    return !outputFifo_.empty() && outputFifo_.front().availableAt <= now;
+}
+
+bool MvpVmeModule::read(u32 reg, u32 &value, Clock::time_point now)
+{
+    switch (reg)
+    {
+        case vme_modules::HardwareIdRegister:
+            value = opts_.hwId;
+            return true;
+
+        case vme_modules::FirmwareRegister:
+            value = opts_.fwId;
+            return true;
+
+        case EnableFlashRegister:
+            value = flashEnabled_;
+            return true;
+
+        case StatusRegister:
+            value = isOutputAvailable(now) ? 0u : status_register_flags::FlashOutputFifoEmpty;
+            return true;
+
+        case OutputFifoRegister:
+            if (isOutputAvailable(now))
+            {
+                value = outputFifo_.front().value;
+                outputFifo_.pop_front();
+            }
+            else
+            {
+                value = output_fifo_flags::InvalidRead | output_fifo_flags::FlashEmpty;
+            }
+            return true;
+
+        case InputFifoRegister:
+            value = 0;
+            return true;
+    }
+
+    return false;
+}
+
+bool MvpVmeModule::write(u32 reg, u32 value, Clock::time_point now)
+{
+    switch (reg)
+    {
+        case EnableFlashRegister:
+            flashEnabled_ = (value & 1u);
+            return true;
+
+        case InputFifoRegister:
+            {
+                if (!flashEnabled_)
+                    return true;
+
+                u8 byte = value & 0xffu;
+                device_.feed(&byte, 1);
+
+                auto response = device_.take_output();
+                auto busy = device_.take_busy_time();
+                auto availableAt = now + opts_.fifoLatency;
+
+                // The response code and status byte are posted once the
+                // instruction has completed.
+                const size_t delayedFrom = (busy.count() > 0 && response.size() >= 2
+                                            ? response.size() - 2 : response.size());
+
+                for (int i=0; i<response.size(); ++i)
+                {
+                    auto t = static_cast<size_t>(i) < delayedFrom ? availableAt : availableAt + busy;
+                    outputFifo_.push_back({ t, response[i] });
+                }
+            }
+            return true;
+
+        case OutputFifoRegister:
+        case StatusRegister:
+        case vme_modules::HardwareIdRegister:
+        case vme_modules::FirmwareRegister:
+            return true;
+    }
+
+    return false;
+}
+
+//
+// MvlcStackExecutor
+//
+
+void MvlcStackExecutor::addModule(u32 moduleBase, const std::shared_ptr<MvpVmeModule> &module)
+{
+    modules_[moduleBase & ModuleBaseMask] = module;
+}
+
+std::shared_ptr<MvpVmeModule> MvlcStackExecutor::getModule(u32 moduleBase) const
+{
+    auto it = modules_.find(moduleBase & ModuleBaseMask);
+    return it != modules_.end() ? it->second : nullptr;
+}
+
+MvpVmeModule *MvlcStackExecutor::findModule(u32 address, u32 &reg) const
+{
+    auto it = modules_.find(address & ModuleBaseMask);
+
+    if (it == modules_.end())
+        return nullptr;
+
+    reg = address & ~ModuleBaseMask;
+    return it->second.get();
+}
+
+bool MvlcStackExecutor::vmeRead(u32 address, u32 &value)
+{
+    skew_ += VMECycleTime;
+    u32 reg = 0;
+
+    if (auto module = findModule(address, reg))
+        return module->read(reg, value, now());
+
+    return false;
+}
+
+bool MvlcStackExecutor::vmeWrite(u32 address, u32 value)
+{
+    skew_ += VMECycleTime;
+    u32 reg = 0;
+
+    if (auto module = findModule(address, reg))
+        return module->write(reg, value, now());
+
+    return false;
+}
+
+MvlcStackExecutor::Result MvlcStackExecutor::execute(const std::vector<u32> &stackBuffer)
+{
+    using CommandType = StackCommand::CommandType;
+
+    Result result;
+    auto &out = result.output;
+
+    std::vector<u32> buffer;
+    std::copy_if(std::begin(stackBuffer), std::end(stackBuffer), std::back_inserter(buffer),
+                 [] (u32 word)
+                 {
+                     auto type = get_stack_word_type(word);
+                     return type != static_cast<u8>(stacks::StackCommandType::StackStart)
+                         && type != static_cast<u8>(stacks::StackCommandType::StackEnd);
+                 });
+
+    const auto commands = stack_builder_from_buffer(buffer).getCommands();
+
+    u32 accu = 0;
+    bool repeatNextRead = false;
+    size_t loopIterations = 0;
+
+    for (size_t ci=0; ci<commands.size(); ++ci)
+    {
+        const auto &cmd = commands[ci];
+
+        switch (cmd.type)
+        {
+            case CommandType::WriteMarker:
+                out.push_back(cmd.value);
+                break;
+
+            case CommandType::WriteSpecial:
+                out.push_back(0u);
+                break;
+
+            case CommandType::Wait:
+                skew_ += WaitCycleTime * cmd.value + WaitCycleTimeFraction * cmd.value / 1000;
+                break;
+
+            case CommandType::SetAccu:
+                accu = cmd.value;
+                repeatNextRead = true;
+                break;
+
+            case CommandType::ReadToAccu:
+                if (!vmeRead(cmd.address, accu))
+                    result.flags |= frame_flags::Timeout;
+                accu &= get_data_width_mask(cmd.dataWidth);
+                break;
+
+            case CommandType::CompareLoopAccu:
+                // Loop back to the preceding command until the comparison
+                // holds.
+                if (!compare_accu(static_cast<AccuComparator>(cmd.address), accu, cmd.value)
+                    && ci > 0)
+                {
+                    if (++loopIterations > MaxLoopIterations)
+                    {
+                        result.flags |= frame_flags::Timeout;
+                        return result;
+                    }
+
+                    ci -= 2;
+                }
+                break;
+
+            case CommandType::VMERead:
+            case CommandType::VMEReadSwapped:
+                if (is_block_amod(cmd.amod))
+                {
+                    // Block read: F5 frame containing the data words. Ends
+                    // with BusError once the module stops answering.
+                    auto headerIndex = out.size();
+                    out.push_back(0u);
+                    u8 blockFlags = 0;
+
+                    for (size_t i=0; i<cmd.transfers; ++i)
+                    {
+                        u32 value = 0;
+
+                        if (!vmeRead(cmd.address, value) || (value & output_fifo_flags::InvalidRead))
+                        {
+                            blockFlags |= frame_flags::BusError;
+                            break;
+                        }
+
+                        out.push_back(value);
+                    }
+
+                    out[headerIndex] = make_frame_header(
+                        frame_headers::BlockRead, blockFlags, 0, out.size() - headerIndex - 1);
+                }
+                else if (repeatNextRead)
+                {
+                    // Fake block read: single cycle reads repeated accu
+                    // times. The MVLC wraps the data in an F5 frame like a
+                    // real block read but always performs all reads, so
+                    // InvalidRead words are part of the data.
+                    repeatNextRead = false;
+                    auto headerIndex = out.size();
+                    out.push_back(0u);
+
+                    for (size_t i=0; i<accu; ++i)
+                    {
+                        u32 value = 0;
+
+                        if (!vmeRead(cmd.address, value))
+                        {
+                            result.flags |= frame_flags::Timeout;
+                            value = 0xffffffffu;
+                        }
+
+                        out.push_back(value & get_data_width_mask(cmd.dataWidth));
+                    }
+
+                    out[headerIndex] = make_frame_header(
+                        frame_headers::BlockRead, 0, 0, out.size() - headerIndex - 1);
+                }
+                else
+                {
+                    u32 value = 0;
+
+                    if (!vmeRead(cmd.address, value))
+                    {
+                        result.flags |= frame_flags::Timeout;
+                        value = 0xffffffffu;
+                    }
+
+                    out.push_back(value & get_data_width_mask(cmd.dataWidth));
+                }
+                break;
+
+            case CommandType::VMEWrite:
+                if (!vmeWrite(cmd.address, cmd.value & get_data_width_mask(cmd.dataWidth)))
+                    result.flags |= frame_flags::Timeout;
+                break;
+
+            case CommandType::SoftwareDelay:
+                // Handled on the client side, never uploaded.
+                break;
+
+            default:
+                result.flags |= frame_flags::SyntaxError;
+                return result;
+        }
+    }
+
+    return result;
+}
+
+//
+// MvlcEthEmulator
+//
+
+MvlcEthEmulator::MvlcEthEmulator()
+    : MvlcEthEmulator(Options{})
+{
+}
+
+MvlcEthEmulator::MvlcEthEmulator(const Options &opts)
+    : opts_(opts)
+    , stackMemory_(stacks::StackMemoryWords)
+{
+    registers_[registers::hardware_id] = opts_.hwId;
+    registers_[registers::firmware_revision] = opts_.fwId;
+}
+
+MvlcEthEmulator::~MvlcEthEmulator()
+{
+    stop();
+}
+
+std::shared_ptr<MvpVmeModule> MvlcEthEmulator::addModule(u32 moduleBase, const MvpVmeModule::Options &opts)
+{
+    auto module = std::make_shared<MvpVmeModule>(opts);
+    std::lock_guard<std::mutex> guard(mutex_);
+    executor_.addModule(moduleBase, module);
+    return module;
+}
+
+MvlcEthEmulator::Stats MvlcEthEmulator::getStats() const
+{
+    std::lock_guard<std::mutex> guard(mutex_);
+    return stats_;
+}
+
+#ifndef _WIN32
+
+std::error_code MvlcEthEmulator::start()
+{
+    auto logger = mvlc::get_logger("mvlc_mvp_lib");
+
+    if (isRunning())
+        return {};
+
+    auto make_socket = [this] (u16 port, int &dest) -> std::error_code
+    {
+        dest = ::socket(AF_INET, SOCK_DGRAM, 0);
+
+        if (dest < 0)
+            return std::error_code(errno, std::system_category());
+
+        int bufferSize = 1024 * 1024;
+        ::setsockopt(dest, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+        ::setsockopt(dest, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+
+        if (::inet_pton(AF_INET, opts_.address.c_str(), &addr.sin_addr) != 1)
+            return std::make_error_code(std::errc::invalid_argument);
+
+        if (::bind(dest, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0)
+            return std::error_code(errno, std::system_category());
+
+        return {};
+    };
+
+    std::error_code ec = make_socket(eth::CommandPort, cmdSocket_);
+
+    if (!ec)
+        ec = make_socket(eth::DataPort, dataSocket_);
+
+    if (ec)
+    {
+        logger->error("MvlcEthEmulator: could not bind to {}: {}", opts_.address, ec.message());
+        stop();
+        return ec;
+    }
+
+    quit_ = false;
+    thread_ = std::thread(&MvlcEthEmulator::loop, this);
+
+    logger->info("MvlcEthEmulator: listening on {}, ports {} and {}",
+                 opts_.address, eth::CommandPort, eth::DataPort);
+
+    return {};
+}
+
+void MvlcEthEmulator::stop()
+{
+    quit_ = true;
+
+    if (thread_.joinable())
+        thread_.join();
+
+    for (int *sock: { &cmdSocket_, &dataSocket_ })
+    {
+        if (*sock >= 0)
+            ::close(*sock);
+        *sock = -1;
+    }
+}
+
+void MvlcEthEmulator::loop()
+{
+    std::vector<u32> buffer(eth::JumboFrameMaxSize / sizeof(u32) + 1);
+
+    while (!quit_)
+    {
+        struct pollfd fds[2] =
+        {
+            { cmdSocket_, POLLIN, 0 },
+            { dataSocket_, POLLIN, 0 },
+        };
+
+        if (::poll(fds, 2, PollTimeout_ms) <= 0)
+            continue;
+
+        // The data pipe is only used by the client to announce its address.
+        // Readout data is never produced.
+        if (fds[1].revents & POLLIN)
+            ::recv(dataSocket_, buffer.data(), buffer.size() * sizeof(u32), 0);
+
+        if (!(fds[0].revents & POLLIN))
+            continue;
+
+        struct sockaddr_in peer = {};
+        socklen_t peerLen = sizeof(peer);
+
+        auto bytes = ::recvfrom(cmdSocket_, buffer.data(), buffer.size() * sizeof(u32), 0,
+                                reinterpret_cast<struct sockaddr *>(&peer), &peerLen);
+
+        if (bytes < static_cast<ssize_t>(sizeof(u32)))
+            continue;
+
+        std::vector<u32> request(buffer.begin(), buffer.begin() + bytes / sizeof(u32));
+        handleCommandPacket(request, &peer);
+    }
+}
+
+void MvlcEthEmulator::sendFrames(u8 packetChannel, u8 frameType, u8 continuationType,
+                                 const std::vector<u32> &contents, u8 flags, const void *peer)
+{
+    size_t offset = 0;
+
+    do
+    {
+        const size_t len = std::min(contents.size() - offset, MaxFrameWords);
+        const bool last = offset + len >= contents.size();
+        const u8 type = offset == 0 ? frameType : continuationType;
+        u8 frameFlags = last ? flags : (flags | frame_flags::Continue);
+
+        std::vector<u32> packet;
+        u16 &packetNumber = packetNumbers_[packetChannel];
+
+        packet.push_back(((packetChannel & eth::header0::PacketChannelMask) << eth::header0::PacketChannelShift)
+                         | ((packetNumber & eth::header0::PacketNumberMask) << eth::header0::PacketNumberShift)
+                         | (((len + 1) & eth::header0::NumDataWordsMask) << eth::header0::NumDataWordsShift));
+        // The frame header directly follows the packet headers.
+        packet.push_back(0u << eth::header1::HeaderPointerShift);
+        packet.push_back(make_frame_header(type, frameFlags, stacks::ImmediateStackID, len));
+        packet.insert(packet.end(), contents.begin() + offset, contents.begin() + offset + len);
+
+        packetNumber = (packetNumber + 1) & eth::header0::PacketNumberMask;
+
+        if (opts_.linkLatency.count() > 0)
+            std::this_thread::sleep_for(opts_.linkLatency);
+
+        auto addr = reinterpret_cast<const struct sockaddr *>(peer);
+        ::sendto(cmdSocket_, packet.data(), packet.size() * sizeof(u32), 0, addr, sizeof(struct sockaddr_in));
+
+        ++stats_.responsePackets;
+        offset += len;
+    } while (offset < contents.size());
+}
+
+#else // _WIN32
+
+std::error_code MvlcEthEmulator::start()
+{
+    return std::make_error_code(std::errc::not_supported);
+}
+
+void MvlcEthEmulator::stop()
+{
+}
+
+void MvlcEthEmulator::loop()
+{
+}
+
+void MvlcEthEmulator::sendFrames(u8, u8, u8, const std::vector<u32> &, u8, const void *)
+{
+}
+
+#endif // _WIN32
+
+void MvlcEthEmulator::handleCommandPacket(const std::vector<u32> &request, const void *peer)
+{
+    using SuperCommandType = super_commands::SuperCommandType;
+
+    std::lock_guard<std::mutex> guard(mutex_);
+    ++stats_.commandPackets;
+
+    // The mirror response contains all commands except the buffer start and
+    // end markers. ReadLocal is followed by the register value, WriteLocal by
+    // the written value.
+    std::vector<u32> mirror;
+    bool triggerImmediateStack = false;
+    const u32 stackMemoryEnd = stacks::StackMemoryBegin + stacks::StackMemoryWords * sizeof(u32);
+
+    for (size_t i=0; i<request.size(); ++i)
+    {
+        const u32 word = request[i];
+        const auto type = static_cast<SuperCommandType>(word >> 16);
+        const u16 arg = word & 0xffffu;
+
+        switch (type)
+        {
+            case SuperCommandType::CmdBufferStart:
+            case SuperCommandType::CmdBufferEnd:
+                break;
+
+            case SuperCommandType::ReferenceWord:
+            case SuperCommandType::WriteReset:
+                mirror.push_back(word);
+                break;
+
+            case SuperCommandType::ReadLocal:
+                mirror.push_back(word);
+                if (arg >= stacks::StackMemoryBegin && arg < stackMemoryEnd)
+                    mirror.push_back(stackMemory_[(arg - stacks::StackMemoryBegin) / sizeof(u32)]);
+                else
+                    mirror.push_back(registers_[arg]);
+                break;
+
+            case SuperCommandType::WriteLocal:
+                {
+                    if (i + 1 >= request.size())
+                        break;
+
+                    const u32 value = request[++i];
+                    mirror.push_back(word);
+                    mirror.push_back(value);
+
+                    if (arg >= stacks::StackMemoryBegin && arg < stackMemoryEnd)
+                        stackMemory_[(arg - stacks::StackMemoryBegin) / sizeof(u32)] = value;
+                    else
+                        registers_[arg] = value;
+
+                    if (arg == stacks::get_trigger_register(stacks::ImmediateStackID) && value != 0)
+                        triggerImmediateStack = true;
+                }
+                break;
+
+            default:
+                // Unknown commands are mirrored unchanged.
+                mirror.push_back(word);
+                break;
+        }
+    }
+
+    ++stats_.superTransactions;
+    sendFrames(static_cast<u8>(eth::PacketChannel::Command),
+               frame_headers::SuperFrame, frame_headers::SuperFrame, mirror, 0, peer);
+
+    if (triggerImmediateStack)
+        executeImmediateStack(peer);
+}
+
+void MvlcEthEmulator::executeImmediateStack(const void *peer)
+{
+    const u32 offsetBytes = registers_[stacks::get_offset_register(stacks::ImmediateStackID)];
+    const auto stackEnd = static_cast<u32>(stacks::StackCommandType::StackEnd);
+
+    std::vector<u32> stackBuffer;
+
+    for (size_t i = offsetBytes / sizeof(u32); i < stackMemory_.size(); ++i)
+    {
+        stackBuffer.push_back(stackMemory_[i]);
+
+        if (get_stack_word_type(stackMemory_[i]) == stackEnd)
+            break;
+    }
+
+    auto result = executor_.execute(stackBuffer);
+
+    ++stats_.stacksExecuted;
+
+    if (result.flags)
+        ++stats_.stackErrors;
+
+    sendFrames(static_cast<u8>(eth::PacketChannel::Stack),
+               frame_headers::StackFrame, frame_headers::StackContinuation,
+               result.output, result.flags, peer);
+}
+
+}
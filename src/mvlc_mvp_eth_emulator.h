@@ -0,0 +1,183 @@
+#ifndef __MESYTEC_MVLC_MVP_ETH_EMULATOR_H__
+#define __MESYTEC_MVLC_MVP_ETH_EMULATOR_H__
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "mvlc_mvp_lib.h"
+#include "mvp_device_model.h"
+
+namespace mesytec::mvp
+{
+
+// Emulated VME module exposing the MVP flash interface registers
+// (EnableFlashRegister, InputFifoRegister, OutputFifoRegister, StatusRegister)
+// plus the hardware and firmware id registers. Instruction bytes written to
+// the input fifo are passed to a MvpDeviceModel. The response bytes become
+// readable from the output fifo after fifoLatency. The response code and
+// status byte of instructions keeping the device busy (e.g. ERF) only show up
+// once the busy time has passed.
+class MvpVmeModule
+{
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        struct Options
+        {
+            u32 hwId = mvlc::vme_modules::HardwareIds::MDPP_16;
+            u32 fwId = 0x0100;
+            std::chrono::microseconds fifoLatency = std::chrono::microseconds(20);
+            MvpDeviceModel::Options device;
+        };
+
+        MvpVmeModule();
+        explicit MvpVmeModule(const Options &opts);
+
+        // Register access. reg is relative to the module base address. Returns
+        // false for unmapped registers.
+        bool read(u32 reg, u32 &value, Clock::time_point now);
+        bool write(u32 reg, u32 value, Clock::time_point now);
+
+        MvpDeviceModel &getDeviceModel() { return device_; }
+        bool isFlashEnabled() const { return flashEnabled_; }
+
+    private:
+        struct FifoEntry
+        {
+            Clock::time_point availableAt;
+            u8 value;
+        };
+
+        bool isOutputAvailable(Clock::time_point now) const;
+
+        Options opts_;
+        MvpDeviceModel device_;
+        std::deque<FifoEntry> outputFifo_;
+        bool flashEnabled_ = false;
+};
+
+// Executes MVLC command stacks against a set of emulated modules.
+//
+// Supported commands: VMERead (single, accu repeated and block reads),
+// VMEWrite, WriteMarker, WriteSpecial, Wait, SetAccu, ReadToAccu and
+// CompareLoopAccu. Waits do not sleep but advance the device clock of the
+// modules by 12.5 ns per cycle.
+class MvlcStackExecutor
+{
+    public:
+        using Clock = MvpVmeModule::Clock;
+
+        struct Result
+        {
+            std::vector<u32> output;
+            u8 flags = 0; // frame_flags
+        };
+
+        // Limits accu loops which never terminate, e.g. polling the status
+        // register while no response is pending. The stack is aborted with
+        // the Timeout flag set.
+        static const size_t MaxLoopIterations = 100000;
+
+        void addModule(u32 moduleBase, const std::shared_ptr<MvpVmeModule> &module);
+        std::shared_ptr<MvpVmeModule> getModule(u32 moduleBase) const;
+
+        // Executes the given stack. The buffer may contain the StackStart and
+        // StackEnd words.
+        Result execute(const std::vector<u32> &stackBuffer);
+
+        // Single VME accesses outside of stacks.
+        bool vmeRead(u32 address, u32 &value);
+        bool vmeWrite(u32 address, u32 value);
+
+    private:
+        Clock::time_point now() const { return Clock::now() + skew_; }
+        MvpVmeModule *findModule(u32 address, u32 &reg) const;
+
+        std::map<u32, std::shared_ptr<MvpVmeModule>> modules_;
+        Clock::duration skew_ = Clock::duration::zero();
+};
+
+// MVLC ETH stand-in: listens on the command and data ports of the given
+// address so that make_mvlc_eth(address) can connect to it.
+//
+// Super command buffers (ReferenceWord, ReadLocal, WriteLocal, WriteReset)
+// are answered with the mirror response. Internal registers are kept in a
+// plain register map, stack uploads go into an emulated stack memory. A write
+// to the trigger register of the immediate stack executes the uploaded stack
+// using a MvlcStackExecutor. The stack output is sent back as a stack frame
+// split into continuation frames if needed. linkLatency is applied before
+// each response packet is sent.
+class MvlcEthEmulator
+{
+    public:
+        struct Options
+        {
+            std::string address = "127.0.0.1";
+            std::chrono::microseconds linkLatency = std::chrono::microseconds(0);
+            u32 hwId = mvlc::vme_modules::HardwareIds::MVLC;
+            u32 fwId = 0x0037;
+        };
+
+        struct Stats
+        {
+            size_t commandPackets = 0;
+            size_t responsePackets = 0;
+            size_t superTransactions = 0;
+            size_t stacksExecuted = 0;
+            size_t stackErrors = 0;
+        };
+
+        MvlcEthEmulator();
+        explicit MvlcEthEmulator(const Options &opts);
+        ~MvlcEthEmulator();
+
+        MvlcEthEmulator(const MvlcEthEmulator &) = delete;
+        MvlcEthEmulator &operator=(const MvlcEthEmulator &) = delete;
+
+        std::shared_ptr<MvpVmeModule> addModule(u32 moduleBase,
+                                                const MvpVmeModule::Options &opts = {});
+
+        std::error_code start();
+        void stop();
+        bool isRunning() const { return thread_.joinable(); }
+
+        // Calls f with the module at moduleBase while holding the emulator
+        // lock.
+        template<typename F>
+        auto withModule(u32 moduleBase, F f)
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            return f(*executor_.getModule(moduleBase));
+        }
+
+        Stats getStats() const;
+
+    private:
+        void loop();
+        void handleCommandPacket(const std::vector<u32> &request, const void *peer);
+        void sendFrames(u8 packetChannel, u8 frameType, u8 continuationType,
+                        const std::vector<u32> &contents, u8 flags, const void *peer);
+        void executeImmediateStack(const void *peer);
+
+        Options opts_;
+        MvlcStackExecutor executor_;
+        std::map<u16, u32> registers_;
+        std::vector<u32> stackMemory_;
+        mutable std::mutex mutex_;
+        Stats stats_;
+
+        int cmdSocket_ = -1;
+        int dataSocket_ = -1;
+        u16 packetNumbers_[3] = {};
+        std::thread thread_;
+        std::atomic<bool> quit_{false};
+};
+
+}
+
+#endif /* __MESYTEC_MVLC_MVP_ETH_EMULATOR_H__ */
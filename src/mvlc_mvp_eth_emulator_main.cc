@@ -0,0 +1,244 @@
+// Runs a MvlcEthEmulator with a single emulated MVP module at VME address 0.
+//
+// Without arguments the emulator serves until interrupted. Connect with e.g.
+// 'mvlc-mvp-updater --mvlc-eth 127.0.0.1 ...'.
+//
+// --run-checks connects to the emulator in-process and exercises the stack
+// based flash functions (erase, the write_page variants, batched writes and
+// page reads), verifying the results against the device model.
+
+#include <csignal>
+#include <iostream>
+#include <argh.h>
+#include <mesytec-mvlc/mesytec-mvlc.h>
+#include "mvlc_mvp_eth_emulator.h"
+#include "mvlc_mvp_lib.h"
+
+using namespace mesytec::mvlc;
+using namespace mesytec::mvp;
+
+namespace
+{
+
+std::atomic<bool> signal_received(false);
+
+void signal_handler(int)
+{
+    signal_received = true;
+}
+
+std::vector<u8> make_test_page(u8 seed, size_t size = PageSize)
+{
+    std::vector<u8> ret(size);
+    for (size_t i=0; i<size; ++i)
+        ret[i] = (i * 7 + seed) & 0xff;
+    return ret;
+}
+
+struct Check
+{
+    std::string name;
+    std::function<std::error_code (MVLC &mvlc, MvlcEthEmulator &emu)> f;
+};
+
+std::error_code verify_model(MvlcEthEmulator &emu, unsigned area, u8 section,
+                             u32 address, const std::vector<u8> &expected)
+{
+    auto actual = emu.withModule(0, [&] (MvpVmeModule &module)
+    {
+        return module.getDeviceModel().peek(area, section, address, expected.size());
+    });
+
+    if (actual.size() != static_cast<int>(expected.size())
+        || !std::equal(expected.begin(), expected.end(), actual.begin()))
+    {
+        return std::make_error_code(std::errc::io_error);
+    }
+
+    return {};
+}
+
+} // end anon namespace
+
+int run_checks(MvlcEthEmulator &emu, const std::string &address)
+{
+    static const unsigned Area = 1;
+    static const u8 Section = 3;
+    static const u32 ModuleBase = 0;
+
+    auto mvlc = make_mvlc_eth(address);
+
+    if (auto ec = mvlc.connect())
+    {
+        spdlog::error("mvlc.connect(): {}", ec.message());
+        return 1;
+    }
+
+    auto write_check = [] (auto writeFunc, u32 pageAddress, u8 seed)
+    {
+        return [=] (MVLC &mvlc, MvlcEthEmulator &emu) -> std::error_code
+        {
+            auto page = make_test_page(seed);
+            FlashAddress addr = flash_address_from_byte_offset(pageAddress);
+
+            if (auto ec = writeFunc(mvlc, ModuleBase, addr, Section, page))
+                return ec;
+
+            return verify_model(emu, Area, Section, pageAddress, page);
+        };
+    };
+
+    std::vector<Check> checks =
+    {
+        { "setup_flash_session", [] (MVLC &mvlc, MvlcEthEmulator &) {
+            return setup_flash_session(mvlc, ModuleBase, Area);
+        }},
+
+        { "erase_section", [] (MVLC &mvlc, MvlcEthEmulator &emu) -> std::error_code {
+            if (auto ec = erase_section(mvlc, ModuleBase, Section))
+                return ec;
+            return verify_model(emu, Area, Section, 0, std::vector<u8>(4 * PageSize, 0xff));
+        }},
+
+        { "write_page",  write_check(write_page,  0 * PageSize, 1) },
+        { "write_page2", write_check(write_page2, 1 * PageSize, 2) },
+        { "write_page3", write_check(write_page3, 2 * PageSize, 3) },
+        { "write_page4", write_check(write_page4, 3 * PageSize, 4) },
+
+        { "write_pages_batch", [] (MVLC &mvlc, MvlcEthEmulator &emu) -> std::error_code {
+            const u32 start = 4 * PageSize;
+            std::vector<std::vector<u8>> pageData;
+            std::vector<gsl::span<const u8>> pages;
+            std::vector<u8> expected;
+
+            for (u8 i=0; i<20; ++i)
+                pageData.emplace_back(make_test_page(10 + i));
+
+            for (const auto &page: pageData)
+            {
+                pages.emplace_back(page);
+                std::copy(page.begin(), page.end(), std::back_inserter(expected));
+            }
+
+            if (auto ec = write_pages_batch(mvlc, ModuleBase, start, Section, pages))
+                return ec;
+
+            return verify_model(emu, Area, Section, start, expected);
+        }},
+
+        { "read_page", [] (MVLC &mvlc, MvlcEthEmulator &) -> std::error_code {
+            std::vector<u8> pageBuffer;
+
+            if (auto ec = read_page(mvlc, ModuleBase, flash_address_from_byte_offset(PageSize),
+                                    Section, PageSize, pageBuffer))
+                return ec;
+
+            return pageBuffer == make_test_page(2)
+                ? std::error_code{} : std::make_error_code(std::errc::io_error);
+        }},
+
+        { "read_pages", [] (MVLC &mvlc, MvlcEthEmulator &emu) -> std::error_code {
+            const size_t len = 6 * PageSize + 100;
+            std::vector<u8> dest;
+
+            if (auto ec = read_pages(mvlc, ModuleBase, 100, Section, len, dest))
+                return ec;
+
+            return verify_model(emu, Area, Section, 100, dest);
+        }},
+    };
+
+    int failed = 0;
+
+    for (const auto &check: checks)
+    {
+        auto tStart = std::chrono::steady_clock::now();
+        auto ec = check.f(mvlc, emu);
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - tStart);
+
+        if (ec)
+        {
+            spdlog::error("{}: FAILED ({}), {} ms", check.name, ec.message(), elapsed.count());
+            ++failed;
+        }
+        else
+            spdlog::info("{}: ok, {} ms", check.name, elapsed.count());
+    }
+
+    auto stats = emu.getStats();
+
+    spdlog::info("emulator: commandPackets={}, responsePackets={}, stacksExecuted={}, stackErrors={}",
+                 stats.commandPackets, stats.responsePackets, stats.stacksExecuted, stats.stackErrors);
+
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    argh::parser parser({"-h", "--help", "--address", "--hardware-id", "--erase-time-ms",
+                         "--page-write-time-us", "--fifo-latency-us", "--link-latency-us"});
+    parser.parse(argc, argv);
+
+    if (parser[{"-h", "--help"}])
+    {
+        std::cout << "Usage: " << argv[0] << " [--address=127.0.0.1] [--hardware-id=0x5005]"
+            " [--erase-time-ms=N] [--page-write-time-us=N] [--fifo-latency-us=N]"
+            " [--link-latency-us=N] [--run-checks] [--debug]\n";
+        return 0;
+    }
+
+    if (parser["--debug"])
+        spdlog::set_level(spdlog::level::debug);
+
+    MvlcEthEmulator::Options emuOpts;
+    MvpVmeModule::Options moduleOpts;
+    std::string str;
+    unsigned value = 0;
+
+    parser("--address", emuOpts.address) >> emuOpts.address;
+
+    if (parser("--hardware-id") >> str)
+        moduleOpts.hwId = std::stoul(str, nullptr, 0);
+
+    if (parser("--erase-time-ms") >> value)
+        moduleOpts.device.erase_time = std::chrono::milliseconds(value);
+
+    if (parser("--page-write-time-us") >> value)
+        moduleOpts.device.page_write_time = std::chrono::microseconds(value);
+
+    if (parser("--fifo-latency-us") >> value)
+        moduleOpts.fifoLatency = std::chrono::microseconds(value);
+
+    if (parser("--link-latency-us") >> value)
+        emuOpts.linkLatency = std::chrono::microseconds(value);
+
+    MvlcEthEmulator emu(emuOpts);
+    auto module = emu.addModule(0, moduleOpts);
+    module->getDeviceModel().program_otp("MDPP-16 ", 0x1234);
+
+    if (auto ec = emu.start())
+    {
+        spdlog::error("Could not start the emulator: {}", ec.message());
+        return 1;
+    }
+
+    if (parser["--run-checks"])
+    {
+        int ret = run_checks(emu, emuOpts.address);
+        emu.stop();
+        return ret;
+    }
+
+    std::signal(SIGINT, signal_handler);
+    std::signal(SIGTERM, signal_handler);
+
+    spdlog::info("Emulator running on {}. Press Ctrl-C to quit.", emuOpts.address);
+
+    while (!signal_received)
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    emu.stop();
+
+    return 0;
+}
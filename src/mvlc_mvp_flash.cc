@@ -1,6 +1,8 @@
 #include "mvlc_mvp_flash.h"
+#include "mvlc_mvp_identify.h"
 #include "mvlc_mvp_lib.h"
 #include "mvlc_mvp_connector.h"
+#include "mvlc_mvp_traffic.h"
 
 using namespace mesytec::mvlc;
 using namespace mesytec::mvp;
@@ -15,9 +17,14 @@ MvlcMvpFlash::~MvlcMvpFlash()
 
 void MvlcMvpFlash::setMvlc(MVLC &mvlc)
 {
+    // The flash session and the module identity belong to the previous
+    // MVLC, even if the next module uses the same VME address.
+    maybe_disable_flash_interface();
     mvlc_ = mvlc;
-    isFlashEnabled_ = false;
-    m_write_enabled = false;
+    mvlcChanged_ = true;
+    clearModuleIdentity();
+    m_state = {};
+    clear_page_cache();
 }
 
 MVLC MvlcMvpFlash::getMvlc() const
@@ -27,9 +34,31 @@ MVLC MvlcMvpFlash::getMvlc() const
 
 void MvlcMvpFlash::setVmeAddress(u32 vmeAddress)
 {
+    // Keep the flash session of the current module if neither the MVLC nor
+    // the address changed.
+    if (vmeAddress == vmeAddress_ && !mvlcChanged_)
+        return;
+
     maybe_disable_flash_interface();
     vmeAddress_ = vmeAddress;
-    m_write_enabled = false;
+    mvlcChanged_ = false;
+    clearModuleIdentity();
+    m_state = {};
+    clear_page_cache();
+}
+
+void MvlcMvpFlash::setModuleIdentity(u32 hwId, u32 fwId)
+{
+    hwId_ = hwId;
+    fwId_ = fwId;
+    hasModuleIdentity_ = true;
+}
+
+void MvlcMvpFlash::clearModuleIdentity()
+{
+    hwId_ = 0;
+    fwId_ = 0;
+    hasModuleIdentity_ = false;
 }
 
 u32 MvlcMvpFlash::getVmeAddress() const
@@ -41,15 +70,18 @@ void MvlcMvpFlash::maybe_enable_flash_interface()
 {
     using namespace mesytec::mvlc::vme_modules;
 
-    if (!isFlashEnabled_)
+    if (!m_state.interface_enabled)
     {
-        u32 hwId = 0, fwId = 0;
+        u32 hwId = hwId_, fwId = fwId_;
 
-        if (auto ec = mvlc_.vmeRead(vmeAddress_ + HardwareIdRegister, hwId, vme_amods::A32, VMEDataWidth::D16))
-            throw std::runtime_error(fmt::format("Error reading hardware id from {:#10x}: {}", vmeAddress_, ec.message()));
+        if (!hasModuleIdentity_)
+        {
+            if (auto ec = paced_vme_read(mvlc_, vmeAddress_ + HardwareIdRegister, hwId, vme_amods::A32, VMEDataWidth::D16))
+                throw std::runtime_error(fmt::format("Error reading hardware id from {:#10x}: {}", vmeAddress_, ec.message()));
 
-        if (auto ec = mvlc_.vmeRead(vmeAddress_ + FirmwareRegister, fwId, vme_amods::A32, VMEDataWidth::D16))
-            throw std::runtime_error(fmt::format("Error reading firmware revision from {:#10x}: {}", vmeAddress_, ec.message()));
+            if (auto ec = paced_vme_read(mvlc_, vmeAddress_ + FirmwareRegister, fwId, vme_amods::A32, VMEDataWidth::D16))
+                throw std::runtime_error(fmt::format("Error reading firmware revision from {:#10x}: {}", vmeAddress_, ec.message()));
+        }
 
         auto canFlash = can_flash_through_vme(hwId, fwId);
 
@@ -59,13 +91,41 @@ void MvlcMvpFlash::maybe_enable_flash_interface()
         if (auto ec = enable_flash_interface(mvlc_, vmeAddress_))
             throw std::system_error(ec);
 
-        isFlashEnabled_ = true;
+        m_state.interface_enabled = true;
+
+        // Bind a cached profile to the module address. A calibration only
+        // runs once per module type. Calibration errors are not fatal: the
+        // module falls back to the default wait cycles.
+        FifoWaitProfile profile;
+
+        if (lookup_fifo_wait_profile(hwId, fwId, profile))
+        {
+            set_fifo_wait_cycles(vmeAddress_, profile.waitCycles);
+        }
+        else if (!autoCalibrateFifoWait_)
+        {
+            set_fifo_wait_cycles(vmeAddress_, 0);
+        }
+        else
+        {
+            // The probe reads done by the calibration require verbose mode
+            // to be off.
+            maybe_set_verbose(false);
+
+            if (auto ec = apply_fifo_wait_profile(mvlc_, vmeAddress_, hwId, fwId, true))
+            {
+                auto msg = QSL("Warning: fifo wait calibration failed on 0x%1: %2. Using default wait cycles.")
+                    .arg(vmeAddress_, 8, 16, QLatin1Char('0'))
+                    .arg(QString::fromStdString(ec.message()));
+                emit progress_text_changed(msg);
+            }
+        }
     }
 }
 
 void MvlcMvpFlash::maybe_disable_flash_interface()
 {
-    if (isFlashEnabled_)
+    if (m_state.interface_enabled)
     {
         if (auto ec = disable_flash_interface(mvlc_, vmeAddress_))
         {
@@ -73,7 +133,7 @@ void MvlcMvpFlash::maybe_disable_flash_interface()
                 .arg(vmeAddress_, 8, 16, QLatin1Char('0'));
             emit progress_text_changed(msg);
         }
-        isFlashEnabled_ = false;
+        m_state.interface_enabled = false;
     }
 }
 
@@ -82,6 +142,8 @@ void MvlcMvpFlash::write_instruction(const gsl::span<uchar> data, int timeout_ms
     (void) timeout_ms;
     maybe_enable_flash_interface();
 
+    track_instruction(data);
+
     if (auto ec = mesytec::mvp::write_instruction(mvlc_, vmeAddress_, data))
         throw std::system_error(ec);
 
@@ -94,7 +156,7 @@ void MvlcMvpFlash::read_response(gsl::span<uchar> dest, int timeout_ms)
     maybe_enable_flash_interface();
 
     std::vector<u8> tmpDest;
-    if (auto ec = mesytec::mvp::read_response(mvlc_, vmeAddress_, tmpDest))
+    if (auto ec = mesytec::mvp::read_response(mvlc_, vmeAddress_, tmpDest, dest.size()))
         throw std::system_error(ec);
 
     std::copy(std::begin(tmpDest), std::begin(tmpDest) + std::min(tmpDest.size(), dest.size()), std::begin(dest));
@@ -107,13 +169,21 @@ void MvlcMvpFlash::write_page(const Address &address, uchar section, const gsl::
     (void) timeout_ms;
     maybe_enable_flash_interface();
     maybe_set_verbose(false);
-    maybe_enable_write();
+    cache_invalidate(address, section, data.size());
 
+    // No host side EFW: the write_page4() stack contains its own.
     std::vector<u8> pageBuffer;
     pageBuffer.reserve(data.size());
     std::copy(std::begin(data), std::end(data), std::back_inserter(pageBuffer));
     if (auto ec = mesytec::mvp::write_page4(mvlc_, vmeAddress_, address.data() , section, pageBuffer))
+    {
+        // The state of the write enable flag is unknown after a failed stack.
+        m_state.write_enabled = false;
         throw std::system_error(ec);
+    }
+
+    // WRF does not clear write enable.
+    m_state.write_enabled = true;
 
     emit data_written(span_to_qvector(data));
 }
@@ -121,9 +191,17 @@ void MvlcMvpFlash::write_page(const Address &address, uchar section, const gsl::
 void MvlcMvpFlash::read_page(const Address &address, uchar section, gsl::span<uchar> dest, int timeout_ms)
 {
     (void) timeout_ms;
+
+    if (cache_lookup(address, section, dest))
+        return;
+
     maybe_enable_flash_interface();
     maybe_set_verbose(false);
 
+    // The REF sent by the stack clears write enable, regardless of the
+    // outcome.
+    m_state.write_enabled = false;
+
     std::vector<u8> pageBuffer;
     pageBuffer.reserve(dest.size());
     if (auto ec = mesytec::mvp::read_page(mvlc_, vmeAddress_, address.data(), section,
@@ -131,12 +209,130 @@ void MvlcMvpFlash::read_page(const Address &address, uchar section, gsl::span<uc
         throw std::system_error(ec);
 
     std::copy(std::begin(pageBuffer), std::begin(pageBuffer) + std::min(pageBuffer.size(), dest.size()), std::begin(dest));
+    cache_store(address, section, dest);
+}
+
+QVector<uchar> MvlcMvpFlash::read_memory(const Address &start, uchar section,
+    size_t len, size_t chunk_size, EarlyReturnFun early_return_fun)
+{
+    QVector<uchar> ret;
+
+    if (cache_read_memory(start, section, len, chunk_size, early_return_fun, ret))
+        return ret;
+
+    return collect_memory(start, section, len, chunk_size, early_return_fun);
+}
+
+void MvlcMvpFlash::stream_memory(const Address &start, uchar section,
+    size_t len, size_t chunk_size, EarlyReturnFun f)
+{
+    maybe_enable_flash_interface();
+    maybe_set_verbose(false);
+
+    chunk_size = std::max(chunk_size, static_cast<size_t>(1));
+    emit progress_range_changed(0, std::max(static_cast<int>(len / chunk_size), 1));
+    int progress = 0;
+    bool returnedEarly = false;
+    size_t bytesStreamed = 0;
+
+    // The batches of the pipelined reader are bounded by the stack size. The
+    // chunks are copied into a single buffer as the callback may modify them.
+    QVector<uchar> buf(chunk_size);
+
+    // Runs on the main thread while the next batch is being read.
+    auto on_batch = [&] (u32 batchAddress, const std::vector<u8> &data)
+    {
+        size_t offset = 0;
+
+        while (offset < data.size())
+        {
+            emit progress_changed(progress++);
+
+            auto rl = std::min(chunk_size, data.size() - offset);
+            std::copy(data.data() + offset, data.data() + offset + rl, buf.data());
+
+            Address chunkAddress(batchAddress + offset);
+            auto chunk = gsl::span<uchar>(buf.data(), rl);
+            cache_store(chunkAddress, section, chunk);
+            bytesStreamed += rl;
+
+            if (f && f(chunkAddress, section, chunk))
+            {
+                returnedEarly = true;
+                return false;
+            }
+
+            offset += rl;
+        }
+
+        return true;
+    };
+
+    // The REFs sent by the read stacks clear write enable, regardless of
+    // the outcome.
+    m_state.write_enabled = false;
+
+    if (auto ec = read_flash_memory_pipelined(mvlc_, vmeAddress_, start.to_int(), section, len, on_batch))
+        throw std::system_error(ec);
+
+    if (!returnedEarly && bytesStreamed != len)
+        throw std::runtime_error(fmt::format("stream_memory: wanted {} bytes, got {} bytes", len, bytesStreamed));
+}
+
+DeviceSnapshot MvlcMvpFlash::read_device_snapshot()
+{
+    maybe_enable_flash_interface();
+    maybe_set_verbose(false);
+
+    ModuleFlashInfo info;
+
+    if (auto ec = read_module_flash_info(mvlc_, vmeAddress_, info))
+        throw std::system_error(ec);
+
+    QVector<uchar> rdi = { opcodes::RDI };
+    QVector<uchar> rai = { opcodes::RAI };
+    QVector<uchar> rdiResponse(info.rdiResponse.begin(), info.rdiResponse.end());
+    QVector<uchar> raiResponse(info.raiResponse.begin(), info.raiResponse.end());
+
+    // The instructions were executed by the stack, update the tracked state
+    // as if they had been sent through write_instruction().
+    track_instruction(rdi);
+    emit instruction_written(rdi);
+    emit response_read(rdiResponse);
+    ensure_response_ok(rdi, rdiResponse);
+
+    track_instruction(rai);
+    emit instruction_written(rai);
+    emit response_read(raiResponse);
+    ensure_response_ok(rai, raiResponse);
+
+    DeviceSnapshot ret;
+    ret.hardware_id = rdiResponse[1];
+    ret.area = raiResponse[1];
+    ret.dipswitch = get_dipswitch(get_last_status());
+    ret.vme_hardware_id = info.hwId;
+    ret.vme_firmware_id = info.fwId;
+    m_state.area = ret.area;
+
+    QVector<uchar> otpData(info.otp.begin(), info.otp.end());
+    cache_store(Address(0), constants::otp_section, otpData);
+    ret.otp = OTP::from_flash_memory(otpData);
+
+    for (size_t i=0; i<info.keySlots.size(); ++i)
+    {
+        QVector<uchar> slotData(info.keySlots[i].begin(), info.keySlots[i].end());
+        cache_store(Address(i * constants::keys_offset), constants::keys_section, slotData);
+        add_key_from_slot(ret.keys, i, slotData);
+    }
+
+    return ret;
 }
 
 void MvlcMvpFlash::recover(size_t tries)
 {
     // Attempt this only once, letting any exception terminate this method.
     maybe_enable_flash_interface();
+    m_state.area = boost::none;
 
     std::exception_ptr last_nop_exception;
 
@@ -170,54 +366,101 @@ void MvlcMvpFlash::recover(size_t tries)
 void MvlcMvpFlash::erase_section(uchar section)
 {
     maybe_enable_flash_interface();
-    maybe_enable_write();
+    cache_invalidate_section(section);
+
+    // No host side EFW: start_erase_section() sends its own. ERF clears write
+    // enable, regardless of the outcome.
+    m_state.write_enabled = false;
+
     if (auto ec = mesytec::mvp::erase_section(mvlc_, vmeAddress_, section))
         throw std::system_error(ec);
 }
 
 void MvlcMvpFlash::write_memory(const Address &start, uchar section, const gsl::span<uchar> mem)
 {
-    // Note (230919): write_pages() does not lead to a noticeable speedup when
-    // flashing firmware packages. The reason is that the stack uploads
-    // (consisting purely of "super" commands) are still transaction based,
-    // meaning the PC has to wait for a response from the MVLC for each part of
-    // the stack that's been written. The core implementation will have to
-    // change to allow "blindly" sending out all the partial stack uploads to
-    // the MVLC before waiting for a response. This could lead to a massive
-    // speedup due to less command ping-pong happening.
-    #if 0
-    // Split mem into page sized parts and pass up to two parts to
-    // write_pages()
+    // Splits the memory into pages and groups the pages into batches fitting
+    // into the MVLC stack memory. Each batch is written by a single stack
+    // containing one EFW (see write_pages_batch()). The batch stacks are sent
+    // through a PageWritePipeline: flash responses are collected after
+    // pipelineDepth_ stacks have been sent. Flash errors are reported after
+    // all pages have been written.
+    maybe_enable_flash_interface();
+    maybe_set_verbose(false);
+    cache_invalidate(start, section, mem.size());
+
+    size_t maxStackWords = 0;
+
+    if (auto ec = get_immediate_stack_max_words(mvlc_, maxStackWords))
+        throw std::system_error(ec);
+
+    const size_t pagesPerStack = get_max_pages_per_stack(maxStackWords);
+
     Address addr(start);
     size_t remaining = mem.size();
     size_t offset    = 0;
-    size_t callsToWritePages = 0;
 
-    emit progress_range_changed(0, mem.size());
+    emit progress_range_changed(0, std::max(static_cast<int>(remaining / constants::page_size), 1));
+    int progress = 0;
 
-    while (remaining) {
-        auto len = std::min(constants::page_size * 2, remaining);
-        gsl::span page1(mem.data() + offset, std::min(constants::page_size, len));
-        gsl::span page2(mem.data() + offset + page1.size(), std::min(constants::page_size, len - page1.size()));
+    // Each batch stack contains its own EFW and ends with a NOP clearing
+    // write enable again (see PageWritePipeline). This is also the state
+    // after a failed batch.
+    m_state.write_enabled = false;
 
-        assert(page1.size() + page2.size() == len);
+    PageWritePipeline pipeline(mvlc_, vmeAddress_, section, pipelineDepth_);
+    std::vector<gsl::span<const u8>> batch;
+    batch.reserve(pagesPerStack);
 
-        if (auto ec = write_pages(mvlc_, vmeAddress_, addr.to_int(), section, page1, page2))
-            throw std::system_error(ec);
+    while (remaining)
+    {
+        const auto batchAddress = addr;
+        batch.clear();
+
+        while (remaining && batch.size() < pagesPerStack)
+        {
+            auto len = std::min(constants::page_size, remaining);
+            batch.emplace_back(mem.data() + offset, len);
 
-        ++callsToWritePages;
-        remaining -= len;
-        addr      += len;
-        offset    += len;
+            remaining -= len;
+            addr      += len;
+            offset    += len;
+        }
+
+        if (auto ec = pipeline.writePages(batchAddress.to_int(), batch))
+            throw std::system_error(ec);
 
-        emit progress_changed(offset);
+        progress += batch.size();
+        emit progress_changed(progress);
     }
 
-    qDebug() << __PRETTY_FUNCTION__ << "write_memory(): needed" << callsToWritePages << "calls to write_pages()";
+    if (auto ec = pipeline.flush())
+        throw std::system_error(ec);
+
+    emit data_written(span_to_qvector(mem));
 
-    #else
-    FlashInterface::write_memory(start, section, mem);
-    #endif
+    if (pipeline.hasErrors())
+    {
+        const auto &errors = pipeline.errors();
+
+        for (const auto &error: errors)
+        {
+            emit progress_text_changed(QSL("Error writing %1 pages starting at 0x%2 (stackRef=0x%3): %4")
+                .arg(error.pageCount)
+                .arg(error.pageAddress, 6, 16, QLatin1Char('0'))
+                .arg(error.stackRef, 8, 16, QLatin1Char('0'))
+                .arg(QString::fromStdString(error.ec.message())));
+        }
+
+        auto &first = errors.front();
+        std::vector<uchar> instr(std::begin(EfwRequest), std::end(EfwRequest));
+        auto resp = first.flashResponse;
+
+        throw FlashInstructionError(instr, resp,
+            QSL("write_memory: %1 of %2 write stacks failed, first failed page at 0x%3")
+                .arg(errors.size())
+                .arg(pipeline.stacksWritten())
+                .arg(first.pageAddress, 6, 16, QLatin1Char('0')));
+    }
 }
 
 void MvlcMvpFlash::boot(uchar area_index)
@@ -235,8 +478,17 @@ void MvlcMvpFlash::ensure_response_ok(
     std::vector<u8> v_instruction(std::begin(instruction), std::end(instruction));
     std::vector<u8> v_response(std::begin(response), std::end(response));
 
+    if (response.size() >= 2)
+    {
+        m_state.last_status = *(std::end(response) - 1);
+        emit statusbyte_received(m_state.last_status);
+    }
+
     if (!check_response(v_instruction, v_response))
+    {
+        m_state.write_enabled = false; // write enable is unset on error
         throw FlashInstructionError(instruction, response, "check_response() not ok");
+    }
 }
 
 }
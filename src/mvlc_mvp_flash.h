@@ -6,6 +6,7 @@
 #include <firmware_ops.h>
 #include <flash_constants.h>
 #include <flash.h>
+#include "mvlc_mvp_write_pipeline.h"
 
 namespace mesytec::mvp
 {
@@ -31,6 +32,12 @@ class MvlcMvpFlash: public mesytec::mvp::FlashInterface
         void setVmeAddress(mvlc::u32 vmeAddress);
         mvlc::u32 getVmeAddress() const;
 
+        // Use the given hardware and firmware ids (e.g. from a previous
+        // identify_modules() call) instead of reading them when enabling the
+        // flash interface. Reset by setMvlc() and setVmeAddress().
+        void setModuleIdentity(mvlc::u32 hwId, mvlc::u32 fwId);
+        void clearModuleIdentity();
+
         void maybe_enable_flash_interface();
         void maybe_disable_flash_interface();
 
@@ -48,10 +55,37 @@ class MvlcMvpFlash: public mesytec::mvp::FlashInterface
 
         void recover(size_t tries=default_recover_tries) override;
 
+        // Reads multiple pages per stack transaction using stream_memory().
+        // chunk_size is the granularity at which the early return function
+        // is invoked.
+        QVector<uchar> read_memory(const Address &start, uchar section,
+          size_t len, size_t chunk_size, EarlyReturnFun f = nullptr) override;
+
+        // Streams the batches read by read_flash_memory_pipelined(). Memory
+        // use is bounded by the pipeline, not by len.
+        void stream_memory(const Address &start, uchar section,
+          size_t len, size_t chunk_size, EarlyReturnFun f) override;
+
+        // Reads the VME id registers and the flash identification data using
+        // read_module_flash_info(), usually a single stack transaction.
+        DeviceSnapshot read_device_snapshot() override;
+
         void erase_section(uchar section) override;
 
+        // Pipelined implementation using PageWritePipeline and multi-page
+        // write stacks. The pipeline depth is the number of write stacks sent
+        // out before the flash responses are collected.
         void write_memory(const Address &start, uchar section, const gsl::span<uchar> data) override;
 
+        void setPipelineDepth(unsigned depth) { pipelineDepth_ = depth; }
+        unsigned getPipelineDepth() const { return pipelineDepth_; }
+
+        // If enabled the fifo wait cycles are calibrated when the flash
+        // interface is enabled for a module type without a cached profile
+        // (see apply_fifo_wait_profile()).
+        void setAutoCalibrateFifoWait(bool b) { autoCalibrateFifoWait_ = b; }
+        bool getAutoCalibrateFifoWait() const { return autoCalibrateFifoWait_; }
+
         // Custom boot() ignoring the missing VME response.
         void boot(uchar area_index) override;
 
@@ -64,7 +98,12 @@ class MvlcMvpFlash: public mesytec::mvp::FlashInterface
     private:
         mvlc::MVLC mvlc_;
         mvlc::u32 vmeAddress_ = 0;
-        bool isFlashEnabled_ = false;
+        unsigned pipelineDepth_ = PageWritePipeline::DefaultMaxInFlight;
+        bool autoCalibrateFifoWait_ = true;
+        bool mvlcChanged_ = false;
+        bool hasModuleIdentity_ = false;
+        mvlc::u32 hwId_ = 0;
+        mvlc::u32 fwId_ = 0;
 };
 
 };
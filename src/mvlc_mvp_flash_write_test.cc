@@ -25,7 +25,9 @@ int main(int argc, char *argv[])
 {
     spdlog::set_level(spdlog::level::debug);
 
-    std::string hostname = "mvlc-0056";
+    // Optional MVLC ETH hostname, e.g. of a mvlc-mvp-eth-emulator. Uses USB
+    // if not given.
+    std::string hostname = argc > 1 ? argv[1] : "";
     u32 moduleBase = 0;
     unsigned area = 3;
     unsigned section = 3; // 3=calib, 12=firmware
@@ -34,7 +36,7 @@ int main(int argc, char *argv[])
 
     try
     {
-        auto mvlc = make_mvlc_usb();
+        auto mvlc = hostname.empty() ? make_mvlc_usb() : make_mvlc_eth(hostname);
 
         if (auto ec = mvlc.connect())
         {
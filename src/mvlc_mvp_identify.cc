@@ -0,0 +1,482 @@
+#include "mvlc_mvp_identify.h"
+
+#include <mesytec-mvlc/scanbus_support.h>
+#include <flash_constants.h>
+#include "mvlc_mvp_connector.h"
+#include "mvlc_mvp_traffic.h"
+
+namespace mesytec::mvp
+{
+
+using namespace mesytec::mvlc;
+
+namespace
+{
+
+// Runs the stack and returns the data words with the frame headers and the
+// reference marker removed.
+std::error_code run_identify_stack(
+    MVLC &mvlc, const StackCommandBuilder &sb, u32 stackRef, std::vector<u32> &dataWords)
+{
+    std::vector<u32> stackOutput;
+
+    if (auto ec = paced_stack_transaction(mvlc, sb, stackOutput))
+        return ec;
+
+    if (stackOutput.size() < 2)
+        return make_error_code(MVLCErrorCode::UnexpectedResponseSize);
+
+    if (stackOutput[1] != stackRef)
+        return MVLCErrorCode::StackReferenceMismatch;
+
+    for (size_t i=0; i<stackOutput.size(); ++i)
+    {
+        u32 word = stackOutput[i];
+
+        if (i == 1)
+            continue; // reference marker
+
+        if (i == 0 || is_stack_buffer_continuation(word))
+        {
+            // Single VME reads failing with BERR or a timeout are flagged in
+            // the frame header.
+            if (extract_frame_info(word).flags & (frame_flags::Timeout | frame_flags::BusError))
+                return MVLCErrorCode::NoVMEResponse;
+
+            if (auto ec = get_stack_frame_error(word))
+                return ec;
+
+            continue;
+        }
+
+        if (is_stack_buffer(word) || is_blockread_buffer(word))
+            continue;
+
+        dataWords.push_back(word);
+    }
+
+    return {};
+}
+
+void read_ids_individually(MVLC &mvlc, ModuleIdentity &ident)
+{
+    scanbus::VMEModuleInfo moduleInfo{};
+    ident.ec = scanbus::read_module_info(mvlc, ident.address, moduleInfo);
+    ident.hwId = moduleInfo.hwId;
+    ident.fwId = moduleInfo.fwId;
+}
+
+// Reads the id registers of a chunk of modules using a single stack.
+void read_ids_chunk(MVLC &mvlc, gsl::span<ModuleIdentity> chunk)
+{
+    u32 stackRef = get_next_stack_reference();
+    StackCommandBuilder sb;
+    sb.addWriteMarker(stackRef);
+
+    for (const auto &ident: chunk)
+    {
+        sb.addVMERead(ident.address + vme_modules::HardwareIdRegister, vme_amods::A32, VMEDataWidth::D16);
+        sb.addVMERead(ident.address + vme_modules::FirmwareRegister, vme_amods::A32, VMEDataWidth::D16);
+    }
+
+    std::vector<u32> dataWords;
+    auto ec = run_identify_stack(mvlc, sb, stackRef, dataWords);
+
+    if (!ec && dataWords.size() != chunk.size() * 2)
+        ec = make_error_code(MVLCErrorCode::UnexpectedResponseSize);
+
+    if (ec)
+    {
+        auto logger = mvlc::get_logger("mvlc_mvp_lib");
+        logger->debug("identify_modules: batched id read failed ({}), reading {} modules individually",
+                      ec.message(), chunk.size());
+
+        for (auto &ident: chunk)
+            read_ids_individually(mvlc, ident);
+
+        return;
+    }
+
+    for (size_t i=0; i<chunk.size(); ++i)
+    {
+        chunk[i].hwId = dataWords[i * 2] & 0xffffu;
+        chunk[i].fwId = dataWords[i * 2 + 1] & 0xffffu;
+    }
+}
+
+const std::vector<u8> VerboseOffRequest = { opcodes::VEB, 0xCD, 0xAB, 1 };
+
+void add_otp_read_to_stack(StackCommandBuilder &sb, u32 moduleBase)
+{
+    sb.addVMEWrite(moduleBase + EnableFlashRegister, 1, vme_amods::A32, VMEDataWidth::D16);
+    add_command_to_stack(sb, moduleBase, VerboseOffRequest);
+    add_page_read_to_stack(sb, moduleBase, 0, constants::otp_section, otp::total_bytes);
+    sb.addVMEWrite(moduleBase + EnableFlashRegister, 0, vme_amods::A32, VMEDataWidth::D16);
+}
+
+// Reads the OTP contents of a chunk of modules using a single stack.
+void read_otp_chunk(MVLC &mvlc, const std::vector<ModuleIdentity *> &chunk)
+{
+    u32 stackRef = get_next_stack_reference();
+    StackCommandBuilder sb;
+    sb.addWriteMarker(stackRef);
+
+    for (auto ident: chunk)
+        add_otp_read_to_stack(sb, ident->address);
+
+    std::vector<u32> dataWords;
+
+    if (auto ec = run_identify_stack(mvlc, sb, stackRef, dataWords))
+    {
+        // The stack may have been aborted after enabling the flash interface
+        // of a module. Disable it on all modules of the chunk, errors are
+        // ignored as the modules are already marked as failed.
+        for (auto ident: chunk)
+        {
+            ident->otpEc = ec;
+            disable_flash_interface(mvlc, ident->address);
+        }
+        return;
+    }
+
+    // Per module: the VEB command segment followed by the OTP data and the
+    // InvalidRead terminator.
+    const size_t vebWords = get_expected_response_size(VerboseOffRequest) + 2;
+    const size_t otpWords = otp::total_bytes + 1;
+    auto dataIter = std::begin(dataWords);
+
+    for (auto ident: chunk)
+    {
+        if (static_cast<size_t>(std::distance(dataIter, std::end(dataWords))) < vebWords + otpWords)
+        {
+            ident->otpEc = make_error_code(MVLCErrorCode::UnexpectedResponseSize);
+            dataIter = std::end(dataWords);
+            continue;
+        }
+
+        std::vector<u8> vebResponse;
+
+        for (size_t i=0; i<vebWords; ++i, ++dataIter)
+        {
+            if (!(*dataIter & output_fifo_flags::InvalidRead))
+                vebResponse.push_back(*dataIter & output_fifo_flags::DataMask);
+        }
+
+        std::vector<u8> otpData;
+        bool invalid = false;
+
+        for (size_t i=0; i<otp::total_bytes; ++i, ++dataIter)
+        {
+            if (*dataIter & output_fifo_flags::InvalidRead)
+                invalid = true;
+            otpData.push_back(*dataIter & output_fifo_flags::DataMask);
+        }
+
+        const bool terminated = (*dataIter++ & output_fifo_flags::InvalidRead);
+
+        if (!check_response(VerboseOffRequest, vebResponse) || invalid || !terminated)
+        {
+            ident->otpEc = make_error_code(std::errc::protocol_error);
+            continue;
+        }
+
+        ident->otp = std::move(otpData);
+    }
+}
+
+// Sequential access to the data words returned by a stack built from single
+// VME reads, add_command_to_stack() and add_page_read_to_stack() calls.
+class StackDataReader
+{
+    public:
+        explicit StackDataReader(const std::vector<u32> &dataWords)
+            : iter_(dataWords.begin())
+            , end_(dataWords.end())
+        {}
+
+        bool singleRead(u32 &dest)
+        {
+            if (iter_ == end_)
+                return false;
+
+            dest = *iter_++ & 0xffffu;
+            return true;
+        }
+
+        // The response of the instruction followed by InvalidRead padding up
+        // to the number of words read by add_command_to_stack().
+        bool commandResponse(const std::vector<u8> &instr, std::vector<u8> &dest)
+        {
+            const size_t segmentWords = get_expected_response_size(instr) + 2;
+            bool terminated = false;
+
+            dest.clear();
+
+            for (size_t i=0; i<segmentWords; ++i, ++iter_)
+            {
+                if (iter_ == end_)
+                    return false;
+
+                if (*iter_ & output_fifo_flags::InvalidRead)
+                    terminated = true;
+                else if (!terminated)
+                    dest.push_back(*iter_ & output_fifo_flags::DataMask);
+            }
+
+            return terminated && check_response(instr, dest);
+        }
+
+        // Page data followed by the InvalidRead terminator.
+        bool pageData(size_t bytes, std::vector<u8> &dest)
+        {
+            if (static_cast<size_t>(std::distance(iter_, end_)) < bytes + 1)
+                return false;
+
+            dest.clear();
+            bool invalid = false;
+
+            for (size_t i=0; i<bytes; ++i, ++iter_)
+            {
+                if (*iter_ & output_fifo_flags::InvalidRead)
+                    invalid = true;
+                dest.push_back(*iter_ & output_fifo_flags::DataMask);
+            }
+
+            const bool terminated = (*iter_++ & output_fifo_flags::InvalidRead);
+
+            return !invalid && terminated;
+        }
+
+    private:
+        std::vector<u32>::const_iterator iter_;
+        std::vector<u32>::const_iterator end_;
+};
+
+const std::vector<u8> RdiRequest = { opcodes::RDI };
+const std::vector<u8> RaiRequest = { opcodes::RAI };
+
+void add_key_slot_read_to_stack(StackCommandBuilder &sb, u32 moduleBase, size_t slot)
+{
+    add_page_read_to_stack(sb, moduleBase, slot * constants::keys_offset,
+                           constants::keys_section, keys::total_bytes);
+}
+
+} // end anon namespace
+
+std::error_code identify_modules(
+    MVLC &mvlc, const std::vector<u32> &addresses,
+    std::vector<ModuleIdentity> &dest, bool readOtp)
+{
+    auto logger = mvlc::get_logger("mvlc_mvp_lib");
+    auto tStart = std::chrono::steady_clock::now();
+
+    dest.clear();
+
+    for (auto addr: addresses)
+    {
+        ModuleIdentity ident;
+        ident.address = addr;
+        dest.emplace_back(ident);
+    }
+
+    if (dest.empty())
+        return {};
+
+    size_t maxStackWords = 0;
+
+    if (auto ec = get_immediate_stack_max_words(mvlc, maxStackWords))
+        return ec;
+
+    // Determine the number of id reads fitting into one stack.
+    size_t idsPerStack = 0;
+    {
+        StackCommandBuilder sb;
+        sb.addWriteMarker(0);
+        const size_t overhead = get_encoded_stack_size(sb);
+        sb.addVMERead(vme_modules::HardwareIdRegister, vme_amods::A32, VMEDataWidth::D16);
+        sb.addVMERead(vme_modules::FirmwareRegister, vme_amods::A32, VMEDataWidth::D16);
+        const size_t perModule = get_encoded_stack_size(sb) - overhead;
+        // Clamped to 1 like get_max_pages_per_stack(). Checked before the
+        // subtraction as the values are unsigned.
+        idsPerStack = (maxStackWords <= overhead + perModule
+                       ? 1 : (maxStackWords - overhead) / perModule);
+    }
+
+    for (size_t i=0; i<dest.size(); i+=idsPerStack)
+    {
+        const size_t count = std::min(idsPerStack, dest.size() - i);
+        read_ids_chunk(mvlc, gsl::span<ModuleIdentity>(dest.data() + i, count));
+    }
+
+    for (auto &ident: dest)
+    {
+        if (ident.ec)
+            continue;
+
+        auto canFlash = can_flash_through_vme(ident.hwId, ident.fwId);
+        ident.canFlash = canFlash.first;
+        ident.canFlashMessage = canFlash.second;
+    }
+
+    if (readOtp)
+    {
+        size_t otpPerStack = 0;
+        {
+            StackCommandBuilder sb;
+            sb.addWriteMarker(0);
+            const size_t overhead = get_encoded_stack_size(sb);
+            add_otp_read_to_stack(sb, 0);
+            const size_t perModule = get_encoded_stack_size(sb) - overhead;
+            otpPerStack = (maxStackWords <= overhead + perModule
+                           ? 1 : (maxStackWords - overhead) / perModule);
+        }
+
+        std::vector<ModuleIdentity *> chunk;
+
+        auto flush_chunk = [&]
+        {
+            if (!chunk.empty())
+                read_otp_chunk(mvlc, chunk);
+            chunk.clear();
+        };
+
+        for (auto &ident: dest)
+        {
+            if (ident.ec || !ident.canFlash)
+                continue;
+
+            chunk.push_back(&ident);
+
+            if (chunk.size() >= otpPerStack)
+                flush_chunk();
+        }
+
+        flush_chunk();
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - tStart);
+
+    logger->debug("identify_modules: identified {} modules (readOtp={}) in {} ms",
+                  dest.size(), readOtp, elapsed.count() / 1000.0);
+
+    return {};
+}
+
+std::error_code read_module_flash_info(MVLC &mvlc, u32 moduleBase, ModuleFlashInfo &dest)
+{
+    auto logger = mvlc::get_logger("mvlc_mvp_lib");
+    auto tStart = std::chrono::steady_clock::now();
+
+    dest = {};
+
+    size_t maxStackWords = 0;
+
+    if (auto ec = get_immediate_stack_max_words(mvlc, maxStackWords))
+        return ec;
+
+    size_t keyReadWords = 0;
+    {
+        StackCommandBuilder sb;
+        add_key_slot_read_to_stack(sb, moduleBase, 0);
+        keyReadWords = get_encoded_stack_size(sb);
+    }
+
+    auto protocol_error = [&]
+    {
+        clear_output_fifo(mvlc, moduleBase);
+        return make_error_code(std::errc::protocol_error);
+    };
+
+    // Adds key slot reads starting at slot while they fit into the stack.
+    // At least one read is added to a stack containing only the marker.
+    size_t slot = 0;
+
+    auto add_key_reads = [&] (StackCommandBuilder &sb, bool atLeastOne)
+    {
+        size_t count = 0;
+
+        while (slot < constants::max_keys
+               && ((atLeastOne && !count)
+                   || get_encoded_stack_size(sb) + keyReadWords <= maxStackWords))
+        {
+            add_key_slot_read_to_stack(sb, moduleBase, slot++);
+            ++count;
+        }
+
+        return count;
+    };
+
+    auto parse_key_reads = [&] (StackDataReader &reader, size_t count)
+    {
+        for (size_t i=0; i<count; ++i)
+        {
+            std::vector<u8> slotData;
+
+            if (!reader.pageData(keys::total_bytes, slotData))
+                return false;
+
+            dest.keySlots.emplace_back(std::move(slotData));
+        }
+
+        return true;
+    };
+
+    size_t stacks = 1;
+    u32 stackRef = get_next_stack_reference();
+    StackCommandBuilder sb;
+    sb.addWriteMarker(stackRef);
+    sb.addVMERead(moduleBase + vme_modules::HardwareIdRegister, vme_amods::A32, VMEDataWidth::D16);
+    sb.addVMERead(moduleBase + vme_modules::FirmwareRegister, vme_amods::A32, VMEDataWidth::D16);
+    add_command_to_stack(sb, moduleBase, RdiRequest);
+    add_command_to_stack(sb, moduleBase, RaiRequest);
+    add_page_read_to_stack(sb, moduleBase, 0, constants::otp_section, otp::total_bytes);
+    size_t keyCount = add_key_reads(sb, false);
+
+    std::vector<u32> dataWords;
+
+    if (auto ec = run_identify_stack(mvlc, sb, stackRef, dataWords))
+        return ec;
+
+    {
+        StackDataReader reader(dataWords);
+
+        if (!reader.singleRead(dest.hwId)
+            || !reader.singleRead(dest.fwId)
+            || !reader.commandResponse(RdiRequest, dest.rdiResponse)
+            || !reader.commandResponse(RaiRequest, dest.raiResponse)
+            || !reader.pageData(otp::total_bytes, dest.otp)
+            || !parse_key_reads(reader, keyCount))
+        {
+            return protocol_error();
+        }
+    }
+
+    while (slot < constants::max_keys)
+    {
+        stackRef = get_next_stack_reference();
+        sb = {};
+        sb.addWriteMarker(stackRef);
+        keyCount = add_key_reads(sb, true);
+        dataWords.clear();
+        ++stacks;
+
+        if (auto ec = run_identify_stack(mvlc, sb, stackRef, dataWords))
+            return ec;
+
+        StackDataReader reader(dataWords);
+
+        if (!parse_key_reads(reader, keyCount))
+            return protocol_error();
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - tStart);
+
+    logger->debug("read_module_flash_info: moduleBase=0x{:08x}, hwId=0x{:04x}, fwId=0x{:04x}, stacks={}, {} ms",
+                  moduleBase, dest.hwId, dest.fwId, stacks, elapsed.count() / 1000.0);
+
+    return {};
+}
+
+}
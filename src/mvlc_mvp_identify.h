@@ -0,0 +1,61 @@
+#ifndef __MESYTEC_MVLC_MVP_IDENTIFY_H__
+#define __MESYTEC_MVLC_MVP_IDENTIFY_H__
+
+#include "mvlc_mvp_lib.h"
+
+namespace mesytec::mvp
+{
+
+// Identification data of a VME module as gathered by identify_modules().
+struct ModuleIdentity
+{
+    u32 address = 0;
+    u32 hwId = 0;
+    u32 fwId = 0;
+    std::error_code ec;         // error reading the id registers
+
+    // Result of can_flash_through_vme(hwId, fwId).
+    bool canFlash = false;
+    std::string canFlashMessage;
+
+    // Raw OTP contents (otp::total_bytes). Only filled if requested and the
+    // module can be flashed.
+    std::vector<u8> otp;
+    std::error_code otpEc;
+};
+
+// Reads the hardware and firmware ids of all given module addresses using as
+// few stack transactions as possible. Addresses are split into chunks fitting
+// the immediate stack memory. If a chunk reports a VME error its modules are
+// read individually so that a single bad address does not fail the others.
+//
+// If readOtp is true the OTP section of each flashable module is read: the
+// flash interface is enabled, verbose mode is turned off, the OTP data is read
+// and the flash interface is disabled again. This is done for multiple modules
+// per stack transaction.
+std::error_code identify_modules(
+    MVLC &mvlc, const std::vector<u32> &addresses,
+    std::vector<ModuleIdentity> &dest, bool readOtp = false);
+
+// Flash identification data of a single module as read by
+// read_module_flash_info().
+struct ModuleFlashInfo
+{
+    u32 hwId = 0;                           // VME hardware id register
+    u32 fwId = 0;                           // VME firmware revision register
+    std::vector<u8> rdiResponse;            // RDI, hardware id, 0xff, status
+    std::vector<u8> raiResponse;            // RAI, area index, 0xff, status
+    std::vector<u8> otp;                    // otp::total_bytes of the OTP section
+    std::vector<std::vector<u8>> keySlots;  // keys::total_bytes per key slot
+};
+
+// Reads the VME id registers, the flash hardware id, the selected area, the
+// OTP contents and all key slots of the module at moduleBase using a single
+// stack transaction. If the immediate stack memory is too small the remaining
+// key slots are read using additional stacks. The flash interface must be
+// enabled and verbose mode must be off.
+std::error_code read_module_flash_info(MVLC &mvlc, u32 moduleBase, ModuleFlashInfo &dest);
+
+}
+
+#endif /* __MESYTEC_MVLC_MVP_IDENTIFY_H__ */
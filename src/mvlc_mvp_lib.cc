@@ -1,7 +1,15 @@
 #include "mvlc_mvp_lib.h"
+#include "mvlc_mvp_stack_decode.h"
+#include "mvlc_mvp_stack_templates.h"
+#include "mvlc_mvp_traffic.h"
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <stdexcept>
+#include <thread>
 #include <vector>
 
 #include <flash_constants.h>
@@ -11,39 +19,311 @@ namespace mesytec::mvp
 
 using namespace mesytec::mvlc;
 
-// After writing to the MVP input FIFO some time needs to pass for the data to
-// be processed. Only then does the output FIFO contain valid data and status
-// flags. This constant is the number of cycles the command stack waits before
-// continuing. Value 1000 ^= 12.5 us.
-static const unsigned PostFifoWriteStackWaitCycles = 100000;
-
-inline u32 get_next_stack_reference()
+u32 get_next_stack_reference()
 {
-    static u32 nextStackReference = 0;
+    static std::atomic<u32> nextStackReference = 0;
     return nextStackReference++;
 }
 
+std::error_code get_stack_frame_error(u32 frameHeader)
+{
+    auto flags = extract_frame_info(frameHeader).flags;
+
+    if (flags & frame_flags::Timeout)
+        return MVLCErrorCode::NoVMEResponse;
+
+    if (flags & frame_flags::SyntaxError)
+        return MVLCErrorCode::StackSyntaxError;
+
+    // Note: BusError is not checked as it is the regular termination
+    // condition of (fake) block reads.
+
+    return {};
+}
+
+namespace
+{
+    struct FifoWaitState
+    {
+        std::mutex mutex;
+        std::map<u32, unsigned> moduleWaitCycles; // moduleBase -> waitCycles
+        std::map<std::pair<u32, u32>, FifoWaitProfile> profiles; // (hwId, fwId) -> profile
+    };
+
+    FifoWaitState &fifo_wait_state()
+    {
+        static FifoWaitState state;
+        return state;
+    }
+}
+
+unsigned get_fifo_wait_cycles(u32 moduleBase)
+{
+    auto &state = fifo_wait_state();
+    std::lock_guard<std::mutex> guard(state.mutex);
+
+    if (auto it = state.moduleWaitCycles.find(moduleBase);
+        it != state.moduleWaitCycles.end())
+    {
+        return it->second;
+    }
+
+    return PostFifoWriteStackWaitCycles;
+}
+
+void set_fifo_wait_cycles(u32 moduleBase, unsigned waitCycles)
+{
+    auto &state = fifo_wait_state();
+    std::lock_guard<std::mutex> guard(state.mutex);
+
+    if (waitCycles)
+        state.moduleWaitCycles[moduleBase] = waitCycles;
+    else
+        state.moduleWaitCycles.erase(moduleBase);
+}
+
+bool lookup_fifo_wait_profile(u32 hwId, u32 fwId, FifoWaitProfile &dest)
+{
+    auto &state = fifo_wait_state();
+    std::lock_guard<std::mutex> guard(state.mutex);
+
+    if (auto it = state.profiles.find(std::make_pair(hwId, fwId));
+        it != state.profiles.end())
+    {
+        dest = it->second;
+        return true;
+    }
+
+    return false;
+}
+
+void store_fifo_wait_profile(const FifoWaitProfile &profile)
+{
+    auto &state = fifo_wait_state();
+    std::lock_guard<std::mutex> guard(state.mutex);
+    state.profiles[std::make_pair(profile.hwId, profile.fwId)] = profile;
+}
+
+void clear_fifo_wait_profiles()
+{
+    auto &state = fifo_wait_state();
+    std::lock_guard<std::mutex> guard(state.mutex);
+    state.profiles.clear();
+    state.moduleWaitCycles.clear();
+}
+
+// Reads a full page from the OTP section using the given wait value into
+// pageBuffer. ok is set to true if the data was read without the InvalidRead
+// flag showing up and equals the reference data (if given). The returned
+// error code is only set if the stack transaction or clearing the output fifo
+// after a failed probe fails.
+static std::error_code probe_read_with_wait(
+    MVLC &mvlc, u32 moduleBase, unsigned waitCycles,
+    const std::vector<u8> *reference, bool &ok, std::vector<u8> &pageBuffer)
+{
+    static const u8 ProbeSection = 0; // OTP
+    const auto addr = flash_address_from_byte_offset(0);
+    u32 stackRef = get_next_stack_reference();
+
+    StackCommandBuilder sb;
+    sb.addWriteMarker(stackRef);
+    sb.addVMEWrite(moduleBase + InputFifoRegister, opcodes::REF,  vme_amods::A32, VMEDataWidth::D16);
+    sb.addVMEWrite(moduleBase + InputFifoRegister, addr[0],       vme_amods::A32, VMEDataWidth::D16);
+    sb.addVMEWrite(moduleBase + InputFifoRegister, addr[1],       vme_amods::A32, VMEDataWidth::D16);
+    sb.addVMEWrite(moduleBase + InputFifoRegister, addr[2],       vme_amods::A32, VMEDataWidth::D16);
+    sb.addVMEWrite(moduleBase + InputFifoRegister, ProbeSection,  vme_amods::A32, VMEDataWidth::D16);
+    sb.addVMEWrite(moduleBase + InputFifoRegister, 0,             vme_amods::A32, VMEDataWidth::D16); // full page
+    if (waitCycles)
+        sb.addWait(waitCycles);
+    sb.addSetAccu(PageSize + 1);
+    sb.addVMERead(moduleBase + OutputFifoRegister, vme_amods::A32, VMEDataWidth::D16);
+
+    std::vector<u32> stackOutput;
+
+    if (auto ec = paced_stack_transaction(mvlc, sb, stackOutput))
+        return ec;
+
+    pageBuffer.clear();
+    std::vector<unsigned> pageSizes = { PageSize };
+    ok = !fill_pages_from_stack_output(pageBuffer, stackOutput, stackRef, pageSizes);
+
+    if (ok && reference)
+        ok = (pageBuffer == *reference);
+
+    // Remove any leftover data from a failed probe before the next attempt.
+    if (!ok)
+    {
+        if (auto ec = clear_output_fifo(mvlc, moduleBase))
+            return ec;
+    }
+
+    return {};
+}
+
+std::error_code calibrate_fifo_wait_cycles(
+    MVLC &mvlc, u32 moduleBase, u32 hwId, u32 fwId, FifoWaitProfile &dest)
+{
+    auto logger = mvlc::get_logger("mvlc_mvp_lib");
+    static const unsigned ProbesPerValue = 3;
+    static const unsigned MinStep = 250;
+
+    std::vector<u8> reference;
+    std::vector<u8> pageBuffer;
+    bool ok = false;
+
+    // Reference read using the worst case wait value.
+    if (auto ec = probe_read_with_wait(mvlc, moduleBase, PostFifoWriteStackWaitCycles, nullptr, ok, reference))
+        return ec;
+
+    if (!ok)
+    {
+        logger->warn("calibrate_fifo_wait_cycles(0x{:08x}): reference read failed", moduleBase);
+        return make_error_code(std::errc::protocol_error);
+    }
+
+    auto value_passes = [&] (unsigned waitCycles, bool &passes) -> std::error_code
+    {
+        passes = true;
+
+        for (unsigned i=0; i<ProbesPerValue && passes; ++i)
+        {
+            if (auto ec = probe_read_with_wait(mvlc, moduleBase, waitCycles, &reference, passes, pageBuffer))
+                return ec;
+        }
+
+        return {};
+    };
+
+    // Binary search for the smallest passing value in [0, PostFifoWriteStackWaitCycles].
+    unsigned lo = 0;
+    unsigned hi = PostFifoWriteStackWaitCycles;
+
+    while (hi - lo > MinStep)
+    {
+        unsigned mid = lo + (hi - lo) / 2;
+        bool passes = false;
+
+        if (auto ec = value_passes(mid, passes))
+            return ec;
+
+        logger->debug("calibrate_fifo_wait_cycles(0x{:08x}): waitCycles={} -> {}",
+                      moduleBase, mid, passes ? "ok" : "fail");
+
+        if (passes)
+            hi = mid;
+        else
+            lo = mid;
+    }
+
+    dest.hwId = hwId;
+    dest.fwId = fwId;
+    dest.minWaitCycles = hi;
+    dest.waitCycles = std::min(hi * FifoWaitSafetyFactor + FifoWaitSafetyOffset,
+                               PostFifoWriteStackWaitCycles);
+
+    logger->info("calibrate_fifo_wait_cycles(0x{:08x}): hwId=0x{:04x}, fwId=0x{:04x}"
+                 ", minWaitCycles={}, waitCycles={} (default={})",
+                 moduleBase, hwId, fwId, dest.minWaitCycles, dest.waitCycles,
+                 PostFifoWriteStackWaitCycles);
+
+    return {};
+}
+
+std::error_code apply_fifo_wait_profile(
+    MVLC &mvlc, u32 moduleBase, u32 hwId, u32 fwId, bool calibrateIfMissing)
+{
+    auto logger = mvlc::get_logger("mvlc_mvp_lib");
+    FifoWaitProfile profile;
+
+    if (lookup_fifo_wait_profile(hwId, fwId, profile))
+    {
+        set_fifo_wait_cycles(moduleBase, profile.waitCycles);
+        return {};
+    }
+
+    if (!calibrateIfMissing)
+    {
+        set_fifo_wait_cycles(moduleBase, 0);
+        return {};
+    }
+
+    if (auto ec = calibrate_fifo_wait_cycles(mvlc, moduleBase, hwId, fwId, profile))
+    {
+        logger->warn("apply_fifo_wait_profile(0x{:08x}): calibration failed ({}), using default wait cycles",
+                     moduleBase, ec.message());
+        set_fifo_wait_cycles(moduleBase, 0);
+        return ec;
+    }
+
+    store_fifo_wait_profile(profile);
+    set_fifo_wait_cycles(moduleBase, profile.waitCycles);
+
+    return {};
+}
+
 std::error_code enable_flash_interface(MVLC &mvlc, u32 moduleBase)
 {
     auto logger = mvlc::get_logger("mvlc_mvp_lib");
     logger->info("Enabling flash interface on 0x{:08x}", moduleBase);
-    return mvlc.vmeWrite(moduleBase + EnableFlashRegister, 1, vme_amods::A32, VMEDataWidth::D16);
+    return paced_vme_write(mvlc, moduleBase + EnableFlashRegister, 1, vme_amods::A32, VMEDataWidth::D16);
 }
 
 std::error_code disable_flash_interface(MVLC &mvlc, u32 moduleBase)
 {
     auto logger = mvlc::get_logger("mvlc_mvp_lib");
     logger->info("Disabling flash interface on 0x{:08x}", moduleBase);
-    return mvlc.vmeWrite(moduleBase + EnableFlashRegister, 0, vme_amods::A32, VMEDataWidth::D16);
+    return paced_vme_write(mvlc, moduleBase + EnableFlashRegister, 0, vme_amods::A32, VMEDataWidth::D16);
 }
 
 std::error_code read_output_fifo(MVLC &mvlc, u32 moduleBase, u32 &dest)
 {
-    return mvlc.vmeRead(moduleBase + OutputFifoRegister, dest, vme_amods::A32, VMEDataWidth::D16);
+    return paced_vme_read(mvlc, moduleBase + OutputFifoRegister, dest, vme_amods::A32, VMEDataWidth::D16);
 }
 
 static const std::chrono::milliseconds MaxResponseWaitTime(2500);
 
+std::error_code block_read_output_fifo(
+    MVLC &mvlc, u32 moduleBase, unsigned wordsToRead, std::vector<u32> &dest)
+{
+    if (wordsToRead == 0)
+        return {};
+
+    u32 stackRef = get_next_stack_reference();
+    StackCommandBuilder sb;
+    sb.addWriteMarker(stackRef);
+    // Give the flash interface time to post the response of a previously
+    // written instruction.
+    sb.addWait(get_fifo_wait_cycles(moduleBase));
+    sb.addSetAccu(wordsToRead);
+    sb.addVMERead(moduleBase + OutputFifoRegister, vme_amods::A32, VMEDataWidth::D16);
+
+    std::vector<u32> stackOutput;
+
+    if (auto ec = paced_stack_transaction(mvlc, sb, stackOutput))
+        return ec;
+
+    if (stackOutput.size() < 2)
+        return make_error_code(MVLCErrorCode::UnexpectedResponseSize);
+
+    if (auto ec = get_stack_frame_error(stackOutput[0]))
+        return ec;
+
+    if (stackOutput[1] != stackRef)
+        return MVLCErrorCode::StackReferenceMismatch;
+
+    for (size_t i=2; i<stackOutput.size(); ++i)
+    {
+        u32 word = stackOutput[i];
+
+        if (is_stack_buffer(word) || is_stack_buffer_continuation(word) || is_blockread_buffer(word))
+            continue;
+
+        dest.push_back(word);
+    }
+
+    return {};
+}
+
 std::error_code clear_output_fifo(MVLC &mvlc, u32 moduleBase)
 {
     auto logger = mvlc::get_logger("mvlc_mvp_lib");
@@ -52,23 +332,32 @@ std::error_code clear_output_fifo(MVLC &mvlc, u32 moduleBase)
     auto tStart = std::chrono::steady_clock::now();
 
     size_t cycles = 0;
+    size_t discarded = 0;
 
     while (true)
     {
-        u32 fifoValue = 0;
+        std::vector<u32> fifoValues;
 
-        auto ec = mvlc.vmeRead(
-            moduleBase + OutputFifoRegister,
-            fifoValue, vme_amods::A32, VMEDataWidth::D16);
+        auto ec = block_read_output_fifo(mvlc, moduleBase, ClearOutputFifoBlockWords, fifoValues);
 
         ++cycles;
 
         if (ec) return ec;
 
-        if (fifoValue & output_fifo_flags::InvalidRead)
-            break;
+        // The fifo is empty once an InvalidRead word shows up. Words read
+        // after it were posted after the fifo ran empty. The block read has
+        // consumed them as well, so they are discarded without being logged
+        // or counted.
+        auto it = std::find_if(std::begin(fifoValues), std::end(fifoValues),
+                               [] (u32 value) { return value & output_fifo_flags::InvalidRead; });
+
+        for (auto di = std::begin(fifoValues); di != it; ++di)
+            logger->debug("  clear_output_fifo: 0x{:04x} = 0x{:08x}", OutputFifoRegister, *di);
 
-        logger->debug("  clear_output_fifo: 0x{:04x} = 0x{:08x}", OutputFifoRegister, fifoValue);
+        discarded += std::distance(std::begin(fifoValues), it);
+
+        if (it != std::end(fifoValues))
+            break;
 
         if (auto elapsed = std::chrono::steady_clock::now() - tStart;
             elapsed >= MaxResponseWaitTime)
@@ -80,8 +369,8 @@ std::error_code clear_output_fifo(MVLC &mvlc, u32 moduleBase)
 
     auto tEnd = std::chrono::steady_clock::now();
     auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(tEnd - tStart);
-    logger->debug("clear_output_fifo() returned after {} read cycles, took {} ms to clear the fifo",
-                  cycles, elapsed.count()/1000.0);
+    logger->debug("clear_output_fifo() returned after {} read cycles, discarded {} words, took {} ms to clear the fifo",
+                  cycles, discarded, elapsed.count()/1000.0);
 
     return {};
 }
@@ -94,30 +383,180 @@ std::error_code perform_writes(MVLC &mvlc, const C &writes)
         u32 addr = write.first;
         u32 val = write.second;
 
-        if (auto ec = mvlc.vmeWrite(addr, val, vme_amods::A32, VMEDataWidth::D16))
+        if (auto ec = paced_vme_write(mvlc, addr, val, vme_amods::A32, VMEDataWidth::D16))
             return ec;
     }
 
     return {};
 }
 
-std::error_code command_transaction(
+size_t get_expected_response_size(const std::vector<u8> &instruction)
+{
+    if (instruction.empty())
+        return 0;
+
+    switch (instruction[0])
+    {
+        case opcodes::NOP: return 3;
+        case opcodes::SAI: return 6;
+        case opcodes::RAI: return 4;
+        case opcodes::RDI: return 4;
+        case opcodes::VEB: return 6;
+        case opcodes::EFW: return 5;
+    }
+
+    // Mirror + 0xff + status
+    return instruction.size() + 2;
+}
+
+void add_command_to_stack(
+    StackCommandBuilder &sb, u32 moduleBase, const std::vector<u8> &instruction)
+{
+    for (auto byte: instruction)
+        sb.addVMEWrite(moduleBase + InputFifoRegister, byte, vme_amods::A32, VMEDataWidth::D16);
+
+    sb.addWait(get_fifo_wait_cycles(moduleBase));
+
+    // Accu loop: read the statusregister until it's 0, meaning "flash output fifo not empty".
+    sb.addReadToAccu(moduleBase + StatusRegister, vme_amods::A32, VMEDataWidth::D16);
+    sb.addCompareLoopAccu(AccuComparator::EQ, 0);
+
+    sb.addSetAccu(get_expected_response_size(instruction) + 2);
+    sb.addVMERead(moduleBase + OutputFifoRegister, vme_amods::A32, VMEDataWidth::D16);
+}
+
+std::error_code command_transactions(
     MVLC &mvlc, u32 moduleBase,
-    const std::vector<u8> &instruction,
-    std::vector<u8> &responseBuffer)
+    const std::vector<std::vector<u8>> &instructions,
+    std::vector<std::vector<u8>> &responses)
 {
-    if (auto ec = write_instruction(mvlc, moduleBase, instruction))
+    auto logger = mvlc::get_logger("mvlc_mvp_lib");
+
+    responses.clear();
+
+    if (instructions.empty())
+        return {};
+
+    // BFP: the module reboots without a response. See write_instruction().
+    for (const auto &instr: instructions)
+    {
+        if (instr.empty() || instr[0] == opcodes::BFP)
+            throw std::invalid_argument("command_transactions: empty or BFP instruction given");
+    }
+
+    u32 stackRef = get_next_stack_reference();
+    StackCommandBuilder sb;
+    sb.addWriteMarker(stackRef);
+
+    for (const auto &instr: instructions)
+        add_command_to_stack(sb, moduleBase, instr);
+
+    std::vector<u32> stackOutput;
+
+    if (auto ec = paced_stack_transaction(mvlc, sb, stackOutput))
+    {
+        logger->error("command_transactions(): mvlc.stackTransaction: {}", ec.message());
         return ec;
+    }
+
+    if (stackOutput.size() < 2)
+        return make_error_code(MVLCErrorCode::UnexpectedResponseSize);
 
-    if (auto ec = read_response(mvlc, moduleBase, responseBuffer))
+    if (auto ec = get_stack_frame_error(stackOutput[0]))
         return ec;
 
-    if (!check_response(instruction, responseBuffer))
+    if (stackOutput[1] != stackRef)
+        return MVLCErrorCode::StackReferenceMismatch;
+
+    std::vector<u32> dataWords;
+
+    for (size_t i=2; i<stackOutput.size(); ++i)
+    {
+        u32 word = stackOutput[i];
+
+        if (is_stack_buffer(word) || is_stack_buffer_continuation(word) || is_blockread_buffer(word))
+            continue;
+
+        dataWords.push_back(word);
+    }
+
+    // Each fake block read returns exactly the number of words set in the
+    // accu. Split the data into per command segments. Within a segment the
+    // response ends at the first InvalidRead word.
+    auto dataIter = std::begin(dataWords);
+    bool ok = true;
+
+    for (const auto &instr: instructions)
+    {
+        const size_t segmentWords = get_expected_response_size(instr) + 2;
+        std::vector<u8> response;
+        bool terminated = false;
+
+        for (size_t i=0; i<segmentWords && dataIter != std::end(dataWords); ++i, ++dataIter)
+        {
+            if (*dataIter & output_fifo_flags::InvalidRead)
+                terminated = true;
+            else if (!terminated)
+                response.push_back(*dataIter & 0xff);
+        }
+
+        logger->debug("command_transactions: moduleBase=0x{:08x}, instr={:#04x}, response={:#04x}",
+                      moduleBase, fmt::join(instr, ", "), fmt::join(response, ", "));
+
+        // A missing terminator means part of the response is still in the
+        // fifo and would end up in the segment of the next command.
+        if (!terminated || !check_response(instr, response))
+            ok = false;
+
+        responses.emplace_back(std::move(response));
+    }
+
+    if (!ok)
+    {
+        if (auto ec = clear_output_fifo(mvlc, moduleBase))
+            return ec;
+
         return make_error_code(std::errc::protocol_error);
+    }
 
     return {};
 }
 
+std::error_code command_transaction(
+    MVLC &mvlc, u32 moduleBase,
+    const std::vector<u8> &instruction,
+    std::vector<u8> &responseBuffer)
+{
+    std::vector<std::vector<u8>> responses;
+    auto ec = command_transactions(mvlc, moduleBase, { instruction }, responses);
+
+    if (!responses.empty())
+        responseBuffer = responses[0];
+
+    return ec;
+}
+
+
+std::error_code setup_flash_session(
+    MVLC &mvlc, u32 moduleBase, unsigned area, bool enableWrite)
+{
+    auto logger = mvlc::get_logger("mvlc_mvp_lib");
+    logger->info("Setting up flash session on 0x{:08x}: area={}, enableWrite={}",
+                 moduleBase, area, enableWrite);
+
+    std::vector<std::vector<u8>> instructions =
+    {
+        { 0x60, 0xCD, 0xAB, 1 },                        // VEB off
+        { 0x20, 0xCD, 0xAB, static_cast<u8>(area) },    // SAI
+    };
+
+    if (enableWrite)
+        instructions.push_back(EfwRequest);
+
+    std::vector<std::vector<u8>> responses;
+
+    return command_transactions(mvlc, moduleBase, instructions, responses);
+}
 
 std::error_code set_area_index(MVLC &mvlc, u32 moduleBase, unsigned area)
 {
@@ -147,16 +586,35 @@ std::error_code write_instruction(MVLC &mvlc, u32 moduleBase, const std::vector<
     logger->debug("write_instruction: moduleBase=0x{:08x}, instr.size()={}B, instr={:#02x}",
                   moduleBase, instruction.size(), fmt::join(instruction, ", "));
 
+    if (instruction.empty())
+        return {};
+
+    // All bytes are written in one stack instead of one VME write
+    // transaction per byte.
+    u32 stackRef = get_next_stack_reference();
+    StackCommandBuilder sb;
+    sb.addWriteMarker(stackRef);
+
     for (u8 arg: instruction)
+        sb.addVMEWrite(moduleBase + InputFifoRegister, arg, vme_amods::A32, VMEDataWidth::D16);
+
+    std::vector<u32> stackOutput;
+
+    if (auto ec = paced_stack_transaction(mvlc, sb, stackOutput))
     {
-        if (auto ec = mvlc.vmeWrite(
-                moduleBase + InputFifoRegister, arg,
-                vme_amods::A32, VMEDataWidth::D16))
-        {
-            return ec;
-        }
+        logger->error("write_instruction(): mvlc.stackTransaction: {}", ec.message());
+        return ec;
     }
 
+    if (stackOutput.size() < 2)
+        return make_error_code(MVLCErrorCode::UnexpectedResponseSize);
+
+    if (auto ec = get_stack_frame_error(stackOutput[0]))
+        return ec;
+
+    if (stackOutput[1] != stackRef)
+        return MVLCErrorCode::StackReferenceMismatch;
+
     return {};
 }
 
@@ -168,7 +626,7 @@ std::error_code write_instruction(MVLC &mvlc, u32 moduleBase, const gsl::span<un
     return write_instruction(mvlc, moduleBase, tmp);
 }
 
-std::error_code read_response(MVLC &mvlc, u32 moduleBase, std::vector<u8> &dest)
+static std::error_code drain_response(MVLC &mvlc, u32 moduleBase, std::vector<u8> &dest)
 {
     auto logger = mvlc::get_logger("mvlc_mvp_lib");
     auto tStart = std::chrono::steady_clock::now();
@@ -177,7 +635,7 @@ std::error_code read_response(MVLC &mvlc, u32 moduleBase, std::vector<u8> &dest)
     {
         u32 fifoValue = 0;
 
-        if (auto ec = mvlc.vmeRead(
+        if (auto ec = paced_vme_read(mvlc,
                 moduleBase + OutputFifoRegister, fifoValue,
                 vme_amods::A32, VMEDataWidth::D16))
         {
@@ -200,32 +658,79 @@ std::error_code read_response(MVLC &mvlc, u32 moduleBase, std::vector<u8> &dest)
         }
     }
 
-    logger->debug("read_response: moduleBase=0x{:08x}, got {} bytes: {:02x}",
-                 moduleBase, dest.size(), fmt::join(dest, ", "));
     return {};
 }
 
-bool check_response(const std::vector<u8> &request,
-                    const std::vector<u8> &response)
+std::error_code read_response(MVLC &mvlc, u32 moduleBase, std::vector<u8> &dest, size_t expectedLen)
 {
-    //auto response = response_; // When simulating the failure condition below.
-
     auto logger = mvlc::get_logger("mvlc_mvp_lib");
+    bool terminated = false;
 
-    logger->trace("check_response: request ={:#04x}", fmt::join(request, ","));
-    logger->trace("check_response: response={:#04x}", fmt::join(response, ","));
-
-    if (response.size() < 2)
+    if (expectedLen)
     {
-        logger->warn("short response (size<2)");
-        return false;
-    }
+        std::vector<u32> fifoValues;
 
-    if (response.size() < request.size())
-    {
-        logger->warn("response too short (len={}) for request (len={})",
-                     response.size(), request.size());
-        return false;
+        if (auto ec = block_read_output_fifo(mvlc, moduleBase, expectedLen + 1, fifoValues))
+            return ec;
+
+        // InvalidRead words before the first data word mean the response was
+        // not available yet. An InvalidRead word after the data terminates
+        // the response.
+        bool gotData = false;
+
+        for (u32 fifoValue: fifoValues)
+        {
+            if (fifoValue & output_fifo_flags::InvalidRead)
+            {
+                if (gotData)
+                {
+                    terminated = true;
+                    break;
+                }
+                continue;
+            }
+
+            dest.push_back(fifoValue & 0xff);
+            gotData = true;
+        }
+
+        if (!terminated)
+            logger->debug("read_response: no terminator after {} bytes (expected {}), draining",
+                          dest.size(), expectedLen);
+    }
+
+    if (!terminated)
+    {
+        if (auto ec = drain_response(mvlc, moduleBase, dest))
+            return ec;
+    }
+
+    logger->debug("read_response: moduleBase=0x{:08x}, got {} bytes: {:02x}",
+                 moduleBase, dest.size(), fmt::join(dest, ", "));
+    return {};
+}
+
+bool check_response(const std::vector<u8> &request,
+                    const std::vector<u8> &response)
+{
+    //auto response = response_; // When simulating the failure condition below.
+
+    auto logger = mvlc::get_logger("mvlc_mvp_lib");
+
+    logger->trace("check_response: request ={:#04x}", fmt::join(request, ","));
+    logger->trace("check_response: response={:#04x}", fmt::join(response, ","));
+
+    if (response.size() < 2)
+    {
+        logger->warn("short response (size<2)");
+        return false;
+    }
+
+    if (response.size() < request.size())
+    {
+        logger->warn("response too short (len={}) for request (len={})",
+                     response.size(), request.size());
+        return false;
     }
 
     #if 0
@@ -303,50 +808,34 @@ std::error_code set_verbose_mode(MVLC &mvlc, u32 moduleBase, bool verbose)
 
 // Extracts the low bytes from the 32-bit words in the stack response. Takes
 // care of stack continuations. Stops once output_fifo_flags::InvalidRead is
-// set.
-void fill_page_buffer_from_stack_output(std::vector<u8> &pageBuffer, const std::vector<u32> stackOutput, u32 stackRef)
+// set. See decode_stack_output() for the implementation.
+std::error_code fill_page_buffer_from_stack_output(std::vector<u8> &pageBuffer, const std::vector<u32> &stackOutput, u32 stackRef)
 {
-    assert(stackOutput.size() > 3);
-    assert(is_stack_buffer(stackOutput.at(0)));
-    assert(stackOutput.at(1) == stackRef);
-
+    // Short output, a missing stack frame header and a reference mismatch are
+    // reported by decode_stack_output().
     auto logger = mvlc::get_logger("mvlc_mvp_lib");
-    pageBuffer.clear();
-    auto view = basic_string_view<u32>(stackOutput.data(), stackOutput.size());
 
-    while (!view.empty())
-    {
-        u32 word = view[0];
-
-        if (is_stack_buffer(word))
-        {
-            assert(view.size() >= 2);
-            assert(view[1] == stackRef);
-            view.remove_prefix(2); // skip over the stack buffer header and the marker
-        }
-        else if (is_stack_buffer_continuation(word) || is_blockread_buffer(word))
-        {
-            view.remove_prefix(1); // skip over the header
-        }
-        else
-        {
-            view.remove_prefix(1);
+    // Upper bound for the number of data bytes: everything except the stack
+    // frame header and the marker.
+    pageBuffer.resize(stackOutput.size() - std::min(stackOutput.size(), size_t(2)));
 
-            if (word & (output_fifo_flags::InvalidRead))
-            {
-                logger->debug("fill_page_buffer_from_stack_output: first non-data word: 0x{:08x}", word);
-                break;
-            }
+    auto result = decode_stack_output(stackOutput, stackRef, pageBuffer);
+    pageBuffer.resize(result.bytes);
 
-            pageBuffer.push_back(word & 0xffu);
-        }
-    }
+    if (result.terminated)
+        logger->trace("fill_page_buffer_from_stack_output: found terminator after {} data words", result.bytes);
 
-    if (!view.empty())
+    if (result.wordsLeft)
     {
+        auto view = basic_string_view<u32>(stackOutput.data(), stackOutput.size());
         log_buffer(logger, spdlog::level::warn, view,
-            fmt::format("fill_page_buffer_from_stack_output: {} words left in stackOutput data", view.size()));
+            fmt::format("fill_page_buffer_from_stack_output: {} words left in stackOutput data", result.wordsLeft));
     }
+
+    if (result.ec)
+        logger->error("fill_page_buffer_from_stack_output: {}", result.ec.message());
+
+    return result.ec;
 }
 
 std::error_code read_page(
@@ -365,35 +854,25 @@ std::error_code read_page(
     // Note: the REF instruction does not mirror itself to the output fifo.
     // Instead the page data starts immediately.
 
+    // The stack is a copy of a cached template with the address and section
+    // patched in. Layout: REF instruction, wait (required, otherwise the
+    // response data will start with the InvalidRead flag set), then a fake
+    // block read of one more word than expected to get the first flash
+    // interface status word after the payload.
     u32 stackRef = get_next_stack_reference();
-    StackCommandBuilder sb;
-    sb.addWriteMarker(stackRef);
-    sb.addVMEWrite(moduleBase + InputFifoRegister, mesytec::mvp::opcodes::REF, vme_amods::A32, VMEDataWidth::D16);
-    sb.addVMEWrite(moduleBase + InputFifoRegister, addr[0], vme_amods::A32, VMEDataWidth::D16);
-    sb.addVMEWrite(moduleBase + InputFifoRegister, addr[1], vme_amods::A32, VMEDataWidth::D16);
-    sb.addVMEWrite(moduleBase + InputFifoRegister, addr[2], vme_amods::A32, VMEDataWidth::D16);
-    sb.addVMEWrite(moduleBase + InputFifoRegister, section, vme_amods::A32, VMEDataWidth::D16);
-    sb.addVMEWrite(moduleBase + InputFifoRegister, bytesToRead == PageSize ? 0 : bytesToRead,
-                   vme_amods::A32, VMEDataWidth::D16);
-
-    // Waiting is required, otherwise the response data will start with the
-    // InvalidRead flag set.
-    sb.addWait(PostFifoWriteStackWaitCycles);
-    // Turn the next vme read into a fake block read. Read one more word than
-    // expected to get the first flash interface status word after the payload.
-    sb.addSetAccu(bytesToRead + 1);
-    // This single read is turned into a block read due to the accu being set.
-    sb.addVMERead(moduleBase + OutputFifoRegister, vme_amods::A32, VMEDataWidth::D16);
+    auto sb = PageStackTemplates::instance().makeReadStack(
+        moduleBase, addr, section, bytesToRead, stackRef);
 
     std::vector<u32> readBuffer; // stores raw read data
 
-    if (auto ec = mvlc.stackTransaction(sb, readBuffer))
+    if (auto ec = paced_stack_transaction(mvlc, sb, readBuffer))
     {
         logger->error("read_page(): mvlc.stackTransaction: {}", ec.message());
         return ec;
     }
 
-    fill_page_buffer_from_stack_output(pageBuffer, readBuffer, stackRef);
+    if (auto ec = fill_page_buffer_from_stack_output(pageBuffer, readBuffer, stackRef))
+        return ec;
 
     if (pageBuffer.size() != bytesToRead)
         logger->warn("read_page(): wanted {} bytes, got {} bytes",
@@ -435,7 +914,7 @@ std::error_code write_page(
 
     for (u8 data: pageBuffer)
     {
-        if (auto ec = mvlc.vmeWrite(moduleBase + InputFifoRegister, data,
+        if (auto ec = paced_vme_write(mvlc, moduleBase + InputFifoRegister, data,
                                     vme_amods::A32, VMEDataWidth::D16))
             return ec;
     }
@@ -493,13 +972,19 @@ std::error_code write_page2(
 
     logger->info("write_page2(): writing page of size {}", pageBuffer.size());
 
+    // Track the encoded stack size instead of re-encoding the stack for each
+    // added byte.
+    const size_t wordsPerWrite = get_encoded_vme_write_size();
+    size_t stackWords = get_encoded_stack_size(sb);
+
     while (pageIter != pageBuffer.end())
     {
-        while (get_encoded_stack_size(sb) < MirrorTransactionMaxContentsWords / 2 - 2
+        while (stackWords < MirrorTransactionMaxContentsWords / 2 - 2
                && pageIter != pageBuffer.end())
         {
             sb.addVMEWrite(moduleBase + InputFifoRegister, *pageIter++,
                            vme_amods::A32, VMEDataWidth::D16);
+            stackWords += wordsPerWrite;
         }
 
         std::vector<u32> stackResponse;
@@ -507,7 +992,7 @@ std::error_code write_page2(
         logger->info("write_page2(): performing stackTransaction with stack of size {}",
                      get_encoded_stack_size(sb));
 
-        if (auto ec = mvlc.stackTransaction(sb, stackResponse))
+        if (auto ec = paced_stack_transaction(mvlc, sb, stackResponse))
         {
             logger->error("write_page2(): stackTransaction failed: {}",
                           ec.message());
@@ -534,6 +1019,7 @@ std::error_code write_page2(
 
         sb = {};
         sb.addWriteMarker(get_next_stack_reference());
+        stackWords = get_encoded_stack_size(sb);
     }
 
     assert(pageIter == pageBuffer.end());
@@ -615,7 +1101,9 @@ std::error_code write_page3(
     for (auto dataWord: pageBuffer)
         sb.addVMEWrite(moduleBase + InputFifoRegister, dataWord, vme_amods::A32, VMEDataWidth::D16);
 
-    sb.addWait(PostFifoWriteStackWaitCycles); // wait for a couple of cycles before returning from the stack
+    // The wait covers the page program time, not only the fifo latency, so
+    // the calibrated read wait value can not be used here.
+    sb.addWait(PostFifoWriteStackWaitCycles);
 
     logger->debug("write_page3(): performing stackTransaction: pageSize={} bytes, stackCommands={}"
                  ", encodedStackSize={} words",
@@ -623,7 +1111,7 @@ std::error_code write_page3(
 
     std::vector<u32> stackResponse;
 
-    if (auto ec = mvlc.stackTransaction(sb, stackResponse))
+    if (auto ec = paced_stack_transaction(mvlc, sb, stackResponse))
     {
         logger->error("write_page3(): stackTransaction failed: {}", ec.message());
         return ec;
@@ -694,7 +1182,7 @@ std::error_code write_page4(
     for (int i=0; i<10; ++i)
     {
         u32 statusValue = 0u;
-        if (auto ec = mvlc.vmeRead(moduleBase + StatusRegister, statusValue, vme_amods::A32, VMEDataWidth::D16))
+        if (auto ec = paced_vme_read(mvlc, moduleBase + StatusRegister, statusValue, vme_amods::A32, VMEDataWidth::D16))
             return ec;
         spdlog::warn("write_page4(): polled flash StatusRegister: {:#04x} (poll1)", statusValue);
         if (statusValue != 0)
@@ -702,48 +1190,26 @@ std::error_code write_page4(
     }
     #endif
 
-    static const std::vector<u8> EfwRequest = { mesytec::mvp::opcodes::EFW, 0xCD, 0xAB };
-    static const unsigned ExpectedFlashResponseSize = 5; // Efw is 3 + 0xff + statusbyte
     const u32 StackReferenceMarker = get_next_stack_reference();
     // Response structure: 0xF3 stack frame header, reference marker word, 0xF5
     // block frame, data words from vme reads.
-    static const unsigned ExpectedStackResponseSize = 3 + ExpectedFlashResponseSize;
-
-    StackCommandBuilder sb;
-    // Initial marker so that stackTransaction() has a reference word.
-    sb.addWriteMarker(StackReferenceMarker);
-
-    // EFW - enable flash write. This is written back to the output fifo by the
-    // flash interface.
-    for (auto op: EfwRequest)
-        sb.addVMEWrite(moduleBase + InputFifoRegister, op,  vme_amods::A32, VMEDataWidth::D16);
-
-    // WRF - write flash. This is not written back to the output fifo.
-    sb.addVMEWrite(moduleBase + InputFifoRegister, opcodes::WRF, vme_amods::A32, VMEDataWidth::D16);
-    sb.addVMEWrite(moduleBase + InputFifoRegister, addr[0],      vme_amods::A32, VMEDataWidth::D16);
-    sb.addVMEWrite(moduleBase + InputFifoRegister, addr[1],      vme_amods::A32, VMEDataWidth::D16);
-    sb.addVMEWrite(moduleBase + InputFifoRegister, addr[2],      vme_amods::A32, VMEDataWidth::D16);
-    sb.addVMEWrite(moduleBase + InputFifoRegister, section,      vme_amods::A32, VMEDataWidth::D16);
-    sb.addVMEWrite(moduleBase + InputFifoRegister, lenByte,      vme_amods::A32, VMEDataWidth::D16);
-
-    // Add the actual page data to the stack.
-    for (auto dataWord: pageBuffer)
-        sb.addVMEWrite(moduleBase + InputFifoRegister, dataWord, vme_amods::A32, VMEDataWidth::D16);
-
-    // Wait for a couple of cycles before continuing with the stack (max value
-    // is 24 bit). Without the wait the output fifo will be in an invalid state
-    // as the commands from the input fifo are still being processed by the
-    // flash interface.
-    sb.addWait(PostFifoWriteStackWaitCycles);
-
-    // Accu loop: read the statusregister until it's 0, meaning "flash output fifo not empty".
-    sb.addReadToAccu(moduleBase + StatusRegister, vme_amods::A32, VMEDataWidth::D16);
-    sb.addCompareLoopAccu(AccuComparator::EQ, 0);
-
-    // Now read the flash response from the flash output fifo. setAccu turns the
-    // read into a fake block read.
-    sb.addSetAccu(ExpectedFlashResponseSize+1);
-    sb.addVMERead(moduleBase + OutputFifoRegister, vme_amods::A32, VMEDataWidth::D16);
+    static const unsigned ExpectedStackResponseSize = 3 + EfwResponseSize;
+
+    // Stack layout (see PageStackTemplates::buildWriteTemplate()):
+    // - EFW - enable flash write. This is written back to the output fifo by
+    //   the flash interface.
+    // - WRF - write flash. This is not written back to the output fifo.
+    // - The page data.
+    // - Wait for a couple of cycles before continuing with the stack (max
+    //   value is 24 bit). Without the wait the output fifo will be in an
+    //   invalid state as the commands from the input fifo are still being
+    //   processed by the flash interface.
+    // - Accu loop: read the statusregister until it's 0, meaning "flash
+    //   output fifo not empty".
+    // - Read the flash response from the flash output fifo. setAccu turns the
+    //   read into a fake block read.
+    auto sb = PageStackTemplates::instance().makeWriteStack(
+        moduleBase, addr, section, pageBuffer, StackReferenceMarker);
 
     logger->debug("write_page4(): performing stackTransaction: pageSize={} bytes, stackCommands={}"
                   ", encodedStackSize={} words",
@@ -751,7 +1217,7 @@ std::error_code write_page4(
 
     std::vector<u32> stackResponse;
 
-    if (auto ec = mvlc.stackTransaction(sb, stackResponse))
+    if (auto ec = paced_stack_transaction(mvlc, sb, stackResponse))
     {
         logger->error("write_page4(): stackTransaction failed: {}", ec.message());
         return ec;
@@ -786,7 +1252,8 @@ std::error_code write_page4(
     }
 
     std::vector<u8> flashResponse;
-    fill_page_buffer_from_stack_output(flashResponse, stackResponse, StackReferenceMarker);
+    if (auto ec = fill_page_buffer_from_stack_output(flashResponse, stackResponse, StackReferenceMarker))
+        return ec;
 
     if (!check_response(EfwRequest, flashResponse))
     {
@@ -812,149 +1279,526 @@ std::error_code write_pages(
     const gsl::span<u8> &page1,
     const gsl::span<u8> &page2)
 {
-    auto logger = mvlc::get_logger("mvlc_mvp_lib");
-
     if (page1.empty()) // page2 is optional
         throw std::invalid_argument("write_pages: empty page1 data given");
 
-    if (page1.size() > PageSize)
-        throw std::invalid_argument("write_pages: page1 size > max page size");
+    std::vector<gsl::span<const u8>> pages = { page1 };
 
-    if (page2.size() > PageSize)
-        throw std::invalid_argument("write_pages: page2 size > max page size");
+    if (!page2.empty())
+        pages.push_back(page2);
 
-    static const std::vector<u8> EfwRequest = { mesytec::mvp::opcodes::EFW, 0xCD, 0xAB };
-    static const unsigned ExpectedFlashResponseSize = EfwRequest.size() + 2; // mirror of the EfwRequest + fifo 0xff + fifo status
-    const u32 StackReferenceMarker = get_next_stack_reference();
-    auto tStart = std::chrono::steady_clock::now();
+    return write_pages_batch(mvlc, moduleBase, firstPageAddress, section, pages);
+}
+
+std::error_code get_immediate_stack_max_words(MVLC &mvlc, size_t &maxWords)
+{
+    // The immediate stack used by stackTransaction() starts at
+    // ImmediateStackStartOffsetBytes and may extend up to the start of the
+    // next readout stack uploaded to the MVLC. If no readout stacks are
+    // present the rest of the stack memory is available.
+    u32 limitBytes = stacks::StackMemoryWords * sizeof(u32);
 
-    unsigned expectedResponseSize = 2; // 0xF3 stack frame header + reference marker word
-    for (const auto &pageBuffer: { page1, page2 })
+    for (u8 stackId = stacks::ImmediateStackID + 1; stackId < stacks::StackCount; ++stackId)
     {
-        if (!pageBuffer.empty())
-            expectedResponseSize += ExpectedFlashResponseSize;
+        u32 offset = 0;
+
+        if (auto ec = mvlc.readRegister(stacks::get_offset_register(stackId), offset))
+            return ec;
+
+        if (offset > stacks::ImmediateStackStartOffsetBytes)
+            limitBytes = std::min(limitBytes, offset);
     }
 
-    // Response structure: 0xF3 stack frame header, reference marker word, data
-    // words from vme reads.
+    // Reserve a few words for the stack begin/end and reference marker
+    // commands added by the stack transaction itself.
+    static const size_t ReservedWords = 8;
+    size_t words = (limitBytes - stacks::ImmediateStackStartOffsetBytes) / sizeof(u32);
+    maxWords = words > ReservedWords ? words - ReservedWords : 0;
 
-    u32 destAddr = firstPageAddress;
+    return {};
+}
 
-    StackCommandBuilder sb;
-    // Initial marker so that stackTransaction() has a reference word.
-    sb.addWriteMarker(get_next_stack_reference());
+void add_page_write_to_stack(
+    StackCommandBuilder &sb, u32 moduleBase,
+    u32 pageAddress, u8 section,
+    const gsl::span<const u8> &page,
+    bool waitForProgram)
+{
+    if (page.empty())
+        throw std::invalid_argument("add_page_write_to_stack: empty page data given");
+
+    if (page.size() > PageSize)
+        throw std::invalid_argument("add_page_write_to_stack: page size > max page size");
+
+    // WRF - write flash. This is not written back to the output fifo. The
+    // commands are copied from a cached template.
+    //
+    // The trailing wait lets the flash interface program the page before the
+    // next instruction arrives in the input fifo. This is bounded by the page
+    // program time, not by the fifo response latency, so the calibrated value
+    // is not used here.
+    PageStackTemplates::instance().appendWritePage(
+        sb, moduleBase, flash_address_from_byte_offset(pageAddress), section, page,
+        waitForProgram ? PostFifoWriteStackWaitCycles : 0);
+}
 
-    for (const auto &pageBuffer: { page1, page2 })
+size_t get_encoded_vme_write_size()
+{
+    static const size_t result = []
     {
-        if (pageBuffer.empty())
-            continue;
+        StackCommandBuilder sb;
+        sb.addVMEWrite(InputFifoRegister, 0, vme_amods::A32, VMEDataWidth::D16);
+        return get_encoded_stack_size(sb);
+    }();
 
-        const u8 lenByte = pageBuffer.size() == PageSize ? 0 : pageBuffer.size();
+    return result;
+}
 
-        // EFW - enable flash write. This is written back to the output fifo by the
-        // flash interface.
-        for (auto op: EfwRequest)
-            sb.addVMEWrite(moduleBase + InputFifoRegister, op,  vme_amods::A32, VMEDataWidth::D16);
+size_t get_max_pages_per_stack(size_t maxStackWords)
+{
+    // Measure the encoded size of a full page write and of the per batch
+    // overhead (marker, EFW, NOP and the response reads).
+    static const std::vector<u8> FullPage(PageSize);
 
-        auto addr = flash_address_from_byte_offset(destAddr);
-        destAddr += pageBuffer.size();
-
-        // WRF - write flash. This is not written back to the output fifo.
-        sb.addVMEWrite(moduleBase + InputFifoRegister, opcodes::WRF, vme_amods::A32, VMEDataWidth::D16);
-        sb.addVMEWrite(moduleBase + InputFifoRegister, addr[0],      vme_amods::A32, VMEDataWidth::D16);
-        sb.addVMEWrite(moduleBase + InputFifoRegister, addr[1],      vme_amods::A32, VMEDataWidth::D16);
-        sb.addVMEWrite(moduleBase + InputFifoRegister, addr[2],      vme_amods::A32, VMEDataWidth::D16);
-        sb.addVMEWrite(moduleBase + InputFifoRegister, section,      vme_amods::A32, VMEDataWidth::D16);
-        sb.addVMEWrite(moduleBase + InputFifoRegister, lenByte,      vme_amods::A32, VMEDataWidth::D16);
-
-        // Add the actual page data to the stack.
-        for (auto dataWord: pageBuffer)
-            sb.addVMEWrite(moduleBase + InputFifoRegister, dataWord, vme_amods::A32, VMEDataWidth::D16);
-
-        // Wait for a couple of cycles before continuing with the stack (max value
-        // is 24 bit). Without the wait the output fifo will be in an invalid state
-        // as the commands from the input fifo are still being processed by the
-        // flash interface.
-        sb.addWait(PostFifoWriteStackWaitCycles);
+    StackCommandBuilder pageSb;
+    add_page_write_to_stack(pageSb, 0, 0, 0, FullPage);
+    const size_t pageWords = get_encoded_stack_size(pageSb);
 
-        // Accu loop: read the statusregister until it's 0, meaning "flash output fifo not empty".
-        sb.addReadToAccu(moduleBase + StatusRegister, vme_amods::A32, VMEDataWidth::D16);
-        sb.addCompareLoopAccu(AccuComparator::EQ, 0);
+    StackCommandBuilder overheadSb;
+    overheadSb.addWriteMarker(0);
+    for (auto op: EfwRequest)
+        overheadSb.addVMEWrite(InputFifoRegister, op, vme_amods::A32, VMEDataWidth::D16);
+    for (unsigned i=0; i<2; ++i)
+    {
+        overheadSb.addVMEWrite(InputFifoRegister, opcodes::NOP, vme_amods::A32, VMEDataWidth::D16);
+        overheadSb.addWait(PostFifoWriteStackWaitCycles);
+        overheadSb.addReadToAccu(StatusRegister, vme_amods::A32, VMEDataWidth::D16);
+        overheadSb.addCompareLoopAccu(AccuComparator::EQ, 0);
+        overheadSb.addSetAccu(EfwResponseSize);
+        overheadSb.addVMERead(OutputFifoRegister, vme_amods::A32, VMEDataWidth::D16);
+    }
+    const size_t overheadWords = get_encoded_stack_size(overheadSb);
 
-        // Now read the flash response from the flash output fifo.
-        for (unsigned i=0; i<ExpectedFlashResponseSize; ++i)
-            sb.addVMERead(moduleBase + OutputFifoRegister, vme_amods::A32, VMEDataWidth::D16);
+    if (maxStackWords <= overheadWords + pageWords)
+        return 1;
+
+    return (maxStackWords - overheadWords) / pageWords;
+}
+
+// Writes one batch of consecutive pages using a single stack transaction.
+// The stack layout is:
+//   marker, EFW, { WRF + page data + wait } * N,
+//   poll + read EFW mirror, NOP, wait, poll + read NOP response.
+// As WRF does not clear the EFW flag and verbose mode is off (WRF returns
+// nothing) a single EFW is enough for the whole batch. The trailing NOP
+// makes sure the flash interface has consumed all queued page data before
+// the stack returns; it also clears the EFW flag.
+static std::error_code write_pages_single_batch(
+    MVLC &mvlc, u32 moduleBase,
+    u32 firstPageAddress, u8 section,
+    const gsl::span<const gsl::span<const u8>> &pages)
+{
+    auto logger = mvlc::get_logger("mvlc_mvp_lib");
+    static const std::vector<u8> NopRequest = { opcodes::NOP };
+    static const unsigned NopResponseSize = 3;
+
+    const u32 StackReferenceMarker = get_next_stack_reference();
+    u32 destAddr = firstPageAddress;
+    size_t totalBytes = 0;
+
+    StackCommandBuilder sb;
+    sb.addWriteMarker(StackReferenceMarker);
+
+    for (auto op: EfwRequest)
+        sb.addVMEWrite(moduleBase + InputFifoRegister, op,  vme_amods::A32, VMEDataWidth::D16);
+
+    for (const auto &page: pages)
+    {
+        add_page_write_to_stack(sb, moduleBase, destAddr, section, page);
+        destAddr += page.size();
+        totalBytes += page.size();
     }
 
-    logger->debug("write_pages(): performing stackTransaction: page1={} bytes, page2={} bytes, stackCommands={}"
+    // EFW mirror response
+    sb.addReadToAccu(moduleBase + StatusRegister, vme_amods::A32, VMEDataWidth::D16);
+    sb.addCompareLoopAccu(AccuComparator::EQ, 0);
+    sb.addSetAccu(EfwResponseSize);
+    sb.addVMERead(moduleBase + OutputFifoRegister, vme_amods::A32, VMEDataWidth::D16);
+
+    // NOP sync point. Read one more word than the response size to get the
+    // InvalidRead terminator.
+    sb.addVMEWrite(moduleBase + InputFifoRegister, opcodes::NOP, vme_amods::A32, VMEDataWidth::D16);
+    sb.addWait(get_fifo_wait_cycles(moduleBase));
+    sb.addReadToAccu(moduleBase + StatusRegister, vme_amods::A32, VMEDataWidth::D16);
+    sb.addCompareLoopAccu(AccuComparator::EQ, 0);
+    sb.addSetAccu(NopResponseSize + 1);
+    sb.addVMERead(moduleBase + OutputFifoRegister, vme_amods::A32, VMEDataWidth::D16);
+
+    logger->debug("write_pages_batch(): performing stackTransaction: pages={}, bytes={}, stackCommands={}"
                   ", encodedStackSize={} words",
-                  page1.size(), page2.size(), sb.commandCount(), get_encoded_stack_size(sb));
+                  pages.size(), totalBytes, sb.commandCount(), get_encoded_stack_size(sb));
 
     std::vector<u32> stackResponse;
 
-    if (auto ec = mvlc.stackTransaction(sb, stackResponse))
+    if (auto ec = paced_stack_transaction(mvlc, sb, stackResponse))
     {
-        logger->error("write_pages(): stackTransaction failed: {}", ec.message());
+        logger->error("write_pages_batch(): stackTransaction failed: {}", ec.message());
         return ec;
     }
 
-    logger->debug("write_pages(): response from stackTransaction: size={}, data={:#08x}",
-                    stackResponse.size(), fmt::join(stackResponse, ", "));
+    if (stackResponse.size() < 2)
+        return make_error_code(MVLCErrorCode::UnexpectedResponseSize);
+
+    if (auto ec = get_stack_frame_error(stackResponse[0]))
+        return ec;
+
+    if (stackResponse[1] != StackReferenceMarker)
+    {
+        logger->error("write_pages_batch(): stack response does not start with the reference marker");
+        return MVLCErrorCode::StackReferenceMismatch;
+    }
+
+    // Single pass over the stack output: the first EfwResponseSize data bytes
+    // are the EFW mirror, the following bytes up to the InvalidRead terminator
+    // are the NOP response.
+    std::vector<u8> flashResponse;
+    if (auto ec = fill_page_buffer_from_stack_output(flashResponse, stackResponse, StackReferenceMarker))
+        return ec;
 
-    if (stackResponse.size() != expectedResponseSize)
+    if (flashResponse.size() < EfwResponseSize + NopResponseSize)
     {
-        logger->error("write_pages(): unexpected stack response size! got {} words, expected {} words",
-            stackResponse.size(), expectedResponseSize);
+        logger->error("write_pages_batch(): short flash response: {:#04x}", fmt::join(flashResponse, ", "));
         return make_error_code(std::errc::protocol_error);
     }
 
-    if (extract_frame_info(stackResponse[0]).flags & frame_flags::AllErrorFlags)
+    std::vector<u8> efwResponse(std::begin(flashResponse), std::begin(flashResponse) + EfwResponseSize);
+    std::vector<u8> nopResponse(std::begin(flashResponse) + EfwResponseSize, std::end(flashResponse));
+
+    if (!check_response(EfwRequest, efwResponse))
     {
-        if (extract_frame_info(stackResponse[0]).flags & frame_flags::Timeout)
-            return MVLCErrorCode::NoVMEResponse;
+        logger->error("write_pages_batch(): EFW check_response() failed for batch starting at 0x{:06x}, response={:#04x}",
+            firstPageAddress, fmt::join(efwResponse, ", "));
+        return make_error_code(std::errc::protocol_error);
+    }
 
-        if (extract_frame_info(stackResponse[0]).flags & frame_flags::SyntaxError)
-            return MVLCErrorCode::StackSyntaxError;
+    if (!check_response(NopRequest, nopResponse))
+    {
+        logger->error("write_pages_batch(): NOP check_response() failed for batch starting at 0x{:06x}, response={:#04x}",
+            firstPageAddress, fmt::join(nopResponse, ", "));
+        return make_error_code(std::errc::protocol_error);
+    }
 
-        // Note: BusError can not happen as there's no block read in the stack
+    return {};
+}
+
+static const std::vector<u8> MulticastNopRequest = { opcodes::NOP };
+static const unsigned MulticastNopResponseSize = 3;
+
+static StackCommandBuilder build_multicast_write_stack(
+    const std::vector<u32> &moduleBases, u32 stackRef,
+    u32 firstPageAddress, u8 section,
+    const gsl::span<const gsl::span<const u8>> &pages)
+{
+    StackCommandBuilder sb;
+    sb.addWriteMarker(stackRef);
+
+    for (auto moduleBase: moduleBases)
+    {
+        for (auto op: EfwRequest)
+            sb.addVMEWrite(moduleBase + InputFifoRegister, op,  vme_amods::A32, VMEDataWidth::D16);
     }
 
-    if (stackResponse[1] != StackReferenceMarker)
+    u32 destAddr = firstPageAddress;
+
+    for (const auto &page: pages)
     {
-        logger->error("write_pages(): stack response does not start with the reference marker");
-        return MVLCErrorCode::StackReferenceMismatch;
+        for (auto moduleBase: moduleBases)
+            add_page_write_to_stack(sb, moduleBase, destAddr, section, page, false);
+
+        // The modules program their pages in parallel.
+        sb.addWait(PostFifoWriteStackWaitCycles);
+        destAddr += page.size();
     }
 
-    // Use clear_output_fifo() to log the remaining data in case of issues.
-    //if (auto ec = clear_output_fifo(mvlc, moduleBase))
-    //    return ec;
+    for (auto moduleBase: moduleBases)
+        sb.addVMEWrite(moduleBase + InputFifoRegister, opcodes::NOP, vme_amods::A32, VMEDataWidth::D16);
+
+    for (auto moduleBase: moduleBases)
+    {
+        // EFW mirror followed by the NOP response and the InvalidRead
+        // terminator.
+        sb.addWait(get_fifo_wait_cycles(moduleBase));
+        sb.addReadToAccu(moduleBase + StatusRegister, vme_amods::A32, VMEDataWidth::D16);
+        sb.addCompareLoopAccu(AccuComparator::EQ, 0);
+        sb.addSetAccu(EfwResponseSize + MulticastNopResponseSize + 1);
+        sb.addVMERead(moduleBase + OutputFifoRegister, vme_amods::A32, VMEDataWidth::D16);
+    }
+
+    return sb;
+}
 
-    std::vector<u8> flashResponse0(std::begin(stackResponse) + 2, std::begin(stackResponse) + 2 + 5);
-    std::vector<u8> flashResponse1(std::begin(stackResponse) + 2 + flashResponse0.size(), std::end(stackResponse));
+// Determines the number of modules per stack and pages per stack for a
+// multicast write. Prefers putting all modules into one stack.
+// The encoded size of build_multicast_write_stack() is
+//   markerWords + modules * moduleWords + pages * (modules * pageWords + waitWords)
+// with the per part sizes measured once, like in get_max_pages_per_stack().
+static std::pair<size_t, size_t> get_multicast_layout(size_t maxStackWords, size_t moduleCount)
+{
+    struct Sizes
+    {
+        size_t markerWords;
+        size_t moduleWords; // EFW, NOP and the response read of one module
+        size_t pageWords;   // one page write without the program wait
+        size_t waitWords;   // the shared program wait after each page
+    };
 
-    if (!check_response(EfwRequest, flashResponse0))
+    static const Sizes sizes = []
     {
-        logger->error("write_pages(): flash check_response() failed for the first page, response={:#02x}",
-            fmt::join(flashResponse0, ", "));
-        return make_error_code(std::errc::protocol_error);
+        static const std::vector<u8> FullPage(PageSize);
+        Sizes result;
+
+        StackCommandBuilder markerSb;
+        markerSb.addWriteMarker(0);
+        result.markerWords = get_encoded_stack_size(markerSb);
+
+        StackCommandBuilder moduleSb;
+        for (auto op: EfwRequest)
+            moduleSb.addVMEWrite(InputFifoRegister, op, vme_amods::A32, VMEDataWidth::D16);
+        moduleSb.addVMEWrite(InputFifoRegister, opcodes::NOP, vme_amods::A32, VMEDataWidth::D16);
+        moduleSb.addWait(PostFifoWriteStackWaitCycles);
+        moduleSb.addReadToAccu(StatusRegister, vme_amods::A32, VMEDataWidth::D16);
+        moduleSb.addCompareLoopAccu(AccuComparator::EQ, 0);
+        moduleSb.addSetAccu(EfwResponseSize + MulticastNopResponseSize + 1);
+        moduleSb.addVMERead(OutputFifoRegister, vme_amods::A32, VMEDataWidth::D16);
+        result.moduleWords = get_encoded_stack_size(moduleSb);
+
+        StackCommandBuilder pageSb;
+        add_page_write_to_stack(pageSb, 0, 0, 0, FullPage, false);
+        result.pageWords = get_encoded_stack_size(pageSb);
+
+        StackCommandBuilder waitSb;
+        waitSb.addWait(PostFifoWriteStackWaitCycles);
+        result.waitWords = get_encoded_stack_size(waitSb);
+
+        return result;
+    }();
+
+    for (size_t modules = moduleCount; modules > 1; --modules)
+    {
+        const size_t fixedWords = sizes.markerWords + modules * sizes.moduleWords;
+
+        if (maxStackWords <= fixedWords)
+            continue;
+
+        const size_t pages = (maxStackWords - fixedWords) / (modules * sizes.pageWords + sizes.waitWords);
+
+        if (pages > 0)
+            return std::make_pair(modules, pages);
     }
 
-    if (!page2.empty() && !check_response(EfwRequest, flashResponse1))
+    return std::make_pair(size_t(1), get_max_pages_per_stack(maxStackWords));
+}
+
+std::error_code write_pages_multicast(
+    MVLC &mvlc, const std::vector<u32> &moduleBases,
+    const u32 firstPageAddress, u8 section,
+    const gsl::span<const gsl::span<const u8>> &pages,
+    std::vector<std::error_code> &moduleErrors)
+{
+    auto logger = mvlc::get_logger("mvlc_mvp_lib");
+
+    moduleErrors.assign(moduleBases.size(), {});
+
+    if (pages.empty() || moduleBases.empty())
+        return {};
+
+    for (const auto &page: pages)
     {
-        logger->error("write_pages(): flash check_response() failed for the second page, response={:#02x}",
-            fmt::join(flashResponse1, ", "));
-        return make_error_code(std::errc::protocol_error);
+        if (page.empty())
+            throw std::invalid_argument("write_pages_multicast: empty page data given");
+
+        if (page.size() > PageSize)
+            throw std::invalid_argument("write_pages_multicast: page size > max page size");
+    }
+
+    size_t maxStackWords = 0;
+
+    if (auto ec = get_immediate_stack_max_words(mvlc, maxStackWords))
+        return ec;
+
+    const auto [modulesPerStack, pagesPerStack] = get_multicast_layout(maxStackWords, moduleBases.size());
+
+    logger->debug("write_pages_multicast(): modules={}, pages={}, modulesPerStack={}, pagesPerStack={}",
+                  moduleBases.size(), pages.size(), modulesPerStack, pagesPerStack);
+
+    for (size_t groupStart = 0; groupStart < moduleBases.size(); groupStart += modulesPerStack)
+    {
+        const size_t groupEnd = std::min(groupStart + modulesPerStack, moduleBases.size());
+        u32 destAddr = firstPageAddress;
+
+        for (size_t pageIndex = 0; pageIndex < pages.size(); pageIndex += pagesPerStack)
+        {
+            // Indexes into moduleBases of the modules without errors.
+            std::vector<size_t> active;
+            std::vector<u32> bases;
+
+            for (size_t mi = groupStart; mi < groupEnd; ++mi)
+            {
+                if (!moduleErrors[mi])
+                {
+                    active.push_back(mi);
+                    bases.push_back(moduleBases[mi]);
+                }
+            }
+
+            if (active.empty())
+                break;
+
+            const size_t count = std::min(pagesPerStack, pages.size() - pageIndex);
+            auto batch = pages.subspan(pageIndex, count);
+            const u32 stackRef = get_next_stack_reference();
+            auto sb = build_multicast_write_stack(bases, stackRef, destAddr, section, batch);
+            std::vector<u32> stackResponse;
+
+            if (auto ec = paced_stack_transaction(mvlc, sb, stackResponse))
+            {
+                logger->error("write_pages_multicast(): stackTransaction failed: {}", ec.message());
+                return ec;
+            }
+
+            if (stackResponse.size() < 2)
+                return make_error_code(MVLCErrorCode::UnexpectedResponseSize);
+
+            if (auto ec = get_stack_frame_error(stackResponse[0]))
+                return ec;
+
+            if (stackResponse[1] != stackRef)
+                return MVLCErrorCode::StackReferenceMismatch;
+
+            std::vector<u32> dataWords;
+
+            for (size_t i=2; i<stackResponse.size(); ++i)
+            {
+                u32 word = stackResponse[i];
+
+                if (is_stack_buffer(word) || is_stack_buffer_continuation(word) || is_blockread_buffer(word))
+                    continue;
+
+                dataWords.push_back(word);
+            }
+
+            // One fixed size block read per module: EFW mirror, NOP response,
+            // terminator.
+            const size_t wordsPerModule = EfwResponseSize + MulticastNopResponseSize + 1;
+            auto dataIter = std::begin(dataWords);
+
+            for (auto mi: active)
+            {
+                std::vector<u8> flashResponse;
+                bool terminated = false;
+
+                for (size_t i=0; i<wordsPerModule && dataIter != std::end(dataWords); ++i, ++dataIter)
+                {
+                    if (*dataIter & output_fifo_flags::InvalidRead)
+                        terminated = true;
+                    else if (!terminated)
+                        flashResponse.push_back(*dataIter & output_fifo_flags::DataMask);
+                }
+
+                bool ok = terminated && flashResponse.size() >= EfwResponseSize + MulticastNopResponseSize;
+
+                if (ok)
+                {
+                    std::vector<u8> efwResponse(std::begin(flashResponse), std::begin(flashResponse) + EfwResponseSize);
+                    std::vector<u8> nopResponse(std::begin(flashResponse) + EfwResponseSize, std::end(flashResponse));
+                    ok = check_response(EfwRequest, efwResponse) && check_response(MulticastNopRequest, nopResponse);
+                }
+
+                if (!ok)
+                {
+                    logger->error("write_pages_multicast(): flash response check failed for module 0x{:08x},"
+                                  " batch starting at 0x{:06x}, response={:#04x}",
+                                  moduleBases[mi], destAddr, fmt::join(flashResponse, ", "));
+                    moduleErrors[mi] = make_error_code(std::errc::protocol_error);
+
+                    if (auto ec = clear_output_fifo(mvlc, moduleBases[mi]))
+                    {
+                        logger->error("write_pages_multicast(): clear_output_fifo failed for module 0x{:08x}: {}",
+                                      moduleBases[mi], ec.message());
+                        moduleErrors[mi] = ec;
+                    }
+                }
+            }
+
+            for (const auto &page: batch)
+                destAddr += page.size();
+        }
+    }
+
+    return {};
+}
+
+std::error_code write_pages_batch(
+    MVLC &mvlc, u32 moduleBase,
+    const u32 firstPageAddress, u8 section,
+    const gsl::span<const gsl::span<const u8>> &pages)
+{
+    auto logger = mvlc::get_logger("mvlc_mvp_lib");
+
+    if (pages.empty())
+        return {};
+
+    for (const auto &page: pages)
+    {
+        if (page.empty())
+            throw std::invalid_argument("write_pages_batch: empty page data given");
+
+        if (page.size() > PageSize)
+            throw std::invalid_argument("write_pages_batch: page size > max page size");
+    }
+
+    size_t maxStackWords = 0;
+
+    if (auto ec = get_immediate_stack_max_words(mvlc, maxStackWords))
+        return ec;
+
+    const size_t pagesPerBatch = get_max_pages_per_stack(maxStackWords);
+    auto tStart = std::chrono::steady_clock::now();
+    u32 destAddr = firstPageAddress;
+    size_t pageIndex = 0;
+    size_t batches = 0;
+    size_t totalBytes = 0;
+
+    logger->debug("write_pages_batch(): maxStackWords={}, pagesPerBatch={}, pages={}",
+                  maxStackWords, pagesPerBatch, pages.size());
+
+    while (pageIndex < pages.size())
+    {
+        const size_t count = std::min(pagesPerBatch, pages.size() - pageIndex);
+        auto batch = pages.subspan(pageIndex, count);
+
+        if (auto ec = write_pages_single_batch(mvlc, moduleBase, destAddr, section, batch))
+            return ec;
+
+        for (const auto &page: batch)
+        {
+            destAddr += page.size();
+            totalBytes += page.size();
+        }
+
+        pageIndex += count;
+        ++batches;
     }
 
     auto tEnd = std::chrono::steady_clock::now();
     auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(tEnd - tStart);
-    logger->debug("write_pages(): took {} ms to write {} bytes of data",
-                 elapsed.count()/1000.0, page1.size() + page2.size());
+    logger->debug("write_pages_batch(): took {} ms to write {} bytes of data using {} stack transactions",
+                 elapsed.count()/1000.0, totalBytes, batches);
 
     return {};
 }
 
-std::error_code erase_section(
+std::error_code start_erase_section(
     MVLC &mvlc, u32 moduleBase, u8 index)
 {
     auto logger = mvlc::get_logger("mvlc_mvp_lib");
@@ -967,114 +1811,504 @@ std::error_code erase_section(
     if (auto ec = write_instruction(mvlc, moduleBase, instr))
         return ec;
 
-    if (auto ec = read_response(mvlc, moduleBase, response))
+    // Only the mirror is available immediately. The response code and status
+    // are posted once the erase is complete.
+    if (auto ec = read_response(mvlc, moduleBase, response, instr.size()))
         return ec;
 
     logger->debug("Response from erase instruction: {:02x}", fmt::join(response, ", "));
 
     if (instr != response)
     {
-        throw std::runtime_error(fmt::format(
-                "Unexpected response from erase command: {:02x}",
-                fmt::join(response, ", ")));
+        logger->error("start_erase_section(): unexpected response from erase command: {:02x}",
+                      fmt::join(response, ", "));
+        return make_error_code(std::errc::protocol_error);
     }
 
-    auto tStart = std::chrono::steady_clock::now();
-    u32 outputFifoValue = 0u;
-    u32 loops = 0u;
+    return {};
+}
 
-    logger->info("Waiting until erase is complete...");
+std::error_code poll_erase_section(
+    MVLC &mvlc, u32 moduleBase, bool &done)
+{
+    done = false;
 
-    // Poll until InvalidRead flag is set
-    logger->debug("Polling until InvalidRead is set");
-    do
-    {
-        if (auto ec = read_output_fifo(mvlc, moduleBase, outputFifoValue))
-            return ec;
+    // Single status register read: 0 means the output fifo is not empty, i.e.
+    // the flash interface has posted the final erase response.
+    u32 status = 0u;
+
+    if (auto ec = paced_vme_read(mvlc, moduleBase + StatusRegister, status, vme_amods::A32, VMEDataWidth::D16))
+        return ec;
+
+    if (status != 0)
+        return {};
+
+    // Read the response code and the status byte. The accu loop terminates
+    // immediately as the fifo is known to be non-empty at this point.
+    u32 stackRef = get_next_stack_reference();
+    StackCommandBuilder sb;
+    sb.addWriteMarker(stackRef);
+    sb.addReadToAccu(moduleBase + StatusRegister, vme_amods::A32, VMEDataWidth::D16);
+    sb.addCompareLoopAccu(AccuComparator::EQ, 0);
+    sb.addSetAccu(2);
+    sb.addVMERead(moduleBase + OutputFifoRegister, vme_amods::A32, VMEDataWidth::D16);
+
+    std::vector<u32> stackOutput;
+
+    if (auto ec = paced_stack_transaction(mvlc, sb, stackOutput))
+        return ec;
+
+    if (stackOutput.size() < 2)
+        return make_error_code(MVLCErrorCode::UnexpectedResponseSize);
+
+    if (auto ec = get_stack_frame_error(stackOutput[0]))
+        return ec;
 
-        ++loops;
-    } while (!(outputFifoValue & output_fifo_flags::InvalidRead));
+    if (stackOutput[1] != stackRef)
+        return MVLCErrorCode::StackReferenceMismatch;
 
-    logger->debug("Done polling until InvalidRead is set, loops={}", loops);
-    loops = 0u;
+    std::vector<u32> dataWords;
 
-    // Now poll until InvalidRead is not set anymore
-    logger->debug("Polling until InvalidRead is cleared");
-    do
+    for (size_t i=2; i<stackOutput.size(); ++i)
     {
-        if (auto ec = read_output_fifo(mvlc, moduleBase, outputFifoValue))
-            return ec;
+        u32 word = stackOutput[i];
+
+        if (is_stack_buffer(word) || is_stack_buffer_continuation(word) || is_blockread_buffer(word))
+            continue;
 
-        ++loops;
-    } while (outputFifoValue & output_fifo_flags::InvalidRead);
+        dataWords.push_back(word);
+    }
 
-    logger->debug("Done polling until InvalidRead is cleared, loops={}", loops);
-    loops = 0u;
+    if (dataWords.size() != 2)
+        return make_error_code(MVLCErrorCode::UnexpectedResponseSize);
 
-    // outputFifofValue should now contain the flash response code 0xff
-    if (outputFifoValue != 0xff)
+    // The first word should contain the flash response code 0xff
+    if (dataWords[0] != 0xff)
         throw std::runtime_error(fmt::format(
-                "Invalid flash response code 0x{:02x}, expected 0xff", outputFifoValue));
+                "Invalid flash response code 0x{:02x}, expected 0xff", dataWords[0]));
+
+    if (!(dataWords[1] & FlashInstructionSuccess))
+        throw std::runtime_error(fmt::format("Flash instruction not successful, code = 0x{:02x}",
+                                             dataWords[1]));
+
+    done = true;
+    return {};
+}
 
-    // Read the flash response status
-    if (auto ec = mvlc.vmeRead(moduleBase + OutputFifoRegister, outputFifoValue,
-                               vme_amods::A32, VMEDataWidth::D16))
+std::error_code erase_section(
+    MVLC &mvlc, u32 moduleBase, u8 index)
+{
+    auto logger = mvlc::get_logger("mvlc_mvp_lib");
+
+    if (auto ec = start_erase_section(mvlc, moduleBase, index))
         return ec;
 
-    if (!(outputFifoValue & FlashInstructionSuccess))
-        throw std::runtime_error(fmt::format("Flash instruction not successful, code = 0x{:02x}",
-                                             outputFifoValue));
+    const auto tStart = std::chrono::steady_clock::now();
+    const auto timeout = std::chrono::milliseconds(constants::erase_timeout_ms);
+    auto pollInterval = EraseMinPollInterval;
+    u32 polls = 0u;
+
+    logger->info("Waiting until erase is complete...");
+
+    while (true)
+    {
+        bool done = false;
+
+        if (auto ec = poll_erase_section(mvlc, moduleBase, done))
+            return ec;
+
+        ++polls;
+
+        if (done)
+            break;
+
+        auto elapsed = std::chrono::steady_clock::now() - tStart;
+
+        if (elapsed >= timeout)
+        {
+            logger->error("erase_section(0x{:08x}, {}): timeout after {} polls", moduleBase, index, polls);
+            return make_error_code(std::errc::timed_out);
+        }
+
+        std::this_thread::sleep_for(pollInterval);
+        pollInterval = std::min(pollInterval * 2, EraseMaxPollInterval);
+    }
 
     auto tEnd = std::chrono::steady_clock::now();
     auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(tEnd - tStart);
 
-    logger->info("Flash response status ok, erasing took {} ms", elapsed.count());
+    logger->info("Flash response status ok, erasing took {} ms, polls={}", elapsed.count(), polls);
 
     return {};
 }
 
-std::error_code read_flash_memory(
-    MVLC &mvlc,
-    u32 vmeAddress,
-    unsigned area,
-    u32 memAddress,
-    unsigned section,
-    size_t len,
-    std::vector<u8> &dest)
+void add_page_read_to_stack(
+    StackCommandBuilder &sb, u32 moduleBase,
+    u32 address, u8 section, unsigned bytesToRead)
 {
-    static const size_t ChunkSize = mesytec::mvp::constants::page_size;
+    if (bytesToRead == 0)
+        throw std::invalid_argument("add_page_read_to_stack: len == 0");
 
-    dest.reserve(len);
-    u32 addr = memAddress;
-    size_t remaining = len;
+    if (bytesToRead > PageSize)
+        throw std::invalid_argument("add_page_read_to_stack: len > page size");
 
-    if (auto ec = enable_flash_interface(mvlc, vmeAddress))
-        return ec;
+    // Note: the REF instruction does not mirror itself to the output fifo.
+    // Instead the page data starts immediately. The template contains the
+    // wait and the fake block read of the page data plus the InvalidRead
+    // terminator word.
+    PageStackTemplates::instance().appendReadPage(
+        sb, moduleBase, flash_address_from_byte_offset(address), section, bytesToRead);
+}
 
-    if (auto ec = set_verbose_mode(mvlc, vmeAddress, false))
-        return ec;
+std::error_code fill_pages_from_stack_output(
+    std::vector<u8> &dest, const std::vector<u32> &stackOutput, u32 stackRef,
+    const std::vector<unsigned> &pageSizes)
+{
+    auto logger = mvlc::get_logger("mvlc_mvp_lib");
+
+    if (stackOutput.size() < 2 || !is_stack_buffer(stackOutput[0]))
+        return make_error_code(MVLCErrorCode::UnexpectedResponseSize);
+
+    if (stackOutput[1] != stackRef)
+        return MVLCErrorCode::StackReferenceMismatch;
 
-    if (auto ec = set_area_index(mvlc, vmeAddress, area))
+    if (auto ec = get_stack_frame_error(stackOutput[0]))
         return ec;
 
-    while (remaining)
+    auto view = basic_string_view<u32>(stackOutput.data(), stackOutput.size());
+    auto pageIter = pageSizes.begin();
+    size_t pageBytes = 0;
+
+    while (!view.empty() && pageIter != pageSizes.end())
     {
-        auto rl = std::min(ChunkSize, remaining);
-        std::vector<u8> pageBuffer;
+        u32 word = view[0];
 
-        if (auto ec = read_page(mvlc, vmeAddress, flash_address_from_byte_offset(addr),
-            section, rl, pageBuffer))
+        if (is_stack_buffer(word))
         {
-            return ec;
+            if (auto ec = get_stack_frame_error(word))
+                return ec;
+            view.remove_prefix(2); // skip over the stack buffer header and the marker
+            continue;
+        }
+
+        if (is_stack_buffer_continuation(word) || is_blockread_buffer(word))
+        {
+            if (auto ec = get_stack_frame_error(word))
+                return ec;
+            view.remove_prefix(1); // skip over the header
+            continue;
         }
 
-        std::copy(std::begin(pageBuffer), std::end(pageBuffer), std::back_inserter(dest));
+        view.remove_prefix(1);
+
+        if (pageBytes < *pageIter)
+        {
+            if (word & output_fifo_flags::InvalidRead)
+            {
+                logger->warn("fill_pages_from_stack_output: short page read: wanted {} bytes, got {} bytes",
+                             *pageIter, pageBytes);
+                return make_error_code(std::errc::protocol_error);
+            }
+
+            dest.push_back(word & output_fifo_flags::DataMask);
+            ++pageBytes;
+        }
+        else
+        {
+            // This is the extra word read after the page data. It has to have
+            // the InvalidRead flag set, otherwise the flash interface returned
+            // more data than expected.
+            if (!(word & output_fifo_flags::InvalidRead))
+            {
+                logger->warn("fill_pages_from_stack_output: excess data after page: 0x{:08x}", word);
+                return make_error_code(std::errc::protocol_error);
+            }
+
+            ++pageIter;
+            pageBytes = 0;
+        }
+    }
+
+    if (pageIter != pageSizes.end())
+    {
+        logger->warn("fill_pages_from_stack_output: stack output ended after {} of {} pages",
+                     pageIter - pageSizes.begin(), pageSizes.size());
+        return make_error_code(MVLCErrorCode::UnexpectedResponseSize);
+    }
+
+    return {};
+}
+
+std::error_code read_pages_raw(
+    MVLC &mvlc, u32 moduleBase,
+    u32 startAddress, u8 section, size_t len, u32 stackRef,
+    std::vector<u32> &stackOutput, std::vector<unsigned> &pageSizes)
+{
+    auto logger = mvlc::get_logger("mvlc_mvp_lib");
+
+    StackCommandBuilder sb;
+    sb.addWriteMarker(stackRef);
+    pageSizes.clear();
+
+    u32 addr = startAddress;
+    size_t remaining = len;
+
+    while (remaining)
+    {
+        // Do not cross page boundaries with a single REF instruction.
+        const size_t pageRest = PageSize - (addr % PageSize);
+        const unsigned rl = std::min(remaining, pageRest);
+
+        add_page_read_to_stack(sb, moduleBase, addr, section, rl);
+        pageSizes.push_back(rl);
 
         remaining -= rl;
         addr += rl;
     }
 
+    if (auto ec = paced_stack_transaction(mvlc, sb, stackOutput))
+    {
+        logger->error("read_pages(): mvlc.stackTransaction: {}", ec.message());
+        return ec;
+    }
+
+    return {};
+}
+
+std::error_code read_pages(
+    MVLC &mvlc, u32 moduleBase,
+    u32 startAddress, u8 section, size_t len,
+    std::vector<u8> &dest)
+{
+    std::vector<u32> stackOutput;
+    std::vector<unsigned> pageSizes;
+    u32 stackRef = get_next_stack_reference();
+
+    if (auto ec = read_pages_raw(mvlc, moduleBase, startAddress, section, len, stackRef, stackOutput, pageSizes))
+        return ec;
+
+    return fill_pages_from_stack_output(dest, stackOutput, stackRef, pageSizes);
+}
+
+size_t get_max_read_pages_per_stack(size_t maxStackWords)
+{
+    StackCommandBuilder pageSb;
+    add_page_read_to_stack(pageSb, 0, 0, 0, PageSize);
+    const size_t pageWords = get_encoded_stack_size(pageSb);
+
+    StackCommandBuilder overheadSb;
+    overheadSb.addWriteMarker(0);
+    const size_t overheadWords = get_encoded_stack_size(overheadSb);
+
+    if (maxStackWords <= overheadWords + pageWords)
+        return 1;
+
+    return (maxStackWords - overheadWords) / pageWords;
+}
+
+namespace
+{
+    // Executes the read stacks of read_flash_memory_pipelined() on a single
+    // worker thread. At most one batch is in flight. The destructor waits for
+    // a running transaction to finish.
+    class PageBatchReader
+    {
+        public:
+            struct Batch
+            {
+                u32 address;
+                size_t len;
+                u32 stackRef;
+                std::vector<u32> stackOutput;
+                std::vector<unsigned> pageSizes;
+                std::error_code ec;
+            };
+
+            PageBatchReader(MVLC &mvlc, u32 moduleBase, u8 section)
+                : mvlc_(mvlc)
+                , moduleBase_(moduleBase)
+                , section_(section)
+                , worker_(&PageBatchReader::loop, this)
+            {
+            }
+
+            ~PageBatchReader()
+            {
+                {
+                    std::lock_guard<std::mutex> guard(mutex_);
+                    quit_ = true;
+                }
+
+                cv_.notify_all();
+                worker_.join();
+            }
+
+            void submit(Batch batch)
+            {
+                {
+                    std::lock_guard<std::mutex> guard(mutex_);
+                    request_ = std::move(batch);
+                    hasRequest_ = true;
+                    busy_ = true;
+                }
+
+                cv_.notify_all();
+            }
+
+            bool busy() const
+            {
+                std::lock_guard<std::mutex> guard(mutex_);
+                return busy_;
+            }
+
+            Batch wait()
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this] { return !busy_; });
+                return std::move(result_);
+            }
+
+        private:
+            void loop()
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+
+                while (true)
+                {
+                    cv_.wait(lock, [this] { return hasRequest_ || quit_; });
+
+                    if (!hasRequest_)
+                        return;
+
+                    auto batch = std::move(request_);
+                    hasRequest_ = false;
+                    lock.unlock();
+
+                    batch.ec = read_pages_raw(mvlc_, moduleBase_, batch.address, section_,
+                                              batch.len, batch.stackRef,
+                                              batch.stackOutput, batch.pageSizes);
+
+                    lock.lock();
+                    result_ = std::move(batch);
+                    busy_ = false;
+                    cv_.notify_all();
+                }
+            }
+
+            MVLC &mvlc_;
+            const u32 moduleBase_;
+            const u8 section_;
+            mutable std::mutex mutex_;
+            std::condition_variable cv_;
+            Batch request_ = {};
+            Batch result_ = {};
+            bool hasRequest_ = false;
+            bool busy_ = false;
+            bool quit_ = false;
+            std::thread worker_;
+    };
+}
+
+std::error_code read_flash_memory_pipelined(
+    MVLC &mvlc, u32 moduleBase,
+    u32 startAddress, u8 section, size_t len,
+    const PageBatchCallback &callback,
+    size_t pagesPerStack)
+{
+    if (!len)
+        return {};
+
+    if (!pagesPerStack)
+    {
+        size_t maxStackWords = 0;
+
+        if (auto ec = get_immediate_stack_max_words(mvlc, maxStackWords))
+            return ec;
+
+        pagesPerStack = get_max_read_pages_per_stack(maxStackWords);
+    }
+
+    const size_t maxBatchBytes = pagesPerStack * PageSize;
+    using Batch = PageBatchReader::Batch;
+
+    // Limits the batch so that it ends on a page boundary (except for the
+    // last batch).
+    auto make_batch = [&] (u32 address, size_t remaining)
+    {
+        Batch batch = {};
+        batch.address = address;
+        batch.len = std::min(remaining, maxBatchBytes - (address % PageSize));
+        batch.stackRef = get_next_stack_reference();
+        return batch;
+    };
+
+    u32 addr = startAddress;
+    size_t remaining = len;
+
+    // The reader destructor waits for a transaction still running in the
+    // background when returning early.
+    PageBatchReader reader(mvlc, moduleBase, section);
+    std::vector<u8> pageData;
+
+    auto current = make_batch(addr, remaining);
+    addr += current.len;
+    remaining -= current.len;
+    reader.submit(std::move(current));
+
+    while (reader.busy())
+    {
+        current = reader.wait();
+
+        if (current.ec)
+            return current.ec;
+
+        // Start the transaction for the next batch, then decode and process
+        // the current batch while the next one is on the wire.
+        if (remaining)
+        {
+            auto batch = make_batch(addr, remaining);
+            addr += batch.len;
+            remaining -= batch.len;
+            reader.submit(std::move(batch));
+        }
+
+        pageData.clear();
+
+        if (auto ec = fill_pages_from_stack_output(pageData, current.stackOutput,
+                                                   current.stackRef, current.pageSizes))
+            return ec;
+
+        if (!callback(current.address, pageData))
+            return {};
+    }
+
     return {};
 }
 
+std::error_code read_flash_memory(
+    MVLC &mvlc,
+    u32 vmeAddress,
+    unsigned area,
+    u32 memAddress,
+    unsigned section,
+    size_t len,
+    std::vector<u8> &dest)
+{
+    dest.reserve(dest.size() + len);
+
+    if (auto ec = enable_flash_interface(mvlc, vmeAddress))
+        return ec;
+
+    if (auto ec = setup_flash_session(mvlc, vmeAddress, area))
+        return ec;
+
+    auto append_batch = [&dest] (u32, const std::vector<u8> &data)
+    {
+        std::copy(std::begin(data), std::end(data), std::back_inserter(dest));
+        return true;
+    };
+
+    return read_flash_memory_pipelined(mvlc, vmeAddress, memAddress, section, len, append_batch);
+}
+
 }
@@ -2,6 +2,10 @@
 #define __MESYTEC_MVLC_MVP_LIB_H__
 
 #include <mesytec-mvlc/mesytec-mvlc.h>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
 #include <gsl/gsl-lite.hpp>
 #include <stdexcept>
 
@@ -12,6 +16,7 @@ using u8 = mvlc::u8;
 using u16 = mvlc::u16;
 using u32 = mvlc::u32;
 using MVLC = mvlc::MVLC;
+using StackCommandBuilder = mvlc::StackCommandBuilder;
 
 using FlashAddress = std::array<u8, 3>;
 
@@ -36,6 +41,76 @@ namespace output_fifo_flags
 
 static const u8 FlashInstructionSuccess = 0x01;
 
+// After writing to the MVP input FIFO some time needs to pass for the data to
+// be processed. Only then does the output FIFO contain valid data and status
+// flags. This constant is the number of cycles the command stack waits before
+// continuing. Value 1000 ^= 12.5 us.
+static const unsigned PostFifoWriteStackWaitCycles = 100000;
+
+// FIFO wait cycle calibration
+//
+// PostFifoWriteStackWaitCycles is a worst case value. The actual time needed by
+// the flash interface to start answering depends on the module type and
+// firmware revision. calibrate_fifo_wait_cycles() determines the minimal wait
+// value for a module using probe page reads. The result plus a safety margin
+// is stored in a process wide profile cache keyed by (hwId, fwId) and applied
+// to a module base address using apply_fifo_wait_profile(). The stack
+// building functions use get_fifo_wait_cycles() which falls back to
+// PostFifoWriteStackWaitCycles for modules without a profile.
+//
+// The per module wait values are process global and keyed by the module base
+// address only, not by the MVLC the module is connected to. Modules sharing a
+// base address on different crates share the value that was applied last.
+// MvlcMvpFlash reapplies the profile each time it enables the flash interface.
+//
+// Only the waits before reading a response use the calibrated value. Waits
+// following a WRF instruction cover the page program time and always use
+// PostFifoWriteStackWaitCycles.
+
+struct FifoWaitProfile
+{
+    u32 hwId = 0;
+    u32 fwId = 0;
+    unsigned minWaitCycles = 0; // minimal wait value passing all probe reads
+    unsigned waitCycles = PostFifoWriteStackWaitCycles; // value including the safety margin
+};
+
+// Multiplier and constant offset applied to the calibrated minimum.
+static const unsigned FifoWaitSafetyFactor = 2;
+static const unsigned FifoWaitSafetyOffset = 2000; // 25 us
+
+// Returns the wait cycles to use after writing to the input fifo of the
+// module at moduleBase.
+unsigned get_fifo_wait_cycles(u32 moduleBase);
+
+// Sets the wait cycles to use for the module at moduleBase. A value of 0 resets
+// the module to PostFifoWriteStackWaitCycles.
+void set_fifo_wait_cycles(u32 moduleBase, unsigned waitCycles);
+
+// Profile cache access.
+bool lookup_fifo_wait_profile(u32 hwId, u32 fwId, FifoWaitProfile &dest);
+void store_fifo_wait_profile(const FifoWaitProfile &profile);
+void clear_fifo_wait_profiles();
+
+// Determines the minimal wait cycles for the module at moduleBase by doing
+// probe reads of a full page from the OTP section with decreasing wait
+// values (binary search). The flash interface must be enabled and verbose
+// mode must be off. The wait value of the module is not modified.
+std::error_code calibrate_fifo_wait_cycles(
+    MVLC &mvlc, u32 moduleBase, u32 hwId, u32 fwId, FifoWaitProfile &dest);
+
+// Looks up the profile for (hwId, fwId) and applies it to moduleBase. If no
+// profile exists and calibrateIfMissing is true a calibration is run and
+// the result is stored in the cache. On calibration failure the module falls
+// back to PostFifoWriteStackWaitCycles.
+std::error_code apply_fifo_wait_profile(
+    MVLC &mvlc, u32 moduleBase, u32 hwId, u32 fwId, bool calibrateIfMissing = true);
+
+// The EFW instruction including the access code. The flash interface mirrors
+// the instruction followed by 0xff and the status byte.
+inline const std::vector<u8> EfwRequest = { 0x80, 0xCD, 0xAB };
+static const unsigned EfwResponseSize = 5;
+
 namespace status_register_flags
 {
     static const u32 FlashOutputFifoEmpty = 1u << 0;
@@ -72,6 +147,14 @@ inline FlashAddress flash_address_from_byte_offset(u32 byteOffset)
     return addr;
 }
 
+// Returns a new marker value for use with StackCommandBuilder::addWriteMarker().
+// The marker is used to match stack responses to the stacks that produced them.
+u32 get_next_stack_reference();
+
+// Maps the error flags of a stack frame header to an error code. Returns an
+// empty error_code if no error flags are set.
+std::error_code get_stack_frame_error(u32 frameHeader);
+
 std::error_code enable_flash_interface(MVLC &mvlc, u32 moduleBase);
 std::error_code disable_flash_interface(MVLC &mvlc, u32 moduleBase);
 std::error_code read_output_fifo(MVLC &mvlc, u32 moduleBase, unsigned bytesToRead, std::vector<u32> &dest);
@@ -80,12 +163,80 @@ std::error_code set_area_index(MVLC &mvlc, u32 moduleBase, unsigned areaIndex);
 std::error_code enable_flash_write(MVLC &mvlc, u32 moduleBase);
 std::error_code set_verbose_mode(MVLC &mvlc, u32 moduleBase, bool verbose);
 
+// Writes the instruction bytes to the input fifo using a single stack
+// transaction. The response is not read.
 std::error_code write_instruction(MVLC &mvlc, u32 moduleBase, const std::vector<u8> &instruction);
 std::error_code write_instruction(MVLC &mvlc, u32 moduleBase, const gsl::span<unsigned char> instruction);
-std::error_code read_response(MVLC &mvlc, u32 moduleBase, std::vector<u8> &dest);
+
+// Reads a flash response into dest. If expectedLen is non-zero a single stack
+// transaction doing a fake block read of expectedLen + 1 words is used. The
+// additional word is expected to be the InvalidRead terminator. If the
+// terminator is missing the remaining data is drained using single reads.
+// With expectedLen == 0 the output fifo is drained using single reads until
+// InvalidRead is set.
+std::error_code read_response(MVLC &mvlc, u32 moduleBase, std::vector<u8> &dest,
+                              size_t expectedLen = 0);
+
+// Stack based fake block read of wordsToRead words from the output fifo.
+// Frame header words are removed, the raw output fifo words including the
+// flag bits are appended to dest.
+std::error_code block_read_output_fifo(
+    MVLC &mvlc, u32 moduleBase, unsigned wordsToRead, std::vector<u32> &dest);
+
+// Number of output fifo words read per stack by clear_output_fifo(). Larger
+// values need fewer stack transactions for a full fifo but every transaction
+// reads this many words even if the fifo is almost empty.
+static const unsigned ClearOutputFifoBlockWords = 64;
+
+// Checks the flash response to the given request: the response has to start
+// with the mirrored request followed by 0xff and a status byte with the
+// success bit set. Known single byte deviations of some modules are
+// tolerated.
 bool check_response(const std::vector<u8> &request,
                     const std::vector<u8> &response);
 
+// Returns the size of the flash response to the given control instruction:
+// instruction mirror + 0xff + status byte plus any data bytes returned by the
+// instruction (RAI, RDI).
+size_t get_expected_response_size(const std::vector<u8> &instruction);
+
+// Appends a complete control command to the stack: the instruction bytes are
+// written to the input fifo, then the status register is polled until the
+// output fifo is not empty and get_expected_response_size() + 2 words are
+// read from the output fifo. The two additional words leave room for the
+// single byte deviations handled by check_response(); reads beyond the end of
+// the response return InvalidRead words.
+// Note: BFP does not produce a response if the FPGA reboots immediately. Do
+// not use it with this function.
+void add_command_to_stack(
+    StackCommandBuilder &sb, u32 moduleBase, const std::vector<u8> &instruction);
+
+// Runs a single control command (NOP, SAI, RAI, VEB, EFW, RDI) using one
+// stack transaction and validates the response with check_response().
+std::error_code command_transaction(
+    MVLC &mvlc, u32 moduleBase,
+    const std::vector<u8> &instruction,
+    std::vector<u8> &responseBuffer);
+
+// Chains multiple control commands into a single stack transaction, e.g.
+// { VEB off, SAI area, EFW }. The commands are executed in order. responses
+// receives one response per command. Each response is validated using
+// check_response(); on failure the output fifo is cleared and
+// std::errc::protocol_error is returned. Note that EFW is cleared by any
+// following instruction, so it should be the last command of a chain.
+// BFP is not supported and throws std::invalid_argument: the module reboots
+// without posting a response, so the status poll of the stack would never
+// terminate. Use write_instruction() for BFP.
+std::error_code command_transactions(
+    MVLC &mvlc, u32 moduleBase,
+    const std::vector<std::vector<u8>> &instructions,
+    std::vector<std::vector<u8>> &responses);
+
+// Session setup using a single chained transaction: verbose mode off, set the
+// area index and optionally enable flash write.
+std::error_code setup_flash_session(
+    MVLC &mvlc, u32 moduleBase, unsigned area, bool enableWrite = false);
+
 // Note: bytesToRead=0 is used to read a full page of 256 bytes.
 // Note: bytesToRead <= 256, the value 0 is the same as 256 (full page)
 std::error_code read_page(
@@ -129,20 +280,141 @@ std::error_code write_page4(
     const FlashAddress &addr, u8 section,
     const std::vector<u8> &pageBuffer);
 
-// Improved/extra complicated version of write_page4() allowing to write up to
-// two full pages per stack transaction.
+// Writes up to two consecutive pages. Wrapper around write_pages_batch().
 std::error_code write_pages(
     MVLC &mvlc, u32 moduleBase,
     const u32 firstPageAddress, u8 section,
     const gsl::span<u8> &page1,
     const gsl::span<u8> &page2 = {});
 
+// Writes an arbitrary number of consecutive pages starting at
+// firstPageAddress. The pages are split into batches, each batch fitting into
+// the stack memory available for immediate stack transactions. Each batch is
+// written using a single stack transaction containing one EFW instruction,
+// the WRF instructions for all pages of the batch and a trailing NOP used as a
+// sync point. Verbose mode must be disabled.
+std::error_code write_pages_batch(
+    MVLC &mvlc, u32 moduleBase,
+    const u32 firstPageAddress, u8 section,
+    const gsl::span<const gsl::span<const u8>> &pages);
+
+// Determines the number of stack memory words usable by stackTransaction()
+// by reading the readout stack offsets from the MVLC.
+std::error_code get_immediate_stack_max_words(MVLC &mvlc, size_t &maxWords);
+
+// Returns the encoded size in words of a single D16 VME write stack command.
+size_t get_encoded_vme_write_size();
+
+// Returns the number of full page writes fitting into a single batch write
+// stack of the given maximum size. Always returns at least 1.
+size_t get_max_pages_per_stack(size_t maxStackWords);
+
+// Appends WRF + page data + a wait command to the stack builder. EFW must be
+// enabled prior to executing the stack. If waitForProgram is false the
+// trailing wait is omitted and the caller is responsible for waiting for the
+// page to be programmed.
+void add_page_write_to_stack(
+    StackCommandBuilder &sb, u32 moduleBase,
+    u32 pageAddress, u8 section,
+    const gsl::span<const u8> &page,
+    bool waitForProgram = true);
+
+// Multicast write: writes the same pages to multiple modules.
+//
+// A single stack contains the EFW instruction for each module, then for each
+// page the WRF sequences for all modules followed by a single wait, so the
+// modules program their pages in parallel. At the end the EFW mirror and the
+// response to a trailing NOP are read back from each module in turn. Modules
+// are split into groups and pages into batches so that each stack fits into
+// the immediate stack memory.
+//
+// moduleErrors receives one entry per module base (same order). Modules with
+// a flash level error are excluded from the following batches. The returned
+// error code is set on transport level errors only.
+std::error_code write_pages_multicast(
+    MVLC &mvlc, const std::vector<u32> &moduleBases,
+    const u32 firstPageAddress, u8 section,
+    const gsl::span<const gsl::span<const u8>> &pages,
+    std::vector<std::error_code> &moduleErrors);
+
+// Erases the given flash section and waits for the erase to complete. The
+// erase state is polled using short stack transactions with an adaptive host
+// side backoff between them so that the VME bus stays usable for other
+// traffic. Returns std::errc::timed_out if the erase does not complete within
+// constants::erase_timeout_ms.
 std::error_code erase_section(
     MVLC &mvlc, u32 moduleBase, u8 index);
 
-void fill_page_buffer_from_stack_output(
-    std::vector<u8> &pageBuffer, const std::vector<u32> stackOutput, u32 stackRef);
+// Split erase interface used by erase_section(). start_erase_section() sends
+// EFW + ERF and checks the mirrored ERF response, an unexpected mirror is
+// reported as std::errc::protocol_error. poll_erase_section() runs a single
+// poll stack and sets done to true once the final flash response has been
+// read and checked. Flash level errors in the final response are reported via
+// exceptions, same as erase_section().
+std::error_code start_erase_section(
+    MVLC &mvlc, u32 moduleBase, u8 index);
+
+std::error_code poll_erase_section(
+    MVLC &mvlc, u32 moduleBase, bool &done);
 
+// Host side delay between erase poll stacks. Starts at the minimum and is
+// doubled after each unsuccessful poll up to the maximum.
+static const std::chrono::milliseconds EraseMinPollInterval(10);
+static const std::chrono::milliseconds EraseMaxPollInterval(200);
+
+// Returns the frame error of the stack output, if any. pageBuffer contains
+// the data decoded up to the error.
+std::error_code fill_page_buffer_from_stack_output(
+    std::vector<u8> &pageBuffer, const std::vector<u32> &stackOutput, u32 stackRef);
+
+// Appends REF + wait + fake block read of bytesToRead + 1 words to the stack.
+// The extra word read is the InvalidRead terminator following the page data.
+void add_page_read_to_stack(
+    StackCommandBuilder &sb, u32 moduleBase,
+    u32 address, u8 section, unsigned bytesToRead);
+
+// Decodes the output of a stack built by add_page_read_to_stack() calls.
+// pageSizes contains the number of bytes read by each of the REF instructions.
+// The page data is appended to dest. Returns an error if the page data is
+// short, a terminator word is missing or the stack frame has error flags set.
+std::error_code fill_pages_from_stack_output(
+    std::vector<u8> &dest, const std::vector<u32> &stackOutput, u32 stackRef,
+    const std::vector<unsigned> &pageSizes);
+
+// Reads len bytes starting at startAddress using a single stack transaction.
+// One REF instruction is issued for each (partial) page. len should be limited
+// so that the stack fits into the immediate stack memory.
+std::error_code read_pages(
+    MVLC &mvlc, u32 moduleBase,
+    u32 startAddress, u8 section, size_t len,
+    std::vector<u8> &dest);
+
+// Executes the read stack and stores the raw stack output. The data can be
+// decoded using fill_pages_from_stack_output().
+std::error_code read_pages_raw(
+    MVLC &mvlc, u32 moduleBase,
+    u32 startAddress, u8 section, size_t len, u32 stackRef,
+    std::vector<u32> &stackOutput, std::vector<unsigned> &pageSizes);
+
+// Called with the start address and the data of each batch read by
+// read_flash_memory_pipelined(). Return false to stop reading.
+using PageBatchCallback = std::function<bool (u32 address, const std::vector<u8> &data)>;
+
+// Returns the number of full page reads fitting into a single read stack of
+// the given maximum size. Always returns at least 1.
+size_t get_max_read_pages_per_stack(size_t maxStackWords);
+
+// Reads len bytes of flash memory in batches of pagesPerStack pages. If
+// pagesPerStack is 0 the batch size is determined from
+// get_immediate_stack_max_words(). The transaction for batch N+1 is started
+// on a worker thread before batch N is decoded and passed to the callback, so
+// host side processing overlaps with the next transaction. Verbose mode must
+// be disabled.
+std::error_code read_flash_memory_pipelined(
+    MVLC &mvlc, u32 moduleBase,
+    u32 startAddress, u8 section, size_t len,
+    const PageBatchCallback &callback,
+    size_t pagesPerStack = 0);
 
 std::error_code read_flash_memory(
     MVLC &mvlc,
@@ -0,0 +1,515 @@
+#include "mvlc_mvp_scheduler.h"
+
+#include <algorithm>
+#include <thread>
+#include <flash_constants.h>
+#include <instruction_interpreter.h>
+
+namespace mesytec::mvp
+{
+
+using namespace mesytec::mvlc;
+
+namespace
+{
+    FlashPartTask make_task(const FirmwarePartPtr &pp)
+    {
+        FlashPartTask task;
+        task.name = pp->get_filename().toStdString();
+        task.section = *pp->get_section();
+
+        if (pp->has_area())
+            task.area = *pp->get_area();
+
+        QVector<uchar> mem;
+
+        if (is_binary_part(pp))
+            mem = pp->get_contents();
+        else if (is_instruction_part(pp))
+            mem = generate_memory(std::dynamic_pointer_cast<InstructionFirmwarePart>(pp)->get_instructions());
+
+        task.data.assign(std::begin(mem), std::end(mem));
+        return task;
+    }
+
+    bool same_parts(const std::vector<FlashPartTask> &a, const std::vector<FlashPartTask> &b)
+    {
+        return std::equal(std::begin(a), std::end(a), std::begin(b), std::end(b),
+                          [] (const FlashPartTask &pa, const FlashPartTask &pb)
+                          {
+                              return (pa.section == pb.section
+                                      && pa.area == pb.area
+                                      && pa.data == pb.data);
+                          });
+    }
+}
+
+std::vector<FlashPartTask> make_flash_part_tasks(const FirmwareArchive &firmware)
+{
+    std::vector<FlashPartTask> result;
+
+    auto add_parts = [&result] (const FirmwarePartList &parts)
+    {
+        for (const auto &pp: parts)
+        {
+            if (!pp->has_section() || is_key_part(pp))
+                continue;
+
+            result.emplace_back(make_task(pp));
+        }
+    };
+
+    add_parts(firmware.get_non_area_specific_parts());
+    add_parts(firmware.get_area_specific_parts());
+
+    return result;
+}
+
+const char *to_string(MultiModuleFlashScheduler::State state)
+{
+    using State = MultiModuleFlashScheduler::State;
+
+    switch (state)
+    {
+        case State::Init:           return "Init";
+        case State::SelectArea:     return "SelectArea";
+        case State::EraseStart:     return "EraseStart";
+        case State::EraseWait:      return "EraseWait";
+        case State::Program:        return "Program";
+        case State::Verify:         return "Verify";
+        case State::NextPart:       return "NextPart";
+        case State::RestoreArea:    return "RestoreArea";
+        case State::Done:           return "Done";
+        case State::Failed:         return "Failed";
+    }
+
+    return "unknown";
+}
+
+MultiModuleFlashScheduler::MultiModuleFlashScheduler(MVLC &mvlc)
+    : mvlc_(mvlc)
+{
+}
+
+void MultiModuleFlashScheduler::addJob(const FlashJob &job)
+{
+    if (!modules_.empty() && !same_parts(modules_.front().job.parts, job.parts))
+        sameParts_ = false;
+
+    Module m;
+    m.job = job;
+    m.status.vmeAddress = job.vmeAddress;
+    m.status.partCount = job.parts.size();
+    modules_.emplace_back(std::move(m));
+}
+
+bool MultiModuleFlashScheduler::isFinished(const Module &m) const
+{
+    return m.status.state == State::Done || m.status.state == State::Failed;
+}
+
+bool MultiModuleFlashScheduler::isReady(const Module &m, const Clock::time_point &now) const
+{
+    if (isFinished(m))
+        return false;
+
+    if (m.status.state == State::EraseWait)
+        return now >= m.nextPoll;
+
+    // Waiting for the other modules to reach the multicast write.
+    if (m.status.state == State::Program && isMulticastActive())
+        return false;
+
+    return true;
+}
+
+bool MultiModuleFlashScheduler::isMulticastActive() const
+{
+    return useMulticast_ && sameParts_;
+}
+
+bool MultiModuleFlashScheduler::isMulticastReady() const
+{
+    if (!isMulticastActive())
+        return false;
+
+    const Module *first = nullptr;
+
+    for (const auto &m: modules_)
+    {
+        if (isFinished(m))
+            continue;
+
+        if (m.status.state != State::Program)
+            return false;
+
+        if (first && m.status.partIndex != first->status.partIndex)
+            return false;
+
+        if (!first)
+            first = &m;
+    }
+
+    return first != nullptr;
+}
+
+bool MultiModuleFlashScheduler::run()
+{
+    while (runOnce()) ;
+
+    return std::all_of(std::begin(modules_), std::end(modules_),
+                       [] (const Module &m) { return m.status.state == State::Done; });
+}
+
+bool MultiModuleFlashScheduler::runOnce()
+{
+    if (std::all_of(std::begin(modules_), std::end(modules_),
+                    [this] (const Module &m) { return isFinished(m); }))
+    {
+        return false;
+    }
+
+    if (isMulticastReady())
+    {
+        stepMulticastProgram();
+        return true;
+    }
+
+    const auto now = Clock::now();
+
+    // Round-robin: pick the next ready module starting at nextModule_.
+    for (size_t i=0; i<modules_.size(); ++i)
+    {
+        size_t idx = (nextModule_ + i) % modules_.size();
+        auto &m = modules_[idx];
+
+        if (!isReady(m, now))
+            continue;
+
+        nextModule_ = (idx + 1) % modules_.size();
+
+        try
+        {
+            if (auto ec = step(m))
+                fail(m, ec.message());
+        }
+        catch (const std::exception &e)
+        {
+            fail(m, e.what());
+        }
+
+        ++m.status.steps;
+
+        if (progressCallback_)
+            progressCallback_(m.status);
+
+        return true;
+    }
+
+    // All active modules are waiting for an erase to complete.
+    auto nextPoll = Clock::time_point::max();
+
+    for (const auto &m: modules_)
+    {
+        if (m.status.state == State::EraseWait)
+            nextPoll = std::min(nextPoll, m.nextPoll);
+    }
+
+    // Without an erase in progress there is no deadline to wait for.
+    if (nextPoll != Clock::time_point::max() && nextPoll > now)
+        std::this_thread::sleep_until(nextPoll);
+
+    return true;
+}
+
+void MultiModuleFlashScheduler::fail(Module &m, const std::string &error)
+{
+    auto logger = mvlc::get_logger("mvlc_mvp_lib");
+    logger->error("MultiModuleFlashScheduler: module 0x{:08x} failed in state {}: {}",
+                  m.job.vmeAddress, to_string(m.status.state), error);
+
+    m.status.state = State::Failed;
+    m.status.error = error;
+
+    // Try to leave the module in a usable state. Errors are ignored as the
+    // module is already marked as failed.
+    clear_output_fifo(mvlc_, m.job.vmeAddress);
+    disable_flash_interface(mvlc_, m.job.vmeAddress);
+}
+
+std::error_code MultiModuleFlashScheduler::step(Module &m)
+{
+    const u32 moduleBase = m.job.vmeAddress;
+    auto &status = m.status;
+
+    switch (status.state)
+    {
+        case State::Init:
+            {
+                if (!maxPagesPerStack_)
+                {
+                    size_t maxStackWords = 0;
+
+                    if (auto ec = get_immediate_stack_max_words(mvlc_, maxStackWords))
+                        return ec;
+
+                    maxPagesPerStack_ = get_max_pages_per_stack(maxStackWords);
+                    maxReadPagesPerStack_ = get_max_read_pages_per_stack(maxStackWords);
+                }
+
+                if (auto ec = enable_flash_interface(mvlc_, moduleBase))
+                    return ec;
+
+                if (auto ec = clear_output_fifo(mvlc_, moduleBase))
+                    return ec;
+
+                if (auto ec = set_verbose_mode(mvlc_, moduleBase, false))
+                    return ec;
+
+                // RAI: response is { 0x30, area, 0xff, status }
+                std::vector<u8> response;
+
+                if (auto ec = command_transaction(mvlc_, moduleBase, { opcodes::RAI }, response))
+                    return ec;
+
+                m.selectedArea = response.size() > 1 ? response[1] : 0;
+                status.partIndex = 0;
+                status.state = m.job.parts.empty() ? State::RestoreArea : State::SelectArea;
+            } break;
+
+        case State::SelectArea:
+            {
+                const auto &part = m.job.parts[status.partIndex];
+                unsigned area = part.area >= 0 ? part.area : m.selectedArea;
+
+                if (auto ec = set_area_index(mvlc_, moduleBase, area))
+                    return ec;
+
+                status.bytesDone = 0;
+                status.bytesTotal = part.data.size();
+
+                if (doErase_ && part.section != constants::otp_section)
+                    status.state = State::EraseStart;
+                else
+                    status.state = State::Program;
+            } break;
+
+        case State::EraseStart:
+            {
+                const auto &part = m.job.parts[status.partIndex];
+
+                if (auto ec = start_erase_section(mvlc_, moduleBase, part.section))
+                    return ec;
+
+                m.eraseStart = Clock::now();
+                m.pollInterval = EraseMinPollInterval;
+                m.nextPoll = m.eraseStart + m.pollInterval;
+                status.state = State::EraseWait;
+            } break;
+
+        case State::EraseWait:
+            {
+                bool done = false;
+
+                if (auto ec = poll_erase_section(mvlc_, moduleBase, done))
+                    return ec;
+
+                if (done)
+                {
+                    status.state = State::Program;
+                    break;
+                }
+
+                if (Clock::now() - m.eraseStart >= std::chrono::milliseconds(constants::erase_timeout_ms))
+                    return make_error_code(std::errc::timed_out);
+
+                m.pollInterval = std::min(m.pollInterval * 2, EraseMaxPollInterval);
+                m.nextPoll = Clock::now() + m.pollInterval;
+            } break;
+
+        case State::Program:
+            return stepProgram(m, m.job.parts[status.partIndex]);
+
+        case State::Verify:
+            return stepVerify(m, m.job.parts[status.partIndex]);
+
+        case State::NextPart:
+            {
+                if (++status.partIndex < m.job.parts.size())
+                    status.state = State::SelectArea;
+                else
+                    status.state = State::RestoreArea;
+            } break;
+
+        case State::RestoreArea:
+            {
+                if (auto ec = set_area_index(mvlc_, moduleBase, m.selectedArea))
+                    return ec;
+
+                if (auto ec = disable_flash_interface(mvlc_, moduleBase))
+                    return ec;
+
+                status.state = State::Done;
+            } break;
+
+        case State::Done:
+        case State::Failed:
+            break;
+    }
+
+    return {};
+}
+
+std::error_code MultiModuleFlashScheduler::stepProgram(Module &m, const FlashPartTask &part)
+{
+    auto &status = m.status;
+    const size_t offset = status.bytesDone;
+
+    if (offset >= part.data.size())
+    {
+        status.bytesDone = 0;
+        status.state = (doVerify_ && !part.data.empty()) ? State::Verify : State::NextPart;
+        return {};
+    }
+
+    // One write stack per step.
+    std::vector<gsl::span<const u8>> pages;
+    size_t pos = offset;
+
+    while (pos < part.data.size() && pages.size() < maxPagesPerStack_)
+    {
+        size_t len = std::min(PageSize, part.data.size() - pos);
+        pages.emplace_back(part.data.data() + pos, len);
+        pos += len;
+    }
+
+    if (auto ec = write_pages_batch(mvlc_, m.job.vmeAddress, offset, part.section, pages))
+        return ec;
+
+    status.bytesDone = pos;
+
+    return {};
+}
+
+void MultiModuleFlashScheduler::stepMulticastProgram()
+{
+    std::vector<Module *> group;
+
+    for (auto &m: modules_)
+    {
+        if (!isFinished(m))
+            group.push_back(&m);
+    }
+
+    // All modules of the group are at the same part and offset.
+    const auto &part = group.front()->job.parts[group.front()->status.partIndex];
+    const size_t offset = group.front()->status.bytesDone;
+
+    auto report = [this] (Module &m)
+    {
+        ++m.status.steps;
+
+        if (progressCallback_)
+            progressCallback_(m.status);
+    };
+
+    if (offset >= part.data.size())
+    {
+        for (auto m: group)
+        {
+            m->status.bytesDone = 0;
+            m->status.state = part.data.empty() ? State::NextPart : State::Verify;
+            report(*m);
+        }
+
+        return;
+    }
+
+    // One multicast write per step.
+    std::vector<gsl::span<const u8>> pages;
+    size_t pos = offset;
+
+    while (pos < part.data.size() && pages.size() < maxPagesPerStack_)
+    {
+        size_t len = std::min(PageSize, part.data.size() - pos);
+        pages.emplace_back(part.data.data() + pos, len);
+        pos += len;
+    }
+
+    std::vector<u32> moduleBases;
+
+    for (auto m: group)
+        moduleBases.push_back(m->job.vmeAddress);
+
+    std::vector<std::error_code> moduleErrors;
+    std::string groupError;
+
+    try
+    {
+        if (auto ec = write_pages_multicast(mvlc_, moduleBases, offset, part.section, pages, moduleErrors))
+            groupError = ec.message();
+    }
+    catch (const std::exception &e)
+    {
+        groupError = e.what();
+    }
+
+    for (size_t i=0; i<group.size(); ++i)
+    {
+        auto &m = *group[i];
+
+        if (!groupError.empty())
+            fail(m, groupError);
+        else if (i < moduleErrors.size() && moduleErrors[i])
+            fail(m, moduleErrors[i].message());
+        else
+            m.status.bytesDone = pos;
+
+        report(m);
+    }
+}
+
+std::error_code MultiModuleFlashScheduler::stepVerify(Module &m, const FlashPartTask &part)
+{
+    auto &status = m.status;
+    const size_t offset = status.bytesDone;
+
+    if (offset >= part.data.size())
+    {
+        status.state = State::NextPart;
+        return {};
+    }
+
+    // One read stack per step.
+    const size_t len = std::min(maxReadPagesPerStack_ * PageSize, part.data.size() - offset);
+    std::vector<u8> readBuffer;
+
+    if (auto ec = read_pages(mvlc_, m.job.vmeAddress, offset, part.section, len, readBuffer))
+        return ec;
+
+    if (readBuffer.size() != len
+        || !std::equal(std::begin(readBuffer), std::end(readBuffer), part.data.begin() + offset))
+    {
+        auto logger = mvlc::get_logger("mvlc_mvp_lib");
+        logger->error("MultiModuleFlashScheduler: module 0x{:08x}: verification of part {} failed"
+                      " in range [0x{:06x}, 0x{:06x})",
+                      m.job.vmeAddress, part.name, offset, offset + len);
+        return make_error_code(std::errc::io_error);
+    }
+
+    status.bytesDone = offset + len;
+
+    return {};
+}
+
+std::vector<MultiModuleFlashScheduler::ModuleStatus> MultiModuleFlashScheduler::getStatus() const
+{
+    std::vector<ModuleStatus> result;
+
+    for (const auto &m: modules_)
+        result.push_back(m.status);
+
+    return result;
+}
+
+}
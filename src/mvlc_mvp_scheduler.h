@@ -0,0 +1,145 @@
+#ifndef __MESYTEC_MVLC_MVP_SCHEDULER_H__
+#define __MESYTEC_MVLC_MVP_SCHEDULER_H__
+
+#include <firmware.h>
+#include "mvlc_mvp_lib.h"
+
+namespace mesytec::mvp
+{
+
+// A single firmware part prepared for writing: target section, optional area
+// and the memory contents starting at flash address 0.
+struct FlashPartTask
+{
+    std::string name;
+    u8 section = 0;
+    int area = -1; // -1: use the area index selected on the module
+    std::vector<u8> data;
+};
+
+// Converts the parts of a firmware archive into write tasks. Non area-specific
+// parts come first, same as in FirmwareWriter::write(). Key parts are skipped,
+// instruction parts are converted to memory contents using generate_memory().
+std::vector<FlashPartTask> make_flash_part_tasks(const FirmwareArchive &firmware);
+
+struct FlashJob
+{
+    u32 vmeAddress = 0;
+    std::vector<FlashPartTask> parts;
+};
+
+// Writes firmware to multiple modules connected to the same MVLC.
+//
+// Each module is driven by a small state machine. run() visits the modules in
+// round-robin order and executes a single step per visit: one erase poll, one
+// page write stack or one page read stack. A module waiting for an erase to
+// complete is skipped until its next poll time, so the erase time of one
+// module overlaps programming and verification of the others. If all active
+// modules are waiting the host sleeps until the earliest poll time.
+//
+// Errors are isolated per module: a failing module is marked as failed, its
+// flash interface is disabled and the remaining modules continue.
+//
+// Multicast mode: if enabled and all jobs contain the same parts, the modules
+// wait in the Program state until all remaining modules reached it for the
+// same part. The part is then written to all of them at once using
+// write_pages_multicast(), one write stack per step. Each module is verified
+// separately afterwards, regardless of setDoVerify(), as the multicast stack
+// only checks the final flash responses. A transport error fails all modules
+// of the multicast group.
+class MultiModuleFlashScheduler
+{
+    public:
+        enum class State
+        {
+            Init,
+            SelectArea,
+            EraseStart,
+            EraseWait,
+            Program,
+            Verify,
+            NextPart,
+            RestoreArea,
+            Done,
+            Failed,
+        };
+
+        struct ModuleStatus
+        {
+            u32 vmeAddress = 0;
+            State state = State::Init;
+            size_t partIndex = 0;
+            size_t partCount = 0;
+            size_t bytesDone = 0;   // bytes written/verified of the current part
+            size_t bytesTotal = 0;  // size of the current part
+            size_t steps = 0;       // number of steps executed for this module
+            std::string error;
+        };
+
+        using ProgressCallback = std::function<void (const ModuleStatus &status)>;
+
+        explicit MultiModuleFlashScheduler(MVLC &mvlc);
+
+        void addJob(const FlashJob &job);
+
+        void setDoErase(bool b) { doErase_ = b; }
+        void setDoVerify(bool b) { doVerify_ = b; }
+        void setUseMulticast(bool b) { useMulticast_ = b; }
+
+        // True if multicast mode is enabled and all jobs contain the same
+        // parts.
+        bool isMulticastActive() const;
+
+        // Invoked after each executed step.
+        void setProgressCallback(const ProgressCallback &cb) { progressCallback_ = cb; }
+
+        // Runs until all modules are either done or failed. Returns true if
+        // all modules completed successfully.
+        bool run();
+
+        // Executes at most one step of the next module in round-robin order.
+        // Returns false once all modules are finished. Sleeps if all active
+        // modules are waiting for an erase to complete.
+        bool runOnce();
+
+        std::vector<ModuleStatus> getStatus() const;
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        struct Module
+        {
+            FlashJob job;
+            ModuleStatus status;
+            unsigned selectedArea = 0;
+            Clock::time_point eraseStart;
+            Clock::time_point nextPoll;
+            std::chrono::milliseconds pollInterval = EraseMinPollInterval;
+        };
+
+        bool isFinished(const Module &m) const;
+        bool isReady(const Module &m, const Clock::time_point &now) const;
+        std::error_code step(Module &m);
+        std::error_code stepProgram(Module &m, const FlashPartTask &part);
+        std::error_code stepVerify(Module &m, const FlashPartTask &part);
+        bool isMulticastReady() const;
+        void stepMulticastProgram();
+        void fail(Module &m, const std::string &error);
+
+        MVLC &mvlc_;
+        std::vector<Module> modules_;
+        size_t nextModule_ = 0;
+        size_t maxPagesPerStack_ = 0;
+        size_t maxReadPagesPerStack_ = 0;
+        bool doErase_ = true;
+        bool doVerify_ = false;
+        bool useMulticast_ = false;
+        bool sameParts_ = true; // true if all jobs contain the same parts
+        ProgressCallback progressCallback_;
+};
+
+const char *to_string(MultiModuleFlashScheduler::State state);
+
+}
+
+#endif /* __MESYTEC_MVLC_MVP_SCHEDULER_H__ */
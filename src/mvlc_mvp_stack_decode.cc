@@ -0,0 +1,305 @@
+#include "mvlc_mvp_stack_decode.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LIBMVP_X86_SIMD 1
+#define LIBMVP_TARGET(t) __attribute__((target(t)))
+#elif defined(_MSC_VER) && defined(_M_X64)
+#define LIBMVP_X86_SIMD 1
+#define LIBMVP_TARGET(t)
+#endif
+
+#ifdef LIBMVP_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace mesytec::mvp
+{
+
+using namespace mesytec::mvlc;
+
+std::vector<DataRun> find_data_runs(const gsl::span<const u32> &stackOutput, u8 &frameFlags)
+{
+    std::vector<DataRun> runs;
+    const size_t n = stackOutput.size();
+    size_t pos = 0;
+
+    auto add_run = [&runs] (size_t offset, size_t size)
+    {
+        if (!size)
+            return;
+
+        if (!runs.empty() && runs.back().offset + runs.back().size == offset)
+            runs.back().size += size;
+        else
+            runs.push_back({ offset, size });
+    };
+
+    frameFlags = 0;
+
+    while (pos < n)
+    {
+        const u32 word = stackOutput[pos];
+
+        if (is_stack_buffer(word) || is_stack_buffer_continuation(word))
+        {
+            const auto info = extract_frame_info(word);
+            const size_t end = std::min(n, pos + 1 + info.len);
+            frameFlags |= info.flags;
+            ++pos;
+
+            // The reference marker directly follows the stack frame header.
+            if (is_stack_buffer(word) && pos < end)
+                ++pos;
+
+            while (pos < end)
+            {
+                const u32 w = stackOutput[pos];
+
+                if (is_blockread_buffer(w))
+                {
+                    const size_t begin = pos + 1;
+                    const size_t blockEnd = std::min(end, begin + extract_frame_info(w).len);
+                    add_run(begin, blockEnd - begin);
+                    pos = blockEnd;
+                }
+                else
+                {
+                    // Result of a single read.
+                    add_run(pos, 1);
+                    ++pos;
+                }
+            }
+        }
+        else
+        {
+            // Data outside of a stack frame. Treated as data, same as the
+            // word by word decoder does.
+            add_run(pos, 1);
+            ++pos;
+        }
+    }
+
+    return runs;
+}
+
+StackDecodeResult decode_stack_output(
+    const gsl::span<const u32> &stackOutput, u32 stackRef, gsl::span<u8> dest)
+{
+    StackDecodeResult result;
+
+    if (stackOutput.size() < 2 || !is_stack_buffer(stackOutput[0]))
+    {
+        result.ec = make_error_code(MVLCErrorCode::UnexpectedResponseSize);
+        return result;
+    }
+
+    if (stackOutput[1] != stackRef)
+    {
+        result.ec = MVLCErrorCode::StackReferenceMismatch;
+        return result;
+    }
+
+    const auto runs = find_data_runs(stackOutput, result.frameFlags);
+
+    // Same policy as get_stack_frame_error(): BusError is the regular
+    // termination condition of (fake) block reads and not an error.
+    if (result.frameFlags & frame_flags::Timeout)
+        result.ec = MVLCErrorCode::NoVMEResponse;
+    else if (result.frameFlags & frame_flags::SyntaxError)
+        result.ec = MVLCErrorCode::StackSyntaxError;
+
+    for (const auto &run: runs)
+    {
+        if (result.terminated)
+        {
+            result.wordsLeft += run.size;
+            continue;
+        }
+
+        const size_t space = dest.size() - result.bytes;
+        const size_t count = std::min(run.size, space);
+
+        auto nr = stack_decode::narrow(stackOutput.data() + run.offset, count, dest.data() + result.bytes);
+        result.bytes += nr.count;
+
+        if (nr.invalidRead)
+        {
+            result.terminated = true;
+            result.wordsLeft += run.size - nr.count - 1;
+            continue;
+        }
+
+        if (count < run.size)
+        {
+            // Only an overflow if the next word is not the terminator.
+            if (!(stackOutput[run.offset + count] & output_fifo_flags::InvalidRead))
+            {
+                if (!result.ec)
+                    result.ec = std::make_error_code(std::errc::no_buffer_space);
+                return result;
+            }
+
+            result.terminated = true;
+            result.wordsLeft += run.size - count - 1;
+        }
+    }
+
+    return result;
+}
+
+namespace stack_decode
+{
+
+NarrowResult narrow_scalar(const u32 *src, size_t n, u8 *dst)
+{
+    for (size_t i=0; i<n; ++i)
+    {
+        const u32 word = src[i];
+
+        if (word & output_fifo_flags::InvalidRead)
+            return { i, true };
+
+        dst[i] = word & output_fifo_flags::DataMask;
+    }
+
+    return { n, false };
+}
+
+#ifdef LIBMVP_X86_SIMD
+
+LIBMVP_TARGET("sse2")
+static NarrowResult narrow_sse2_impl(const u32 *src, size_t n, u8 *dst)
+{
+    const __m128i dataMask = _mm_set1_epi32(output_fifo_flags::DataMask);
+    const __m128i flagMask = _mm_set1_epi32(output_fifo_flags::InvalidRead);
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    // 16 words per iteration. The words are masked to 8 bits so the signed
+    // saturating packs are lossless.
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i + 0));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i + 4));
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i + 8));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i + 12));
+
+        __m128i flags = _mm_or_si128(
+            _mm_or_si128(_mm_and_si128(a, flagMask), _mm_and_si128(b, flagMask)),
+            _mm_or_si128(_mm_and_si128(c, flagMask), _mm_and_si128(d, flagMask)));
+
+        // InvalidRead somewhere in this block: let the scalar code find the
+        // exact position.
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(flags, zero)) != 0xffff)
+            break;
+
+        __m128i ab = _mm_packs_epi32(_mm_and_si128(a, dataMask), _mm_and_si128(b, dataMask));
+        __m128i cd = _mm_packs_epi32(_mm_and_si128(c, dataMask), _mm_and_si128(d, dataMask));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_packus_epi16(ab, cd));
+    }
+
+    auto result = narrow_scalar(src + i, n - i, dst + i);
+    result.count += i;
+    return result;
+}
+
+#if defined(__GNUC__) || defined(__AVX2__)
+LIBMVP_TARGET("avx2")
+static NarrowResult narrow_avx2_impl(const u32 *src, size_t n, u8 *dst)
+{
+    const __m256i dataMask = _mm256_set1_epi32(output_fifo_flags::DataMask);
+    const __m256i flagMask = _mm256_set1_epi32(output_fifo_flags::InvalidRead);
+    // The packs instructions work per 128-bit lane. This restores the word
+    // order after packing.
+    const __m256i permute = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    size_t i = 0;
+
+    // 32 words per iteration.
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i + 0));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i + 8));
+        __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i + 16));
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i + 24));
+
+        __m256i flags = _mm256_or_si256(
+            _mm256_or_si256(_mm256_and_si256(a, flagMask), _mm256_and_si256(b, flagMask)),
+            _mm256_or_si256(_mm256_and_si256(c, flagMask), _mm256_and_si256(d, flagMask)));
+
+        if (!_mm256_testz_si256(flags, flags))
+            break;
+
+        __m256i ab = _mm256_packs_epi32(_mm256_and_si256(a, dataMask), _mm256_and_si256(b, dataMask));
+        __m256i cd = _mm256_packs_epi32(_mm256_and_si256(c, dataMask), _mm256_and_si256(d, dataMask));
+        __m256i bytes = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(ab, cd), permute);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), bytes);
+    }
+
+    auto result = narrow_sse2_impl(src + i, n - i, dst + i);
+    result.count += i;
+    return result;
+}
+#define LIBMVP_HAVE_AVX2_IMPL 1
+#endif
+
+#endif // LIBMVP_X86_SIMD
+
+bool have_sse2()
+{
+#if defined(LIBMVP_X86_SIMD) && defined(__GNUC__)
+    return __builtin_cpu_supports("sse2");
+#elif defined(LIBMVP_X86_SIMD)
+    return true; // x64 always has SSE2
+#else
+    return false;
+#endif
+}
+
+bool have_avx2()
+{
+#if defined(LIBMVP_HAVE_AVX2_IMPL) && defined(__GNUC__)
+    return __builtin_cpu_supports("avx2");
+#elif defined(LIBMVP_HAVE_AVX2_IMPL)
+    return true; // MSVC: only built with /arch:AVX2
+#else
+    return false;
+#endif
+}
+
+NarrowResult narrow_sse2(const u32 *src, size_t n, u8 *dst)
+{
+#ifdef LIBMVP_X86_SIMD
+    if (have_sse2())
+        return narrow_sse2_impl(src, n, dst);
+#endif
+    return narrow_scalar(src, n, dst);
+}
+
+NarrowResult narrow_avx2(const u32 *src, size_t n, u8 *dst)
+{
+#ifdef LIBMVP_HAVE_AVX2_IMPL
+    if (have_avx2())
+        return narrow_avx2_impl(src, n, dst);
+#endif
+    return narrow_sse2(src, n, dst);
+}
+
+NarrowResult narrow(const u32 *src, size_t n, u8 *dst)
+{
+    using NarrowFunc = NarrowResult (*)(const u32 *, size_t, u8 *);
+
+    static const NarrowFunc impl = []
+    {
+        if (have_avx2())
+            return &narrow_avx2;
+        if (have_sse2())
+            return &narrow_sse2;
+        return &narrow_scalar;
+    }();
+
+    return impl(src, n, dst);
+}
+
+} // end namespace stack_decode
+
+}
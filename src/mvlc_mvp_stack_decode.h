@@ -0,0 +1,71 @@
+#ifndef __MESYTEC_MVLC_MVP_STACK_DECODE_H__
+#define __MESYTEC_MVLC_MVP_STACK_DECODE_H__
+
+#include "mvlc_mvp_lib.h"
+
+namespace mesytec::mvp
+{
+
+// Decoding of flash output fifo data from stack transaction output.
+//
+// Decoding is done in two passes: first the frame structure (stack frames,
+// stack continuation frames, block read frames) is walked using the frame
+// header length fields to find the contiguous runs of data words. Then each
+// run is narrowed from u32 output fifo words to bytes. The narrowing step
+// uses SSE2 or AVX2 if available and detects the InvalidRead flag.
+
+struct DataRun
+{
+    size_t offset; // index into the stack output
+    size_t size;   // number of data words
+};
+
+struct StackDecodeResult
+{
+    std::error_code ec;         // frame error (Timeout, SyntaxError) or dest overflow
+    size_t bytes = 0;           // number of bytes written to dest
+    bool terminated = false;    // true if a word with InvalidRead set was found
+    size_t wordsLeft = 0;       // data words following the terminating word
+    u8 frameFlags = 0;          // OR of the flags of all stack frame headers
+};
+
+// Finds the data word runs in the given stack output. The stack frame
+// header, the reference marker and all nested frame headers are skipped.
+// frameFlags receives the OR of the flags of all stack and continuation
+// frame headers.
+std::vector<DataRun> find_data_runs(const gsl::span<const u32> &stackOutput, u8 &frameFlags);
+
+// Narrows the data words of the stack output into dest. Stops at the first
+// word with the InvalidRead flag set, same as
+// fill_page_buffer_from_stack_output(). If dest is too small
+// std::errc::no_buffer_space is returned in the result. Frame error flags are
+// reported via ec and frameFlags but decoding continues.
+StackDecodeResult decode_stack_output(
+    const gsl::span<const u32> &stackOutput, u32 stackRef, gsl::span<u8> dest);
+
+namespace stack_decode
+{
+    struct NarrowResult
+    {
+        size_t count = 0;           // number of words narrowed before the first InvalidRead word
+        bool invalidRead = false;   // true if an InvalidRead word was found at src[count]
+    };
+
+    // Implementations of the narrowing step. Each one converts n output fifo
+    // words to bytes, stopping at the first word with the InvalidRead flag
+    // set. The SIMD versions return the scalar result if the instruction set
+    // is not available.
+    NarrowResult narrow_scalar(const u32 *src, size_t n, u8 *dst);
+    NarrowResult narrow_sse2(const u32 *src, size_t n, u8 *dst);
+    NarrowResult narrow_avx2(const u32 *src, size_t n, u8 *dst);
+
+    // Dispatches to the best implementation supported by the host cpu.
+    NarrowResult narrow(const u32 *src, size_t n, u8 *dst);
+
+    bool have_sse2();
+    bool have_avx2();
+}
+
+}
+
+#endif /* __MESYTEC_MVLC_MVP_STACK_DECODE_H__ */
@@ -0,0 +1,196 @@
+#include <chrono>
+#include <random>
+#include <mesytec-mvlc/mesytec-mvlc.h>
+#include "mvlc_mvp_lib.h"
+#include "mvlc_mvp_stack_decode.h"
+
+using namespace mesytec::mvlc;
+using namespace mesytec::mvp;
+
+// Builds synthetic stack output as produced by a page read stack: stack frame
+// header, reference marker, block read frames containing the output fifo data
+// words and the InvalidRead terminator word. Like the MVLC the output is split
+// into frames of at most frame_headers::LengthMask words: a StackFrame
+// followed by StackContinuation frames. All but the last frame have the
+// Continue flag set.
+static std::vector<u32> make_stack_output(size_t dataBytes, u32 stackRef, std::mt19937 &rng)
+{
+    static const size_t MaxBlockWords = 256;
+    static const size_t MaxFrameWords = frame_headers::LengthMask;
+
+    std::uniform_int_distribution<u32> dist(0, 0xff);
+    std::vector<u32> data;
+
+    for (size_t i=0; i<dataBytes; ++i)
+        data.push_back(dist(rng));
+
+    data.push_back(output_fifo_flags::InvalidRead);
+
+    // Frame contents: the reference marker followed by the block read frames.
+    std::vector<u32> contents = { stackRef };
+
+    for (size_t i=0; i<data.size(); i+=MaxBlockWords)
+    {
+        size_t count = std::min(MaxBlockWords, data.size() - i);
+        contents.push_back((frame_headers::BlockRead << frame_headers::TypeShift) | count);
+        contents.insert(std::end(contents), std::begin(data) + i, std::begin(data) + i + count);
+    }
+
+    std::vector<u32> result;
+    size_t offset = 0;
+
+    while (offset < contents.size())
+    {
+        // Block read frames are not split across stack frames.
+        size_t len = 0;
+
+        while (offset + len < contents.size())
+        {
+            size_t partLen = 1;
+
+            if (is_blockread_buffer(contents[offset + len]))
+                partLen += extract_frame_info(contents[offset + len]).len;
+
+            if (len + partLen > MaxFrameWords)
+                break;
+
+            len += partLen;
+        }
+
+        const bool last = offset + len >= contents.size();
+        const u32 type = result.empty() ? frame_headers::StackFrame : frame_headers::StackContinuation;
+        const u32 flags = last ? 0u : frame_flags::Continue;
+
+        result.push_back((type << frame_headers::TypeShift)
+                         | (flags << frame_headers::FrameFlagsShift)
+                         | len);
+        result.insert(std::end(result), std::begin(contents) + offset, std::begin(contents) + offset + len);
+        offset += len;
+    }
+
+    return result;
+}
+
+// The word by word decoder previously used in fill_page_buffer_from_stack_output().
+static void decode_legacy(std::vector<u8> &dest, const std::vector<u32> &stackOutput)
+{
+    dest.clear();
+    auto view = basic_string_view<u32>(stackOutput.data(), stackOutput.size());
+
+    while (!view.empty())
+    {
+        u32 word = view[0];
+
+        if (is_stack_buffer(word))
+            view.remove_prefix(2);
+        else if (is_stack_buffer_continuation(word) || is_blockread_buffer(word))
+            view.remove_prefix(1);
+        else
+        {
+            view.remove_prefix(1);
+
+            if (word & output_fifo_flags::InvalidRead)
+                break;
+
+            dest.push_back(word & 0xffu);
+        }
+    }
+}
+
+using NarrowFunc = stack_decode::NarrowResult (*)(const u32 *, size_t, u8 *);
+
+static void decode_with(NarrowFunc narrow, std::vector<u8> &dest, const std::vector<u32> &stackOutput)
+{
+    u8 frameFlags = 0;
+    auto runs = find_data_runs(stackOutput, frameFlags);
+    dest.resize(stackOutput.size());
+    size_t bytes = 0;
+
+    for (const auto &run: runs)
+    {
+        auto nr = narrow(stackOutput.data() + run.offset, run.size, dest.data() + bytes);
+        bytes += nr.count;
+
+        if (nr.invalidRead)
+            break;
+    }
+
+    dest.resize(bytes);
+}
+
+template<typename F>
+static double time_it(size_t loops, F f)
+{
+    auto tStart = std::chrono::steady_clock::now();
+
+    for (size_t i=0; i<loops; ++i)
+        f();
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - tStart);
+
+    return elapsed.count() / static_cast<double>(loops);
+}
+
+int main(int argc, char *argv[])
+{
+    spdlog::set_level(spdlog::level::info);
+
+    size_t dataBytes = 64 * 1024;
+    size_t loops = 1000;
+
+    if (argc > 1)
+        dataBytes = std::stoul(argv[1]);
+
+    if (argc > 2)
+        loops = std::stoul(argv[2]);
+
+    std::mt19937 rng(1234);
+    const u32 stackRef = 0x1337;
+    const auto stackOutput = make_stack_output(dataBytes, stackRef, rng);
+
+    spdlog::info("stack output: {} words, {} data bytes, sse2={}, avx2={}",
+                 stackOutput.size(), dataBytes,
+                 stack_decode::have_sse2(), stack_decode::have_avx2());
+
+    std::vector<u8> reference;
+    decode_legacy(reference, stackOutput);
+
+    struct Impl
+    {
+        const char *name;
+        NarrowFunc func;
+    };
+
+    const std::vector<Impl> impls =
+    {
+        { "scalar", &stack_decode::narrow_scalar },
+        { "sse2", &stack_decode::narrow_sse2 },
+        { "avx2", &stack_decode::narrow_avx2 },
+        { "dispatch", &stack_decode::narrow },
+    };
+
+    std::vector<u8> dest;
+
+    double tLegacy = time_it(loops, [&] { decode_legacy(dest, stackOutput); });
+    spdlog::info("{:>10}: {:8.2f} us/decode", "legacy", tLegacy);
+
+    int ret = 0;
+
+    for (const auto &impl: impls)
+    {
+        decode_with(impl.func, dest, stackOutput);
+
+        if (dest != reference)
+        {
+            spdlog::error("{}: decoded data differs from the legacy decoder", impl.name);
+            ret = 1;
+            continue;
+        }
+
+        double t = time_it(loops, [&] { decode_with(impl.func, dest, stackOutput); });
+        spdlog::info("{:>10}: {:8.2f} us/decode, speedup {:.2f}x", impl.name, t, tLegacy / t);
+    }
+
+    return ret;
+}
@@ -0,0 +1,196 @@
+#include "mvlc_mvp_stack_templates.h"
+
+#include <flash_constants.h>
+
+namespace mesytec::mvp
+{
+
+using namespace mesytec::mvlc;
+
+namespace
+{
+    // Placeholder address/section/length commands. Returns the index of the
+    // first address command.
+    size_t add_address_commands(StackCommandBuilder &sb, u32 moduleBase, size_t &sectionIndex, unsigned len)
+    {
+        size_t addressIndex = sb.commandCount();
+        for (size_t i=0; i<std::tuple_size<FlashAddress>::value; ++i)
+            sb.addVMEWrite(moduleBase + InputFifoRegister, 0, vme_amods::A32, VMEDataWidth::D16);
+        sectionIndex = sb.commandCount();
+        sb.addVMEWrite(moduleBase + InputFifoRegister, 0, vme_amods::A32, VMEDataWidth::D16);
+        sb.addVMEWrite(moduleBase + InputFifoRegister, len == PageSize ? 0 : len,
+                       vme_amods::A32, VMEDataWidth::D16);
+        return addressIndex;
+    }
+}
+
+PageStackTemplates &PageStackTemplates::instance()
+{
+    static PageStackTemplates templates;
+    return templates;
+}
+
+PageStackTemplates::Template PageStackTemplates::buildTemplate(const Key &key)
+{
+    auto [moduleBase, op, len, waitCycles] = key;
+    Template result;
+    StackCommandBuilder sb;
+
+    if (op == Operation::ReadPage || op == Operation::WritePage)
+    {
+        result.hasMarker = true;
+        result.markerIndex = sb.commandCount();
+        sb.addWriteMarker(0);
+    }
+
+    if (op == Operation::WritePage)
+    {
+        for (auto byte: EfwRequest)
+            sb.addVMEWrite(moduleBase + InputFifoRegister, byte, vme_amods::A32, VMEDataWidth::D16);
+    }
+
+    switch (op)
+    {
+        case Operation::ReadPage:
+        case Operation::ReadPageFragment:
+            sb.addVMEWrite(moduleBase + InputFifoRegister, opcodes::REF, vme_amods::A32, VMEDataWidth::D16);
+            result.addressIndex = add_address_commands(sb, moduleBase, result.sectionIndex, len);
+            sb.addWait(waitCycles);
+            sb.addSetAccu(len + 1);
+            sb.addVMERead(moduleBase + OutputFifoRegister, vme_amods::A32, VMEDataWidth::D16);
+            break;
+
+        case Operation::WritePage:
+        case Operation::WritePageFragment:
+            sb.addVMEWrite(moduleBase + InputFifoRegister, opcodes::WRF, vme_amods::A32, VMEDataWidth::D16);
+            result.addressIndex = add_address_commands(sb, moduleBase, result.sectionIndex, len);
+
+            result.dataIndex = sb.commandCount();
+            result.dataSize = len;
+            for (unsigned i=0; i<len; ++i)
+                sb.addVMEWrite(moduleBase + InputFifoRegister, 0, vme_amods::A32, VMEDataWidth::D16);
+
+            if (waitCycles)
+                sb.addWait(waitCycles);
+            break;
+    }
+
+    if (op == Operation::WritePage)
+    {
+        sb.addReadToAccu(moduleBase + StatusRegister, vme_amods::A32, VMEDataWidth::D16);
+        sb.addCompareLoopAccu(AccuComparator::EQ, 0);
+        sb.addSetAccu(EfwResponseSize + 1);
+        sb.addVMERead(moduleBase + OutputFifoRegister, vme_amods::A32, VMEDataWidth::D16);
+    }
+
+    result.commands = sb.getCommands();
+    return result;
+}
+
+std::shared_ptr<const PageStackTemplates::Template> PageStackTemplates::getTemplate(const Key &key)
+{
+    std::lock_guard<std::mutex> guard(mutex_);
+
+    auto it = templates_.find(key);
+
+    if (it == templates_.end())
+        it = templates_.emplace(key, std::make_shared<const Template>(buildTemplate(key))).first;
+
+    return it->second;
+}
+
+void PageStackTemplates::appendPatched(
+    StackCommandBuilder &sb,
+    const Template &tmpl, const FlashAddress &addr, u8 section,
+    const gsl::span<const u8> &page, u32 stackRef)
+{
+    for (size_t i=0; i<tmpl.commands.size(); ++i)
+    {
+        auto cmd = tmpl.commands[i];
+
+        if (tmpl.hasMarker && i == tmpl.markerIndex)
+            cmd.value = stackRef;
+        else if (i >= tmpl.addressIndex && i < tmpl.addressIndex + addr.size())
+            cmd.value = addr[i - tmpl.addressIndex];
+        else if (i == tmpl.sectionIndex)
+            cmd.value = section;
+        else if (i >= tmpl.dataIndex && i < tmpl.dataIndex + tmpl.dataSize)
+            cmd.value = page[i - tmpl.dataIndex];
+
+        sb.addCommand(cmd);
+    }
+}
+
+StackCommandBuilder PageStackTemplates::makeReadStack(
+    u32 moduleBase, const FlashAddress &addr, u8 section,
+    unsigned bytesToRead, u32 stackRef)
+{
+    if (bytesToRead == 0 || bytesToRead > PageSize)
+        throw std::invalid_argument("makeReadStack: invalid read length");
+
+    auto tmpl = getTemplate(std::make_tuple(
+            moduleBase, Operation::ReadPage, bytesToRead, get_fifo_wait_cycles(moduleBase)));
+
+    StackCommandBuilder sb;
+    appendPatched(sb, *tmpl, addr, section, {}, stackRef);
+    return sb;
+}
+
+StackCommandBuilder PageStackTemplates::makeWriteStack(
+    u32 moduleBase, const FlashAddress &addr, u8 section,
+    const gsl::span<const u8> &page, u32 stackRef)
+{
+    if (page.empty() || page.size() > PageSize)
+        throw std::invalid_argument("makeWriteStack: invalid page size");
+
+    // The wait after WRF covers the page program time, see
+    // PostFifoWriteStackWaitCycles.
+    auto tmpl = getTemplate(std::make_tuple(
+            moduleBase, Operation::WritePage, static_cast<unsigned>(page.size()),
+            PostFifoWriteStackWaitCycles));
+
+    StackCommandBuilder sb;
+    appendPatched(sb, *tmpl, addr, section, page, stackRef);
+    return sb;
+}
+
+void PageStackTemplates::appendReadPage(
+    StackCommandBuilder &sb, u32 moduleBase, const FlashAddress &addr,
+    u8 section, unsigned bytesToRead)
+{
+    if (bytesToRead == 0 || bytesToRead > PageSize)
+        throw std::invalid_argument("appendReadPage: invalid read length");
+
+    auto tmpl = getTemplate(std::make_tuple(
+            moduleBase, Operation::ReadPageFragment, bytesToRead, get_fifo_wait_cycles(moduleBase)));
+
+    appendPatched(sb, *tmpl, addr, section, {}, 0);
+}
+
+void PageStackTemplates::appendWritePage(
+    StackCommandBuilder &sb, u32 moduleBase, const FlashAddress &addr,
+    u8 section, const gsl::span<const u8> &page, unsigned waitCycles)
+{
+    if (page.empty() || page.size() > PageSize)
+        throw std::invalid_argument("appendWritePage: invalid page size");
+
+    auto tmpl = getTemplate(std::make_tuple(
+            moduleBase, Operation::WritePageFragment, static_cast<unsigned>(page.size()),
+            waitCycles));
+
+    appendPatched(sb, *tmpl, addr, section, page, 0);
+}
+
+void PageStackTemplates::clear()
+{
+    std::lock_guard<std::mutex> guard(mutex_);
+    templates_.clear();
+}
+
+size_t PageStackTemplates::size() const
+{
+    std::lock_guard<std::mutex> guard(mutex_);
+    return templates_.size();
+}
+
+}
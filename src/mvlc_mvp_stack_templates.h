@@ -0,0 +1,92 @@
+#ifndef __MESYTEC_MVLC_MVP_STACK_TEMPLATES_H__
+#define __MESYTEC_MVLC_MVP_STACK_TEMPLATES_H__
+
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include "mvlc_mvp_lib.h"
+
+namespace mesytec::mvp
+{
+
+// Cache of prebuilt page read/write stacks.
+//
+// Building a page write stack requires ~270 StackCommandBuilder calls. The
+// templates are built once per (moduleBase, operation, length, waitCycles)
+// and copied for each page. Only the stack reference marker, the flash
+// address, the section and the data bytes are patched in the copied command
+// list. The length is part of the cache key as it changes the stack layout.
+//
+// The complete stack layouts are identical to the ones built by read_page()
+// and write_page4(). The page fragments are used by add_page_read_to_stack()
+// and add_page_write_to_stack() to build the batched and pipelined stacks.
+class PageStackTemplates
+{
+    public:
+        enum class Operation
+        {
+            ReadPage,           // marker + ReadPageFragment
+            WritePage,          // marker + EFW + WritePageFragment + status poll + EFW response read
+            ReadPageFragment,   // REF + wait + fake block read of len + 1 words
+            WritePageFragment,  // WRF + data + optional wait
+        };
+
+        // Returns the process wide template cache.
+        static PageStackTemplates &instance();
+
+        StackCommandBuilder makeReadStack(
+            u32 moduleBase, const FlashAddress &addr, u8 section,
+            unsigned bytesToRead, u32 stackRef);
+
+        StackCommandBuilder makeWriteStack(
+            u32 moduleBase, const FlashAddress &addr, u8 section,
+            const gsl::span<const u8> &page, u32 stackRef);
+
+        // Append the page fragments to an existing stack.
+        void appendReadPage(
+            StackCommandBuilder &sb, u32 moduleBase, const FlashAddress &addr,
+            u8 section, unsigned bytesToRead);
+
+        // A waitCycles value of 0 omits the trailing wait command.
+        void appendWritePage(
+            StackCommandBuilder &sb, u32 moduleBase, const FlashAddress &addr,
+            u8 section, const gsl::span<const u8> &page, unsigned waitCycles);
+
+        void clear();
+        size_t size() const;
+
+    private:
+        struct Template
+        {
+            std::vector<mvlc::StackCommand> commands;
+            bool hasMarker = false;
+            size_t markerIndex = 0;
+            size_t addressIndex = 0; // index of the first of the 3 address bytes
+            size_t sectionIndex = 0;
+            size_t dataIndex = 0;    // index of the first data byte (write only)
+            size_t dataSize = 0;
+        };
+
+        // moduleBase, operation, length, waitCycles
+        using Key = std::tuple<u32, Operation, unsigned, unsigned>;
+
+        // Returns the template for key, building it if needed. Templates are
+        // immutable once built and stay valid after clear() was called.
+        std::shared_ptr<const Template> getTemplate(const Key &key);
+
+        static Template buildTemplate(const Key &key);
+
+        // Appends the template commands to sb, patching in the variable
+        // values on the way.
+        static void appendPatched(
+            StackCommandBuilder &sb,
+            const Template &tmpl, const FlashAddress &addr, u8 section,
+            const gsl::span<const u8> &page, u32 stackRef);
+
+        mutable std::mutex mutex_;
+        std::map<Key, std::shared_ptr<const Template>> templates_;
+};
+
+}
+
+#endif /* __MESYTEC_MVLC_MVP_STACK_TEMPLATES_H__ */
@@ -0,0 +1,131 @@
+#include "mvlc_mvp_traffic.h"
+
+#include <thread>
+
+namespace mesytec::mvp
+{
+
+using namespace mesytec::mvlc;
+
+FlashTrafficPacer &FlashTrafficPacer::instance()
+{
+    static FlashTrafficPacer pacer;
+    return pacer;
+}
+
+void FlashTrafficPacer::setBudget(const FlashTrafficBudget &budget)
+{
+    std::unique_lock<std::mutex> guard(mutex_);
+    budget_ = budget;
+    nextStart_ = {};
+
+    auto logger = mvlc::get_logger("mvlc_mvp_lib");
+    logger->info("flash traffic budget: maxTransactionsPerSecond={}, maxBusOccupancyPercent={}",
+                 budget.maxTransactionsPerSecond, budget.maxBusOccupancyPercent);
+}
+
+FlashTrafficBudget FlashTrafficPacer::getBudget() const
+{
+    std::unique_lock<std::mutex> guard(mutex_);
+    return budget_;
+}
+
+void FlashTrafficPacer::acquire()
+{
+    auto now = Clock::now();
+    Clock::time_point start = now;
+
+    {
+        std::unique_lock<std::mutex> guard(mutex_);
+
+        if (budget_.isLimited())
+        {
+            start = std::max(now, nextStart_);
+
+            // Reserve the slot so that concurrent callers queue up behind
+            // this transaction.
+            if (budget_.maxTransactionsPerSecond > 0.0)
+            {
+                nextStart_ = start + std::chrono::duration_cast<Clock::duration>(
+                    std::chrono::duration<double>(1.0 / budget_.maxTransactionsPerSecond));
+            }
+
+            stats_.pacingDelay += std::chrono::duration_cast<std::chrono::microseconds>(start - now);
+        }
+
+        if (firstStart_ == Clock::time_point{})
+            firstStart_ = start;
+    }
+
+    if (start > now)
+        std::this_thread::sleep_until(start);
+}
+
+void FlashTrafficPacer::release(const Clock::duration &busyTime, size_t responseWords)
+{
+    auto now = Clock::now();
+
+    std::unique_lock<std::mutex> guard(mutex_);
+
+    if (budget_.maxBusOccupancyPercent > 0.0 && budget_.maxBusOccupancyPercent < 100.0)
+    {
+        const double p = budget_.maxBusOccupancyPercent;
+        auto idle = std::chrono::duration_cast<Clock::duration>(busyTime * ((100.0 - p) / p));
+        nextStart_ = std::max(nextStart_, now + idle);
+    }
+
+    ++stats_.transactions;
+    stats_.responseWords += responseWords;
+    stats_.busyTime += std::chrono::duration_cast<std::chrono::microseconds>(busyTime);
+    lastEnd_ = now;
+    stats_.elapsed = std::chrono::duration_cast<std::chrono::microseconds>(lastEnd_ - firstStart_);
+}
+
+FlashTrafficStats FlashTrafficPacer::getStats() const
+{
+    std::unique_lock<std::mutex> guard(mutex_);
+    return stats_;
+}
+
+void FlashTrafficPacer::resetStats()
+{
+    std::unique_lock<std::mutex> guard(mutex_);
+    stats_ = {};
+    firstStart_ = {};
+    lastEnd_ = {};
+}
+
+std::error_code paced_stack_transaction(
+    MVLC &mvlc, const StackCommandBuilder &sb, std::vector<u32> &dest)
+{
+    auto &pacer = FlashTrafficPacer::instance();
+    pacer.acquire();
+    auto tStart = FlashTrafficPacer::Clock::now();
+    auto ec = mvlc.stackTransaction(sb, dest);
+    pacer.release(FlashTrafficPacer::Clock::now() - tStart, dest.size());
+    return ec;
+}
+
+std::error_code paced_vme_read(
+    MVLC &mvlc, u32 address, u32 &value, u8 amod, VMEDataWidth dataWidth)
+{
+    auto &pacer = FlashTrafficPacer::instance();
+    pacer.acquire();
+    auto tStart = FlashTrafficPacer::Clock::now();
+    auto ec = mvlc.vmeRead(address, value, amod, dataWidth);
+    pacer.release(FlashTrafficPacer::Clock::now() - tStart, 1);
+    return ec;
+}
+
+std::error_code paced_vme_write(
+    MVLC &mvlc, u32 address, u32 value, u8 amod, VMEDataWidth dataWidth)
+{
+    auto &pacer = FlashTrafficPacer::instance();
+    pacer.acquire();
+    auto tStart = FlashTrafficPacer::Clock::now();
+    auto ec = mvlc.vmeWrite(address, value, amod, dataWidth);
+    pacer.release(FlashTrafficPacer::Clock::now() - tStart);
+    return ec;
+}
+
+}
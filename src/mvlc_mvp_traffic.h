@@ -0,0 +1,109 @@
+#ifndef __MESYTEC_MVLC_MVP_TRAFFIC_H__
+#define __MESYTEC_MVLC_MVP_TRAFFIC_H__
+
+#include "mvlc_mvp_lib.h"
+
+namespace mesytec::mvp
+{
+
+// Limits for the MVLC traffic generated by the flash code. Allows running
+// flash updates on an MVLC which is doing readout at the same time: instead of
+// issuing stacks back to back the flash transactions are spread out so that
+// the readout sees a bounded and predictable additional latency.
+//
+// Both limits can be combined, the stricter one wins. A value of 0 disables
+// the respective limit.
+struct FlashTrafficBudget
+{
+    // Maximum number of flash transactions (stack transactions and single
+    // VME reads/writes) started per second.
+    double maxTransactionsPerSecond = 0.0;
+
+    // Maximum percentage of wall time spent inside flash transactions. After a
+    // transaction taking t the next one is delayed by t * (100 - p) / p.
+    double maxBusOccupancyPercent = 0.0;
+
+    bool isLimited() const
+    {
+        return maxTransactionsPerSecond > 0.0 || maxBusOccupancyPercent > 0.0;
+    }
+};
+
+struct FlashTrafficStats
+{
+    size_t transactions = 0;
+    size_t responseWords = 0;                   // words returned by stack transactions
+    std::chrono::microseconds busyTime{};       // time spent inside transactions
+    std::chrono::microseconds pacingDelay{};    // time spent waiting for the budget
+    std::chrono::microseconds elapsed{};        // first transaction start to last transaction end
+
+    double transactionsPerSecond() const
+    {
+        return elapsed.count() ? transactions * 1e6 / elapsed.count() : 0.0;
+    }
+
+    double busOccupancyPercent() const
+    {
+        return elapsed.count() ? busyTime.count() * 100.0 / elapsed.count() : 0.0;
+    }
+};
+
+// Process wide pacer used by the paced_* functions below. All flash code in
+// this library issues its MVLC transactions through these functions.
+class FlashTrafficPacer
+{
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        static FlashTrafficPacer &instance();
+
+        void setBudget(const FlashTrafficBudget &budget);
+        FlashTrafficBudget getBudget() const;
+
+        // Blocks until the next transaction may be started.
+        void acquire();
+
+        // Records a finished transaction started by the previous acquire().
+        void release(const Clock::duration &busyTime, size_t responseWords = 0);
+
+        FlashTrafficStats getStats() const;
+        void resetStats();
+
+    private:
+        FlashTrafficPacer() = default;
+
+        mutable std::mutex mutex_;
+        FlashTrafficBudget budget_;
+        Clock::time_point nextStart_;
+        Clock::time_point firstStart_;
+        Clock::time_point lastEnd_;
+        FlashTrafficStats stats_;
+};
+
+inline void set_flash_traffic_budget(const FlashTrafficBudget &budget)
+{
+    FlashTrafficPacer::instance().setBudget(budget);
+}
+
+inline FlashTrafficStats get_flash_traffic_stats()
+{
+    return FlashTrafficPacer::instance().getStats();
+}
+
+inline void reset_flash_traffic_stats()
+{
+    FlashTrafficPacer::instance().resetStats();
+}
+
+std::error_code paced_stack_transaction(
+    MVLC &mvlc, const StackCommandBuilder &sb, std::vector<u32> &dest);
+
+std::error_code paced_vme_read(
+    MVLC &mvlc, u32 address, u32 &value, u8 amod, VMEDataWidth dataWidth);
+
+std::error_code paced_vme_write(
+    MVLC &mvlc, u32 address, u32 value, u8 amod, VMEDataWidth dataWidth);
+
+}
+
+#endif /* __MESYTEC_MVLC_MVP_TRAFFIC_H__ */
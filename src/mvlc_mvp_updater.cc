@@ -1,9 +1,14 @@
 #include <filesystem>
+#include <random>
+#include <sstream>
 #include <mesytec-mvlc/scanbus_support.h>
 #include <mesytec-mvlc/util/string_util.h>
 #include <device_type_check.h>
 #include <mvlc_mvp_lib.h>
 #include <mvlc_mvp_flash.h>
+#include <mvlc_mvp_identify.h>
+#include <mvlc_mvp_scheduler.h>
+#include <mvlc_mvp_traffic.h>
 #include <git_version.h>
 #include <QElapsedTimer>
 
@@ -42,6 +47,50 @@ unsigned long convert_to_unsigned(const std::string &str)
     return std::stoul(str, nullptr, 0);
 }
 
+double convert_to_double(const std::string &str)
+{
+    return std::stod(str);
+}
+
+// Parses the optional flash traffic budget params and sets the global budget
+// if any limit was given.
+bool parse_traffic_budget(argh::parser &parser)
+{
+    mesytec::mvp::FlashTrafficBudget budget;
+
+    if (!parse_into(parser, "--max-stacks-per-second", budget.maxTransactionsPerSecond, convert_to_double))
+        return false;
+
+    if (!parse_into(parser, "--max-bus-occupancy", budget.maxBusOccupancyPercent, convert_to_double))
+        return false;
+
+    if (budget.maxTransactionsPerSecond < 0.0)
+    {
+        std::cerr << "Error: --max-stacks-per-second must not be negative\n";
+        return false;
+    }
+
+    if (budget.maxBusOccupancyPercent < 0.0 || budget.maxBusOccupancyPercent > 100.0)
+    {
+        std::cerr << "Error: --max-bus-occupancy must be in range [0, 100]\n";
+        return false;
+    }
+
+    if (budget.isLimited())
+        mesytec::mvp::set_flash_traffic_budget(budget);
+
+    return true;
+}
+
+void print_traffic_stats(const std::string &cmdName)
+{
+    auto stats = mesytec::mvp::get_flash_traffic_stats();
+
+    std::cout << fmt::format("{}: {} MVLC transactions in {:.2f} s ({:.1f}/s), bus occupancy {:.1f}%, pacing delay {:.2f} s\n",
+        cmdName, stats.transactions, stats.elapsed.count() / 1e6, stats.transactionsPerSecond(),
+        stats.busOccupancyPercent(), stats.pacingDelay.count() / 1e6);
+}
+
 using namespace mesytec;
 using namespace mesytec::mvlc;
 
@@ -227,16 +276,28 @@ DEF_EXEC_FUNC(scanbus_command)
             std::cout << fmt::format("Found {} module candidate addresses: {:#010x}\n",
                 candidates.size(), fmt::join(candidates, ", "));
 
-        for (auto addr: candidates)
+        std::vector<ModuleIdentity> identities;
+
+        if (auto ec = identify_modules(mvlc, candidates, identities))
         {
-            VMEModuleInfo moduleInfo{};
+            std::cout << fmt::format("Error reading module ids: {}\n", ec.message());
+            return 1;
+        }
 
-            if (auto ec = read_module_info(mvlc, addr, moduleInfo))
+        for (const auto &ident: identities)
+        {
+            auto addr = ident.address;
+
+            if (ident.ec)
             {
-                std::cout << fmt::format("Error checking address {:#010x}: {}\n", addr, ec.message());
+                std::cout << fmt::format("Error checking address {:#010x}: {}\n", addr, ident.ec.message());
                 continue;
             }
 
+            VMEModuleInfo moduleInfo{};
+            moduleInfo.hwId = ident.hwId;
+            moduleInfo.fwId = ident.fwId;
+
             auto msg = fmt::format("Found module at {:#010x}: hwId={:#06x}, fwId={:#06x}, type={}",
                 addr, moduleInfo.hwId, moduleInfo.fwId, moduleInfo.moduleTypeName());
 
@@ -381,7 +442,7 @@ DEF_EXEC_FUNC(write_firmware_command)
     bool doVerify = false;
 
     auto parser = ctx.parser;
-    parser.add_params({"--vme-address", "--area", "--firmware"});
+    parser.add_params({"--vme-address", "--area", "--firmware", "--max-stacks-per-second", "--max-bus-occupancy"});
     parser.parse(argv);
     trace_log_parser_info(parser, "write_firmware_command");
 
@@ -391,6 +452,9 @@ DEF_EXEC_FUNC(write_firmware_command)
     if (!parse_into(parser, "--area", area, convert_to_unsigned))
         return 1;
 
+    if (!parse_traffic_budget(parser))
+        return 1;
+
     if (!(parser("--firmware") >> firmwareInput))
     {
         std::cerr << "Error: missing --firmware <file|dir> parameter!\n";
@@ -496,6 +560,7 @@ DEF_EXEC_FUNC(write_firmware_command)
 
         reportTimer.start();
         writer.write();
+        print_traffic_stats("write-firmware");
     } catch (const std::exception &e)
     {
         std::cerr << fmt::format("Error writing firmware to VME address 0x{:08x}: {}\n", vmeAddress, e.what());
@@ -531,6 +596,14 @@ Options:
         If specified the target flash sections will not be erased prior to
         writing. Use for debugging/testing only!
 
+    --max-stacks-per-second=<n>
+        Limit the number of MVLC transactions issued per second. Use to run
+        the update next to an active DAQ readout on the same MVLC.
+
+    --max-bus-occupancy=<percent>
+        Limit the percentage of time spent in MVLC transactions. After each
+        transaction the next one is delayed accordingly.
+
 
 )~"),
     .exec = write_firmware_command,
@@ -546,9 +619,12 @@ DEF_EXEC_FUNC(verify_firmware_command)
     u32 vmeAddress = 0;
     unsigned area = 0;
     std::string firmwareInput;
+    SampleVerifyOptions sampleOptions;
+    sampleOptions.seed = std::random_device()();
 
     auto parser = ctx.parser;
-    parser.add_params({"--vme-address", "--area", "--firmware"});
+    parser.add_params({"--vme-address", "--area", "--firmware", "--max-stacks-per-second", "--max-bus-occupancy",
+                       "--sample-pages", "--entropy-pages", "--seed"});
     parser.parse(argv);
     trace_log_parser_info(parser, "write_firmware_command");
 
@@ -558,6 +634,20 @@ DEF_EXEC_FUNC(verify_firmware_command)
     if (!parse_into(parser, "--area", area, convert_to_unsigned))
         return 1;
 
+    if (!parse_traffic_budget(parser))
+        return 1;
+
+    if (!parse_into(parser, "--sample-pages", sampleOptions.random_pages, convert_to_unsigned))
+        return 1;
+
+    if (!parse_into(parser, "--entropy-pages", sampleOptions.entropy_pages, convert_to_unsigned))
+        return 1;
+
+    if (!parse_into(parser, "--seed", sampleOptions.seed, convert_to_unsigned))
+        return 1;
+
+    const bool quickVerify = parser["--quick"];
+
     if (!(parser("--firmware") >> firmwareInput))
     {
         std::cerr << "Error: missing --firmware <file|dir> parameter!\n";
@@ -616,6 +706,9 @@ DEF_EXEC_FUNC(verify_firmware_command)
         writer.set_do_erase(false);
         writer.set_do_program(false);
         writer.set_do_verify(true);
+        writer.set_verify_mode(VerifyMode::CollectAll);
+        writer.set_quick_verify(quickVerify);
+        writer.set_sample_verify_options(sampleOptions);
         int curProgress = 0;
         int maxProgress = 0;
         QString writerStatus;
@@ -658,10 +751,19 @@ DEF_EXEC_FUNC(verify_firmware_command)
 
         reportTimer.start();
         writer.write();
+
+        for (const auto &part: writer.get_verify_reports())
+        {
+            std::cout << fmt::format("verify-firmware: {} (section {}): {}\n",
+                part.filename.toStdString(), part.section, part.report.to_string().toStdString());
+        }
+
+        print_traffic_stats("verify-firmware");
     }
     catch (const FlashVerificationError &e)
     {
         std::cerr << fmt::format("Firmware verification failed (VME address 0x{:08x}): {}\n", vmeAddress, e.to_string().toLocal8Bit().constData());
+        std::cerr << e.result().ranges_to_string().toLocal8Bit().constData() << "\n";
         return 1;
     }
     catch (const std::exception &e)
@@ -677,10 +779,11 @@ static const Command VerifyFirmwareCommand
 {
     .name = "verify-firmware",
     .help = unindent(R"~(
-Usage: verify-firmware --firmware=<file|dir> [--vme-address=<addr>] [--area=<area>]
+Usage: verify-firmware --firmware=<file|dir> [--vme-address=<addr>] [--area=<area>] [--quick]
 
     Compares the given MVP firmware package/file with the contents of the
-    specified destination device and area.
+    specified destination device and area. On mismatch all differing address
+    ranges of the failed part are listed.
 
 Options:
     --firmware=<file|dir>
@@ -693,10 +796,37 @@ Options:
         Flash area to write the firmware to. Not needed if a *.mvp package is
         used as these usually contain the target area encoded in the contained filenames.
 
+    --quick
+        Only compare a sample of the pages of each part: the first and last
+        pages, the pages with the highest data entropy and pseudo random
+        pages. If any sampled page differs the part is verified completely.
+        The sample size and the detection probability are reported per part.
+
+    --sample-pages=<n>
+        Number of pseudo random pages per part in quick mode. Default: 16.
+
+    --entropy-pages=<n>
+        Number of high entropy pages per part in quick mode. Default: 8.
+
+    --seed=<n>
+        Seed for the random page selection. Random by default, the seed used
+        is part of the report so that a run can be repeated.
+
+    --max-stacks-per-second=<n>
+        Limit the number of MVLC transactions issued per second. Use to run
+        the update next to an active DAQ readout on the same MVLC.
+
+    --max-bus-occupancy=<percent>
+        Limit the percentage of time spent in MVLC transactions. After each
+        transaction the next one is delayed accordingly.
+
 Example:
     # Connect to mvlc-0124 via ethernet and verify it's running FW0045.
     mvlc-mvp-updater verify-firmware --mvlc mvlc-0124 --firmware ~/MVLC_FW0045.mvp --vme-address 0xffff0000
 
+    # Quick check of an MDPP-16 at 0x00000000 using a sample of the pages.
+    mvlc-mvp-updater verify-firmware --mvlc mvlc-0124 --firmware ~/MDPP16_SCP_FW0050.mvp --quick
+
 )~"),
     .exec = verify_firmware_command
 };
@@ -761,6 +891,244 @@ Options:
     .exec = boot_module_command,
 };
 
+DEF_EXEC_FUNC(write_firmware_multi_command)
+{
+    (void) self; (void) argc; (void) argv;
+    spdlog::trace("entered write_firmware_multi_command()");
+
+    using namespace mesytec::mvp;
+
+    std::string vmeAddressesInput;
+    std::string firmwareInput;
+    std::vector<u32> vmeAddresses;
+    bool doErase = true;
+    bool doVerify = false;
+    bool useMulticast = true;
+
+    auto parser = ctx.parser;
+    parser.add_params({"--vme-addresses", "--firmware", "--max-stacks-per-second", "--max-bus-occupancy"});
+    parser.parse(argv);
+    trace_log_parser_info(parser, "write_firmware_multi_command");
+
+    if (!parse_traffic_budget(parser))
+        return 1;
+
+    if (!(parser("--vme-addresses") >> vmeAddressesInput))
+    {
+        std::cerr << "Error: missing --vme-addresses <addr,addr,...> parameter!\n";
+        return 1;
+    }
+
+    {
+        std::istringstream ss(vmeAddressesInput);
+        std::string part;
+
+        while (std::getline(ss, part, ','))
+        {
+            if (part.empty())
+                continue;
+
+            try
+            {
+                vmeAddresses.push_back(convert_to_unsigned(part));
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << fmt::format("Error: could not parse vme address '{}': {}\n", part, e.what());
+                return 1;
+            }
+        }
+    }
+
+    if (vmeAddresses.empty())
+    {
+        std::cerr << "Error: no vme addresses given\n";
+        return 1;
+    }
+
+    if (!(parser("--firmware") >> firmwareInput))
+    {
+        std::cerr << "Error: missing --firmware <file|dir> parameter!\n";
+        return 1;
+    }
+
+    if (parser["--no-erase"])
+        doErase = false;
+
+    if (parser["--verify"])
+        doVerify = true;
+
+    if (parser["--no-multicast"])
+        useMulticast = false;
+
+    mesytec::mvp::FirmwareArchive firmware;
+    namespace fs = std::filesystem;
+
+    auto st = fs::status(firmwareInput);
+    auto qFirmwareInput = QString::fromStdString(firmwareInput);
+
+    try
+    {
+        if (st.type() == fs::file_type::directory)
+            firmware = mesytec::mvp::from_dir(qFirmwareInput);
+        else
+        {
+            auto ext = str_tolower(fs::path(firmwareInput).extension().string());
+            if (ext == ".bin" || ext == ".key" || ext == ".hex")
+                firmware = mesytec::mvp::from_single_file(qFirmwareInput);
+            else
+                firmware = mesytec::mvp::from_zip(qFirmwareInput);
+        }
+
+        if (firmware.is_empty())
+        {
+            std::cerr << "Error: empty firmware data from " << firmwareInput << "\n";
+            return 1;
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << fmt::format("Error reading firmware from {}: {}\n", firmwareInput, e.what());
+        return 1;
+    }
+
+    auto [mvlc, ec] = make_and_connect_default_mvlc(ctx.parser);
+
+    if (!mvlc || ec)
+        return 1;
+
+    const auto parts = make_flash_part_tasks(firmware);
+    MultiModuleFlashScheduler scheduler(mvlc);
+    scheduler.setDoErase(doErase);
+    scheduler.setDoVerify(doVerify);
+    scheduler.setUseMulticast(useMulticast);
+    int ret = 0;
+
+    // Device type checks are done up front using the batched module
+    // identification. Mismatching modules are skipped.
+    std::vector<ModuleIdentity> identities;
+
+    if (auto ec = identify_modules(mvlc, vmeAddresses, identities, true))
+    {
+        std::cerr << fmt::format("Error identifying modules: {}\n", ec.message());
+        return 1;
+    }
+
+    for (auto &ident: identities)
+    {
+        const auto vmeAddress = ident.address;
+
+        if (ident.ec || ident.otpEc || !ident.canFlash)
+        {
+            std::cerr << fmt::format("Error checking VME address 0x{:08x}: {}\n", vmeAddress,
+                ident.ec ? ident.ec.message()
+                : !ident.canFlash ? ident.canFlashMessage
+                : ident.otpEc.message());
+            ret = 1;
+            continue;
+        }
+
+        auto targetDeviceType = OTP::from_flash_memory(gsl::span<uchar>(ident.otp)).get_device().trimmed();
+
+        if (!check_device_type_match(targetDeviceType, firmware,
+            [vmeAddress](const QString &msg) {
+                std::cout << fmt::format("0x{:08x}: {}\n", vmeAddress, msg.toLocal8Bit().constData()); }))
+        {
+            ret = 1;
+            continue;
+        }
+
+        scheduler.addJob({ vmeAddress, parts });
+    }
+
+    QElapsedTimer reportTimer;
+    static int ReportInterval_ms = 1000;
+
+    auto report = [&]
+    {
+        for (const auto &status: scheduler.getStatus())
+        {
+            std::cout << fmt::format("write-firmware-multi: 0x{:08x}: {} (part {}/{}, {}/{} bytes)\n",
+                status.vmeAddress, to_string(status.state), status.partIndex + 1, status.partCount,
+                status.bytesDone, status.bytesTotal);
+        }
+    };
+
+    scheduler.setProgressCallback([&] (const MultiModuleFlashScheduler::ModuleStatus &)
+    {
+        if (reportTimer.elapsed() >= ReportInterval_ms)
+        {
+            report();
+            reportTimer.start();
+        }
+    });
+
+    reportTimer.start();
+
+    if (!scheduler.run())
+        ret = 1;
+
+    print_traffic_stats("write-firmware-multi");
+
+    for (const auto &status: scheduler.getStatus())
+    {
+        if (status.state == MultiModuleFlashScheduler::State::Done)
+            std::cout << fmt::format("0x{:08x}: done\n", status.vmeAddress);
+        else
+            std::cerr << fmt::format("0x{:08x}: failed: {}\n", status.vmeAddress, status.error);
+    }
+
+    return ret;
+}
+
+static const Command WriteFirmwareMultiCommand
+{
+    .name = "write-firmware-multi",
+    .help = unindent(R"~(
+Usage: write-firmware-multi --firmware=<file|dir> --vme-addresses=<addr,addr,...>
+
+    Writes the given MVP firmware package/file to multiple modules connected
+    to the same MVLC. The modules are processed in an interleaved fashion:
+    while one module is erasing the others are programmed or verified.
+    A failing module does not affect the other modules.
+
+    As all modules get the same firmware the pages are written to all modules
+    at once using multicast write stacks. Each module is verified separately
+    afterwards.
+
+Options:
+    --firmware=<file|dir>
+        Path to the input file or directory. Usually a *.mvp file but can also be single *.bin or *.hex files.
+
+    --vme-addresses=<addr,addr,...>
+        Comma separated list of 32-bit VME addresses of the target devices.
+
+    --verify
+        If present the flash contents will be verified after writing.
+
+    --no-erase
+        If specified the target flash sections will not be erased prior to
+        writing. Use for debugging/testing only!
+
+    --no-multicast
+        Write each module separately instead of using multicast writes.
+        Verification is then only done if --verify is given.
+
+    --max-stacks-per-second=<n>
+        Limit the number of MVLC transactions issued per second. Use to run
+        the update next to an active DAQ readout on the same MVLC.
+
+    --max-bus-occupancy=<percent>
+        Limit the percentage of time spent in MVLC transactions. After each
+        transaction the next one is delayed accordingly.
+
+Example:
+    mvlc-mvp-updater write-firmware-multi --mvlc mvlc-0124 --firmware ~/MDPP16_SCP_FW0050.mvp --vme-addresses 0x00000000,0x00010000 --verify
+
+)~"),
+    .exec = write_firmware_multi_command,
+};
+
 inline Command make_command(const std::string &name)
 {
     Command ret;
@@ -850,6 +1218,7 @@ int main(int argc, char *argv[])
     ctx.commands.insert(ScanbusCommand);
     ctx.commands.insert(DumpMemoryCommand);
     ctx.commands.insert(WriteFirmwareCommand);
+    ctx.commands.insert(WriteFirmwareMultiCommand);
     ctx.commands.insert(VerifyFirmwareCommand);
     ctx.commands.insert(BootModuleCommand);
 
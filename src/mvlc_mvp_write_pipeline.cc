@@ -0,0 +1,256 @@
+#include "mvlc_mvp_write_pipeline.h"
+
+#include <array>
+#include <flash_constants.h>
+#include "mvlc_mvp_traffic.h"
+
+namespace mesytec::mvp
+{
+
+using namespace mesytec::mvlc;
+
+namespace
+{
+    const std::vector<u8> NopRequest = { opcodes::NOP };
+    const unsigned NopResponseSize = 3;
+
+    // Words read per outstanding stack: EFW mirror followed by the NOP
+    // response.
+    const unsigned StackResponseWords = EfwResponseSize + NopResponseSize;
+}
+
+PageWritePipeline::PageWritePipeline(MVLC &mvlc, u32 moduleBase, u8 section, unsigned maxInFlight)
+    : mvlc_(mvlc)
+    , moduleBase_(moduleBase)
+    , section_(section)
+    , maxInFlight_(std::max(maxInFlight, 1u))
+{
+}
+
+std::error_code PageWritePipeline::writePage(u32 pageAddress, const gsl::span<const u8> &page)
+{
+    std::array<gsl::span<const u8>, 1> pages = { page };
+    return writePages(pageAddress, pages);
+}
+
+std::error_code PageWritePipeline::writePages(
+    u32 firstPageAddress, const gsl::span<const gsl::span<const u8>> &pages)
+{
+    if (pages.empty())
+        return {};
+
+    auto logger = mvlc::get_logger("mvlc_mvp_lib");
+
+    if (inFlight_.size() >= maxInFlight_)
+    {
+        if (auto ec = collectResponses())
+            return ec;
+    }
+
+    const u32 stackRef = get_next_stack_reference();
+    u32 destAddr = firstPageAddress;
+
+    StackCommandBuilder sb;
+    sb.addWriteMarker(stackRef);
+
+    // EFW - enable flash write. The mirrored response is collected later on.
+    // WRF does not clear the EFW flag so one EFW per stack is enough.
+    for (auto op: EfwRequest)
+        sb.addVMEWrite(moduleBase_ + InputFifoRegister, op, vme_amods::A32, VMEDataWidth::D16);
+
+    // Each page is followed by the full program wait. Overlapping the wait
+    // with the upload of the next page would require the input fifo to
+    // accept the next WRF while the previous page is being programmed.
+    for (const auto &page: pages)
+    {
+        add_page_write_to_stack(sb, moduleBase_, destAddr, section_, page);
+        destAddr += page.size();
+    }
+
+    // NOP - clears write enable and marks the end of the stack's responses.
+    sb.addVMEWrite(moduleBase_ + InputFifoRegister, opcodes::NOP, vme_amods::A32, VMEDataWidth::D16);
+
+    std::vector<u32> stackResponse;
+
+    if (auto ec = paced_stack_transaction(mvlc_, sb, stackResponse))
+    {
+        logger->error("PageWritePipeline: stackTransaction failed for pages starting at 0x{:06x}: {}",
+                      firstPageAddress, ec.message());
+        return ec;
+    }
+
+    // Expect the 0xF3 stack frame and the marker word
+    if (stackResponse.size() != 2)
+        return make_error_code(MVLCErrorCode::UnexpectedResponseSize);
+
+    if (auto ec = get_stack_frame_error(stackResponse[0]))
+        return ec;
+
+    if (stackResponse[1] != stackRef)
+    {
+        logger->error("PageWritePipeline: stack response reference mismatch: got 0x{:08x}, expected 0x{:08x}",
+                      stackResponse[1], stackRef);
+        return MVLCErrorCode::StackReferenceMismatch;
+    }
+
+    inFlight_.push_back({ stackRef, firstPageAddress, pages.size() });
+    pagesWritten_ += pages.size();
+    ++stacksWritten_;
+
+    return {};
+}
+
+std::error_code PageWritePipeline::flush()
+{
+    while (!inFlight_.empty())
+    {
+        if (auto ec = collectResponses())
+            return ec;
+    }
+
+    return {};
+}
+
+std::error_code PageWritePipeline::collectResponses()
+{
+    if (inFlight_.empty())
+        return {};
+
+    auto logger = mvlc::get_logger("mvlc_mvp_lib");
+    const u32 stackRef = get_next_stack_reference();
+
+    StackCommandBuilder sb;
+    sb.addWriteMarker(stackRef);
+
+    // For each outstanding stack: poll the status register until the output
+    // fifo is not empty, then read exactly the size of the EFW mirror and the
+    // NOP response. No additional word is read so that the response of the
+    // next stack is not consumed. The final read must return the InvalidRead
+    // terminator, otherwise the fifo contained more data than expected.
+    for (size_t i=0; i<inFlight_.size(); ++i)
+    {
+        sb.addReadToAccu(moduleBase_ + StatusRegister, vme_amods::A32, VMEDataWidth::D16);
+        sb.addCompareLoopAccu(AccuComparator::EQ, 0);
+        sb.addSetAccu(StackResponseWords);
+        sb.addVMERead(moduleBase_ + OutputFifoRegister, vme_amods::A32, VMEDataWidth::D16);
+    }
+
+    sb.addVMERead(moduleBase_ + OutputFifoRegister, vme_amods::A32, VMEDataWidth::D16);
+
+    std::vector<u32> stackResponse;
+
+    if (auto ec = paced_stack_transaction(mvlc_, sb, stackResponse))
+    {
+        logger->error("PageWritePipeline: collect stackTransaction failed: {}", ec.message());
+        return ec;
+    }
+
+    if (stackResponse.size() < 2)
+        return make_error_code(MVLCErrorCode::UnexpectedResponseSize);
+
+    if (auto ec = get_stack_frame_error(stackResponse[0]))
+        return ec;
+
+    if (stackResponse[1] != stackRef)
+        return MVLCErrorCode::StackReferenceMismatch;
+
+    // Extract the raw data words. Unlike fill_page_buffer_from_stack_output()
+    // the InvalidRead words are kept so that missing responses can be
+    // attributed to the right stack.
+    std::vector<u32> dataWords;
+    dataWords.reserve(inFlight_.size() * StackResponseWords + 1);
+
+    for (size_t i=2; i<stackResponse.size(); ++i)
+    {
+        u32 word = stackResponse[i];
+
+        if (is_stack_buffer(word) || is_stack_buffer_continuation(word) || is_blockread_buffer(word))
+            continue;
+
+        dataWords.push_back(word);
+    }
+
+    auto add_error = [this] (const InFlightStack &stack, const std::vector<u8> &flashResponse)
+    {
+        PageWriteError error;
+        error.pageAddress = stack.pageAddress;
+        error.pageCount = stack.pageCount;
+        error.stackRef = stack.stackRef;
+        error.ec = make_error_code(std::errc::protocol_error);
+        error.flashResponse = flashResponse;
+        errors_.emplace_back(std::move(error));
+    };
+
+    // Each response must start with the EFW mirror and end with the NOP
+    // response. A short or extra response shifts the data of all following
+    // stacks, so once a response does not line up all remaining stacks of
+    // this collect are failed instead of being matched against the wrong
+    // data.
+    auto dataIter = dataWords.begin();
+    bool aligned = true;
+
+    for (const auto &stack: inFlight_)
+    {
+        std::vector<u8> flashResponse;
+
+        if (aligned)
+        {
+            bool invalidRead = false;
+
+            for (unsigned i=0; i<StackResponseWords && dataIter != dataWords.end(); ++i, ++dataIter)
+            {
+                if (*dataIter & output_fifo_flags::InvalidRead)
+                    invalidRead = true;
+                else
+                    flashResponse.push_back(*dataIter & output_fifo_flags::DataMask);
+            }
+
+            aligned = !invalidRead && flashResponse.size() == StackResponseWords;
+
+            if (aligned)
+            {
+                std::vector<u8> efwResponse(flashResponse.begin(), flashResponse.begin() + EfwResponseSize);
+                std::vector<u8> nopResponse(flashResponse.begin() + EfwResponseSize, flashResponse.end());
+                aligned = check_response(EfwRequest, efwResponse) && check_response(NopRequest, nopResponse);
+            }
+
+            if (aligned)
+                continue;
+        }
+
+        logger->error("PageWritePipeline: flash response check failed for {} pages starting at 0x{:06x}"
+                      " (stackRef=0x{:08x}), response={:#04x}",
+                      stack.pageCount, stack.pageAddress, stack.stackRef, fmt::join(flashResponse, ", "));
+        add_error(stack, flashResponse);
+    }
+
+    const bool terminated = (dataIter != dataWords.end()
+                             && (*dataIter & output_fifo_flags::InvalidRead)
+                             && dataIter + 1 == dataWords.end());
+
+    if (aligned && !terminated)
+    {
+        // Extra data after the last response: it can not be attributed to a
+        // single stack.
+        logger->error("PageWritePipeline: unexpected data after the last flash response,"
+                      " failing {} stacks", inFlight_.size());
+
+        for (const auto &stack: inFlight_)
+            add_error(stack, {});
+    }
+
+    if (!aligned || !terminated)
+    {
+        if (auto ec = clear_output_fifo(mvlc_, moduleBase_))
+        {
+            inFlight_.clear();
+            return ec;
+        }
+    }
+
+    inFlight_.clear();
+
+    return {};
+}
+
+}
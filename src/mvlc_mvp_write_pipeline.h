@@ -0,0 +1,83 @@
+#ifndef __MESYTEC_MVLC_MVP_WRITE_PIPELINE_H__
+#define __MESYTEC_MVLC_MVP_WRITE_PIPELINE_H__
+
+#include <deque>
+#include "mvlc_mvp_lib.h"
+
+namespace mesytec::mvp
+{
+
+// Error information for a write stack sent through the PageWritePipeline.
+struct PageWriteError
+{
+    u32 pageAddress = 0;        // flash byte address of the (first) page
+    size_t pageCount = 1;       // number of pages written by the stack
+    u32 stackRef = 0;           // reference marker of the stack that wrote the pages
+    std::error_code ec;
+    std::vector<u8> flashResponse; // raw flash response data if available
+};
+
+// Pipelined flash page writer.
+//
+// Each write stack consists of a single EFW followed by the WRF + page data
+// sequences of one or more consecutive pages (see add_page_write_to_stack())
+// and a final NOP which clears write enable. The stacks do not poll the flash
+// status and do not read the flash response. Instead the EFW mirror and NOP
+// responses accumulate in the flash output fifo. Once maxInFlight stacks have
+// been sent a single collect stack reads all pending responses which are then
+// matched to the written pages in order.
+//
+// Transport level errors (stack errors, reference mismatches) are returned
+// immediately. Flash level errors are collected and can be inspected using
+// errors() after calling flush(). If a response does not line up with the
+// expected EFW + NOP layout all stacks from that one on are reported as
+// failed and the output fifo is cleared.
+class PageWritePipeline
+{
+    public:
+        static const unsigned DefaultMaxInFlight = 4;
+
+        PageWritePipeline(MVLC &mvlc, u32 moduleBase, u8 section,
+                          unsigned maxInFlight = DefaultMaxInFlight);
+
+        // Sends out a stack writing the given page.
+        std::error_code writePage(u32 pageAddress, const gsl::span<const u8> &page);
+
+        // Sends out a single stack writing the given consecutive pages. The
+        // caller is responsible for keeping the stack size within the limits
+        // (see get_max_pages_per_stack()). If maxInFlight stacks are
+        // outstanding the pending flash responses are collected first.
+        std::error_code writePages(u32 firstPageAddress, const gsl::span<const gsl::span<const u8>> &pages);
+
+        // Collects the flash responses of all outstanding stacks.
+        std::error_code flush();
+
+        const std::vector<PageWriteError> &errors() const { return errors_; }
+        bool hasErrors() const { return !errors_.empty(); }
+        size_t pagesWritten() const { return pagesWritten_; }
+        size_t stacksWritten() const { return stacksWritten_; }
+        size_t inFlight() const { return inFlight_.size(); }
+
+    private:
+        struct InFlightStack
+        {
+            u32 stackRef;
+            u32 pageAddress;
+            size_t pageCount;
+        };
+
+        std::error_code collectResponses();
+
+        MVLC &mvlc_;
+        u32 moduleBase_;
+        u8 section_;
+        unsigned maxInFlight_;
+        std::deque<InFlightStack> inFlight_;
+        std::vector<PageWriteError> errors_;
+        size_t pagesWritten_ = 0;
+        size_t stacksWritten_ = 0;
+};
+
+}
+
+#endif /* __MESYTEC_MVLC_MVP_WRITE_PIPELINE_H__ */
@@ -0,0 +1,367 @@
+#include "mvp_device_model.h"
+
+namespace mesytec::mvp
+{
+
+namespace
+{
+  // WRF and REF: opcode, 3 address bytes, section, length (256 encoded as 0)
+  const size_t data_header_size = 6;
+
+  size_t decode_len_byte(uchar len_byte)
+  {
+    return len_byte == 0 ? constants::page_size : len_byte;
+  }
+
+  size_t decode_address(const uchar *instr)
+  {
+    return instr[1] | (instr[2] << 8) | (instr[3] << 16);
+  }
+
+  void append_big_endian(QVector<uchar> &dest, uint32_t value, size_t bytes)
+  {
+    for (size_t i=0; i<bytes; ++i)
+      dest.push_back((value >> (8 * (bytes - i - 1))) & 0xff);
+  }
+}
+
+MvpDeviceModel::MvpDeviceModel()
+{}
+
+MvpDeviceModel::MvpDeviceModel(const Options &opts)
+  : m_opts(opts)
+{}
+
+size_t MvpDeviceModel::get_instruction_size(const uchar *data, size_t size)
+{
+  if (!size)
+    return 0;
+
+  size_t ret = 1;
+
+  switch (data[0]) {
+    case opcodes::SAI:
+    case opcodes::VEB:
+    case opcodes::BFP:
+      ret = 4;
+      break;
+
+    case opcodes::UFA:
+    case opcodes::EFW:
+      ret = 3;
+      break;
+
+    case opcodes::ERF:
+      ret = 5;
+      break;
+
+    case opcodes::REF:
+      ret = data_header_size;
+      break;
+
+    case opcodes::WRF:
+      if (size < data_header_size)
+        return 0;
+      ret = data_header_size + decode_len_byte(data[5]);
+      break;
+  }
+
+  return size >= ret ? ret : 0;
+}
+
+void MvpDeviceModel::feed(const uchar *data, size_t size)
+{
+  m_input.append(QVector<uchar>(data, data + size));
+
+  int offset = 0;
+
+  while (offset < m_input.size()) {
+    auto instr = m_input.data() + offset;
+    auto instr_size = get_instruction_size(instr, m_input.size() - offset);
+
+    if (!instr_size)
+      break;
+
+    execute(instr, instr_size);
+    offset += instr_size;
+  }
+
+  m_input.remove(0, offset);
+}
+
+QVector<uchar> MvpDeviceModel::take_output()
+{
+  QVector<uchar> ret;
+  std::swap(ret, m_output);
+  return ret;
+}
+
+MvpDeviceModel::Duration MvpDeviceModel::take_busy_time()
+{
+  auto ret = m_busy_time;
+  m_busy_time = Duration(0);
+  return ret;
+}
+
+void MvpDeviceModel::reset_io()
+{
+  m_input.clear();
+  m_output.clear();
+}
+
+uchar MvpDeviceModel::get_status_byte(bool success) const
+{
+  uchar ret = success ? status::inst_success : 0;
+  ret |= (m_area << 1) & status::area;
+  ret |= (m_opts.dipswitch << 3) & status::dipswitch;
+  return ret;
+}
+
+void MvpDeviceModel::respond(const uchar *instr, size_t size, bool success)
+{
+  m_output.append(QVector<uchar>(instr, instr + size));
+  m_output.push_back(0xff);
+  m_output.push_back(get_status_byte(success));
+}
+
+bool MvpDeviceModel::check_access_code(const uchar *instr) const
+{
+  return instr[1] == constants::access_code[0]
+    && instr[2] == constants::access_code[1];
+}
+
+MvpDeviceModel::MemoryKey MvpDeviceModel::memory_key(uchar area, uchar section) const
+{
+  // The non area specific sections exist only once.
+  if (constants::non_area_specific_sections.contains(section))
+    area = 0;
+
+  return std::make_pair(area, section);
+}
+
+void MvpDeviceModel::execute(const uchar *instr, size_t size)
+{
+  const uchar op = instr[0];
+  ++m_instruction_counts[op];
+  m_busy_time += m_opts.instruction_time;
+
+  bool success = true;
+  // EFW sets write enable, WRF keeps it, everything else clears it.
+  bool write_enable = false;
+
+  switch (op) {
+    case opcodes::NOP:
+    case opcodes::RES:
+      respond(instr, size, true);
+      break;
+
+    case opcodes::SAI:
+      success = check_access_code(instr) && instr[3] < m_opts.area_count;
+      if (success)
+        m_area = instr[3];
+      respond(instr, size, success);
+      break;
+
+    case opcodes::BFP:
+      success = check_access_code(instr) && instr[3] < m_opts.area_count;
+      if (success) {
+        m_area = instr[3];
+        ++m_boot_count;
+      }
+      respond(instr, size, success);
+      break;
+
+    case opcodes::RAI:
+    case opcodes::RDI:
+      {
+        uchar value = op == opcodes::RAI ? m_area : m_opts.hardware_id;
+        m_output << op << value << 0xff << get_status_byte(true);
+      }
+      break;
+
+    case opcodes::UFA:
+      // Accepted but without effect: the factory areas are not protected in
+      // the model except for the OTP erase check below.
+      success = check_access_code(instr);
+      respond(instr, size, success);
+      break;
+
+    case opcodes::VEB:
+      success = check_access_code(instr) && instr[3] <= 1;
+      if (success)
+        m_verbose = (instr[3] == 0);
+      respond(instr, size, success);
+      break;
+
+    case opcodes::EFW:
+      success = check_access_code(instr);
+      write_enable = success;
+      respond(instr, size, success);
+      break;
+
+    case opcodes::ERF:
+      {
+        const uchar section = instr[4];
+        success = m_write_enabled && is_valid_section(section)
+          && section != constants::otp_section;
+
+        if (success) {
+          erase(m_area, section);
+          m_busy_time += m_opts.erase_time;
+        }
+
+        respond(instr, size, success);
+      }
+      break;
+
+    case opcodes::WRF:
+      {
+        const uchar section = instr[4];
+        success = m_write_enabled && is_valid_section(section);
+
+        if (success) {
+          program(m_area, section, decode_address(instr),
+            instr + data_header_size, size - data_header_size);
+          m_busy_time += m_opts.page_write_time;
+        }
+
+        write_enable = success;
+
+        // Silent in non-verbose mode. Errors show up as a cleared write
+        // enable flag only.
+        if (m_verbose)
+          respond(instr, size, success);
+      }
+      break;
+
+    case opcodes::REF:
+      {
+        const uchar section = instr[4];
+        const size_t len = decode_len_byte(instr[5]);
+        success = is_valid_section(section);
+
+        auto data = success
+          ? peek(m_area, section, decode_address(instr), len)
+          : QVector<uchar>(len, 0xff);
+
+        if (m_verbose) {
+          m_output.append(QVector<uchar>(instr, instr + size));
+          m_output.append(data);
+          m_output << 0xff << get_status_byte(success);
+        } else {
+          m_output.append(data);
+        }
+      }
+      break;
+
+    default:
+      success = false;
+      respond(instr, size, false);
+      break;
+  }
+
+  if (!success)
+    ++m_failed_instructions;
+
+  m_write_enabled = write_enable;
+}
+
+QVector<uchar> MvpDeviceModel::peek(uchar area, uchar section, size_t address, size_t len) const
+{
+  QVector<uchar> ret(len, 0xff);
+  auto it = m_memory.find(memory_key(area, section));
+
+  if (it == m_memory.end())
+    return ret;
+
+  const auto &mem = it->second;
+
+  for (size_t i=0; i<len; ++i) {
+    auto addr = address + i;
+    auto page = mem.find(addr / constants::page_size);
+
+    if (page != mem.end())
+      ret[i] = page->second[addr % constants::page_size];
+  }
+
+  return ret;
+}
+
+void MvpDeviceModel::program(uchar area, uchar section, size_t address,
+  const uchar *data, size_t len)
+{
+  auto &mem = m_memory[memory_key(area, section)];
+
+  for (size_t i=0; i<len; ++i) {
+    auto addr = (address + i) & constants::address_max;
+    auto &page = mem[addr / constants::page_size];
+
+    if (page.isEmpty())
+      page = Page(constants::page_size, 0xff);
+
+    // Programming can only clear bits.
+    page[addr % constants::page_size] &= data[i];
+  }
+}
+
+void MvpDeviceModel::poke(uchar area, uchar section, size_t address, const QVector<uchar> &data)
+{
+  auto &mem = m_memory[memory_key(area, section)];
+
+  for (int i=0; i<data.size(); ++i) {
+    auto addr = (address + i) & constants::address_max;
+    auto &page = mem[addr / constants::page_size];
+
+    if (page.isEmpty())
+      page = Page(constants::page_size, 0xff);
+
+    page[addr % constants::page_size] = data[i];
+  }
+}
+
+void MvpDeviceModel::erase(uchar area, uchar section)
+{
+  m_memory.erase(memory_key(area, section));
+}
+
+void MvpDeviceModel::program_otp(const QString &device, uint32_t sn)
+{
+  if (device.size() != static_cast<int>(otp::device_bytes))
+    throw OTPError("Invalid device name length");
+
+  QVector<uchar> data;
+
+  for (auto c: device.toLatin1())
+    data.push_back(c);
+
+  append_big_endian(data, sn, otp::sn_bytes);
+
+  poke(0, constants::otp_section, otp::device_offset, data);
+}
+
+void MvpDeviceModel::program_key(size_t slot, const Key &key)
+{
+  if (slot >= constants::max_keys)
+    throw KeyError("Invalid key slot");
+
+  QVector<uchar> data;
+
+  for (auto c: key.get_prefix().toLatin1())
+    data.push_back(c);
+
+  append_big_endian(data, key.get_sn(), keys::sn_bytes);
+  append_big_endian(data, key.get_sw(), keys::sw_bytes);
+  // Two unused bytes between the software id and the key.
+  data << 0xff << 0xff;
+  append_big_endian(data, key.get_key(), keys::key_bytes);
+
+  poke(0, constants::keys_section, slot * constants::keys_offset, data);
+}
+
+void MvpDeviceModel::reset_statistics()
+{
+  m_instruction_counts.clear();
+  m_failed_instructions = 0;
+}
+
+} // ns mesytec::mvp
@@ -0,0 +1,127 @@
+#ifndef EXTERNAL_LIBMVP_SRC_MVP_DEVICE_MODEL_H_
+#define EXTERNAL_LIBMVP_SRC_MVP_DEVICE_MODEL_H_
+
+#include <chrono>
+#include <map>
+#include <QMap>
+#include <QVector>
+
+#include "flash.h"
+#include "flash_constants.h"
+
+namespace mesytec::mvp
+{
+
+/** Software model of the MVP flash controller of a module.
+ *
+ * Instruction bytes are fed in using feed(), responses are collected using
+ * take_output(). Instructions may be split across multiple feed() calls. The
+ * model implements the opcodes from flash_constants.h with their response
+ * formats, verbose mode, area selection, the EFW write enable rule (cleared
+ * after any instruction except WRF and on error) and the status byte layout
+ * (inst_success, area and dipswitch bits).
+ *
+ * Flash memory is stored sparsely per (area, section). Unwritten memory reads
+ * as 0xFF, erasing resets a section to 0xFF and programming can only clear
+ * bits, like on the real NOR flash. The non area specific sections (OTP,
+ * keys, calibration) are shared by all areas. The OTP section can not be
+ * erased.
+ *
+ * The model does not sleep. The time the device would be busy executing the
+ * instructions is accumulated and can be retrieved using take_busy_time().
+ * Transports decide whether to wait for it (PTY emulator) or to advance a
+ * virtual clock. */
+class MvpDeviceModel
+{
+  public:
+    using Duration = std::chrono::microseconds;
+
+    struct Options
+    {
+      uchar hardware_id = 0x01;
+      uchar dipswitch   = 0;
+      uchar area_count  = constants::area_count;
+
+      Duration instruction_time = Duration(0);
+      Duration page_write_time  = Duration(0);
+      Duration erase_time       = Duration(0);
+    };
+
+    MvpDeviceModel();
+    explicit MvpDeviceModel(const Options &opts);
+
+    const Options &get_options() const { return m_opts; }
+    void set_options(const Options &opts) { m_opts = opts; }
+
+    /** Processes the given instruction bytes. Incomplete instructions are
+     * kept until the remaining bytes arrive. */
+    void feed(const uchar *data, size_t size);
+    void feed(const QVector<uchar> &data) { feed(data.data(), data.size()); }
+
+    /** Returns and clears the response bytes produced so far. */
+    QVector<uchar> take_output();
+    bool has_output() const { return !m_output.isEmpty(); }
+
+    /** Returns and clears the accumulated device busy time. */
+    Duration take_busy_time();
+
+    /** Drops buffered partial instructions and pending output. */
+    void reset_io();
+
+    // Device state
+    bool is_verbose() const { return m_verbose; }
+    bool is_write_enabled() const { return m_write_enabled; }
+    uchar get_area_index() const { return m_area; }
+    int get_boot_count() const { return m_boot_count; }
+    uchar get_status_byte(bool success) const;
+
+    // Direct memory access for test setup and inspection. Does not check or
+    // modify the protocol state.
+    QVector<uchar> peek(uchar area, uchar section, size_t address, size_t len) const;
+    void poke(uchar area, uchar section, size_t address, const QVector<uchar> &data);
+    void erase(uchar area, uchar section);
+
+    /** Writes device type and serial number into the OTP section. */
+    void program_otp(const QString &device, uint32_t sn);
+
+    /** Writes a key into the given key slot of the keys section. */
+    void program_key(size_t slot, const Key &key);
+
+    // Statistics
+    const QMap<uchar, size_t> &get_instruction_counts() const { return m_instruction_counts; }
+    size_t get_instruction_count(uchar opcode) const { return m_instruction_counts.value(opcode); }
+    size_t get_failed_instruction_count() const { return m_failed_instructions; }
+    void reset_statistics();
+
+  private:
+    using Page = QVector<uchar>;
+    using SectionMemory = std::map<size_t, Page>; // page index -> page data
+    using MemoryKey = std::pair<uchar, uchar>;    // area, section
+
+    static size_t get_instruction_size(const uchar *data, size_t size);
+
+    void execute(const uchar *instr, size_t size);
+    void respond(const uchar *instr, size_t size, bool success);
+    bool check_access_code(const uchar *instr) const;
+    MemoryKey memory_key(uchar area, uchar section) const;
+    void program(uchar area, uchar section, size_t address, const uchar *data, size_t len);
+
+    Options m_opts;
+    QVector<uchar> m_input;
+    QVector<uchar> m_output;
+    Duration m_busy_time = Duration(0);
+
+    bool m_verbose        = true;
+    bool m_write_enabled  = false;
+    uchar m_area          = 0;
+    int m_boot_count      = 0;
+
+    std::map<MemoryKey, SectionMemory> m_memory;
+
+    QMap<uchar, size_t> m_instruction_counts;
+    size_t m_failed_instructions = 0;
+};
+
+} // ns mesytec::mvp
+
+#endif // EXTERNAL_LIBMVP_SRC_MVP_DEVICE_MODEL_H_
@@ -0,0 +1,194 @@
+#include "mvp_pty_emulator.h"
+
+#include <vector>
+#include <QtGlobal>
+
+#ifdef Q_OS_UNIX
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#endif
+
+namespace mesytec::mvp
+{
+
+namespace
+{
+  // Bits per byte on the serial line: start bit, 8 data bits, stop bit.
+  const int bits_per_byte = 10;
+  const int poll_timeout_ms = 50;
+  const size_t read_buffer_size = 4096;
+
+#ifdef Q_OS_UNIX
+  std::runtime_error make_errno_error(const char *what)
+  {
+    return std::runtime_error(QString("MvpPtyEmulator: %1: %2")
+      .arg(what).arg(std::strerror(errno)).toStdString());
+  }
+#endif
+}
+
+MvpPtyEmulator::MvpPtyEmulator()
+{}
+
+MvpPtyEmulator::MvpPtyEmulator(const MvpDeviceModel::Options &opts)
+  : m_model(opts)
+{}
+
+MvpPtyEmulator::~MvpPtyEmulator()
+{
+  stop();
+}
+
+#ifdef Q_OS_UNIX
+
+void MvpPtyEmulator::start()
+{
+  if (is_running())
+    return;
+
+  m_master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+
+  if (m_master_fd < 0)
+    throw make_errno_error("posix_openpt");
+
+  if (grantpt(m_master_fd) < 0 || unlockpt(m_master_fd) < 0) {
+    auto e = make_errno_error("grantpt/unlockpt");
+    stop();
+    throw e;
+  }
+
+  m_port_name = QString::fromLocal8Bit(ptsname(m_master_fd));
+
+  // Keep the slave side open: reads on the master fail with EIO while no
+  // slave fd is open, e.g. in between two QSerialPort sessions.
+  m_slave_fd = ::open(m_port_name.toLocal8Bit().constData(), O_RDWR | O_NOCTTY);
+
+  if (m_slave_fd < 0) {
+    auto e = make_errno_error("open slave");
+    stop();
+    throw e;
+  }
+
+  struct termios tio;
+
+  if (tcgetattr(m_slave_fd, &tio) == 0) {
+    cfmakeraw(&tio);
+    tcsetattr(m_slave_fd, TCSANOW, &tio);
+  }
+
+  m_quit = false;
+  m_thread = std::thread(&MvpPtyEmulator::loop, this);
+
+  qDebug() << "MvpPtyEmulator: listening on" << m_port_name;
+}
+
+void MvpPtyEmulator::stop()
+{
+  m_quit = true;
+
+  if (m_thread.joinable())
+    m_thread.join();
+
+  if (m_slave_fd >= 0)
+    ::close(m_slave_fd);
+
+  if (m_master_fd >= 0)
+    ::close(m_master_fd);
+
+  m_slave_fd = m_master_fd = -1;
+  m_port_name.clear();
+}
+
+void MvpPtyEmulator::loop()
+{
+  std::vector<uchar> buf(read_buffer_size);
+
+  while (!m_quit) {
+    struct pollfd pfd = { m_master_fd, POLLIN, 0 };
+    int res = ::poll(&pfd, 1, poll_timeout_ms);
+
+    if (res < 0 && errno != EINTR) {
+      qDebug() << "MvpPtyEmulator: poll failed:" << std::strerror(errno);
+      break;
+    }
+
+    if (res <= 0)
+      continue;
+
+    auto bytes = ::read(m_master_fd, buf.data(), buf.size());
+
+    if (bytes <= 0) {
+      if (bytes < 0 && (errno == EINTR || errno == EAGAIN))
+        continue;
+      qDebug() << "MvpPtyEmulator: read from master failed:" << std::strerror(errno);
+      break;
+    }
+
+    QVector<uchar> output;
+    MvpDeviceModel::Duration busy(0);
+
+    {
+      std::lock_guard<std::mutex> guard(m_model_mutex);
+      m_model.feed(buf.data(), bytes);
+      output = m_model.take_output();
+      busy = m_model.take_busy_time();
+    }
+
+    // The time the device needs to receive the instructions and to send
+    // the response.
+    if (int baud = m_baud_rate)
+      busy += MvpDeviceModel::Duration(
+        (bytes + output.size()) * bits_per_byte * 1000000ll / baud);
+
+    if (double scale = m_time_scale; scale > 0.0 && busy.count() > 0)
+      std::this_thread::sleep_for(std::chrono::duration<double, std::micro>(busy.count() * scale));
+
+    if (!output.isEmpty())
+      write_to_master(output);
+  }
+}
+
+void MvpPtyEmulator::write_to_master(const QVector<uchar> &data)
+{
+  size_t written = 0;
+
+  while (written < static_cast<size_t>(data.size()) && !m_quit) {
+    auto res = ::write(m_master_fd, data.data() + written, data.size() - written);
+
+    if (res < 0) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      qDebug() << "MvpPtyEmulator: write to master failed:" << std::strerror(errno);
+      return;
+    }
+
+    written += res;
+  }
+}
+
+#else // Q_OS_UNIX
+
+void MvpPtyEmulator::start()
+{
+  throw std::runtime_error("MvpPtyEmulator: pseudo terminals are not supported on this platform");
+}
+
+void MvpPtyEmulator::stop()
+{
+}
+
+void MvpPtyEmulator::loop()
+{
+}
+
+void MvpPtyEmulator::write_to_master(const QVector<uchar> &)
+{
+}
+
+#endif // Q_OS_UNIX
+
+} // ns mesytec::mvp
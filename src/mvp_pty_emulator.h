@@ -0,0 +1,78 @@
+#ifndef EXTERNAL_LIBMVP_SRC_MVP_PTY_EMULATOR_H_
+#define EXTERNAL_LIBMVP_SRC_MVP_PTY_EMULATOR_H_
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include "mvp_device_model.h"
+
+namespace mesytec::mvp
+{
+
+/** Emulates an MVP module connected via serial port using a pseudo terminal.
+ *
+ * A worker thread reads instruction bytes from the master side of the PTY,
+ * runs them through a MvpDeviceModel and writes the responses back. The
+ * slave side (get_port_name()) can be opened by QSerialPort and used with
+ * SerialPortFlash like a real port.
+ *
+ * Device busy times reported by the model are slept for, scaled by the time
+ * scale factor (0 disables waiting). If a baud rate is set the transfer time
+ * of the response bytes is emulated as well.
+ *
+ * Only available on POSIX systems. start() throws on other platforms. */
+class MvpPtyEmulator
+{
+  public:
+    MvpPtyEmulator();
+    explicit MvpPtyEmulator(const MvpDeviceModel::Options &opts);
+    ~MvpPtyEmulator();
+
+    MvpPtyEmulator(const MvpPtyEmulator &) = delete;
+    MvpPtyEmulator &operator=(const MvpPtyEmulator &) = delete;
+
+    /** Opens the pseudo terminal and starts the worker thread. Throws
+     * std::runtime_error on error. */
+    void start();
+    void stop();
+    bool is_running() const { return m_thread.joinable(); }
+
+    /** Path of the PTY slave device, e.g. /dev/pts/3. Empty if not running. */
+    QString get_port_name() const { return m_port_name; }
+
+    void set_time_scale(double scale) { m_time_scale = scale; }
+    double get_time_scale() const { return m_time_scale; }
+
+    /** Emulated serial line speed in baud. 0 transfers without delay. */
+    void set_baud_rate(int baud) { m_baud_rate = baud; }
+    int get_baud_rate() const { return m_baud_rate; }
+
+    /** Calls f with the device model while holding the model lock. */
+    template<typename F>
+    auto with_model(F f)
+    {
+      std::lock_guard<std::mutex> guard(m_model_mutex);
+      return f(m_model);
+    }
+
+  private:
+    void loop();
+    void write_to_master(const QVector<uchar> &data);
+
+    MvpDeviceModel m_model;
+    std::mutex m_model_mutex;
+
+    int m_master_fd = -1;
+    int m_slave_fd  = -1;
+    QString m_port_name;
+
+    std::thread m_thread;
+    std::atomic<bool> m_quit{false};
+    std::atomic<double> m_time_scale{1.0};
+    std::atomic<int> m_baud_rate{0};
+};
+
+} // ns mesytec::mvp
+
+#endif // EXTERNAL_LIBMVP_SRC_MVP_PTY_EMULATOR_H_
@@ -0,0 +1,128 @@
+// Runs the MVP flash emulator on a pseudo terminal. By default the emulator
+// runs until interrupted and prints the port name to use with the GUI or
+// other tools. With --bench a firmware sized write and verify is done through
+// SerialPortFlash against the emulator to measure the serial path throughput.
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QSerialPort>
+#include <csignal>
+#include <iostream>
+#include <random>
+
+#include "mvp_pty_emulator.h"
+#include "serial_port_flash.h"
+
+using namespace mesytec::mvp;
+
+namespace
+{
+
+void run_bench(const QString &port_name, size_t bytes, bool streaming)
+{
+  QSerialPort port;
+  port.setPortName(port_name);
+
+  if (!port.open(QIODevice::ReadWrite))
+    throw make_com_error(&port);
+
+  SerialPortFlash flash(&port);
+  flash.set_streaming_enabled(streaming);
+  flash.ensure_clean_state();
+
+  std::mt19937 rng(1234);
+  std::uniform_int_distribution<int> dist(0, 0xff);
+  QVector<uchar> data(bytes);
+  std::generate(data.begin(), data.end(), [&] { return dist(rng); });
+
+  QElapsedTimer timer;
+  timer.start();
+  flash.erase_section(constants::firmware_section);
+  auto t_erase = timer.restart();
+  flash.write_memory({0, 0, 0}, constants::firmware_section, gsl::span(data));
+  auto t_write = timer.restart();
+  auto result = flash.verify_memory({0, 0, 0}, constants::firmware_section, gsl::span(data));
+  auto t_verify = timer.elapsed();
+
+  auto rate = [bytes] (qint64 ms) {
+    return ms > 0 ? bytes / 1024.0 / (ms / 1000.0) : 0.0;
+  };
+
+  std::cout << "streaming=" << streaming
+    << ": erase " << t_erase << " ms"
+    << ", write " << t_write << " ms (" << rate(t_write) << " KiB/s)"
+    << ", verify " << t_verify << " ms (" << rate(t_verify) << " KiB/s)"
+    << ", verify result: " << result.to_string().toStdString()
+    << std::endl;
+}
+
+std::atomic<bool> quit_requested{false};
+
+void signal_handler(int)
+{
+  quit_requested = true;
+}
+
+} // end anon namespace
+
+int main(int argc, char *argv[])
+{
+  QCoreApplication app(argc, argv);
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription("MVP flash emulator using a pseudo terminal");
+  parser.addHelpOption();
+  parser.addOptions({
+    { "device", "OTP device type (8 characters)", "device", "MDPP-16 " },
+    { "sn", "OTP serial number", "sn", "1234" },
+    { "hardware-id", "Hardware id returned by RDI", "id", "1" },
+    { "dipswitch", "DIP switch value", "value", "0" },
+    { "erase-time-ms", "Duration of a section erase", "ms", "0" },
+    { "page-write-time-us", "Duration of a page write", "us", "0" },
+    { "time-scale", "Factor applied to the emulated device times", "scale", "1.0" },
+    { "baud", "Emulated serial line speed, 0 for unlimited", "baud", "0" },
+    { "bench", "Write and verify the given number of bytes through SerialPortFlash and exit", "bytes" },
+  });
+
+  parser.process(app);
+
+  MvpDeviceModel::Options opts;
+  opts.hardware_id      = parser.value("hardware-id").toUInt(nullptr, 0);
+  opts.dipswitch        = parser.value("dipswitch").toUInt(nullptr, 0);
+  opts.erase_time       = std::chrono::milliseconds(parser.value("erase-time-ms").toInt());
+  opts.page_write_time  = MvpDeviceModel::Duration(parser.value("page-write-time-us").toInt());
+
+  MvpPtyEmulator emulator(opts);
+  emulator.set_time_scale(parser.value("time-scale").toDouble());
+  emulator.set_baud_rate(parser.value("baud").toInt());
+
+  try {
+    emulator.with_model([&] (MvpDeviceModel &model) {
+      model.program_otp(parser.value("device"), parser.value("sn").toUInt(nullptr, 0));
+    });
+
+    emulator.start();
+
+    if (parser.isSet("bench")) {
+      auto bytes = parser.value("bench").toULongLong(nullptr, 0);
+      run_bench(emulator.get_port_name(), bytes, false);
+      run_bench(emulator.get_port_name(), bytes, true);
+      return 0;
+    }
+  } catch (const std::exception &e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+
+  std::cout << "Emulating MVP device on " << emulator.get_port_name().toStdString()
+    << ", press Ctrl-C to quit" << std::endl;
+
+  std::signal(SIGINT, signal_handler);
+  std::signal(SIGTERM, signal_handler);
+
+  while (!quit_requested)
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  return 0;
+}
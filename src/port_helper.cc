@@ -111,7 +111,18 @@ void PortHelper::open_port()
 
 void PortHelper::refresh()
 {
-  emit available_ports_changed(get_available_ports());
+  m_last_ports = get_available_ports();
+  emit available_ports_changed(m_last_ports);
+}
+
+void PortHelper::refresh_if_changed()
+{
+  auto ports = get_available_ports();
+
+  if (ports != m_last_ports) {
+    m_last_ports = ports;
+    emit available_ports_changed(m_last_ports);
+  }
 }
 
 } // ns mvp
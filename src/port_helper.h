@@ -46,8 +46,13 @@ class PortHelper: public QObject
     void open_port();
 
   public slots:
+    /** Emits available_ports_changed() with the current port list. */
     void refresh();
 
+    /** Emits available_ports_changed() only if the port list differs from
+     * the one emitted last. */
+    void refresh_if_changed();
+
     /** Sets the port name the user wants to use. */
     void set_selected_port_name(const QString &name);
 
@@ -55,6 +60,7 @@ class PortHelper: public QObject
     QSerialPort *m_port;
     QSerialPortInfo m_selected_port_info;
     PortInfoProvider m_portinfo_provider;
+    PortInfoList m_last_ports;
 };
 
 } // ns mvp
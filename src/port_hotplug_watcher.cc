@@ -0,0 +1,76 @@
+#include "port_hotplug_watcher.h"
+
+#include <QDir>
+#include <QFileSystemWatcher>
+#include <QTimer>
+
+namespace mesytec
+{
+namespace mvp
+{
+
+namespace
+{
+  // udev creates /dev/serial/by-id when the first USB-serial device shows up
+  // and removes it once the last one is gone. /dev itself is always watched.
+  const char *dev_dir = "/dev";
+  const char *serial_by_id_dir = "/dev/serial/by-id";
+}
+
+PortHotplugWatcher::PortHotplugWatcher(QObject *parent)
+  : QObject(parent)
+  , m_watcher(new QFileSystemWatcher(this))
+  , m_debounce_timer(new QTimer(this))
+{
+  m_debounce_timer->setSingleShot(true);
+  m_debounce_timer->setInterval(debounce_ms);
+
+  connect(m_debounce_timer, &QTimer::timeout,
+    this, &PortHotplugWatcher::ports_changed);
+
+  connect(m_watcher, &QFileSystemWatcher::directoryChanged,
+    this, &PortHotplugWatcher::on_directory_changed);
+
+#ifdef Q_OS_LINUX
+  m_active = m_watcher->addPath(dev_dir);
+  watch_optional_dirs();
+#endif
+}
+
+PortInfoList PortHotplugWatcher::get_ports()
+{
+  QMutexLocker guard(&m_mutex);
+
+  if (m_dirty || !m_active) {
+    m_ports = QSerialPortInfo::availablePorts();
+    m_dirty = false;
+  }
+
+  return m_ports;
+}
+
+void PortHotplugWatcher::invalidate()
+{
+  QMutexLocker guard(&m_mutex);
+  m_dirty = true;
+}
+
+void PortHotplugWatcher::on_directory_changed(const QString &path)
+{
+  (void) path;
+
+  // Device nodes are created and renamed in several steps by udev. Collect
+  // the changes and notify once things have settled.
+  invalidate();
+  watch_optional_dirs();
+  m_debounce_timer->start();
+}
+
+void PortHotplugWatcher::watch_optional_dirs()
+{
+  if (QDir(serial_by_id_dir).exists() && !m_watcher->directories().contains(serial_by_id_dir))
+    m_watcher->addPath(serial_by_id_dir);
+}
+
+} // ns mvp
+} // ns mesytec
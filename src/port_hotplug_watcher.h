@@ -0,0 +1,68 @@
+#ifndef EXTERNAL_LIBMVP_SRC_PORT_HOTPLUG_WATCHER_H_
+#define EXTERNAL_LIBMVP_SRC_PORT_HOTPLUG_WATCHER_H_
+
+#include <QMutex>
+#include <QObject>
+#include "port_helper.h"
+
+class QFileSystemWatcher;
+class QTimer;
+
+namespace mesytec
+{
+namespace mvp
+{
+
+/** Serial port hotplug detection.
+ *
+ * On Linux the /dev and /dev/serial/by-id directories are watched for
+ * changes. Serial devices appearing or disappearing result in a single
+ * (debounced) ports_changed() signal. The port list is cached and only
+ * enumerated again after a change was detected, so the provider returned by
+ * get_provider() can be used by PortHelper instead of enumerating on every
+ * call.
+ *
+ * If watching is not possible (other platforms, /dev not accessible)
+ * is_active() returns false and the provider enumerates on every call. */
+class PortHotplugWatcher: public QObject
+{
+  Q_OBJECT
+  signals:
+    void ports_changed();
+
+  public:
+    static const int debounce_ms = 250;
+
+    PortHotplugWatcher(QObject *parent=nullptr);
+
+    /** True if the device directory is watched. Otherwise get_ports()
+     * enumerates the ports on every call. */
+    bool is_active() const { return m_active; }
+
+    /** Returns the cached port list, enumerating the ports if a change was
+     * detected since the last call. */
+    PortInfoList get_ports();
+
+    /** Marks the cached port list as outdated. */
+    void invalidate();
+
+    PortInfoProvider get_provider()
+    { return [this] { return get_ports(); }; }
+
+  private:
+    void on_directory_changed(const QString &path);
+    void watch_optional_dirs();
+
+    QFileSystemWatcher *m_watcher;
+    QTimer *m_debounce_timer;
+    bool m_active = false;
+
+    QMutex m_mutex;
+    PortInfoList m_ports;
+    bool m_dirty = true;
+};
+
+} // ns mvp
+} // ns mesytec
+
+#endif // EXTERNAL_LIBMVP_SRC_PORT_HOTPLUG_WATCHER_H_
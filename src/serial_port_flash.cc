@@ -1,5 +1,7 @@
 #include "serial_port_flash.h"
 
+#include <deque>
+
 namespace mesytec::mvp
 {
 
@@ -50,15 +52,14 @@ void SerialPortFlash::write_page(const Address &addr, uchar section,
 
   maybe_set_verbose(use_verbose);
   maybe_enable_write();
+  cache_invalidate(addr, section, sz);
 
-  uchar len_byte(sz == constants::page_size ? 0 : sz); // 256 encoded as 0
-  m_wbuf = { opcodes::WRF, addr[0], addr[1], addr[2], section, len_byte };
-
-  //qDebug() << "WRF: addr=" << addr << ", si =" << section << ", len =" << len_byte;
-
-  write_instruction(m_wbuf);
-  write(data, timeout_ms);
+  // Header and data are sent in one write.
+  QVector<uchar> buf;
+  append_page_write(buf, addr, section, data);
+  write(gsl::span(buf), timeout_ms);
 
+  emit instruction_written(buf.mid(0, 6));
   emit data_written(span_to_qvector(data));
 
   //qDebug() << "WRF data written:" << span_to_qvector(data);
@@ -75,6 +76,250 @@ void SerialPortFlash::write_page(const Address &addr, uchar section,
   }
 }
 
+void SerialPortFlash::append_page_write(QVector<uchar> &buf, const Address &addr,
+  uchar section, const gsl::span<uchar> data)
+{
+  uchar len_byte(data.size() == constants::page_size ? 0 : data.size()); // 256 encoded as 0
+  buf << opcodes::WRF << addr[0] << addr[1] << addr[2] << section << len_byte;
+  std::copy(std::begin(data), std::end(data), std::back_inserter(buf));
+}
+
+namespace
+{
+  // Each streamed write batch starts with EFW (NOP clears write enable) and
+  // ends with a NOP used as the sync point.
+  const QVector<uchar> batch_start = { opcodes::EFW, constants::access_code[0], constants::access_code[1] };
+  const QVector<uchar> batch_sync  = { opcodes::NOP };
+}
+
+void SerialPortFlash::read_batch_responses(int timeout_ms)
+{
+  for (const auto &instr: { batch_start, batch_sync }) {
+    QVector<uchar> wbuf(instr);
+    QVector<uchar> rbuf(instr.size() + 2);
+    read(gsl::span(rbuf), timeout_ms);
+    emit response_read(rbuf);
+    ensure_response_ok(gsl::span(wbuf), gsl::span(rbuf));
+  }
+}
+
+void SerialPortFlash::write_memory(const Address &start, uchar section,
+  const gsl::span<uchar> data)
+{
+  if (!m_streaming)
+    return FlashInterface::write_memory(start, section, data);
+
+  // WRF is silent in non-verbose mode which allows streaming the pages.
+  maybe_set_verbose(false);
+  cache_invalidate(start, section, data.size());
+
+  Address addr(start);
+  size_t remaining = data.size();
+  size_t offset    = 0;
+
+  emit progress_range_changed(0, std::max(static_cast<int>(remaining / constants::page_size), 1));
+  int progress = 0;
+
+  const int batch_timeout_ms = constants::data_timeout_ms * static_cast<int>(m_sync_interval)
+    + constants::default_timeout_ms;
+  size_t in_flight = 0;
+  QVector<uchar> buf;
+
+  try {
+    while (remaining) {
+      buf.clear();
+      buf += batch_start;
+
+      for (size_t i=0; i<m_sync_interval && remaining; ++i) {
+        emit progress_changed(progress++);
+        auto len  = std::min(constants::page_size, remaining);
+        auto page = gsl::span(data.data() + offset, len);
+        append_page_write(buf, addr, section, page);
+        emit data_written(span_to_qvector(page));
+
+        remaining -= len;
+        addr      += len;
+        offset    += len;
+      }
+
+      buf += batch_sync;
+      queue(gsl::span(buf));
+      ++in_flight;
+
+      // Keep the next batch queued while waiting for the sync response of the
+      // previous one.
+      if (in_flight > 1) {
+        read_batch_responses(batch_timeout_ms);
+        --in_flight;
+      }
+    }
+
+    while (in_flight) {
+      read_batch_responses(batch_timeout_ms);
+      --in_flight;
+    }
+  } catch (...) {
+    m_state.write_enabled = false;
+    throw;
+  }
+
+  // The trailing NOP cleared write enable.
+  m_state.write_enabled = false;
+}
+
+QVector<uchar> SerialPortFlash::read_memory(const Address &start, uchar section,
+  size_t len, size_t chunk_size, EarlyReturnFun early_return_fun)
+{
+  if (!m_streaming || m_read_pipeline_depth <= 1)
+    return FlashInterface::read_memory(start, section, len, chunk_size, early_return_fun);
+
+  QVector<uchar> ret(len);
+
+  if (cache_read_memory(start, section, len, chunk_size, early_return_fun, ret))
+    return ret;
+
+  return collect_memory(start, section, len, chunk_size, early_return_fun);
+}
+
+void SerialPortFlash::stream_memory(const Address &start, uchar section,
+  size_t len, size_t chunk_size, EarlyReturnFun f)
+{
+  if (!m_streaming || m_read_pipeline_depth <= 1)
+    return FlashInterface::stream_memory(start, section, len, chunk_size, f);
+
+  if (chunk_size == 0 || chunk_size > constants::page_size)
+    throw std::invalid_argument("stream_memory: invalid chunk size");
+
+  // The data of the queued reads stays in the port until consumed, so a
+  // single chunk buffer suffices.
+  QVector<uchar> buf(chunk_size);
+
+  emit progress_range_changed(0, std::max(static_cast<int>(len / chunk_size), 1));
+  int progress = 0;
+
+  maybe_set_verbose(false);
+
+  struct PendingRead
+  {
+    Address addr;
+    size_t len;
+  };
+
+  std::deque<PendingRead> pending;
+  Address next_addr(start);
+  size_t next_offset = 0;
+
+  auto queue_read = [&] {
+    auto rl = std::min(chunk_size, len - next_offset);
+    uchar len_byte(rl == constants::page_size ? 0 : rl); // 256 encoded as 0
+    QVector<uchar> ref = { opcodes::REF, next_addr[0], next_addr[1], next_addr[2], section, len_byte };
+    queue(gsl::span(ref));
+    pending.push_back({ next_addr, rl });
+    next_addr   += rl;
+    next_offset += rl;
+  };
+
+  // On error the data of the reads still in flight would be taken as the
+  // response of the next instruction, see read_device_snapshot().
+  try {
+    while (next_offset < len || !pending.empty()) {
+      while (next_offset < len && pending.size() < m_read_pipeline_depth)
+        queue_read();
+
+      auto cur = pending.front();
+      pending.pop_front();
+
+      emit progress_changed(progress++);
+
+      auto chunk = gsl::span(buf.data(), cur.len);
+      read(chunk, constants::data_timeout_ms);
+      cache_store(cur.addr, section, chunk);
+
+      if (f && f(cur.addr, section, chunk)) {
+        // Consume the data of the reads already sent out.
+        for (const auto &p: pending)
+          read(gsl::span(buf.data(), p.len), constants::data_timeout_ms);
+
+        return;
+      }
+    }
+  } catch (...) {
+    // The original error is reported, not a failed recovery.
+    try {
+      recover();
+    } catch (const std::exception &) {
+    }
+    throw;
+  }
+}
+
+DeviceSnapshot SerialPortFlash::read_device_snapshot()
+{
+  if (!m_streaming)
+    return FlashInterface::read_device_snapshot();
+
+  maybe_set_verbose(false);
+
+  auto make_ref = [](const Address &addr, uchar section, size_t len) {
+    return QVector<uchar>{ opcodes::REF, addr[0], addr[1], addr[2], section, static_cast<uchar>(len) };
+  };
+
+  QVector<uchar> rdi = { opcodes::RDI };
+  QVector<uchar> rai = { opcodes::RAI };
+  QVector<QVector<uchar>> instructions = { rdi, rai,
+    make_ref(Address(0), constants::otp_section, otp::total_bytes) };
+
+  for (size_t i=0; i<constants::max_keys; ++i)
+    instructions.push_back(make_ref(Address(i * constants::keys_offset),
+        constants::keys_section, keys::total_bytes));
+
+  for (auto &instr: instructions) {
+    track_instruction(gsl::span(instr));
+    queue(gsl::span(instr));
+    emit instruction_written(instr);
+  }
+
+  DeviceSnapshot ret;
+
+  // All responses are queued up in the port at this point. On error the
+  // remaining ones have to be drained, otherwise they would be taken as the
+  // response of the next instruction.
+  try {
+    read_response(m_rbuf, size_t(4));
+    ensure_response_ok(gsl::span(rdi), m_rbuf);
+    ret.hardware_id = m_rbuf[1];
+
+    read_response(m_rbuf, size_t(4));
+    ensure_response_ok(gsl::span(rai), m_rbuf);
+    ret.area        = m_rbuf[1];
+    ret.dipswitch   = get_dipswitch(get_last_status());
+    m_state.area    = ret.area;
+
+    QVector<uchar> mem(otp::total_bytes);
+    read(gsl::span(mem), constants::data_timeout_ms);
+    cache_store(Address(0), constants::otp_section, gsl::span(mem));
+    ret.otp = OTP::from_flash_memory(mem);
+
+    mem.resize(keys::total_bytes);
+
+    for (size_t i=0; i<constants::max_keys; ++i) {
+      Address addr(i * constants::keys_offset);
+      read(gsl::span(mem), constants::data_timeout_ms);
+      cache_store(addr, constants::keys_section, gsl::span(mem));
+      add_key_from_slot(ret.keys, i, mem);
+    }
+  } catch (...) {
+    // The original error is reported, not a failed recovery.
+    try {
+      recover();
+    } catch (const std::exception &) {
+    }
+    throw;
+  }
+
+  return ret;
+}
+
 void SerialPortFlash::read_page(const Address &addr, uchar section,
   gsl::span<uchar> dest, int timeout_ms)
 {
@@ -89,6 +334,9 @@ void SerialPortFlash::read_page(const Address &addr, uchar section,
   if (len > constants::page_size)
     throw std::invalid_argument("read_page: len > page size");
 
+  if (cache_lookup(addr, section, dest))
+    return;
+
   maybe_set_verbose(false);
 
   uchar len_byte(len == constants::page_size ? 0 : len); // 256 encoded as 0
@@ -96,21 +344,14 @@ void SerialPortFlash::read_page(const Address &addr, uchar section,
   m_wbuf = { opcodes::REF, addr[0], addr[1], addr[2], section, len_byte };
   write_instruction(m_wbuf);
   read(dest, timeout_ms);
+  cache_store(addr, section, dest);
 }
 
 void SerialPortFlash::write_instruction(const gsl::span<uchar> data, int timeout_ms)
 {
+  track_instruction(data);
   write(data, timeout_ms);
 
-  uchar opcode(*std::begin(data));
-
-  if (opcode != opcodes::WRF && m_write_enabled) {
-    // any instruction except WRF (and EFW) unsets write enable
-    qDebug() << "clearing cached write_enable flag (instruction ="
-      << op_to_string(opcode) << "!= WRF)";
-    m_write_enabled = false;
-  }
-
   //qDebug() << "instruction written:" << format_bytes(span_to_qvector(data));
 
   emit instruction_written(span_to_qvector(data));
@@ -132,6 +373,14 @@ void SerialPortFlash::write(const gsl::span<uchar> data, int timeout_ms)
   }
 }
 
+void SerialPortFlash::queue(const gsl::span<uchar> data)
+{
+  qint64 res = m_port->write(reinterpret_cast<const char *>(data.data()), data.size());
+
+  if (res != static_cast<qint64>(data.size()))
+    throw make_com_error(m_port);
+}
+
 void SerialPortFlash::read(gsl::span<uchar> dest, int timeout_ms)
 {
   const auto len = dest.size();
@@ -19,7 +19,12 @@ namespace mesytec::mvp
         , m_port(device)
       {}
 
-      void set_port(gsl::not_null<QIODevice *> device) { m_port = device; }
+      void set_port(gsl::not_null<QIODevice *> device)
+      {
+        m_port = device;
+        m_state = {};
+        clear_page_cache();
+      }
       QIODevice *get_port() const { return m_port; }
 
       void write_instruction(const gsl::span<uchar> data,
@@ -36,6 +41,38 @@ namespace mesytec::mvp
 
       void recover(size_t tries=default_recover_tries) override;
 
+      /** Streaming mode: consecutive page writes are collected into a single
+       * write buffer and sent without waiting for each instruction to be
+       * written. Every sync_interval pages a NOP is appended and its response
+       * is used for flow control and error detection. Up to two such batches
+       * are in flight at any time. Page reads queue up to
+       * read_pipeline_depth REF instructions before consuming the data of
+       * the first one. Disabled by default. */
+      void set_streaming_enabled(bool b) { m_streaming = b; }
+      bool is_streaming_enabled() const { return m_streaming; }
+
+      void set_sync_interval(size_t pages) { m_sync_interval = std::max(pages, size_t(1)); }
+      size_t get_sync_interval() const { return m_sync_interval; }
+
+      void set_read_pipeline_depth(size_t depth) { m_read_pipeline_depth = std::max(depth, size_t(1)); }
+      size_t get_read_pipeline_depth() const { return m_read_pipeline_depth; }
+
+      void write_memory(const Address &start, uchar section,
+        const gsl::span<uchar> data) override;
+
+      QVector<uchar> read_memory(const Address &start, uchar section,
+        size_t len, size_t chunk_size, EarlyReturnFun f = nullptr) override;
+
+      void stream_memory(const Address &start, uchar section,
+        size_t len, size_t chunk_size, EarlyReturnFun f) override;
+
+      /** In streaming mode the RDI, RAI and all OTP and key reads are sent
+       * as one burst before the first response is consumed. */
+      DeviceSnapshot read_device_snapshot() override;
+
+      static const size_t default_sync_interval = 16;
+      static const size_t default_read_pipeline_depth = 4;
+
     protected:
       QVector<uchar> read_available(
         int timeout_ms = constants::default_timeout_ms);
@@ -46,8 +83,18 @@ namespace mesytec::mvp
       void read(gsl::span<uchar> dest,
         int timeout_ms = constants::default_timeout_ms);
 
+      /** Hands the data to the device without waiting for it to be written. */
+      void queue(const gsl::span<uchar> data);
+
     private:
+      void append_page_write(QVector<uchar> &buf, const Address &addr,
+        uchar section, const gsl::span<uchar> data);
+      void read_batch_responses(int timeout_ms);
+
       QIODevice *m_port = nullptr;
+      bool m_streaming = false;
+      size_t m_sync_interval = default_sync_interval;
+      size_t m_read_pipeline_depth = default_read_pipeline_depth;
   };
 
 }
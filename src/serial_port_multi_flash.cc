@@ -0,0 +1,176 @@
+#include "serial_port_multi_flash.h"
+
+#include <QElapsedTimer>
+#include <QSerialPort>
+#include <QThreadPool>
+#include <QtConcurrent>
+
+#include "device_type_check.h"
+#include "firmware_ops.h"
+#include "serial_port_flash.h"
+
+namespace mesytec::mvp
+{
+
+bool is_usb_serial_port(const QSerialPortInfo &info)
+{
+  return info.hasVendorIdentifier() && !info.serialNumber().isEmpty();
+}
+
+PortInfoList find_ports(PortFilter filter, PortInfoProvider provider)
+{
+  auto ports = provider ? provider() : QSerialPortInfo::availablePorts();
+
+  if (filter) {
+    ports.erase(std::remove_if(ports.begin(), ports.end(),
+          [&](const QSerialPortInfo &info) { return !filter(info); }), ports.end());
+  }
+
+  return ports;
+}
+
+MultiPortFlasher::MultiPortFlasher(const FirmwareArchive &firmware, QObject *parent)
+  : QObject(parent)
+  , m_firmware(firmware)
+{
+}
+
+bool MultiPortFlasher::run()
+{
+  {
+    QMutexLocker guard(&m_mutex);
+    m_progress = QVector<PortProgress>(m_ports.size());
+    m_results = QVector<PortFlashResult>(m_ports.size());
+  }
+
+  // Dedicated pool so that all ports run concurrently regardless of the
+  // global thread pool size.
+  QThreadPool pool;
+  pool.setMaxThreadCount(std::max(m_ports.size(), 1));
+
+  QVector<QFuture<PortFlashResult>> futures;
+
+  for (int i=0; i<m_ports.size(); ++i) {
+    auto info = m_ports[i];
+    futures.push_back(QtConcurrent::run(&pool, [this, i, info] {
+          return flash_port(i, info);
+          }));
+  }
+
+  bool ret = true;
+
+  for (int i=0; i<futures.size(); ++i) {
+    auto result = futures[i].result();
+    ret = ret && result.success;
+
+    QMutexLocker guard(&m_mutex);
+    m_results[i] = result;
+  }
+
+  return ret;
+}
+
+QVector<PortFlashResult> MultiPortFlasher::get_results() const
+{
+  QMutexLocker guard(&m_mutex);
+  return m_results;
+}
+
+void MultiPortFlasher::update_progress(int index, int value, int max)
+{
+  qint64 total = 0;
+  int count = 0;
+
+  {
+    QMutexLocker guard(&m_mutex);
+    auto &p = m_progress[index];
+
+    if (max >= 0)
+      p.max = max;
+    p.value = value;
+
+    for (const auto &pp: m_progress) {
+      if (pp.max > 0)
+        total += static_cast<qint64>(pp.value) * progress_per_port / pp.max;
+    }
+
+    count = m_progress.size();
+  }
+
+  emit progress_changed(static_cast<int>(total), count * progress_per_port);
+}
+
+PortFlashResult MultiPortFlasher::flash_port(int index, const QSerialPortInfo &info)
+{
+  PortFlashResult result;
+  result.port_name = info.portName();
+  result.serial_number = info.serialNumber();
+
+  QElapsedTimer timer;
+  timer.start();
+
+  auto log = [&](const QString &msg) {
+    emit port_status_message(result.port_name, msg);
+  };
+
+  try {
+    // The port and flash objects live in this worker thread.
+    QSerialPort port;
+    port.setPortName(info.portName());
+
+    if (!port.open(QIODevice::ReadWrite))
+      throw make_com_error(&port);
+
+    SerialPortFlash flash(&port);
+
+    connect(&flash, &FlashInterface::progress_range_changed, [&](int, int max) {
+        update_progress(index, 0, max);
+        });
+
+    connect(&flash, &FlashInterface::progress_changed, [&](int value) {
+        update_progress(index, value, -1);
+        });
+
+    connect(&flash, &FlashInterface::progress_text_changed, log);
+
+    flash.ensure_clean_state();
+
+    auto otp = flash.read_otp();
+    result.device = otp.get_device();
+
+    if (!check_device_type_match(otp.get_device(), m_firmware, log))
+      throw std::runtime_error("device type does not match the firmware");
+
+    if (m_area_index >= 0)
+      flash.set_area_index(m_area_index);
+
+    FirmwareWriter writer(m_firmware, &flash);
+    writer.set_do_erase(m_do_erase);
+    writer.set_do_program(m_do_program);
+    writer.set_do_verify(m_do_verify);
+
+    connect(&writer, &FirmwareWriter::status_message, log);
+
+    writer.write();
+    result.success = true;
+  } catch (const FlashInstructionError &e) {
+    result.error = e.to_string();
+  } catch (const FlashVerificationError &e) {
+    result.error = e.to_string();
+  } catch (const std::exception &e) {
+    result.error = QString(e.what());
+  }
+
+  result.elapsed_ms = timer.elapsed();
+
+  // A failed port keeps the progress it reached, the failure is reported by
+  // port_finished().
+  if (result.success)
+    update_progress(index, 1, 1);
+
+  emit port_finished(result.port_name, result.success, result.error);
+
+  return result;
+}
+
+} // ns mesytec::mvp
@@ -0,0 +1,99 @@
+#ifndef EXTERNAL_LIBMVP_SRC_SERIAL_PORT_MULTI_FLASH_H_
+#define EXTERNAL_LIBMVP_SRC_SERIAL_PORT_MULTI_FLASH_H_
+
+#include <QMutex>
+#include <QObject>
+#include <QVector>
+
+#include "firmware.h"
+#include "port_helper.h"
+
+namespace mesytec::mvp
+{
+  struct PortFlashResult
+  {
+    QString port_name;
+    QString serial_number;
+    QString device;     // OTP device type, empty if it could not be read
+    bool success = false;
+    QString error;
+    qint64 elapsed_ms = 0;
+  };
+
+  typedef std::function<bool (const QSerialPortInfo &)> PortFilter;
+
+  /** Matches USB-serial adapters: ports reporting a USB vendor id and a
+   * serial number. Built-in serial ports are skipped. */
+  bool is_usb_serial_port(const QSerialPortInfo &info);
+
+  /** Returns the ports from the provider accepted by the filter. */
+  PortInfoList find_ports(PortFilter filter = is_usb_serial_port,
+    PortInfoProvider provider = {});
+
+  /** Writes a firmware archive to the devices connected to multiple serial
+   * ports in parallel.
+   *
+   * Each port is handled by its own worker thread creating its own
+   * QSerialPort and SerialPortFlash instances. A worker reads the OTP of its
+   * device, checks the device type against the firmware and runs a
+   * FirmwareWriter. Failures are recorded per port and do not affect the
+   * other ports. Signals are emitted from the worker threads. */
+  class MultiPortFlasher: public QObject
+  {
+    Q_OBJECT
+    signals:
+      void port_status_message(const QString &port_name, const QString &msg);
+      void port_finished(const QString &port_name, bool success, const QString &error);
+      /** Aggregated progress of the current operation (erase, program,
+       * verify) of all ports. Each port contributes progress_per_port steps
+       * to max. The progress of a failed port stays at the value reached
+       * before the failure, so max is not reached if any port failed. */
+      void progress_changed(int value, int max);
+
+    public:
+      static const int progress_per_port = 1000;
+
+      MultiPortFlasher(const FirmwareArchive &firmware, QObject *parent = nullptr);
+
+      void set_ports(const PortInfoList &ports) { m_ports = ports; }
+      PortInfoList get_ports() const { return m_ports; }
+
+      /** Area index to select before writing. -1 to use the currently
+       * selected area. */
+      void set_area_index(int area) { m_area_index = area; }
+
+      void set_do_erase(bool b)   { m_do_erase = b; }
+      void set_do_program(bool b) { m_do_program = b; }
+      void set_do_verify(bool b)  { m_do_verify = b; }
+
+      /** Runs all ports to completion. Blocks the calling thread. Returns
+       * true if all ports succeeded. */
+      bool run();
+
+      QVector<PortFlashResult> get_results() const;
+
+    private:
+      struct PortProgress
+      {
+        int value = 0;
+        int max = 0;
+      };
+
+      PortFlashResult flash_port(int index, const QSerialPortInfo &info);
+      void update_progress(int index, int value, int max);
+
+      FirmwareArchive m_firmware;
+      PortInfoList m_ports;
+      int m_area_index = -1;
+      bool m_do_erase = true;
+      bool m_do_program = true;
+      bool m_do_verify = false;
+
+      mutable QMutex m_mutex;
+      QVector<PortProgress> m_progress;
+      QVector<PortFlashResult> m_results;
+  };
+
+} // ns mesytec::mvp
+
+#endif // EXTERNAL_LIBMVP_SRC_SERIAL_PORT_MULTI_FLASH_H_
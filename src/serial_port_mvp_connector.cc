@@ -2,6 +2,7 @@
 
 #include "serial_port_flash.h"
 #include "port_helper.h"
+#include "port_hotplug_watcher.h"
 
 namespace mesytec::mvp
 {
@@ -11,6 +12,10 @@ struct SerialPortMvpConnector::Private
     QSerialPort *serialPort_;
     SerialPortFlash *flash_;
     PortHelper *portHelper_;
+    // Not a child of the connector: the connector is moved to worker threads
+    // while actions run but the watcher has to stay in the gui thread to
+    // receive notifications.
+    std::unique_ptr<PortHotplugWatcher> hotplugWatcher_;
     QVariantMap connectInfo_;
 };
 
@@ -20,12 +25,30 @@ SerialPortMvpConnector::SerialPortMvpConnector(QObject *parent)
 {
     d->serialPort_ = new QSerialPort(this);
     d->flash_ = new SerialPortFlash(d->serialPort_, this);
-    d->portHelper_ = new PortHelper(d->serialPort_, this);
+    d->hotplugWatcher_ = std::make_unique<PortHotplugWatcher>();
+    d->portHelper_ = new PortHelper(d->serialPort_, d->hotplugWatcher_->get_provider(), this);
+
+    connect(d->hotplugWatcher_.get(), &PortHotplugWatcher::ports_changed,
+            d->portHelper_, &PortHelper::refresh_if_changed);
+
+    // Polling fallback. With hotplug detection active the port list is only
+    // enumerated again every FallbackRefreshInterval_ms to catch missed
+    // events.
+    static const int PollRefreshInterval_ms = 1000;
+    static const int FallbackRefreshInterval_ms = 10000;
 
     auto refreshTimer = new QTimer(this);
-    connect(refreshTimer, &QTimer::timeout, d->portHelper_, &PortHelper::refresh);
-    refreshTimer->setInterval(1000);
+    connect(refreshTimer, &QTimer::timeout, this, [this] {
+        if (d->hotplugWatcher_->is_active())
+            d->hotplugWatcher_->invalidate();
+        d->portHelper_->refresh_if_changed();
+    });
+    refreshTimer->setInterval(d->hotplugWatcher_->is_active()
+                              ? FallbackRefreshInterval_ms : PollRefreshInterval_ms);
     refreshTimer->start();
+
+    // Initial port list.
+    QTimer::singleShot(0, d->portHelper_, &PortHelper::refresh);
 }
 
 SerialPortMvpConnector::~SerialPortMvpConnector()
@@ -0,0 +1,225 @@
+#include "simulated_flash.h"
+
+#include <thread>
+
+namespace mesytec::mvp
+{
+
+SimulatedFlash::SimulatedFlash(QObject *parent)
+  : FlashInterface(parent)
+{}
+
+SimulatedFlash::SimulatedFlash(const MvpDeviceModel::Options &opts, QObject *parent)
+  : FlashInterface(parent)
+  , m_model(opts)
+{}
+
+void SimulatedFlash::inject_fault(FaultType type, uchar opcode, size_t skip)
+{
+  m_faults.push_back({ type, opcode, skip });
+}
+
+void SimulatedFlash::set_random_faults(FaultType type, double rate, unsigned seed)
+{
+  m_random_fault_type = type;
+  m_random_fault_rate = rate;
+  m_rng.seed(seed);
+}
+
+void SimulatedFlash::clear_faults()
+{
+  m_faults.clear();
+  m_random_fault_rate = 0.0;
+}
+
+bool SimulatedFlash::take_fault(uchar opcode, bool response_fault, FaultType &type)
+{
+  auto matches_phase = [response_fault] (FaultType t) {
+    return (t != FaultType::DropInstruction) == response_fault;
+  };
+
+  for (int i=0; i<m_faults.size(); ++i) {
+    auto &fault = m_faults[i];
+
+    if (fault.opcode != any_opcode && fault.opcode != opcode)
+      continue;
+
+    if (!matches_phase(fault.type))
+      continue;
+
+    if (fault.skip) {
+      --fault.skip;
+      continue;
+    }
+
+    type = fault.type;
+    m_faults.remove(i);
+    return true;
+  }
+
+  if (m_random_fault_rate > 0.0 && matches_phase(m_random_fault_type)) {
+    std::uniform_real_distribution<double> dist(0.0, 1.0);
+
+    if (dist(m_rng) < m_random_fault_rate) {
+      type = m_random_fault_type;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void SimulatedFlash::advance(Duration d)
+{
+  m_virtual_time += d;
+
+  if (m_time_scale > 0.0 && d.count() > 0)
+    std::this_thread::sleep_for(std::chrono::duration<double, std::micro>(d.count() * m_time_scale));
+}
+
+void SimulatedFlash::transfer(const gsl::span<uchar> data)
+{
+  if (data.empty())
+    throw std::invalid_argument("transfer: empty instruction given");
+
+  const uchar opcode = *std::begin(data);
+
+  advance(m_transfer_latency + m_byte_latency * static_cast<long long>(data.size()));
+
+  FaultType fault = FaultType::DropInstruction;
+
+  if (take_fault(opcode, false, fault)) {
+    ++m_injected_faults;
+    return;
+  }
+
+  m_model.feed(data.data(), data.size());
+  auto response = m_model.take_output();
+  advance(m_model.take_busy_time() + m_byte_latency * static_cast<long long>(response.size()));
+
+  // Response faults are only taken by instructions producing a response.
+  // Otherwise e.g. a FailStatus fault for WRF would be used up by the silent
+  // page writes done with verbose mode off.
+  if (!response.isEmpty() && take_fault(opcode, true, fault)) {
+    ++m_injected_faults;
+
+    switch (fault) {
+      case FaultType::ResponseTimeout:
+        response.clear();
+        break;
+
+      case FaultType::CorruptResponse:
+        response[0] ^= 0xff;
+        break;
+
+      case FaultType::FailStatus:
+        response.last() &= ~status::inst_success;
+        break;
+
+      case FaultType::DropInstruction:
+        break;
+    }
+  }
+
+  m_rx += response;
+}
+
+void SimulatedFlash::write_instruction(const gsl::span<uchar> data, int)
+{
+  track_instruction(data);
+  transfer(data);
+
+  emit instruction_written(span_to_qvector(data));
+}
+
+void SimulatedFlash::read_response(gsl::span<uchar> dest, int timeout_ms)
+{
+  read(dest, timeout_ms);
+  emit response_read(span_to_qvector(dest));
+}
+
+void SimulatedFlash::read(gsl::span<uchar> dest, int timeout_ms)
+{
+  const auto len = static_cast<int>(dest.size());
+
+  if (m_rx.size() < len) {
+    // Nothing else is going to arrive.
+    advance(std::chrono::milliseconds(timeout_ms));
+    throw ComError("read timeout", QSerialPort::TimeoutError);
+  }
+
+  std::copy(m_rx.begin(), m_rx.begin() + len, std::begin(dest));
+  m_rx.remove(0, len);
+}
+
+void SimulatedFlash::write_page(const Address &addr, uchar section,
+  const gsl::span<uchar> data, int)
+{
+  const auto sz = data.size();
+
+  if (sz == 0)
+    throw std::invalid_argument("write_page: empty data given");
+
+  if (sz > constants::page_size)
+    throw std::invalid_argument("write_page: data size > page size");
+
+  maybe_set_verbose(false);
+  maybe_enable_write();
+  cache_invalidate(addr, section, sz);
+
+  uchar len_byte(sz == constants::page_size ? 0 : sz); // 256 encoded as 0
+  QVector<uchar> buf = { opcodes::WRF, addr[0], addr[1], addr[2], section, len_byte };
+  std::copy(std::begin(data), std::end(data), std::back_inserter(buf));
+
+  transfer(gsl::span(buf));
+
+  emit instruction_written(buf.mid(0, 6));
+  emit data_written(span_to_qvector(data));
+}
+
+void SimulatedFlash::read_page(const Address &addr, uchar section,
+  gsl::span<uchar> dest, int timeout_ms)
+{
+  auto len = dest.size();
+
+  if (len == 0)
+    throw std::invalid_argument("read_page: len == 0");
+
+  if (len > constants::page_size)
+    throw std::invalid_argument("read_page: len > page size");
+
+  if (cache_lookup(addr, section, dest))
+    return;
+
+  maybe_set_verbose(false);
+
+  uchar len_byte(len == constants::page_size ? 0 : len); // 256 encoded as 0
+
+  m_wbuf = { opcodes::REF, addr[0], addr[1], addr[2], section, len_byte };
+  write_instruction(m_wbuf);
+  read(dest, timeout_ms);
+  cache_store(addr, section, dest);
+}
+
+void SimulatedFlash::recover(size_t tries)
+{
+  std::exception_ptr last_nop_exception;
+
+  for (size_t n=0; n<tries; ++n) {
+    m_rx.clear();
+
+    try {
+      nop();
+      return;
+    } catch (const std::exception &) {
+      last_nop_exception = std::current_exception();
+    }
+  }
+
+  if (last_nop_exception)
+    std::rethrow_exception(last_nop_exception);
+  else
+    throw std::runtime_error("NOP recovery failed for an unknown reason");
+}
+
+} // ns mesytec::mvp
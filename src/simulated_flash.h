@@ -0,0 +1,122 @@
+#ifndef EXTERNAL_LIBMVP_SRC_SIMULATED_FLASH_H_
+#define EXTERNAL_LIBMVP_SRC_SIMULATED_FLASH_H_
+
+#include <random>
+
+#include "flash.h"
+#include "mvp_device_model.h"
+
+namespace mesytec::mvp
+{
+
+/** FlashInterface implementation talking directly to an in-process
+ * MvpDeviceModel.
+ *
+ * Time is virtual by default: the latencies and the busy times reported by
+ * the model (e.g. section erases) advance a clock instead of blocking, so
+ * FirmwareWriter, KeysHandler, verification and the GUI can be exercised
+ * without hardware and without waiting. Setting a time scale > 0 makes the
+ * simulation sleep for the scaled durations, e.g. for GUI load testing.
+ *
+ * Faults can be injected per opcode (one-shot, optionally skipping a number
+ * of matching instructions) or randomly with a fixed rate and seed. */
+class SimulatedFlash: public FlashInterface
+{
+  Q_OBJECT
+  public:
+    using Duration = MvpDeviceModel::Duration;
+
+    enum class FaultType
+    {
+      ResponseTimeout,  // the instruction is executed but the response is lost
+      CorruptResponse,  // the first response byte is inverted
+      FailStatus,       // the inst_success bit of the response is cleared
+      DropInstruction,  // the instruction never reaches the device
+    };
+
+    static const uchar any_opcode = 0xff;
+
+    SimulatedFlash(QObject *parent = nullptr);
+    explicit SimulatedFlash(const MvpDeviceModel::Options &opts, QObject *parent = nullptr);
+
+    MvpDeviceModel &get_model() { return m_model; }
+    const MvpDeviceModel &get_model() const { return m_model; }
+
+    /** Latency added for each transfer to the device and for each byte
+     * transferred in either direction. */
+    void set_latency(Duration per_transfer, Duration per_byte = Duration(0))
+    {
+      m_transfer_latency = per_transfer;
+      m_byte_latency = per_byte;
+    }
+
+    /** 0 (default) keeps time purely virtual. */
+    void set_time_scale(double scale) { m_time_scale = scale; }
+    double get_time_scale() const { return m_time_scale; }
+
+    Duration get_virtual_time() const { return m_virtual_time; }
+    void reset_virtual_time() { m_virtual_time = Duration(0); }
+
+    /** Injects a one-shot fault into the (skip+1)th following instruction
+     * with the given opcode. Faults affecting the response only count
+     * instructions which produce a response, e.g. not WRF with verbose mode
+     * off. */
+    void inject_fault(FaultType type, uchar opcode = any_opcode, size_t skip = 0);
+
+    /** Injects faults of the given type into randomly chosen instructions.
+     * A rate of 0 disables random faults. */
+    void set_random_faults(FaultType type, double rate, unsigned seed = 0);
+
+    void clear_faults();
+    size_t get_injected_fault_count() const { return m_injected_faults; }
+
+    void write_instruction(const gsl::span<uchar> data,
+      int timeout_ms = constants::default_timeout_ms) override;
+
+    void read_response(gsl::span<uchar> dest,
+      int timeout_ms = constants::default_timeout_ms) override;
+
+    void write_page(const Address &address, uchar section,
+      const gsl::span<uchar> data, int timeout_ms = constants::data_timeout_ms) override;
+
+    void read_page(const Address &address, uchar section, gsl::span<uchar> dest,
+      int timeout_ms = constants::data_timeout_ms) override;
+
+    void recover(size_t tries=default_recover_tries) override;
+
+    using FlashInterface::read_response;
+    using FlashInterface::read_page;
+
+  private:
+    struct Fault
+    {
+      FaultType type;
+      uchar opcode;
+      size_t skip;
+    };
+
+    void transfer(const gsl::span<uchar> data);
+    void read(gsl::span<uchar> dest, int timeout_ms);
+    // response_fault selects between DropInstruction (false) and the faults
+    // modifying the response (true).
+    bool take_fault(uchar opcode, bool response_fault, FaultType &type);
+    void advance(Duration d);
+
+    MvpDeviceModel m_model;
+    QVector<uchar> m_rx;
+
+    Duration m_transfer_latency = Duration(0);
+    Duration m_byte_latency = Duration(0);
+    Duration m_virtual_time = Duration(0);
+    double m_time_scale = 0.0;
+
+    QVector<Fault> m_faults;
+    FaultType m_random_fault_type = FaultType::ResponseTimeout;
+    double m_random_fault_rate = 0.0;
+    std::mt19937 m_rng;
+    size_t m_injected_faults = 0;
+};
+
+} // ns mesytec::mvp
+
+#endif // EXTERNAL_LIBMVP_SRC_SIMULATED_FLASH_H_
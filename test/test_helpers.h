@@ -0,0 +1,21 @@
+#ifndef UUID_a1ec3d07_08cc_4db8_a800_21ff215166cb
+#define UUID_a1ec3d07_08cc_4db8_a800_21ff215166cb
+
+#include <QVector>
+
+#include "flash_constants.h"
+
+namespace mesytec::mvp
+{
+  /* Deterministic flash test data. The page index is mixed in so that
+   * consecutive pages differ, seed selects different data sets. */
+  inline QVector<uchar> make_test_data(size_t size, uchar seed = 0)
+  {
+    QVector<uchar> ret(size);
+    for (size_t i=0; i<size; ++i)
+      ret[i] = (i * 13 + i / constants::page_size + seed) & 0xff;
+    return ret;
+  }
+}
+
+#endif /* UUID_a1ec3d07_08cc_4db8_a800_21ff215166cb */
@@ -0,0 +1,93 @@
+#include "tests.h"
+#include "mvlc_mvp_stack_decode.h"
+
+using namespace mesytec::mvlc;
+using namespace mesytec::mvp;
+
+namespace
+{
+  u32 make_header(u32 type, u32 flags, size_t len)
+  {
+    return (type << frame_headers::TypeShift)
+      | (flags << frame_headers::FrameFlagsShift)
+      | static_cast<u32>(len);
+  }
+
+  // Stack frame containing the marker and a single block read frame with
+  // the given data bytes followed by the InvalidRead terminator.
+  std::vector<u32> make_output(const std::vector<u8> &data, u32 stackRef, u32 stackFlags)
+  {
+    std::vector<u32> block;
+
+    for (auto b: data)
+      block.push_back(b);
+    block.push_back(output_fifo_flags::InvalidRead);
+
+    std::vector<u32> ret = { 0, stackRef, make_header(frame_headers::BlockRead, 0, block.size()) };
+    ret.insert(std::end(ret), std::begin(block), std::end(block));
+    ret[0] = make_header(frame_headers::StackFrame, stackFlags, ret.size() - 1);
+    return ret;
+  }
+}
+
+void TestMvlcStackDecode::test_decode()
+{
+  const std::vector<u8> data = { 0x01, 0x02, 0xfe, 0xff, 0x80 };
+  std::vector<u8> dest(16);
+
+  auto result = decode_stack_output(make_output(data, 0x1337, 0), 0x1337, dest);
+  QVERIFY(!result.ec);
+  QVERIFY(result.terminated);
+  QCOMPARE(result.bytes, data.size());
+  QCOMPARE(result.wordsLeft, size_t(0));
+  QVERIFY(std::equal(std::begin(data), std::end(data), std::begin(dest)));
+
+  // Data split across a stack frame and a continuation frame.
+  std::vector<u32> split = {
+    make_header(frame_headers::StackFrame, frame_flags::Continue, 3), 0x1337,
+    make_header(frame_headers::BlockRead, 0, 1), 0x01,
+    make_header(frame_headers::StackContinuation, 0, 3),
+    make_header(frame_headers::BlockRead, 0, 2), 0x02, output_fifo_flags::InvalidRead,
+  };
+
+  result = decode_stack_output(split, 0x1337, dest);
+  QVERIFY(!result.ec);
+  QCOMPARE(result.bytes, size_t(2));
+  QCOMPARE(dest[0], u8(0x01));
+  QCOMPARE(dest[1], u8(0x02));
+}
+
+void TestMvlcStackDecode::test_frame_flags()
+{
+  const std::vector<u8> data = { 0x11, 0x22, 0x33 };
+  std::vector<u8> dest(16);
+
+  // BusError terminates (fake) block reads and is not an error, same as in
+  // get_stack_frame_error().
+  auto result = decode_stack_output(make_output(data, 1, frame_flags::BusError), 1, dest);
+  QVERIFY(!result.ec);
+  QVERIFY(result.frameFlags & frame_flags::BusError);
+  QCOMPARE(result.bytes, data.size());
+  QVERIFY(!get_stack_frame_error(make_header(frame_headers::StackFrame, frame_flags::BusError, 0)));
+
+  result = decode_stack_output(make_output(data, 1, frame_flags::Timeout), 1, dest);
+  QCOMPARE(result.ec, std::error_code(MVLCErrorCode::NoVMEResponse));
+
+  result = decode_stack_output(make_output(data, 1, frame_flags::SyntaxError), 1, dest);
+  QCOMPARE(result.ec, std::error_code(MVLCErrorCode::StackSyntaxError));
+}
+
+void TestMvlcStackDecode::test_malformed_output()
+{
+  std::vector<u8> pageBuffer;
+
+  // Short output, missing stack frame header and a reference mismatch are
+  // reported as errors.
+  QVERIFY(fill_page_buffer_from_stack_output(pageBuffer, {}, 1));
+  QVERIFY(fill_page_buffer_from_stack_output(pageBuffer, { 0x12345678, 1, 2, 3 }, 1));
+  QCOMPARE(fill_page_buffer_from_stack_output(pageBuffer, make_output({ 0x42 }, 2, 0), 1),
+    std::error_code(MVLCErrorCode::StackReferenceMismatch));
+
+  QVERIFY(!fill_page_buffer_from_stack_output(pageBuffer, make_output({ 0x42 }, 1, 0), 1));
+  QCOMPARE(pageBuffer, std::vector<u8>{ 0x42 });
+}
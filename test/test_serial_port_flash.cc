@@ -0,0 +1,113 @@
+#include "tests.h"
+#include "test_helpers.h"
+#include "mvp_pty_emulator.h"
+#include "serial_port_flash.h"
+
+#include <QSerialPort>
+
+using namespace mesytec::mvp;
+
+namespace
+{
+  // Runs f with a SerialPortFlash connected to a freshly started emulator.
+  template<typename F>
+  void with_emulator(F f)
+  {
+#ifdef Q_OS_UNIX
+    MvpPtyEmulator emu;
+    emu.set_time_scale(0.0);
+    emu.with_model([] (MvpDeviceModel &model) {
+        model.program_otp("MDPP-16 ", 0x1234);
+        model.program_key(3, Key("MDPP-16 ", 0x1234, 0x0002, 0xcafe0815));
+        });
+    emu.start();
+
+    QSerialPort port;
+    port.setPortName(emu.get_port_name());
+    QVERIFY(port.open(QIODevice::ReadWrite));
+
+    SerialPortFlash flash(&port);
+    flash.ensure_clean_state();
+    f(emu, flash);
+#else
+    (void) f;
+    QSKIP("pseudo terminals are not supported on this platform");
+#endif
+  }
+}
+
+void TestSerialPortFlash::test_instructions()
+{
+  with_emulator([] (MvpPtyEmulator &emu, SerialPortFlash &flash) {
+      flash.set_streaming_enabled(true);
+      flash.set_area_index(2);
+      QCOMPARE(flash.read_area_index(), uchar(2));
+      QCOMPARE(get_area(flash.get_last_status()), 2);
+
+      flash.enable_write();
+      flash.nop();
+      QVERIFY(!emu.with_model([] (MvpDeviceModel &m) { return m.is_write_enabled(); }));
+
+      auto otp = flash.read_otp();
+      QCOMPARE(otp.get_device(), QString("MDPP-16 "));
+      QCOMPARE(otp.get_sn(), uint32_t(0x1234));
+
+      auto keys = flash.read_keys();
+      QCOMPARE(keys.size(), 1);
+      QVERIFY(keys.contains(3));
+      QCOMPARE(keys[3].get_key(), uint32_t(0xcafe0815));
+
+      // Pipelined snapshot read, the port must be clean afterwards.
+      auto snapshot = flash.read_device_snapshot();
+      QCOMPARE(snapshot.area, uchar(2));
+      QCOMPARE(snapshot.otp.get_sn(), uint32_t(0x1234));
+      QCOMPARE(snapshot.keys.size(), 1);
+      QCOMPARE(snapshot.keys[3].get_key(), uint32_t(0xcafe0815));
+      flash.nop();
+      });
+}
+
+void TestSerialPortFlash::test_write_verify()
+{
+  with_emulator([] (MvpPtyEmulator &, SerialPortFlash &flash) {
+      const auto section = constants::firmware_section;
+      auto data = make_test_data(10 * constants::page_size + 17);
+
+      for (bool streaming: { false, true }) {
+        flash.set_streaming_enabled(streaming);
+        flash.erase_section(section);
+        QVERIFY(flash.blankcheck_section(section, data.size()));
+
+        flash.write_memory({0, 0, 0}, section, gsl::span(data));
+        QVERIFY(flash.verify_memory({0, 0, 0}, section, gsl::span(data)));
+        QVERIFY(!flash.is_write_enabled());
+      }
+
+      // Writing without erasing can only clear bits.
+      QVector<uchar> zeroes(constants::page_size, 0x00);
+      flash.write_memory({0, 0, 0}, section, gsl::span(zeroes));
+      auto res = flash.verify_memory({0, 0, 0}, section, gsl::span(data));
+      QVERIFY(!res);
+      QCOMPARE(res.actual, uchar(0));
+      });
+}
+
+void TestSerialPortFlash::test_errors()
+{
+  with_emulator([] (MvpPtyEmulator &, SerialPortFlash &flash) {
+      // ERF without EFW fails and clears the cached write enable flag.
+      QVector<uchar> erf = { opcodes::ERF, 0, 0, 0, constants::firmware_section };
+      flash.write_instruction(gsl::span(erf));
+      QVector<uchar> response(erf.size() + 2);
+      flash.read_response(gsl::span(response));
+      QVERIFY_EXCEPTION_THROWN(flash.ensure_response_ok(gsl::span(erf), gsl::span(response)),
+        FlashInstructionError);
+
+      // The OTP section can not be erased.
+      QVERIFY_EXCEPTION_THROWN(flash.erase_section(constants::otp_section),
+        FlashInstructionError);
+      QCOMPARE(flash.read_otp().get_sn(), uint32_t(0x1234));
+
+      flash.nop();
+      });
+}
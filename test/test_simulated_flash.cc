@@ -0,0 +1,317 @@
+#include "tests.h"
+#include "test_helpers.h"
+#include "firmware_ops.h"
+#include "simulated_flash.h"
+
+using namespace mesytec::mvp;
+
+void TestSimulatedFlash::test_firmware_writer()
+{
+  MvpDeviceModel::Options opts;
+  opts.erase_time = std::chrono::seconds(60);
+
+  SimulatedFlash flash(opts);
+  flash.get_model().program_otp("MDPP-16 ", 0x1234);
+  flash.set_area_index(2);
+
+  const auto fw_data  = make_test_data(3 * constants::page_size + 100, 1);
+  const auto cal_data = make_test_data(constants::page_size, 2);
+
+  FirmwareArchive firmware;
+  firmware.add_part(std::make_shared<BinaryFirmwarePart>(
+      "MDPP16_SCP_FW0001_1_12.bin", uchar(1), constants::firmware_section, fw_data));
+  firmware.add_part(std::make_shared<BinaryFirmwarePart>(
+      "MDPP16_3.bin", boost::none, constants::common_calibration_section, cal_data));
+
+  flash.reset_virtual_time();
+
+  FirmwareWriter writer(firmware, &flash);
+  writer.set_do_verify(true);
+  writer.write();
+
+  const auto &model = flash.get_model();
+
+  QCOMPARE(model.peek(1, constants::firmware_section, 0, fw_data.size()), fw_data);
+  QCOMPARE(model.peek(2, constants::common_calibration_section, 0, cal_data.size()), cal_data);
+  // Area 2 was selected initially and has not been touched.
+  QCOMPARE(model.peek(2, constants::firmware_section, 0, fw_data.size()),
+    QVector<uchar>(fw_data.size(), 0xff));
+  QCOMPARE(flash.read_area_index(), uchar(2));
+
+  // Two erases took two virtual minutes.
+  QVERIFY(flash.get_virtual_time() >= std::chrono::seconds(120));
+  QCOMPARE(model.get_instruction_count(opcodes::ERF), size_t(2));
+}
+
+void TestSimulatedFlash::test_faults()
+{
+  SimulatedFlash flash;
+  flash.get_model().program_otp("MDPP-16 ", 0x1234);
+
+  // Failed status
+  flash.inject_fault(SimulatedFlash::FaultType::FailStatus, opcodes::SAI);
+  QVERIFY_EXCEPTION_THROWN(flash.set_area_index(1), FlashInstructionError);
+  flash.set_area_index(1);
+  QCOMPARE(flash.read_area_index(), uchar(1));
+
+  // Lost response and recovery
+  flash.inject_fault(SimulatedFlash::FaultType::ResponseTimeout, opcodes::NOP);
+  QVERIFY_EXCEPTION_THROWN(flash.nop(), ComError);
+  flash.recover();
+
+  // Corrupted response
+  flash.inject_fault(SimulatedFlash::FaultType::CorruptResponse, opcodes::RDI);
+  QVERIFY_EXCEPTION_THROWN(flash.read_hardware_id(), FlashInstructionError);
+  flash.recover();
+
+  // The third page write is lost on the way to the device.
+  const auto section = constants::firmware_section;
+  auto data = make_test_data(4 * constants::page_size, 3);
+
+  flash.erase_section(section);
+  flash.inject_fault(SimulatedFlash::FaultType::DropInstruction, opcodes::WRF, 2);
+  flash.write_memory({0, 0, 0}, section, gsl::span(data));
+
+  auto res = flash.verify_memory({0, 0, 0}, section, gsl::span(data));
+  QVERIFY(!res);
+  QCOMPARE(res.offset, 2 * constants::page_size);
+  QCOMPARE(res.actual, uchar(0xff));
+
+  QCOMPARE(flash.get_injected_fault_count(), size_t(4));
+  QCOMPARE(flash.read_otp().get_sn(), uint32_t(0x1234));
+
+  // Page writes with verbose mode off have no response to fail, so the fault
+  // stays pending.
+  flash.inject_fault(SimulatedFlash::FaultType::FailStatus, opcodes::WRF);
+  flash.write_memory({0, 0, 0}, section, gsl::span(data));
+  QCOMPARE(flash.get_injected_fault_count(), size_t(4));
+  flash.clear_faults();
+}
+
+void TestSimulatedFlash::test_page_cache()
+{
+  SimulatedFlash flash;
+  auto &model = flash.get_model();
+  model.program_otp("MDPP-16 ", 0x1234);
+  model.program_key(3, Key("MDPP-16 ", 0x1234, 0x0001, 0xcafe1234));
+
+  flash.set_page_cache_enabled(true);
+
+  const auto keys = flash.read_keys();
+  const auto otp  = flash.read_otp();
+  const auto refs = model.get_instruction_count(opcodes::REF);
+
+  QCOMPARE(keys.size(), 1);
+
+  // Served from the cache without touching the device.
+  QVERIFY(flash.read_keys() == keys);
+  QCOMPARE(flash.get_free_key_slots().size(), int(constants::max_keys - 1));
+  QCOMPARE(flash.read_otp().get_sn(), otp.get_sn());
+  QCOMPARE(model.get_instruction_count(opcodes::REF), refs);
+  QVERIFY(flash.get_page_cache_hits() > 0);
+
+  // Erasing the keys section invalidates the cached key pages only.
+  flash.erase_section(constants::keys_section);
+  QVERIFY(flash.read_keys().isEmpty());
+  QVERIFY(model.get_instruction_count(opcodes::REF) > refs);
+  const auto refs_after_erase = model.get_instruction_count(opcodes::REF);
+  QCOMPARE(flash.read_otp().get_sn(), otp.get_sn());
+  QCOMPARE(model.get_instruction_count(opcodes::REF), refs_after_erase);
+
+  // Area-specific sections are cached per area and invalidated by page
+  // writes.
+  const auto section = constants::firmware_section;
+  const auto data = make_test_data(constants::page_size, 5);
+  const QVector<uchar> erased(data.size(), 0xff);
+
+  flash.set_area_index(1);
+  flash.erase_section(section);
+  QCOMPARE(flash.read_page({0, 0, 0}, section, data.size()), erased);
+
+  auto wdata = data;
+  flash.write_page({0, 0, 0}, section, gsl::span(wdata));
+  QCOMPARE(flash.read_page({0, 0, 0}, section, data.size()), data);
+
+  flash.set_area_index(2);
+  QCOMPARE(flash.read_page({0, 0, 0}, section, data.size()), erased);
+
+  flash.set_area_index(1);
+  const auto misses = flash.get_page_cache_misses();
+  QCOMPARE(flash.read_page({0, 0, 0}, section, data.size()), data);
+  QCOMPARE(flash.get_page_cache_misses(), misses);
+
+  // Changes made behind the back of the cache are visible once it is
+  // disabled.
+  model.erase(1, section);
+  QCOMPARE(flash.read_page({0, 0, 0}, section, data.size()), data);
+  flash.set_page_cache_enabled(false);
+  QCOMPARE(flash.read_page({0, 0, 0}, section, data.size()), erased);
+}
+
+void TestSimulatedFlash::test_state_tracking()
+{
+  SimulatedFlash flash;
+  auto &model = flash.get_model();
+  const auto section = constants::common_calibration_section;
+
+  QVERIFY(!flash.get_state().verbose);
+  QVERIFY(!flash.get_state().area);
+
+  // Repeated reads send VEB only once.
+  flash.read_memory({0, 0, 0}, section, 16, constants::page_size);
+  flash.read_memory({0, 0, 0}, section, 16, constants::page_size);
+  flash.blankcheck_section(section, constants::page_size);
+  QCOMPARE(model.get_instruction_count(opcodes::VEB), size_t(1));
+  QVERIFY(flash.get_suppressed_instructions().veb >= 2);
+
+  // Area selection
+  QCOMPARE(flash.read_area_index(), uchar(0));
+  flash.maybe_set_area_index(0);
+  flash.maybe_set_area_index(1);
+  flash.maybe_set_area_index(1);
+  QCOMPARE(model.get_instruction_count(opcodes::SAI), size_t(1));
+  QCOMPARE(flash.get_suppressed_instructions().sai, size_t(2));
+  QCOMPARE(*flash.get_state().area, uchar(1));
+
+  // Write enable is kept over WRF and cleared by any other instruction.
+  auto data = make_test_data(constants::page_size, 7);
+  flash.erase_section(section);
+  QVERIFY(!flash.is_write_enabled());
+  QCOMPARE(model.is_write_enabled(), flash.is_write_enabled());
+
+  flash.write_memory({0, 0, 0}, section, gsl::span(data));
+  flash.maybe_enable_write();
+  QCOMPARE(model.is_write_enabled(), flash.is_write_enabled());
+
+  flash.nop();
+  QVERIFY(!flash.is_write_enabled());
+  QCOMPARE(model.is_write_enabled(), flash.is_write_enabled());
+
+  // The status byte of failed instructions is tracked too.
+  flash.inject_fault(SimulatedFlash::FaultType::FailStatus, opcodes::NOP);
+  QVERIFY_EXCEPTION_THROWN(flash.nop(), FlashInstructionError);
+  QCOMPARE(flash.get_last_status() & status::inst_success, 0);
+
+  // The device state is unknown after boot.
+  flash.boot(2);
+  QVERIFY(!flash.get_state().verbose);
+  QVERIFY(!flash.get_state().area);
+  flash.maybe_set_area_index(2);
+  QCOMPARE(model.get_instruction_count(opcodes::SAI), size_t(2));
+}
+
+void TestSimulatedFlash::test_device_snapshot()
+{
+  MvpDeviceModel::Options opts;
+  opts.hardware_id = 0x42;
+  opts.dipswitch   = 2;
+
+  SimulatedFlash flash(opts);
+  auto &model = flash.get_model();
+  const Key key("MDPP-16 ", 0x1234, 0x0010, 0xdeadbeef);
+
+  model.program_otp("MDPP-16 ", 0x1234);
+  model.program_key(3, key);
+  flash.set_area_index(1);
+  model.reset_statistics();
+
+  auto snapshot = flash.read_device_snapshot();
+
+  QCOMPARE(snapshot.hardware_id, uchar(0x42));
+  QCOMPARE(snapshot.area, uchar(1));
+  QCOMPARE(snapshot.dipswitch, 2);
+  QCOMPARE(snapshot.otp.get_device(), QString("MDPP-16 "));
+  QCOMPARE(snapshot.otp.get_sn(), uint32_t(0x1234));
+  QCOMPARE(snapshot.keys.size(), 1);
+  QVERIFY(snapshot.keys.value(3) == key);
+  QCOMPARE(snapshot.vme_hardware_id, uint32_t(0));
+
+  QCOMPARE(model.get_instruction_count(opcodes::RDI), size_t(1));
+  QCOMPARE(model.get_instruction_count(opcodes::RAI), size_t(1));
+  QCOMPARE(*flash.get_state().area, uchar(1));
+}
+
+void TestSimulatedFlash::test_verify_memory()
+{
+  SimulatedFlash flash;
+  auto &model = flash.get_model();
+  const auto section = constants::firmware_section;
+  const size_t start = 3 * constants::page_size + 10;
+  auto data = make_test_data(8 * constants::page_size, 5);
+
+  model.poke(0, section, start, data);
+  QVERIFY(flash.verify_memory(Address(start), section, gsl::span(data)));
+
+  // Two differing bytes close to each other, one differing page later on.
+  auto corrupted = data;
+  corrupted[100] ^= 0x01;
+  corrupted[105] ^= 0x01;
+  for (size_t i=0; i<constants::page_size; ++i)
+    corrupted[5 * constants::page_size + i] ^= 0xff;
+  model.poke(0, section, start, corrupted);
+
+  // Stops at the first difference, offsets are relative to start.
+  model.reset_statistics();
+  auto res = flash.verify_memory(Address(start), section, gsl::span(data));
+  QVERIFY(!res);
+  QCOMPARE(res.offset, size_t(100));
+  QCOMPARE(res.expected, data[100]);
+  QCOMPARE(res.actual, corrupted[100]);
+  QCOMPARE(res.mismatch_count, size_t(1));
+  QCOMPARE(model.get_instruction_count(opcodes::REF), 100 / get_default_mem_read_chunk_size() + 1);
+
+  res = flash.verify_memory(Address(start), section, gsl::span(data), VerifyMode::CollectAll);
+  QVERIFY(!res);
+  QCOMPARE(res.offset, size_t(100));
+  QCOMPARE(res.mismatch_count, 2 + constants::page_size);
+  QCOMPARE(res.mismatches.size(), 2);
+  QCOMPARE(res.mismatches[0].offset, size_t(100));
+  QCOMPARE(res.mismatches[0].length, size_t(6));
+  QCOMPARE(res.mismatches[0].count, size_t(2));
+  QCOMPARE(res.mismatches[1].offset, 5 * constants::page_size);
+  QCOMPARE(res.mismatches[1].length, constants::page_size);
+  QVERIFY(!res.ranges_to_string().isEmpty());
+}
+
+void TestSimulatedFlash::test_sample_verify()
+{
+  SimulatedFlash flash;
+  auto &model = flash.get_model();
+  const auto section = constants::firmware_section;
+  const size_t pages = 32;
+
+  // Constant data except for one high entropy page.
+  QVector<uchar> data(pages * constants::page_size, 0x00);
+  auto random_page = make_test_data(constants::page_size, 9);
+  std::copy(random_page.begin(), random_page.end(), data.begin() + 17 * constants::page_size);
+  model.poke(0, section, 0, data);
+
+  SampleVerifyOptions opts;
+  opts.entropy_pages = 1;
+  opts.random_pages  = 0;
+
+  auto report = flash.sample_verify_memory({0, 0, 0}, section, gsl::span(data), opts);
+  QCOMPARE(report.total_pages, pages);
+  QCOMPARE(report.pages, (QVector<size_t>{ 0, 17, 31 }));
+  QVERIFY(!report.escalated);
+  QVERIFY(report.result);
+
+  // The random selection only depends on the seed.
+  opts.random_pages = 5;
+  opts.seed = 1234;
+  report = flash.sample_verify_memory({0, 0, 0}, section, gsl::span(data), opts);
+  QCOMPARE(report.pages.size(), 8);
+  QCOMPARE(flash.sample_verify_memory({0, 0, 0}, section, gsl::span(data), opts).pages, report.pages);
+  QVERIFY(report.detection_probability(1) > 0.2);
+  QVERIFY(!report.to_string().isEmpty());
+
+  // A difference in a sampled page escalates to a full verify.
+  auto corrupted = data;
+  corrupted[31 * constants::page_size + 3] = 0x42;
+  model.poke(0, section, 0, corrupted);
+  report = flash.sample_verify_memory({0, 0, 0}, section, gsl::span(data), opts, VerifyMode::CollectAll);
+  QVERIFY(report.escalated);
+  QVERIFY(!report.result);
+  QCOMPARE(report.result.offset, 31 * constants::page_size + 3);
+  QCOMPARE(report.result.mismatch_count, size_t(1));
+}
@@ -14,9 +14,15 @@ int main(int argc, char *argv[])
       std::make_shared<TestFirmware>(),
       std::make_shared<TestInstructionFile>(),
       std::make_shared<TestInstructionInterpreter>(),
-      std::make_shared<TestFirmwareOps>()
+      std::make_shared<TestFirmwareOps>(),
+      std::make_shared<TestSerialPortFlash>(),
+      std::make_shared<TestSimulatedFlash>()
     };
 
+#ifdef LIBMVP_HAVE_MVLC
+    tests.push_back(std::make_shared<TestMvlcStackDecode>());
+#endif
+
 #ifdef RUN_GUI_TESTS
 
     tests.push_back(std::make_shared<TestFileDialog>());
@@ -64,4 +64,37 @@ class TestFirmwareOps: public QObject
     void test_keysinfo();
 };
 
+class TestSerialPortFlash: public QObject
+{
+  Q_OBJECT
+  private slots:
+    void test_instructions();
+    void test_write_verify();
+    void test_errors();
+};
+
+class TestSimulatedFlash: public QObject
+{
+  Q_OBJECT
+  private slots:
+    void test_firmware_writer();
+    void test_faults();
+    void test_page_cache();
+    void test_state_tracking();
+    void test_device_snapshot();
+    void test_verify_memory();
+    void test_sample_verify();
+};
+
+#ifdef LIBMVP_HAVE_MVLC
+class TestMvlcStackDecode: public QObject
+{
+  Q_OBJECT
+  private slots:
+    void test_decode();
+    void test_frame_flags();
+    void test_malformed_output();
+};
+#endif
+
 #endif